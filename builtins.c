@@ -40,7 +40,7 @@
 #include "openssl/sha.h"
 #endif
 
-#define CHECK_OVERFLOW 1
+#define INT_T_MIN ((int_t)((uint_t)1 << (sizeof(int_t)*8-1)))
 #define MAX_VARS 32768
 
 #ifndef _WIN32
@@ -53,12 +53,10 @@ static void msleep(int ms)
 }
 #endif
 
-#if 0
-static double rat_to_float(cell *n)
+static double rat_to_float(const cell *n)
 {
 	return (double)n->val_num / n->val_den;
 }
-#endif
 
 static int do_throw_term(query *q, cell *c);
 
@@ -236,6 +234,7 @@ static cell *alloc_heap(query *q, idx_t nbr_cells)
 		a->heap = calloc(q->h_size, sizeof(cell));
 		a->h_size = q->h_size;
 		a->nbr = q->st.anbr++;
+		q->tot_heapsize += a->h_size;
 		q->arenas = a;
 	}
 
@@ -251,6 +250,7 @@ static cell *alloc_heap(query *q, idx_t nbr_cells)
 		a->heap = calloc(q->h_size, sizeof(cell));
 		a->h_size = q->h_size;
 		a->nbr = q->st.anbr++;
+		q->tot_heapsize += a->h_size;
 		q->arenas = a;
 		q->st.hp = 0;
 	}
@@ -262,6 +262,466 @@ static cell *alloc_heap(query *q, idx_t nbr_cells)
 	return c;
 }
 
+// Cells allocated here are not reclaimed on backtracking, only when
+// the query ends. Used by nb_setarg/3.
+
+static cell *alloc_nb_heap(query *q, idx_t nbr_cells)
+{
+	arena *a = calloc(1, sizeof(arena));
+	a->heap = calloc(nbr_cells, sizeof(cell));
+	a->hp = a->h_size = nbr_cells;
+	a->next = q->nb_arenas;
+	q->nb_arenas = a;
+	return a->heap;
+}
+
+static int is_heap_cell(const query *q, const cell *c)
+{
+	for (const arena *a = q->arenas; a; a = a->next) {
+		if ((c >= a->heap) && (c < (a->heap + a->hp)))
+			return 1;
+	}
+
+	for (const arena *a = q->nb_arenas; a; a = a->next) {
+		if ((c >= a->heap) && (c < (a->heap + a->hp)))
+			return 1;
+	}
+
+	return 0;
+}
+
+// Integers live in the cell until a result overflows int_t, then they
+// are promoted to a GMP integer hanging off a TYPE_BIGINT cell. Results
+// that fit again are demoted, so a bigint is never a small integer. The
+// mpz is owned like a blob: the cell that made it frees it and copies
+// are marked const.
+
+enum { BIG_ADD, BIG_SUB, BIG_MUL, BIG_DIVINT, BIG_DIV, BIG_MOD, BIG_REM, BIG_MIN, BIG_MAX, BIG_AND, BIG_OR, BIG_XOR, BIG_SHL, BIG_SHR, BIG_POWI };
+
+static double num_to_float(const cell *c);
+
+#if USE_BIGINT
+struct bigint_ {
+	mpz_t ival;
+};
+
+static bigint *new_bigint(void)
+{
+	bigint *b = malloc(sizeof(bigint));
+	mpz_init(b->ival);
+	return b;
+}
+
+static void mpz_set_int(mpz_t z, int_t v)
+{
+	uint_t u = v < 0 ? -(uint_t)v : (uint_t)v;
+	mpz_import(z, 1, 1, sizeof(uint_t), 0, 0, &u);
+
+	if (v < 0)
+		mpz_neg(z, z);
+}
+
+static int mpz_get_int(const mpz_t z, int_t *v)
+{
+	const size_t bits = sizeof(int_t) * 8;
+	size_t n = mpz_sizeinbase(z, 2);
+
+	if ((n > bits) || ((n == bits) && ((mpz_sgn(z) > 0) || (mpz_scan1(z, 0) != bits-1))))
+		return 0;
+
+	uint_t u = 0;
+	mpz_export(&u, NULL, 1, sizeof(uint_t), 0, 0, z);
+	*v = mpz_sgn(z) < 0 ? (int_t)-u : (int_t)u;
+	return 1;
+}
+
+static void cell_to_mpz(mpz_t z, const cell *c)
+{
+	if (is_bigint(c)) {
+		mpz_init_set(z, c->val_big->ival);
+	} else {
+		mpz_init(z);
+		mpz_set_int(z, c->val_num);
+	}
+}
+
+// Move 'z' into 'c', demoting it if it fits. The cell owns the result.
+
+static void make_bigint(cell *c, mpz_t z)
+{
+	int_t v;
+
+	if (mpz_get_int(z, &v)) {
+		mpz_clear(z);
+		make_int(c, v);
+		return;
+	}
+
+	c->val_type = TYPE_BIGINT;
+	c->nbr_cells = 1;
+	c->arity = c->flags = 0;
+	c->val_big = malloc(sizeof(bigint));
+	memcpy(c->val_big->ival, z, sizeof(mpz_t));
+}
+
+// Results of evaluation are owned by a heap cell, so they go away
+// on backtracking like any other heap term.
+
+static void make_bigint_accum(query *q, mpz_t z)
+{
+	make_bigint(&q->accum, z);
+
+	if (!is_bigint(&q->accum))
+		return;
+
+	cell *c = alloc_heap(q, 1);
+	*c = q->accum;
+}
+
+static void own_bigint_on_heap(query *q, cell *c)
+{
+	cell *tmp = alloc_heap(q, 1);
+	*tmp = *c;
+	c->flags |= FLAG_CONST_BIGINT;
+}
+
+void make_bigint_str(cell *c, const char *s, int base, int neg)
+{
+	c->val_type = TYPE_BIGINT;
+	c->val_big = new_bigint();
+	mpz_set_str(c->val_big->ival, s, base);
+
+	if (neg)
+		mpz_neg(c->val_big->ival, c->val_big->ival);
+}
+
+char *bigint_to_str(const cell *c, int base)
+{
+	char *dst = malloc(mpz_sizeinbase(c->val_big->ival, base) + 2);
+	return mpz_get_str(dst, base, c->val_big->ival);
+}
+
+static int_t bigint_msb(const cell *c)
+{
+	return mpz_sizeinbase(c->val_big->ival, 2) - 1;
+}
+
+void free_bigint(cell *c)
+{
+	mpz_clear(c->val_big->ival);
+	free(c->val_big);
+}
+
+void dup_bigint(cell *c)
+{
+	bigint *b = new_bigint();
+	mpz_set(b->ival, c->val_big->ival);
+	c->val_big = b;
+	c->flags &= ~(FLAG_CONST_BIGINT|FLAG_DUP_BIGINT);
+}
+
+int bigint_cmp(const cell *p1, const cell *p2)
+{
+	int val = mpz_cmp(p1->val_big->ival, p2->val_big->ival);
+	return val < 0 ? -1 : val > 0 ? 1 : 0;
+}
+
+// Compare two numbers, at least one of which is a bigint.
+
+static int compare_bigint(const cell *p1, const cell *p2)
+{
+	if (!is_bigint(p2))
+		return -compare_bigint(p2, p1);
+
+	if (is_bigint(p1))
+		return bigint_cmp(p1, p2);
+
+	int val;
+
+	if (is_integer(p1)) {
+		mpz_t tmp;
+		mpz_init(tmp);
+		mpz_set_int(tmp, p1->val_num);
+		val = mpz_cmp(tmp, p2->val_big->ival);
+		mpz_clear(tmp);
+	} else
+		val = -mpz_cmp_d(p2->val_big->ival, num_to_float(p1));
+
+	return val < 0 ? -1 : val > 0 ? 1 : 0;
+}
+
+static int do_bigint_op(query *q, int op, cell *p1, cell *p2)
+{
+	if (!is_number(p1) || !is_number(p2)) {
+		throw_error(q, is_number(p1) ? p2 : p1, "type_error", "number");
+		return 0;
+	}
+
+	if (is_float(p1) || is_float(p2) || !is_integer_or_bigint(p1) || !is_integer_or_bigint(p2)) {
+		double d1 = num_to_float(p1), d2 = num_to_float(p2);
+
+		switch (op) {
+			case BIG_ADD: q->accum.val_flt = d1 + d2; break;
+			case BIG_SUB: q->accum.val_flt = d1 - d2; break;
+			case BIG_MUL: q->accum.val_flt = d1 * d2; break;
+			default:
+				throw_error(q, is_integer_or_bigint(p1) ? p2 : p1, "type_error", "integer");
+				return 0;
+		}
+
+		q->accum.val_type = TYPE_FLOAT;
+		return 1;
+	}
+
+	mpz_t z1, z2;
+	cell_to_mpz(z1, p1);
+	cell_to_mpz(z2, p2);
+
+	if (!mpz_sgn(z2) && ((op == BIG_DIVINT) || (op == BIG_DIV) || (op == BIG_MOD) || (op == BIG_REM))) {
+		mpz_clear(z1);
+		mpz_clear(z2);
+		throw_error(q, p2, "evaluation_error", "zero_divisor");
+		return 0;
+	}
+
+	if (((op == BIG_SHL) || (op == BIG_SHR) || (op == BIG_POWI)) && !mpz_fits_ulong_p(z2)) {
+		int neg = mpz_sgn(z2) < 0;
+		mpz_clear(z1);
+		mpz_clear(z2);
+
+		if (neg && (op == BIG_POWI)) {
+			q->accum.val_type = TYPE_INTEGER;
+			q->accum.val_num = 0;
+			q->accum.val_den = 1;
+			return 1;
+		}
+
+		throw_error(q, p2, "resource_error", "memory");
+		return 0;
+	}
+
+	switch (op) {
+		case BIG_ADD: mpz_add(z1, z1, z2); break;
+		case BIG_SUB: mpz_sub(z1, z1, z2); break;
+		case BIG_MUL: mpz_mul(z1, z1, z2); break;
+		case BIG_DIVINT: mpz_tdiv_q(z1, z1, z2); break;
+		case BIG_DIV: mpz_fdiv_q(z1, z1, z2); break;
+		case BIG_MOD: mpz_fdiv_r(z1, z1, z2); break;
+		case BIG_REM: mpz_tdiv_r(z1, z1, z2); break;
+		case BIG_MIN: if (mpz_cmp(z2, z1) < 0) mpz_swap(z1, z2); break;
+		case BIG_MAX: if (mpz_cmp(z2, z1) > 0) mpz_swap(z1, z2); break;
+		case BIG_AND: mpz_and(z1, z1, z2); break;
+		case BIG_OR: mpz_ior(z1, z1, z2); break;
+		case BIG_XOR: mpz_xor(z1, z1, z2); break;
+		case BIG_SHL: mpz_mul_2exp(z1, z1, mpz_get_ui(z2)); break;
+		case BIG_SHR: mpz_fdiv_q_2exp(z1, z1, mpz_get_ui(z2)); break;
+		case BIG_POWI: mpz_pow_ui(z1, z1, mpz_get_ui(z2)); break;
+	}
+
+	mpz_clear(z2);
+	make_bigint_accum(q, z1);
+	return 1;
+}
+
+static int do_bigint_op1(query *q, cell *p1, void (*op)(mpz_ptr, mpz_srcptr))
+{
+	mpz_t z;
+	cell_to_mpz(z, p1);
+	op(z, z);
+	make_bigint_accum(q, z);
+	return 1;
+}
+
+// N rdiv D where either is a bigint. Rationals are a pair of int_t,
+// so the result has to reduce to one of those or to an integer.
+
+static int do_bigint_rdiv(query *q, cell *p1, cell *p2)
+{
+	mpz_t n, d;
+	cell_to_mpz(n, p1);
+	cell_to_mpz(d, p2);
+
+	if (!mpz_sgn(d)) {
+		mpz_clear(n);
+		mpz_clear(d);
+		throw_error(q, p2, "evaluation_error", "zero_divisor");
+		return 0;
+	}
+
+	mpz_t g;
+	mpz_init(g);
+	mpz_gcd(g, n, d);
+	mpz_divexact(n, n, g);
+	mpz_divexact(d, d, g);
+	mpz_clear(g);
+
+	if (mpz_sgn(d) < 0) {
+		mpz_neg(n, n);
+		mpz_neg(d, d);
+	}
+
+	if (!mpz_cmp_ui(d, 1)) {
+		mpz_clear(d);
+		make_bigint_accum(q, n);
+		return 1;
+	}
+
+	int_t num, den;
+	int ok = mpz_get_int(n, &num) && mpz_get_int(d, &den);
+	mpz_clear(n);
+	mpz_clear(d);
+
+	if (!ok) {
+		throw_error(q, p1, "domain_error", "integer_overflow");
+		return 0;
+	}
+
+	q->accum.val_type = TYPE_INTEGER;
+	q->accum.val_num = num;
+	q->accum.val_den = den;
+	return 1;
+}
+
+static void mpz_nabs(mpz_ptr r, mpz_srcptr z)
+{
+	mpz_abs(r, z);
+	mpz_neg(r, r);
+}
+
+#define BIG_NEG mpz_neg
+#define BIG_ABS mpz_abs
+#define BIG_NABS mpz_nabs
+#define BIG_COM mpz_com
+
+static int make_float_to_bigint(query *q, double d)
+{
+	mpz_t z;
+	mpz_init_set_d(z, d);
+	make_bigint_accum(q, z);
+	return 1;
+}
+
+static int add_bigint(cell *sum, cell *n)
+{
+	mpz_t z1, z2;
+	cell_to_mpz(z1, sum);
+	cell_to_mpz(z2, n);
+	mpz_add(z1, z1, z2);
+	mpz_clear(z2);
+
+	if (is_bigint(sum))
+		free_bigint(sum);
+
+	make_bigint(sum, z1);
+	return 1;
+}
+#else
+struct bigint_ {
+	int_t ival;
+};
+
+#define BIG_NEG NULL
+#define BIG_ABS NULL
+#define BIG_NABS NULL
+#define BIG_COM NULL
+
+void make_bigint_str(cell *c, __attribute__((unused)) const char *s, __attribute__((unused)) int base, __attribute__((unused)) int neg)
+{
+	make_int(c, 0);
+}
+
+char *bigint_to_str(__attribute__((unused)) const cell *c, __attribute__((unused)) int base) { return strdup("0"); }
+static int_t bigint_msb(__attribute__((unused)) const cell *c) { return 0; }
+void free_bigint(__attribute__((unused)) cell *c) {}
+void dup_bigint(__attribute__((unused)) cell *c) {}
+int bigint_cmp(__attribute__((unused)) const cell *p1, __attribute__((unused)) const cell *p2) { return 0; }
+static int compare_bigint(__attribute__((unused)) const cell *p1, __attribute__((unused)) const cell *p2) { return 0; }
+static void own_bigint_on_heap(__attribute__((unused)) query *q, __attribute__((unused)) cell *c) {}
+
+static int do_bigint_op(query *q, int op, cell *p1, cell *p2)
+{
+	if (((op == BIG_DIVINT) || (op == BIG_DIV) || (op == BIG_MOD) || (op == BIG_REM)) && !p2->val_num) {
+		throw_error(q, p2, "evaluation_error", "zero_divisor");
+		return 0;
+	}
+
+	throw_error(q, p1, "domain_error", "integer_overflow");
+	return 0;
+}
+
+static int do_bigint_op1(query *q, cell *p1, __attribute__((unused)) void *op)
+{
+	throw_error(q, p1, "domain_error", "integer_overflow");
+	return 0;
+}
+
+static int do_bigint_rdiv(query *q, cell *p1, __attribute__((unused)) cell *p2)
+{
+	throw_error(q, p1, "domain_error", "integer_overflow");
+	return 0;
+}
+
+static int make_float_to_bigint(query *q, double d)
+{
+	cell tmp;
+	make_float(&tmp, d);
+	throw_error(q, &tmp, "domain_error", "integer_overflow");
+	return 0;
+}
+
+static int add_bigint(__attribute__((unused)) cell *sum, __attribute__((unused)) cell *n)
+{
+	return 0;
+}
+#endif
+
+static double num_to_float(const cell *c)
+{
+#if USE_BIGINT
+	if (is_bigint(c))
+		return mpz_get_d(c->val_big->ival);
+#endif
+
+	if (is_float(c))
+		return c->val_flt;
+
+	return rat_to_float(c);
+}
+
+// Numeric comparison for the arithmetic builtins when a bigint is
+// involved. Throws if either side is not a number.
+
+static int compare_numbers(query *q, cell *p1, cell *p2)
+{
+	if (!is_number(p1) || !is_number(p2)) {
+		throw_error(q, is_number(p1) ? p2 : p1, "type_error", "number");
+		return 0;
+	}
+
+	return compare_bigint(p1, p2);
+}
+
+static int make_float_to_int(query *q, double d)
+{
+	const double lim = ldexp(1.0, sizeof(int_t)*8-1);
+
+	if ((d >= -lim) && (d < lim)) {
+		q->accum.val_num = (int_t)d;
+		q->accum.val_den = 1;
+		q->accum.val_type = TYPE_INTEGER;
+		return 1;
+	}
+
+	if (!isfinite(d)) {
+		cell tmp;
+		make_float(&tmp, d);
+		throw_error(q, &tmp, "domain_error", "integer_overflow");
+		return 0;
+	}
+
+	return make_float_to_bigint(q, d);
+}
+
 //static idx_t heap_used(const query *q) { return q->st.hp; }
 //static cell *get_heap(const query *q, idx_t i) { return q->arenas->heap + i; }
 
@@ -440,62 +900,249 @@ static size_t g_tab_idx;
 static idx_t g_tab1[64000];
 static unsigned g_tab2[64000];
 
-static void deep_copy2_to_tmp(query *q, cell *p1, idx_t p1_ctx)
+typedef struct {
+	cell *c;
+	slot *e;
+	idx_t ctx, save_idx;
+	unsigned nbr;
+} copy_frame;
+
+// The slot a variable is finally bound to a compound through, or NULL.
+
+static slot *bound_slot(query *q, cell *c, idx_t c_ctx)
 {
-	idx_t save_idx = tmp_heap_used(q);
-	p1 = deref(q, p1, p1_ctx);
-	p1_ctx = q->latest_ctx;
-	cell *tmp = alloc_tmp_heap(q, 1);
-	copy_cells(tmp, p1, 1);
-
-	if (!is_structure(p1)) {
-		if (is_blob(p1) && !is_const_cstring(p1)) {
-			size_t len = LEN_STR(p1);
-			tmp->val_str = malloc(len+1);
-			memcpy(tmp->val_str, p1->val_str, len);
-			tmp->val_str[len] = '\0';
+	frame *g = GET_FRAME(c_ctx);
+	slot *e = GET_SLOT(g, c->var_nbr);
+
+	while (is_variable(&e->c)) {
+		g = GET_FRAME(e->ctx);
+		e = GET_SLOT(g, e->c.var_nbr);
+	}
+
+	return is_indirect(&e->c) ? e : NULL;
+}
+
+static void copy_var_to_tmp(query *q, cell *tmp, cell *p1, idx_t p1_ctx)
+{
+	frame *g = GET_FRAME(p1_ctx);
+	slot *e = GET_SLOT(g, p1->var_nbr);
+	idx_t slot_nbr = e - q->slots;
+
+	for (size_t i = 0; i < g_tab_idx; i++) {
+		if (g_tab1[i] == slot_nbr) {
+			tmp->var_nbr = g_tab2[i];
+			tmp->flags = FLAG_FRESH;
 			return;
 		}
+	}
 
-		if (!is_variable(p1))
-			return;
+	tmp->var_nbr = g_varno;
+	tmp->flags = FLAG_FRESH;
+	g_tab1[g_tab_idx] = slot_nbr;
+	g_tab2[g_tab_idx] = g_varno++;
+	g_tab_idx++;
+}
 
-		frame *g = GET_FRAME(p1_ctx);
-		slot *e = GET_SLOT(g, p1->var_nbr);
-		idx_t slot_nbr = e - q->slots;
+// Flatten a term onto the tmp heap using an explicit stack, so depth
+// is bounded only by memory. Each slot bound to a compound is marked
+// while that compound is being copied: meeting a marked slot again
+// means the term is cyclic, and the variable is emitted as is rather
+// than expanded. With 'copy_vars' unbound variables are renumbered
+// into fresh ones (see g_varno), otherwise they are copied verbatim.
 
-		for (size_t i = 0; i < g_tab_idx; i++) {
-			if (g_tab1[i] == slot_nbr) {
-				tmp->var_nbr = g_tab2[i];
-				tmp->flags = FLAG_FRESH;
-				return;
+static void deep_copy3_to_tmp(query *q, cell *p1, idx_t p1_ctx, int copy_vars)
+{
+	copy_frame local[64], *stack = local;
+	unsigned sp = 0, size = sizeof(local) / sizeof(local[0]);
+
+	for (;;) {
+		slot *e = NULL;
+
+		if (is_variable(p1) && (e = bound_slot(q, p1, p1_ctx)) != NULL
+			&& (e->c.flags & FLAG_VISITED)) {
+			cell *tmp = alloc_tmp_heap(q, 1);
+			copy_cells(tmp, p1, 1);
+
+			if (copy_vars)
+				copy_var_to_tmp(q, tmp, p1, p1_ctx);
+
+			e = NULL;
+		} else {
+			idx_t save_idx = tmp_heap_used(q);
+			p1 = deref(q, p1, p1_ctx);
+			p1_ctx = q->latest_ctx;
+			cell *tmp = alloc_tmp_heap(q, 1);
+			copy_cells(tmp, p1, 1);
+
+			if (is_structure(p1)) {
+				if (sp == size) {
+					size *= 2;
+
+					if (stack == local) {
+						stack = malloc(sizeof(copy_frame)*size);
+						memcpy(stack, local, sizeof(local));
+					} else
+						stack = realloc(stack, sizeof(copy_frame)*size);
+				}
+
+				if (e)
+					e->c.flags |= FLAG_VISITED;
+
+				copy_frame *f = stack + sp++;
+				f->c = p1 + 1;
+				f->e = e;
+				f->ctx = p1_ctx;
+				f->save_idx = save_idx;
+				f->nbr = p1->arity;
+			} else if (is_blob(p1) && !is_const_cstring(p1)) {
+				size_t len = LEN_STR(p1);
+				tmp->val_str = malloc(len+1);
+				memcpy(tmp->val_str, p1->val_str, len);
+				tmp->val_str[len] = '\0';
+			} else if (is_bigint(p1)) {
+				dup_bigint(tmp);
+			} else if (copy_vars && is_variable(p1)) {
+				copy_var_to_tmp(q, tmp, p1, p1_ctx);
 			}
 		}
 
-		tmp->var_nbr = g_varno;
-		tmp->flags = FLAG_FRESH;
-		g_tab1[g_tab_idx] = slot_nbr;
-		g_tab2[g_tab_idx] = g_varno++;
-		g_tab_idx++;
-		return;
-	}
+		while (sp && !stack[sp-1].nbr) {
+			copy_frame *f = stack + --sp;
+			cell *tmp = get_tmp_heap(q, f->save_idx);
+			tmp->nbr_cells = tmp_heap_used(q) - f->save_idx;
 
-	unsigned arity = p1->arity;
-	p1++;
+			if (f->e)
+				f->e->c.flags &= ~FLAG_VISITED;
+		}
 
-	while (arity--) {
-		cell *c = deref(q, p1, p1_ctx);
-		deep_copy2_to_tmp(q, c, q->latest_ctx);
-		p1 += p1->nbr_cells;
+		if (!sp)
+			break;
+
+		copy_frame *f = stack + sp - 1;
+		p1 = f->c;
+		p1_ctx = f->ctx;
+		f->c += p1->nbr_cells;
+		f->nbr--;
 	}
 
-	tmp = get_tmp_heap(q, save_idx);
-	tmp->nbr_cells = tmp_heap_used(q) - save_idx;
+	if (stack != local)
+		free(stack);
 }
 
-static cell *deep_copy_to_tmp(query *q, cell *p1, idx_t p1_ctx)
+static void deep_copy2_to_tmp(query *q, cell *p1, idx_t p1_ctx)
 {
-	init_tmp_heap(q);
+	deep_copy3_to_tmp(q, p1, p1_ctx, 1);
+}
+
+// A pre-order walk over the subterms of a term, dereferenced, with the
+// same stack and cycle handling as above. Variables closing a cycle
+// are skipped.
+
+typedef struct {
+	copy_frame local[64], *stack;
+	cell *c, *pending;
+	slot *e;
+	idx_t ctx, pending_ctx;
+	unsigned sp, size;
+	int cyclic;
+} term_walker;
+
+static void walk_init(term_walker *w, cell *c, idx_t c_ctx)
+{
+	w->stack = w->local;
+	w->sp = 0;
+	w->size = sizeof(w->local) / sizeof(w->local[0]);
+	w->c = c;
+	w->ctx = c_ctx;
+	w->pending = NULL;
+	w->e = NULL;
+	w->cyclic = 0;
+}
+
+static cell *walk_next(query *q, term_walker *w, idx_t *c_ctx)
+{
+	if (w->pending) {
+		if (w->sp == w->size) {
+			w->size *= 2;
+
+			if (w->stack == w->local) {
+				w->stack = malloc(sizeof(copy_frame)*w->size);
+				memcpy(w->stack, w->local, sizeof(w->local));
+			} else
+				w->stack = realloc(w->stack, sizeof(copy_frame)*w->size);
+		}
+
+		if (w->e)
+			w->e->c.flags |= FLAG_VISITED;
+
+		copy_frame *f = w->stack + w->sp++;
+		f->c = w->pending + 1;
+		f->e = w->e;
+		f->ctx = w->pending_ctx;
+		f->nbr = w->pending->arity;
+		w->pending = NULL;
+	}
+
+	for (;;) {
+		cell *c = w->c;
+		idx_t ctx = w->ctx;
+
+		if (c)
+			w->c = NULL;
+		else {
+			while (w->sp && !w->stack[w->sp-1].nbr) {
+				copy_frame *f = w->stack + --w->sp;
+
+				if (f->e)
+					f->e->c.flags &= ~FLAG_VISITED;
+			}
+
+			if (!w->sp)
+				return NULL;
+
+			copy_frame *f = w->stack + w->sp - 1;
+			c = f->c;
+			ctx = f->ctx;
+			f->c += c->nbr_cells;
+			f->nbr--;
+		}
+
+		slot *e = NULL;
+
+		if (is_variable(c) && (e = bound_slot(q, c, ctx)) != NULL
+			&& (e->c.flags & FLAG_VISITED)) {
+			w->cyclic = 1;
+			continue;
+		}
+
+		c = deref(q, c, ctx);
+		ctx = q->latest_ctx;
+
+		if (is_structure(c)) {
+			w->pending = c;
+			w->pending_ctx = ctx;
+			w->e = e;
+		}
+
+		*c_ctx = ctx;
+		return c;
+	}
+}
+
+static void walk_done(term_walker *w)
+{
+	while (w->sp--) {
+		if (w->stack[w->sp].e)
+			w->stack[w->sp].e->c.flags &= ~FLAG_VISITED;
+	}
+
+	if (w->stack != w->local)
+		free(w->stack);
+}
+
+static cell *deep_copy_to_tmp(query *q, cell *p1, idx_t p1_ctx)
+{
+	init_tmp_heap(q);
 	frame *g = GET_FRAME(q->st.curr_frame);
 	g_varno = g->nbr_vars;
 	g_tab_idx = 0;
@@ -525,34 +1172,7 @@ static cell *deep_copy_to_heap(query *q, cell *p1, idx_t p1_ctx)
 
 static void deep_clone2_to_tmp(query *q, cell *p1, idx_t p1_ctx)
 {
-	idx_t save_idx = tmp_heap_used(q);
-	p1 = deref(q, p1, p1_ctx);
-	p1_ctx = q->latest_ctx;
-	cell *tmp = alloc_tmp_heap(q, 1);
-	copy_cells(tmp, p1, 1);
-
-	if (!is_structure(p1)) {
-		if (is_blob(p1) && !is_const_cstring(p1)) {
-			size_t len = LEN_STR(p1);
-			tmp->val_str = malloc(len+1);
-			memcpy(tmp->val_str, p1->val_str, len);
-			tmp->val_str[len] = '\0';
-		}
-
-		return;
-	}
-
-	unsigned arity = p1->arity;
-	p1++;
-
-	while (arity--) {
-		cell *c = deref(q, p1, p1_ctx);
-		deep_clone2_to_tmp(q, c, q->latest_ctx);
-		p1 += p1->nbr_cells;
-	}
-
-	tmp = get_tmp_heap(q, save_idx);
-	tmp->nbr_cells = tmp_heap_used(q) - save_idx;
+	deep_copy3_to_tmp(q, p1, p1_ctx, 0);
 }
 
 static cell *deep_clone_to_tmp(query *q, cell *p1, idx_t p1_ctx)
@@ -586,9 +1206,8 @@ void throw_error(query *q, cell *c, const char *err_type, const char *expected)
 		tmp = *c;
 
 	idx_t c_ctx = q->latest_ctx;
-	size_t len = write_term_to_buf(q, NULL, 0, &tmp, c_ctx, 1, 0, 0);
-	char *dst = malloc(len+1);
-	write_term_to_buf(q, dst, len+1, &tmp, c_ctx, 1, 0, 0);
+	char *dst = write_term_to_strbuf(q, &tmp, c_ctx, 1);
+	size_t len = strlen(dst);
 	size_t len2 = (len * 2) + strlen(err_type) + strlen(expected) + LEN_STR(q->st.curr_cell) + 20;
 	char *dst2 = malloc(len2+1);
 
@@ -609,15 +1228,33 @@ void throw_error(query *q, cell *c, const char *err_type, const char *expected)
 		snprintf(dst2, len2, "error(%s(%s,%s),%s/%u)", err_type, expected, dst, GET_STR(q->st.curr_cell), q->st.curr_cell->arity);
 	}
 
+	free(dst);
+
+	// The builtin still has to return before anything is unwound, so
+	// the error is left for run_query() to raise. The first one wins.
+
+	if (q->ball)
+		free(dst2);
+	else
+		q->ball = dst2;
+}
+
+// Raises the error left by throw_error(), returning true if a catcher
+// took it, in which case its recovery goal is the next to run.
+
+int raise_error(query *q)
+{
+	char *src = q->ball;
+	q->ball = NULL;
 	parser *p = q->m->p;
-	p->srcptr = dst2;
+	p->srcptr = src;
 	parser_tokenize(p, 0, 0);
 	parser_attach(p, 0);
 	//parser_xref(p, p->t, NULL);
-	do_throw_term(q, p->t->cells);
+	int ok = do_throw_term(q, p->t->cells) && q->st.curr_cell->fn(q);
 	clear_term(p->t);
-	free(dst2);
-	free(dst);
+	free(src);
+	return ok;
 }
 
 static int fn_iso_unify_2(query *q)
@@ -700,27 +1337,33 @@ static int fn_iso_nonvar_1(query *q)
 	return !is_variable(p1);
 }
 
-static int has_vars(query *q, cell *c, idx_t c_ctx)
+int is_cyclic_term(query *q, cell *c, idx_t c_ctx)
 {
-	if (is_variable(c))
-		return 1;
-
-	if (!is_structure(c))
-		return 0;
+	term_walker w;
+	walk_init(&w, c, c_ctx);
 
-	unsigned arity = c->arity;
-	c++;
+	while (!w.cyclic && walk_next(q, &w, &c_ctx))
+		;
 
-	while (arity--) {
-		cell *c2 = deref(q, c, c_ctx);
+	walk_done(&w);
+	return w.cyclic;
+}
 
-		if (has_vars(q, c2, q->latest_ctx))
-			return 1;
+static int has_vars(query *q, cell *c, idx_t c_ctx)
+{
+	term_walker w;
+	walk_init(&w, c, c_ctx);
+	int found = 0;
 
-		c += c->nbr_cells;
+	while ((c = walk_next(q, &w, &c_ctx)) != NULL) {
+		if (is_variable(c)) {
+			found = 1;
+			break;
+		}
 	}
 
-	return 0;
+	walk_done(&w);
+	return found;
 }
 
 static int fn_iso_ground_1(query *q)
@@ -729,6 +1372,18 @@ static int fn_iso_ground_1(query *q)
 	return !has_vars(q, p1, p1_ctx);
 }
 
+static int fn_acyclic_term_1(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	return !is_cyclic_term(q, p1, p1_ctx);
+}
+
+static int fn_cyclic_term_1(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	return is_cyclic_term(q, p1, p1_ctx);
+}
+
 static int fn_iso_cut_0(query *q)
 {
 	cut_me(q, 0);
@@ -1007,9 +1662,37 @@ static int fn_iso_atom_codes_2(query *q)
 	return unify(q, p2, p2_ctx, l, q->st.curr_frame);
 }
 
+// Digits that overflowed int_t are read again from the (already
+// checked) list to build a bigint.
+
+static void make_int_from_digits(query *q, cell *tmp, cell *l, idx_t l_ctx, int codes)
+{
+	size_t len = 0, size = 64;
+	char *dst = malloc(size);
+	cell tmp2;
+
+	while (is_list(l)) {
+		cell *head = deref(q, list_head(l), l_ctx);
+
+		if ((len + 1) >= size)
+			dst = realloc(dst, size *= 2);
+
+		dst[len++] = codes ? head->val_num : *GET_STR(head);
+		l = deref(q, list_tail(l, &tmp2), l_ctx);
+		l_ctx = q->latest_ctx;
+	}
+
+	dst[len] = '\0';
+	make_bigint_str(tmp, dst, 10, 0);
+	tmp->nbr_cells = 1;
+	tmp->arity = tmp->flags = 0;
+	own_bigint_on_heap(q, tmp);
+	free(dst);
+}
+
 static int fn_iso_number_chars_2(query *q)
 {
-	GET_FIRST_ARG(p1,integer_or_var);
+	GET_FIRST_ARG(p1,integer_or_bigint_or_var);
 	GET_NEXT_ARG(p2,list_or_var);
 
 	if (is_variable(p1) && is_variable(p2)) {
@@ -1023,6 +1706,7 @@ static int fn_iso_number_chars_2(query *q)
 		head = deref(q, head, p2_ctx);
 
 		int_t val = 0;
+		int big = 0;
 
 		while (tail) {
 			if (!is_atom(head)) {
@@ -1038,8 +1722,8 @@ static int fn_iso_number_chars_2(query *q)
 				return 0;
 			}
 
-			val *= 10;
-			val += ch - '0';
+			if (__builtin_mul_overflow(val, 10, &val) || __builtin_add_overflow(val, ch - '0', &val))
+				big = 1;
 
 			if (is_literal(tail)) {
 				if (tail->val_off == g_nil_s)
@@ -1058,18 +1742,31 @@ static int fn_iso_number_chars_2(query *q)
 
 		cell tmp;
 		make_int(&tmp, val);
+
+		if (big && USE_BIGINT)
+			make_int_from_digits(q, &tmp, p2, p2_ctx, 0);
+
 		return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
 	}
 
-	char tmpbuf[256];
-	sprint_int(tmpbuf, sizeof(tmpbuf), p1->val_num, 10);
-	cell tmp = make_string(q, tmpbuf, strlen(tmpbuf));
+	char tmpbuf[256], *src = tmpbuf;
+
+	if (is_bigint(p1))
+		src = bigint_to_str(p1, 10);
+	else
+		sprint_int(tmpbuf, sizeof(tmpbuf), p1->val_num, 10);
+
+	cell tmp = make_string(q, src, strlen(src));
+
+	if (src != tmpbuf)
+		free(src);
+
 	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 }
 
 static int fn_iso_number_codes_2(query *q)
 {
-	GET_FIRST_ARG(p1,integer_or_var);
+	GET_FIRST_ARG(p1,integer_or_bigint_or_var);
 	GET_NEXT_ARG(p2,iso_list_or_var);
 
 	if (is_variable(p1) && is_variable(p2)) {
@@ -1083,6 +1780,7 @@ static int fn_iso_number_codes_2(query *q)
 		head = deref(q, head, p2_ctx);
 
 		int_t val = 0;
+		int big = 0;
 
 		while (tail) {
 			if (!is_integer(head)) {
@@ -1097,8 +1795,8 @@ static int fn_iso_number_codes_2(query *q)
 				return 0;
 			}
 
-			val *= 10;
-			val += ch - '0';
+			if (__builtin_mul_overflow(val, 10, &val) || __builtin_add_overflow(val, ch - '0', &val))
+				big = 1;
 
 			if (is_literal(tail)) {
 				if (tail->val_off == g_nil_s)
@@ -1117,22 +1815,34 @@ static int fn_iso_number_codes_2(query *q)
 
 		cell tmp;
 		make_int(&tmp, val);
+
+		if (big && USE_BIGINT)
+			make_int_from_digits(q, &tmp, p2, p2_ctx, 1);
+
 		return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
 	}
 
-	char tmpbuf[256];
-	sprint_int(tmpbuf, sizeof(tmpbuf), p1->val_num, 10);
-	const char *src = tmpbuf;
+	char tmpbuf[256], *src = tmpbuf;
+
+	if (is_bigint(p1))
+		src = bigint_to_str(p1, 10);
+	else
+		sprint_int(tmpbuf, sizeof(tmpbuf), p1->val_num, 10);
+
+	const char *s = src;
 	cell tmp;
-	make_int(&tmp, *src);
+	make_int(&tmp, *s);
 	alloc_list(q, &tmp);
 
-	while (*++src) {
+	while (*++s) {
 		cell tmp;
-		make_int(&tmp, *src);
+		make_int(&tmp, *s);
 		append_list(q, &tmp);
 	}
 
+	if (src != tmpbuf)
+		free(src);
+
 	cell *l = end_list(q);
 	fix_list(l);
 	return unify(q, p2, p2_ctx, l, q->st.curr_frame);
@@ -1790,6 +2500,116 @@ static void parse_read_params(query *q, cell *p, stream *str)
 	}
 }
 
+// Reads the next block of the stream onto the end of whatever is
+// left unparsed from 'keep' on. The block is topped up to the end of
+// its last line, but by no more than another block, so a term that
+// still runs over is parsed again with the next.
+//
+// Other reads of the stream take what is left in the block first, see
+// net_pending(), so end of file is only seen once it is used up.
+
+#define READ_BLOCK_SIZE (1024*64)
+
+static int read_block(parser *p, stream *str, const char *keep)
+{
+	size_t kept = keep ? strlen(keep) : 0;
+	size_t need = kept + (READ_BLOCK_SIZE * 2) + 1;
+
+	if (kept)
+		memmove(p->save_line, keep, kept);
+
+	if (p->n_line < need) {
+		p->save_line = realloc(p->save_line, p->n_line=need);
+		if (!p->save_line) abort();
+	}
+
+	p->srcptr = NULL;
+	size_t len = net_read(p->save_line+kept, READ_BLOCK_SIZE, str);
+	int ch;
+
+	while (len && (p->save_line[kept+len-1] != '\n')
+		&& (len < (READ_BLOCK_SIZE * 2)) && ((ch = net_getc(str)) != EOF))
+		p->save_line[kept+len++] = ch;
+
+	p->save_line[kept+len] = '\0';
+	p->srcptr = p->save_line;
+
+	if (!len)
+		return 0;
+
+	clearerr(str->fp);
+	return 1;
+}
+
+// Parses the next term from the block buffer into p->t, returning
+// 1 for a term, 0 at end of file and -1 on a syntax error.
+
+static int read_buffered_term(query *q, parser *p, stream *str)
+{
+	// Terms are taken straight from the block, so the parser mustn't
+	// go to the file for more lines behind our back...
+
+	p->fp = NULL;
+	p->one_shot = 1;
+
+	if (!p->buffered) {
+		p->srcptr = p->save_line;
+
+		if (p->srcptr)
+			*p->srcptr = '\0';
+
+		p->buffered = 1;
+	}
+
+	for (;;) {
+		const char *src = p->srcptr;
+
+		while (src && isspace(*src))
+			src++;
+
+		if (!src || !*src) {
+			if (!read_block(p, str, NULL))
+				return 0;
+
+			continue;
+		}
+
+		p->srcptr = (char*)src;
+		p->t->cidx = 0;
+		p->start_term = 1;
+		p->end_of_term = 0;
+		p->comment = 0;
+		p->error = 0;
+		int save = q->m->flag.character_escapes;
+		q->m->flag.character_escapes = q->character_escapes;
+		parser_tokenize(p, 0, 0);
+		q->m->flag.character_escapes = save;
+
+		if (p->error)
+			return -1;
+
+		// A term running over the end of the block is parsed again
+		// once the rest of it has been read...
+
+		if (!p->end_of_term) {
+			if (read_block(p, str, src))
+				continue;
+
+			if (!p->t->cidx)
+				return 0;
+
+			fprintf(stdout, "Error: syntax error, incomplete term\n");
+			return -1;
+		}
+
+		if (!parser_attach(p, 0))
+			return -1;
+
+		parser_xref(p, p->t, NULL);
+		return 1;
+	}
+}
+
 static int do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, char *src)
 {
 	if (!str->p)
@@ -1814,6 +2634,12 @@ static int do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cell *p2,
 		p2_ctx = q->latest_ctx;
 	}
 
+	// Once read_terms/3 has buffered ahead the rest comes from there,
+	// and is kept for later if parsing from src...
+
+	int buffered = !src && p->buffered;
+	char *save_src = p->srcptr;
+
 	for (;;) {
 #if 0
 		if (isatty(fileno(str->fp)) && !src) {
@@ -1822,6 +2648,21 @@ static int do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cell *p2,
 		}
 #endif
 
+		if (buffered) {
+			int ok = read_buffered_term(q, p, str);
+
+			if (ok < 0)
+				return 0;
+
+			if (!ok) {
+				cell tmp;
+				make_literal(&tmp, g_eof_s);
+				return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+			}
+
+			break;
+		}
+
 		if (!src) {
 			if (net_getline(&p->save_line, &p->n_line, str) == -1) {
 				if (q->is_task && !feof(str->fp)) {
@@ -1839,7 +2680,7 @@ static int do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cell *p2,
 			if (p->save_line[strlen(p->save_line)-1] == '\n')
 				p->save_line[strlen(p->save_line)-1] = '\0';
 
-			if (p->save_line[strlen(p->save_line)-1] == '\r')
+			if (*p->save_line && (p->save_line[strlen(p->save_line)-1] == '\r'))
 				p->save_line[strlen(p->save_line)-1] = '\0';
 
 			if (!strlen(p->save_line))
@@ -1852,27 +2693,119 @@ static int do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cell *p2,
 		break;
 	}
 
-	int save = q->m->flag.character_escapes;
-	q->m->flag.character_escapes = q->character_escapes;
-	parser_tokenize(p, 0, 0);
-	q->m->flag.character_escapes = save;
+	if (!buffered) {
+		int save = q->m->flag.character_escapes;
+		q->m->flag.character_escapes = q->character_escapes;
+		parser_tokenize(p, 0, 0);
+		q->m->flag.character_escapes = save;
 
-	if (p->error)
-		return 0;
+		if (src)
+			p->srcptr = save_src;
 
-	if (!parser_attach(p, 0))
-		return 0;
+		if (p->error)
+			return 0;
+
+		if (!parser_attach(p, 0))
+			return 0;
+
+		parser_xref(p, p->t, NULL);
+	}
 
-	parser_xref(p, p->t, NULL);
 	q->m->flag.double_quote_chars = flag_chars;
 	q->m->flag.double_quote_codes = flag_codes;
 	q->m->flag.double_quote_atom = flag_atom;
 
 	cell *tmp = alloc_heap(q, p->t->cidx-1);
 	copy_cells(tmp, p->t->cells, p->t->cidx-1);
+
+	// The heap copy now owns any bigints and strings...
+
+	for (idx_t i = 0; i < p->t->cidx-1; i++) {
+		if (is_bigint(p->t->cells+i))
+			p->t->cells[i].flags |= FLAG_DUP_BIGINT;
+		else if (is_blob(p->t->cells+i))
+			p->t->cells[i].flags |= FLAG_DUP_CSTRING;
+	}
+
 	return unify(q, p1, p1_ctx, tmp, q->st.curr_frame);
 }
 
+static int fn_read_terms_3(query *q)
+{
+	GET_FIRST_ARG(pstr,stream);
+	GET_NEXT_ARG(p1,integer);
+	GET_NEXT_ARG(p2,any);
+	int n = get_stream(q, pstr);
+	stream *str = &g_streams[n];
+
+	if (is_bigint(p1) || (p1->val_num < 1)) {
+		throw_error(q, p1, "domain_error", "not_less_than_one");
+		return 0;
+	}
+
+	if (!str->p)
+		str->p = create_parser(q->m);
+
+	parser *p = str->p;
+	int_t max = p1->val_num, cnt = 0;
+	init_tmp_heap(q);
+
+	while (cnt < max) {
+		int ok = read_buffered_term(q, p, str);
+
+		if (ok < 0)
+			return 0;
+
+		if (!ok)
+			break;
+
+		frame *g = GET_FRAME(q->st.curr_frame);
+		unsigned var_nbr = g->nbr_vars, nbr_vars = p->t->nbr_vars;
+
+		if (nbr_vars) {
+			create_vars(q, nbr_vars);
+
+			if (g->nbr_vars != (var_nbr + nbr_vars))
+				return 0;
+		}
+
+		idx_t nbr_cells = p->t->cidx - 1;
+
+		for (idx_t i = 0; i < nbr_cells; i++) {
+			cell *c = p->t->cells + i;
+
+			if (is_variable(c))
+				c->var_nbr += var_nbr;
+		}
+
+		if (!cnt++)
+			alloc_list(q, p->t->cells);
+		else
+			append_list(q, p->t->cells);
+
+		// The list now owns any bigints and strings...
+
+		for (idx_t i = 0; i < nbr_cells; i++) {
+			cell *c = p->t->cells + i;
+
+			if (is_bigint(c))
+				c->flags |= FLAG_DUP_BIGINT;
+			else if (is_blob(c))
+				c->flags |= FLAG_DUP_CSTRING;
+		}
+	}
+
+	if (!cnt) {
+		cell tmp;
+		make_literal(&tmp, g_nil_s);
+		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	}
+
+	cell *l = end_list(q);
+	fix_list(l);
+	return unify(q, p2, p2_ctx, l, q->st.curr_frame);
+}
+
 static int fn_iso_read_1(query *q)
 {
 	GET_FIRST_ARG(p1,any);
@@ -2530,7 +3463,124 @@ void do_reduce(cell *n)
 
 #define reduce(c) if ((c)->val_den != 1) do_reduce(c)
 
-static int fn_iso_is_2(query *q)
+// Rationals are a pair of int_t with a positive denominator. They are
+// not promoted to GMP, so results are cross-reduced first to keep the
+// products small and a result that still overflows is an error rather
+// than a wrapped value.
+
+enum { RAT_ADD, RAT_SUB, RAT_MUL, RAT_DIV };
+
+static uint_t rat_gcd(int_t a, int_t b)
+{
+	uint_t u = a < 0 ? -(uint_t)a : (uint_t)a;
+	uint_t v = b < 0 ? -(uint_t)b : (uint_t)b;
+
+	while (v) {
+		uint_t t = u % v;
+		u = v;
+		v = t;
+	}
+
+	return u ? u : 1;
+}
+
+static int rat_op(query *q, int op, const cell *p1, const cell *p2)
+{
+	int_t a = p1->val_num, b = p1->val_den, c = p2->val_num, d = p2->val_den;
+	int_t num, den, t1, t2;
+	int ok;
+
+	if (op == RAT_DIV) {
+		if (!c) {
+			throw_error(q, (cell*)p2, "evaluation_error", "zero_divisor");
+			return 0;
+		}
+
+		int_t save = c;
+		c = d;
+		d = save;
+	}
+
+	// Try the plain products first, as is/2 reduces the result anyway,
+	// and only pay for reducing the operands and cross-reducing when
+	// they overflow.
+
+	for (int pass = 0; pass < 2; pass++) {
+		if (pass) {
+			int_t g = rat_gcd(a, b);
+			a /= g; b /= g;
+			g = rat_gcd(c, d);
+			c /= g; d /= g;
+		}
+
+		if ((op == RAT_ADD) || (op == RAT_SUB)) {
+			int_t g = pass ? rat_gcd(b, d) : 1;
+			ok = !__builtin_mul_overflow(a, d / g, &t1)
+				&& !__builtin_mul_overflow(c, b / g, &t2)
+				&& !(op == RAT_ADD ? __builtin_add_overflow(t1, t2, &num) : __builtin_sub_overflow(t1, t2, &num))
+				&& !__builtin_mul_overflow(b, d / g, &den);
+		} else {
+			int_t g1 = pass ? rat_gcd(a, d) : 1, g2 = pass ? rat_gcd(c, b) : 1;
+			ok = !__builtin_mul_overflow(a / g1, c / g2, &num)
+				&& !__builtin_mul_overflow(b / g2, d / g1, &den);
+		}
+
+		if (ok)
+			break;
+	}
+
+	if (!ok) {
+		throw_error(q, (cell*)p1, "domain_error", "integer_overflow");
+		return 0;
+	}
+
+	q->accum.val_type = TYPE_INTEGER;
+	q->accum.val_num = num;
+	q->accum.val_den = den;
+
+	if (den < 0) {
+		if ((num == INT_T_MIN) || (den == INT_T_MIN)) {
+			throw_error(q, (cell*)p1, "domain_error", "integer_overflow");
+			return 0;
+		}
+
+		q->accum.val_num = -num;
+		q->accum.val_den = -den;
+	}
+
+	return 1;
+}
+
+// Exact comparison of two rationals by their continued fractions,
+// which needs no products and so can't overflow.
+
+static int rat_cmp(const cell *p1, const cell *p2)
+{
+	int_t a = p1->val_num, b = p1->val_den, c = p2->val_num, d = p2->val_den;
+	int sign = 1;
+
+	for (;;) {
+		int_t q1 = a / b, r1 = a % b;
+		int_t q2 = c / d, r2 = c % d;
+
+		if (r1 < 0) { r1 += b; q1--; }
+		if (r2 < 0) { r2 += d; q2--; }
+
+		if (q1 != q2)
+			return q1 < q2 ? -sign : sign;
+
+		if (!r1 || !r2)
+			return !r1 && !r2 ? 0 : !r1 ? -sign : sign;
+
+		// a/b - q = r1/b, so compare b/r1 with d/r2 the other way round
+
+		a = b; b = r1;
+		c = d; d = r2;
+		sign = -sign;
+	}
+}
+
+static int fn_iso_is_2(query *q)
 {
 	GET_FIRST_ARG(p1,any);
 	GET_NEXT_ARG(p2_tmp,any);
@@ -2546,11 +3596,20 @@ static int fn_iso_is_2(query *q)
 		return 1;
 	}
 
+	if (is_variable(p1) && is_bigint(&p2)) {
+		p2.flags |= FLAG_CONST_BIGINT;
+		set_var(q, p1, p1_ctx, &p2, q->st.curr_frame);
+		return 1;
+	}
+
 	if (is_variable(p1) && is_number(&p2)) {
 		set_var(q, p1, p1_ctx, &p2, q->st.curr_frame);
 		return 1;
 	}
 
+	if (is_bigint(p1) || is_bigint(&p2))
+		return is_bigint(p1) && is_bigint(&p2) && !bigint_cmp(p1, &p2);
+
 	if (is_integer(p1) && is_integer(&p2))
 		return (p1->val_num == p2.val_num);
 
@@ -2585,8 +3644,8 @@ static int fn_iso_float_1(query *q)
 			return 1;
 		}
 
-		if (is_integer(&p1)) {
-			q->accum.val_flt = (double)p1.val_num;
+		if (is_integer_or_bigint(&p1)) {
+			q->accum.val_flt = num_to_float(&p1);
 			q->accum.val_type = TYPE_FLOAT;
 			return 1;
 		}
@@ -2605,10 +3664,11 @@ static int fn_iso_integer_1(query *q)
 	if (q->calc) {
 		cell p1 = calc(q, p1_tmp);
 
-		if is_float(&p1) {
-			q->accum.val_num = (int_t)p1.val_flt;
-			q->accum.val_den = 1;
-			q->accum.val_type = TYPE_INTEGER;
+		if is_float(&p1)
+			return make_float_to_int(q, p1.val_flt);
+
+		if (is_bigint(&p1)) {
+			q->accum = p1;
 			return 1;
 		}
 
@@ -2623,17 +3683,20 @@ static int fn_iso_integer_1(query *q)
 		return 0;
 	}
 
-	return is_integer(p1_tmp);
+	return is_integer_or_bigint(p1_tmp);
 }
 
 static int fn_iso_abs_1(query *q)
 {
 	GET_FIRST_ARG(p1_tmp,any);
 	cell p1 = calc(q, p1_tmp);
+	if (is_bigint(&p1) || (is_integer(&p1) && (p1.val_num == INT_T_MIN)))
+		return do_bigint_op1(q, &p1, BIG_ABS);
+
 	q->accum.val_type = p1.val_type;
 
 	if (is_integer(&p1))
-		q->accum.val_num = llabs((long long)p1.val_num);
+		q->accum.val_num = p1.val_num < 0 ? -p1.val_num : p1.val_num;
 	else if is_float(&p1)
 		q->accum.val_flt = fabs(p1.val_flt);
 	else {
@@ -2650,7 +3713,11 @@ static int fn_iso_sign_1(query *q)
 	cell p1 = calc(q, p1_tmp);
 	q->accum.val_type = p1.val_type;
 
-	if (is_integer(&p1))
+	if (is_bigint(&p1)) {
+		q->accum.val_num = num_to_float(&p1) < 0 ? -1 : 1;
+		q->accum.val_den = 1;
+		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_integer(&p1))
 		q->accum.val_num = p1.val_num < 0 ? -1 : p1.val_num > 0  ? 1 : 0;
 	else if is_float(&p1)
 		q->accum.val_flt = p1.val_flt < 0 ? -1 : p1.val_flt > 0  ? 1 : 0;
@@ -2674,6 +3741,9 @@ static int fn_iso_negative_1(query *q)
 {
 	GET_FIRST_ARG(p1_tmp,any);
 	cell p1 = calc(q, p1_tmp);
+	if (is_bigint(&p1) || (is_integer(&p1) && (p1.val_num == INT_T_MIN)))
+		return do_bigint_op1(q, &p1, BIG_NEG);
+
 	q->accum.val_type = p1.val_type;
 
 	if (is_rational(&p1))
@@ -2710,33 +3780,14 @@ static int fn_iso_add_2(query *q)
 	cell p2 = calc(q, p2_tmp);
 
 	if (is_integer(&p1) && is_integer(&p2)) {
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		__int128_t tmp = (__int128_t)p1.val_num + p2.val_num;
-
-		if ((tmp > INT64_MAX) || (tmp < INT64_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		int64_t tmp = (int64_t)p1.val_num + p2.val_num;
+		if (__builtin_add_overflow(p1.val_num, p2.val_num, &q->accum.val_num))
+			return do_bigint_op(q, BIG_ADD, &p1, &p2);
 
-		if ((tmp > INT32_MAX) || (tmp < INT32_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#endif
-			q->accum.val_num = p1.val_num + p2.val_num;
-			q->accum.val_type = TYPE_INTEGER;
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		}
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		}
-#endif
-	} else if (is_rational(&p1) && is_rational(&p2)) {
-		q->accum.val_num = p1.val_num * p2.val_den;
-		q->accum.val_num += p2.val_num * p1.val_den;
-		q->accum.val_den = p1.val_den * p2.val_den;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_ADD, &p1, &p2);
+	} else if (is_rational(&p1) && is_rational(&p2)) {
+		return rat_op(q, RAT_ADD, &p1, &p2);
 	} else if (is_integer(&p1) && is_float(&p2)) {
 		q->accum.val_flt = (double)p1.val_num + p2.val_flt;
 		q->accum.val_type = TYPE_FLOAT;
@@ -2762,33 +3813,14 @@ static int fn_iso_sub_2(query *q)
 	cell p2 = calc(q, p2_tmp);
 
 	if (is_integer(&p1) && is_integer(&p2)) {
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		__int128_t tmp = (__int128_t)p1.val_num - p2.val_num;
-
-		if ((tmp > INT64_MAX) || (tmp < INT64_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		int64_t tmp = (int64_t)p1.val_num - p2.val_num;
+		if (__builtin_sub_overflow(p1.val_num, p2.val_num, &q->accum.val_num))
+			return do_bigint_op(q, BIG_SUB, &p1, &p2);
 
-		if ((tmp > INT32_MAX) || (tmp < INT32_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#endif
-			q->accum.val_num = p1.val_num - p2.val_num;
-			q->accum.val_type = TYPE_INTEGER;
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		}
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		}
-#endif
-	} else if (is_rational(&p1) && is_rational(&p2)) {
-		q->accum.val_num = p1.val_num * p2.val_den;
-		q->accum.val_num -= p2.val_num * p1.val_den;
-		q->accum.val_den = p1.val_den * p2.val_den;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_SUB, &p1, &p2);
+	} else if (is_rational(&p1) && is_rational(&p2)) {
+		return rat_op(q, RAT_SUB, &p1, &p2);
 	} else if (is_integer(&p1) && is_float(&p2)) {
 		q->accum.val_flt = (double)p1.val_num - p2.val_flt;
 		q->accum.val_type = TYPE_FLOAT;
@@ -2814,34 +3846,14 @@ static int fn_iso_mul_2(query *q)
 	cell p2 = calc(q, p2_tmp);
 
 	if ((is_integer(&p1)) && is_integer(&p2)) {
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		__int128_t tmp = (__int128_t)p1.val_num * p2.val_num;
-
-		if ((tmp > INT64_MAX) || (tmp < INT64_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		int64_t tmp = (int64_t)p1.val_num * p2.val_num;
+		if (__builtin_mul_overflow(p1.val_num, p2.val_num, &q->accum.val_num))
+			return do_bigint_op(q, BIG_MUL, &p1, &p2);
 
-		if ((tmp > INT32_MAX) || (tmp < INT32_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#endif
-			q->accum.val_num = p1.val_num * p2.val_num;
-			q->accum.val_type = TYPE_INTEGER;
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		}
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		}
-#endif
-	} else if (is_rational(&p1) && is_rational(&p2)) {
-		q->accum.val_num = p1.val_num * p2.val_den;
-		q->accum.val_num *= p2.val_num * p1.val_den;
-		q->accum.val_den = p1.val_den * p2.val_den;
-		q->accum.val_den *= p1.val_den * p2.val_den;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_MUL, &p1, &p2);
+	} else if (is_rational(&p1) && is_rational(&p2)) {
+		return rat_op(q, RAT_MUL, &p1, &p2);
 	} else if (is_integer(&p1) && is_float(&p2)) {
 		q->accum.val_flt = (double)p1.val_num * p2.val_flt;
 		q->accum.val_type = TYPE_FLOAT;
@@ -2870,6 +3882,9 @@ static int fn_iso_exp_1(query *q)
 	} else if (is_float(&p1)) {
 		q->accum.val_flt = exp(p1.val_flt);
 		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_bigint(&p1)) {
+		q->accum.val_flt = exp(num_to_float(&p1));
+		q->accum.val_type = TYPE_FLOAT;
 	} else {
 		throw_error(q, &p1, "type_error", "number");
 		return 0;
@@ -2889,6 +3904,9 @@ static int fn_iso_sqrt_1(query *q)
 	} else if (is_float(&p1)) {
 		q->accum.val_flt = sqrt(p1.val_flt);
 		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_bigint(&p1)) {
+		q->accum.val_flt = sqrt(num_to_float(&p1));
+		q->accum.val_type = TYPE_FLOAT;
 	} else {
 		throw_error(q, &p1, "type_error", "number");
 		return 0;
@@ -2908,6 +3926,9 @@ static int fn_iso_log_1(query *q)
 	} else if (is_float(&p1)) {
 		q->accum.val_flt = log(p1.val_flt);
 		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_bigint(&p1)) {
+		q->accum.val_flt = log(num_to_float(&p1));
+		q->accum.val_type = TYPE_FLOAT;
 	} else {
 		throw_error(q, &p1, "type_error", "number");
 		return 0;
@@ -2921,35 +3942,16 @@ static int fn_iso_truncate_1(query *q)
 	GET_FIRST_ARG(p1_tmp,any);
 	cell p1 = calc(q, p1_tmp);
 
-	if (is_float(&p1)) {
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		__int128_t tmp = p1.val_flt;
-
-		if ((tmp > INT64_MAX) || (tmp < INT64_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		int64_t tmp = p1.val_flt;
+	if (is_float(&p1))
+		return make_float_to_int(q, p1.val_flt);
 
-		if ((tmp > INT32_MAX) || (tmp < INT32_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#endif
-			q->accum.val_num = (int_t)p1.val_flt;
-			q->accum.val_type = TYPE_INTEGER;
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		}
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		}
-#endif
-	} else {
-		throw_error(q, &p1, "type_error", "float");
-		return 0;
+	if (is_bigint(&p1)) {
+		q->accum = p1;
+		return 1;
 	}
 
-	return 1;
+	throw_error(q, &p1, "type_error", "float");
+	return 0;
 }
 
 static int fn_iso_round_1(query *q)
@@ -2957,35 +3959,16 @@ static int fn_iso_round_1(query *q)
 	GET_FIRST_ARG(p1_tmp,any);
 	cell p1 = calc(q, p1_tmp);
 
-	if (is_float(&p1)) {
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		__int128_t tmp = round(p1.val_flt);
-
-		if ((tmp > INT64_MAX) || (tmp < INT64_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		int64_t tmp = round(p1.val_flt);
+	if (is_float(&p1))
+		return make_float_to_int(q, round(p1.val_flt));
 
-		if ((tmp > INT32_MAX) || (tmp < INT32_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#endif
-			q->accum.val_num = (int_t)round(p1.val_flt);
-			q->accum.val_type = TYPE_INTEGER;
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		}
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		}
-#endif
-	} else {
-		throw_error(q, &p1, "type_error", "float");
-		return 0;
+	if (is_bigint(&p1)) {
+		q->accum = p1;
+		return 1;
 	}
 
-	return 1;
+	throw_error(q, &p1, "type_error", "float");
+	return 0;
 }
 
 static int fn_iso_ceiling_1(query *q)
@@ -2993,35 +3976,16 @@ static int fn_iso_ceiling_1(query *q)
 	GET_FIRST_ARG(p1_tmp,any);
 	cell p1 = calc(q, p1_tmp);
 
-	if (is_float(&p1)) {
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		__int128_t tmp = ceil(p1.val_flt);
-
-		if ((tmp > INT64_MAX) || (tmp < INT64_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		int64_t tmp = ceil(p1.val_flt);
+	if (is_float(&p1))
+		return make_float_to_int(q, ceil(p1.val_flt));
 
-		if ((tmp > INT32_MAX) || (tmp < INT32_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#endif
-			q->accum.val_num = (int_t)ceil(p1.val_flt);
-			q->accum.val_type = TYPE_INTEGER;
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		}
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		}
-#endif
-	} else {
-		throw_error(q, &p1, "type_error", "float");
-		return 0;
+	if (is_bigint(&p1)) {
+		q->accum = p1;
+		return 1;
 	}
 
-	return 1;
+	throw_error(q, &p1, "type_error", "float");
+	return 0;
 }
 
 static int fn_iso_float_integer_part_1(query *q)
@@ -3030,28 +3994,10 @@ static int fn_iso_float_integer_part_1(query *q)
 	cell p1 = calc(q, p1_tmp);
 
 	if (is_float(&p1)) {
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		__int128_t tmp = p1.val_flt;
-
-		if ((tmp > INT64_MAX) || (tmp < INT64_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		int64_t tmp = p1.val_flt;
-
-		if ((tmp > INT32_MAX) || (tmp < INT32_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#endif
-			q->accum.val_flt = (int_t)p1.val_flt;
-			q->accum.val_type = TYPE_FLOAT;
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		}
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		}
-#endif
+		q->accum.val_flt = trunc(p1.val_flt);
+		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_bigint(&p1)) {
+		q->accum = p1;
 	} else {
 		throw_error(q, &p1, "type_error", "float");
 		return 0;
@@ -3066,28 +4012,8 @@ static int fn_iso_float_fractional_part_1(query *q)
 	cell p1 = calc(q, p1_tmp);
 
 	if (is_float(&p1)) {
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		__int128_t tmp = p1.val_flt - (__int64_t)p1.val_flt;
-
-		if ((tmp > INT64_MAX) || (tmp < INT64_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		int64_t tmp = p1.val_flt - (int64_t)p1.val_flt;
-
-		if ((tmp > INT32_MAX) || (tmp < INT32_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#endif
-			q->accum.val_flt = p1.val_flt - (int_t)p1.val_flt;
-			q->accum.val_type = TYPE_FLOAT;
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		}
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		}
-#endif
+		q->accum.val_flt = p1.val_flt - trunc(p1.val_flt);
+		q->accum.val_type = TYPE_FLOAT;
 	} else {
 		throw_error(q, &p1, "type_error", "float");
 		return 0;
@@ -3101,35 +4027,16 @@ static int fn_iso_floor_1(query *q)
 	GET_FIRST_ARG(p1_tmp,any);
 	cell p1 = calc(q, p1_tmp);
 
-	if (is_float(&p1)) {
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		__int128_t tmp = floor(p1.val_flt);
-
-		if ((tmp > INT64_MAX) || (tmp < INT64_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		int64_t tmp = floor(p1.val_flt);
+	if (is_float(&p1))
+		return make_float_to_int(q, floor(p1.val_flt));
 
-		if ((tmp > INT32_MAX) || (tmp < INT32_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#endif
-			q->accum.val_num = (int_t)floor(p1.val_flt);
-			q->accum.val_type = TYPE_INTEGER;
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		}
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		}
-#endif
-	} else {
-		throw_error(q, &p1, "type_error", "float");
-		return 0;
+	if (is_bigint(&p1)) {
+		q->accum = p1;
+		return 1;
 	}
 
-	return 1;
+	throw_error(q, &p1, "type_error", "float");
+	return 0;
 }
 
 static int fn_iso_sin_1(query *q)
@@ -3143,6 +4050,9 @@ static int fn_iso_sin_1(query *q)
 	} else if (is_float(&p1)) {
 		q->accum.val_flt = sin(p1.val_flt);
 		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_bigint(&p1)) {
+		q->accum.val_flt = sin(num_to_float(&p1));
+		q->accum.val_type = TYPE_FLOAT;
 	} else {
 		throw_error(q, &p1, "type_error", "number");
 		return 0;
@@ -3162,6 +4072,9 @@ static int fn_iso_cos_1(query *q)
 	} else if (is_float(&p1)) {
 		q->accum.val_flt = cos(p1.val_flt);
 		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_bigint(&p1)) {
+		q->accum.val_flt = cos(num_to_float(&p1));
+		q->accum.val_type = TYPE_FLOAT;
 	} else {
 		throw_error(q, &p1, "type_error", "number");
 		return 0;
@@ -3181,6 +4094,9 @@ static int fn_iso_tan_1(query *q)
 	} else if (is_float(&p1)) {
 		q->accum.val_flt = tan(p1.val_flt);
 		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_bigint(&p1)) {
+		q->accum.val_flt = tan(num_to_float(&p1));
+		q->accum.val_type = TYPE_FLOAT;
 	} else {
 		throw_error(q, &p1, "type_error", "number");
 		return 0;
@@ -3200,6 +4116,9 @@ static int fn_iso_asin_1(query *q)
 	} else if (is_float(&p1)) {
 		q->accum.val_flt = asin(p1.val_flt);
 		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_bigint(&p1)) {
+		q->accum.val_flt = asin(num_to_float(&p1));
+		q->accum.val_type = TYPE_FLOAT;
 	} else {
 		throw_error(q, &p1, "type_error", "number");
 		return 0;
@@ -3219,6 +4138,9 @@ static int fn_iso_acos_1(query *q)
 	} else if (is_float(&p1)) {
 		q->accum.val_flt = acos(p1.val_flt);
 		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_bigint(&p1)) {
+		q->accum.val_flt = acos(num_to_float(&p1));
+		q->accum.val_type = TYPE_FLOAT;
 	} else {
 		throw_error(q, &p1, "type_error", "number");
 		return 0;
@@ -3238,6 +4160,9 @@ static int fn_iso_atan_1(query *q)
 	} else if (is_float(&p1)) {
 		q->accum.val_flt = atan(p1.val_flt);
 		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_bigint(&p1)) {
+		q->accum.val_flt = atan(num_to_float(&p1));
+		q->accum.val_type = TYPE_FLOAT;
 	} else {
 		throw_error(q, &p1, "type_error", "number");
 		return 0;
@@ -3265,6 +4190,9 @@ static int fn_iso_atan_2(query *q)
 	} else if (is_float(&p1) && is_integer(&p2)) {
 		q->accum.val_flt = atan2(p1.val_flt, p2.val_num);
 		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_number(&p1) && is_number(&p2)) {
+		q->accum.val_flt = atan2(num_to_float(&p1), num_to_float(&p2));
+		q->accum.val_type = TYPE_FLOAT;
 	} else {
 		throw_error(q, &p1, "type_error", "number");
 		return 0;
@@ -3300,6 +4228,18 @@ static int fn_iso_copysign_2(query *q)
 	} else if (is_float(&p1) && is_rational(&p2)) {
 		q->accum.val_flt = copysign(p1.val_flt, p2.val_num);
 		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_bigint(&p1) && is_number(&p2)) {
+		return do_bigint_op1(q, &p1, num_to_float(&p2) < 0.0 ? BIG_NABS : BIG_ABS);
+	} else if (is_float(&p1) && is_bigint(&p2)) {
+		q->accum.val_flt = copysign(p1.val_flt, num_to_float(&p2));
+		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_rational(&p1) && is_bigint(&p2)) {
+		q->accum = p1;
+
+		if (num_to_float(&p2) < 0.0)
+			q->accum.val_num = -llabs((long long)p1.val_num);
+
+		q->accum.val_type = TYPE_INTEGER;
 	} else {
 		throw_error(q, &p1, "type_error", "number");
 		return 0;
@@ -3315,7 +4255,15 @@ static int fn_iso_pow_2(query *q)
 	cell p1 = calc(q, p1_tmp);
 	cell p2 = calc(q, p2_tmp);
 
-	if (is_rational(&p1) && is_rational(&p2)) {
+	if (is_bigint(&p1) || is_bigint(&p2)) {
+		if (!is_number(&p1) || !is_number(&p2)) {
+			throw_error(q, &p1, "type_error", "number");
+			return 0;
+		}
+
+		q->accum.val_flt = pow(num_to_float(&p1), num_to_float(&p2));
+		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_rational(&p1) && is_rational(&p2)) {
 		q->accum.val_flt = pow((double)p1.val_num/p1.val_den, (double)p2.val_num/p2.val_den);
 		q->accum.val_type = TYPE_FLOAT;
 	} else if (is_rational(&p1) && is_float(&p2)) {
@@ -3335,6 +4283,24 @@ static int fn_iso_pow_2(query *q)
 	return 1;
 }
 
+static int powi_overflow(int_t base, int_t exp, int_t *res)
+{
+	int_t r = 1;
+
+	while (exp) {
+		if ((exp & 1) && __builtin_mul_overflow(r, base, &r))
+			return 1;
+
+		exp >>= 1;
+
+		if (exp && __builtin_mul_overflow(base, base, &base))
+			return 1;
+	}
+
+	*res = r;
+	return 0;
+}
+
 static int fn_iso_powi_2(query *q)
 {
 	GET_FIRST_ARG(p1_tmp,any);
@@ -3342,29 +4308,19 @@ static int fn_iso_powi_2(query *q)
 	cell p1 = calc(q, p1_tmp);
 	cell p2 = calc(q, p2_tmp);
 
-	if (is_integer(&p1) && is_integer(&p2)) {
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		__int128_t tmp = pow(p1.val_num,p2.val_num);
-
-		if ((tmp > INT64_MAX) || (tmp < INT64_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		int64_t tmp = pow(p1.val_num,p2.val_num);
+	if (is_integer(&p1) && is_integer(&p2) && (p2.val_num >= 0)) {
+		if (powi_overflow(p1.val_num, p2.val_num, &q->accum.val_num))
+			return do_bigint_op(q, BIG_POWI, &p1, &p2);
 
-		if ((tmp > INT32_MAX) || (tmp < INT32_MIN)) {
-			throw_error(q, &p1, "domain_error", "integer_overflow");
-			return 0;
-		} else {
-#endif
-			q->accum.val_num = (int_t)pow(p1.val_num,p2.val_num);
-			q->accum.val_type = TYPE_INTEGER;
-#if defined(__SIZEOF_INT128__) && !USE_INT128 && CHECK_OVERFLOW
-		}
-#elif defined(__SIZEOF_INT64__) && USE_INT32 && CHECK_OVERFLOW
-		}
-#endif
+		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_integer(&p1) && is_integer(&p2)) {
+		q->accum.val_num = (int_t)pow(p1.val_num,p2.val_num);
+		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_integer_or_bigint(&p1) && is_integer_or_bigint(&p2)) {
+		return do_bigint_op(q, BIG_POWI, &p1, &p2);
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		q->accum.val_flt = pow(num_to_float(&p1), num_to_float(&p2));
+		q->accum.val_type = TYPE_FLOAT;
 	} else if (is_rational(&p1) && is_rational(&p2)) {
 		q->accum.val_flt = pow((double)p1.val_num/p1.val_den, (double)p2.val_num/p2.val_den);
 		q->accum.val_type = TYPE_FLOAT;
@@ -3392,15 +4348,19 @@ static int fn_iso_divide_2(query *q)
 	cell p1 = calc(q, p1_tmp);
 	cell p2 = calc(q, p2_tmp);
 
-	if (is_integer(&p1) && is_integer(&p2)) {
+	if (is_bigint(&p1) || is_bigint(&p2)) {
+		if (!is_number(&p1) || !is_number(&p2)) {
+			throw_error(q, &p1, "type_error", "number");
+			return 0;
+		}
+
+		q->accum.val_flt = num_to_float(&p1) / num_to_float(&p2);
+		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_integer(&p1) && is_integer(&p2)) {
 		q->accum.val_flt = (double)p1.val_num / p2.val_num;
 		q->accum.val_type = TYPE_FLOAT;
 	} else if (is_rational(&p1) && is_rational(&p2)) {
-		p1.val_num *= p2.val_den;
-		p2.val_num *= p1.val_den;
-		q->accum.val_num = p1.val_num;
-		q->accum.val_den = p2.val_num;
-		q->accum.val_type = TYPE_INTEGER;
+		return rat_op(q, RAT_DIV, &p1, &p2);
 	} else if (is_integer(&p1) && is_float(&p2)) {
 		q->accum.val_flt = (double)p1.val_num / p2.val_flt;
 		q->accum.val_type = TYPE_FLOAT;
@@ -3426,8 +4386,13 @@ static int fn_iso_divint_2(query *q)
 	cell p2 = calc(q, p2_tmp);
 
 	if (is_integer(&p1) && is_integer(&p2)) {
+		if (!p2.val_num || ((p2.val_num == -1) && (p1.val_num == INT_T_MIN)))
+			return do_bigint_op(q, BIG_DIVINT, &p1, &p2);
+
 		q->accum.val_num = p1.val_num / p2.val_num;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_DIVINT, &p1, &p2);
 	} else {
 		throw_error(q, &p1, "type_error", "integer");
 		return 0;
@@ -3444,8 +4409,13 @@ static int fn_iso_div_2(query *q)
 	cell p2 = calc(q, p2_tmp);
 
 	if (is_integer(&p1) && is_integer(&p2)) {
+		if (!p2.val_num || ((p2.val_num == -1) && (p1.val_num == INT_T_MIN)))
+			return do_bigint_op(q, BIG_DIV, &p1, &p2);
+
 		q->accum.val_num = (p1.val_num - llabs((long long)(p1.val_num % p2.val_num))) / p2.val_num;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_DIV, &p1, &p2);
 	} else {
 		throw_error(q, &p1, "type_error", "integer");
 		return 0;
@@ -3462,8 +4432,20 @@ static int fn_iso_mod_2(query *q)
 	cell p2 = calc(q, p2_tmp);
 
 	if (is_integer(&p1) && is_integer(&p2)) {
-			q->accum.val_num = llabs((long long)(p1.val_num % p2.val_num));
+		if (!p2.val_num || ((p2.val_num == -1) && (p1.val_num == INT_T_MIN)))
+			return do_bigint_op(q, BIG_MOD, &p1, &p2);
+
+		// The result takes the sign of the divisor.
+
+		int_t r = p1.val_num % p2.val_num;
+
+		if (r && ((r < 0) != (p2.val_num < 0)))
+			r += p2.val_num;
+
+		q->accum.val_num = r;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_MOD, &p1, &p2);
 	} else {
 		throw_error(q, &p1, "type_error", "integer");
 		return 0;
@@ -3472,7 +4454,7 @@ static int fn_iso_mod_2(query *q)
 	return 1;
 }
 
-static int fn_iso_max_2(query *q)
+static int fn_iso_rem_2(query *q)
 {
 	GET_FIRST_ARG(p1_tmp,any);
 	GET_NEXT_ARG(p2_tmp,any);
@@ -3480,8 +4462,33 @@ static int fn_iso_max_2(query *q)
 	cell p2 = calc(q, p2_tmp);
 
 	if (is_integer(&p1) && is_integer(&p2)) {
-		q->accum.val_num = p1.val_num >= p2.val_num ? p1.val_num : p2.val_num;
+		if (!p2.val_num || ((p2.val_num == -1) && (p1.val_num == INT_T_MIN)))
+			return do_bigint_op(q, BIG_REM, &p1, &p2);
+
+		q->accum.val_num = p1.val_num % p2.val_num;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_REM, &p1, &p2);
+	} else {
+		throw_error(q, &p1, "type_error", "integer");
+		return 0;
+	}
+
+	return 1;
+}
+
+static int fn_iso_max_2(query *q)
+{
+	GET_FIRST_ARG(p1_tmp,any);
+	GET_NEXT_ARG(p2_tmp,any);
+	cell p1 = calc(q, p1_tmp);
+	cell p2 = calc(q, p2_tmp);
+
+	if (is_integer(&p1) && is_integer(&p2)) {
+		q->accum.val_num = p1.val_num >= p2.val_num ? p1.val_num : p2.val_num;
+		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_MAX, &p1, &p2);
 	} else {
 		throw_error(q, &p1, "type_error", "integer");
 		return 0;
@@ -3500,6 +4507,8 @@ static int fn_iso_min_2(query *q)
 	if (is_integer(&p1) && is_integer(&p2)) {
 		q->accum.val_num = p1.val_num <= p2.val_num ? p1.val_num : p2.val_num;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_MIN, &p1, &p2);
 	} else {
 		throw_error(q, &p1, "type_error", "integer");
 		return 0;
@@ -3518,6 +4527,8 @@ static int fn_iso_xor_2(query *q)
 	if (is_integer(&p1) && is_integer(&p2)) {
 		q->accum.val_num = p1.val_num ^ p2.val_num;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_XOR, &p1, &p2);
 	} else {
 		throw_error(q, &p1, "type_error", "integer");
 		return 0;
@@ -3536,6 +4547,8 @@ static int fn_iso_and_2(query *q)
 	if (is_integer(&p1) && is_integer(&p2)) {
 		q->accum.val_num = p1.val_num & p2.val_num;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_AND, &p1, &p2);
 	} else {
 		throw_error(q, &p1, "type_error", "integer");
 		return 0;
@@ -3554,6 +4567,8 @@ static int fn_iso_or_2(query *q)
 	if (is_integer(&p1) && is_integer(&p2)) {
 		q->accum.val_num = p1.val_num | p2.val_num;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_OR, &p1, &p2);
 	} else {
 		throw_error(q, &p1, "type_error", "integer");
 		return 0;
@@ -3562,6 +4577,20 @@ static int fn_iso_or_2(query *q)
 	return 1;
 }
 
+static int shl_overflow(int_t v, int_t n)
+{
+	const int_t bits = sizeof(int_t) * 8;
+
+	if (n < 0)
+		return 0;
+
+	if (n >= (bits - 1))
+		return v != 0;
+
+	int_t hi = v >> (bits - 1 - n);
+	return (hi != 0) && (hi != -1);
+}
+
 static int fn_iso_shl_2(query *q)
 {
 	GET_FIRST_ARG(p1_tmp,any);
@@ -3570,8 +4599,13 @@ static int fn_iso_shl_2(query *q)
 	cell p2 = calc(q, p2_tmp);
 
 	if (is_integer(&p1) && is_integer(&p2)) {
+		if (shl_overflow(p1.val_num, p2.val_num))
+			return do_bigint_op(q, BIG_SHL, &p1, &p2);
+
 		q->accum.val_num = p1.val_num << p2.val_num;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_SHL, &p1, &p2);
 	} else {
 		throw_error(q, &p1, "type_error", "integer");
 		return 0;
@@ -3588,8 +4622,14 @@ static int fn_iso_shr_2(query *q)
 	cell p2 = calc(q, p2_tmp);
 
 	if (is_integer(&p1) && is_integer(&p2)) {
-		q->accum.val_num = p1.val_num >> p2.val_num;
+		if (p2.val_num >= (int_t)sizeof(int_t)*8)
+			q->accum.val_num = p1.val_num < 0 ? -1 : 0;
+		else
+			q->accum.val_num = p1.val_num >> p2.val_num;
+
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1) || is_bigint(&p2)) {
+		return do_bigint_op(q, BIG_SHR, &p1, &p2);
 	} else {
 		throw_error(q, &p1, "type_error", "integer");
 		return 0;
@@ -3606,6 +4646,8 @@ static int fn_iso_neg_1(query *q)
 	if (is_integer(&p1)) {
 		q->accum.val_num = ~p1.val_num;
 		q->accum.val_type = TYPE_INTEGER;
+	} else if (is_bigint(&p1)) {
+		return do_bigint_op1(q, &p1, BIG_COM);
 	} else {
 		throw_error(q, &p1, "type_error", "integer");
 		return 0;
@@ -3628,12 +4670,15 @@ static int cstring_cmp(const char *s1, size_t len1, const char *s2, size_t len2)
 	return 0;
 }
 
-static int compare(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, int depth)
+static int compare(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx);
+
+// Order two terms by their principal functors. Returns 0 with *args
+// set when both are compounds with the same name and arity, so the
+// arguments decide.
+
+static int compare_head(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, int *args)
 {
-	if (depth == MAX_DEPTH) {
-		q->cycle_error = 1;
-		return 0;
-	}
+	*args = 0;
 
 	if (is_variable(p1)) {
 		if (is_variable(p2)) {
@@ -3647,12 +4692,19 @@ static int compare(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, int
 		return -1;
 	}
 
+	if ((is_bigint(p1) && (is_rational(p2) || is_bigint(p2))) || (is_rational(p1) && is_bigint(p2)))
+		return compare_bigint(p1, p2);
+
+	if (is_bigint(p1)) {
+		if (is_float(p2) || is_variable(p2))
+			return 1;
+
+		return -1;
+	}
+
 	if (is_rational(p1)) {
 		if (is_rational(p2)) {
-			cell tmp1 = *p1, tmp2 = *p2;
-			tmp1.val_num *= tmp2.val_den;
-			tmp2.val_num *= tmp1.val_den;
-			return tmp1.val_num < tmp2.val_num ? -1 : tmp1.val_num > tmp2.val_num ? 1 : 0;
+			return rat_cmp(p1, p2);
 		}
 
 		if (is_float(p2))
@@ -3693,101 +4745,177 @@ static int compare(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, int
 	if (p1->arity > p2->arity)
 		return 1;
 
-	if (is_list(p1) && is_list(p2)) {
-		while (is_list(p1) && is_list(p2)) {
-			cell *h1 = LIST_HEAD(p1);
-			h1 = deref(q, h1, p1_ctx);
-			idx_t tmp1_ctx = q->latest_ctx;
-			cell *h2 = LIST_HEAD(p2);
-			h2 = deref(q, h2, p2_ctx);
-			idx_t tmp2_ctx = q->latest_ctx;
+	if (!is_list(p1) || !is_list(p2)) {
+		int val = strcmp(GET_STR(p1), GET_STR(p2));
+		if (val) return val;
 
-			int val = compare(q, h1, tmp1_ctx, h2, tmp2_ctx, depth+1);
-			if (val) return val;
+		if (is_string(p1) || is_string(p2))
+			return is_string(p1) ? -1 : 1;
+	}
 
-			p1 = LIST_TAIL(p1);
-			p1 = deref(q, p1, p1_ctx);
-			p1_ctx = q->latest_ctx;
-			p2 = LIST_TAIL(p2);
-			p2 = deref(q, p2, p2_ctx);
-			p2_ctx = q->latest_ctx;
-		}
+	*args = 1;
+	return 0;
+}
 
-		if (is_list(p1))
-			return 1;
+// A list where one side is a packed string, walked a character at a
+// time. Leaves the final tails in p1/p2, which may point at tmp1/tmp2.
 
-		if (is_list(p2))
-			return -1;
+static int compare_string_list(query *q, cell **p1, idx_t *p1_ctx, cell **p2, idx_t *p2_ctx, cell *tmp1, cell *tmp2)
+{
+	while (is_list(*p1) && is_list(*p2)) {
+		if (is_string(*p1) && is_string(*p2)) {
+			int val = cstring_cmp(GET_STR(*p1), LEN_STR(*p1), GET_STR(*p2), LEN_STR(*p2));
+			if (val) return val;
+			make_literal(tmp1, g_nil_s);
+			*p1 = *p2 = tmp1;
+			return 0;
+		}
 
-		int val = compare(q, p1, p1_ctx, p2, p2_ctx, depth+1);
+		cell *h1 = deref(q, list_head(*p1), *p1_ctx);
+		idx_t h1_ctx = q->latest_ctx;
+		cell *h2 = deref(q, list_head(*p2), *p2_ctx);
+		idx_t h2_ctx = q->latest_ctx;
+		int val = compare(q, h1, h1_ctx, h2, h2_ctx);
 		if (val) return val;
 
-		return 0;
+		*p1 = deref(q, list_tail(*p1, tmp1), *p1_ctx);
+		*p1_ctx = q->latest_ctx;
+		*p2 = deref(q, list_tail(*p2, tmp2), *p2_ctx);
+		*p2_ctx = q->latest_ctx;
 	}
 
-	int val = strcmp(GET_STR(p1), GET_STR(p2));
-	if (val) return val;
+	return 0;
+}
 
-	int arity = p1->arity;
-	p1 = p1 + 1;
-	p2 = p2 + 1;
+// Compare walks both terms like unification does, with an explicit
+// stack and the last argument taken in place. A pair of compounds met
+// again (checked by Brent's method) compares equal so far, which ends
+// the walk over cyclic terms.
 
-	while (arity--) {
-		cell *h1 = deref(q, p1, p1_ctx);
-		idx_t tmp1_ctx = q->latest_ctx;
-		cell *h2 = deref(q, p2, p2_ctx);
-		idx_t tmp2_ctx = q->latest_ctx;
+typedef struct {
+	cell *c1, *c2;
+	idx_t c1_ctx, c2_ctx;
+	unsigned nbr;
+} compare_frame;
 
-		int val = compare(q, h1, tmp1_ctx, h2, tmp2_ctx, depth+1);
-		if (val) return val;
+static int compare(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx)
+{
+	compare_frame local[64], *stack = local;
+	unsigned sp = 0, size = sizeof(local) / sizeof(local[0]);
+	cell *save1 = NULL, *save2 = NULL, tmp1, tmp2;
+	idx_t save1_ctx = 0, save2_ctx = 0, power = 1, lam = 0;
+	int val = 0;
 
-		p1 += p1->nbr_cells;
-		p2 += p2->nbr_cells;
+	for (;;) {
+		int args;
+
+		if (is_list(p1) && is_list(p2) && (is_string(p1) || is_string(p2))) {
+			if ((val = compare_string_list(q, &p1, &p1_ctx, &p2, &p2_ctx, &tmp1, &tmp2)) != 0)
+				break;
+
+			continue;
+		}
+
+		if ((val = compare_head(q, p1, p1_ctx, p2, p2_ctx, &args)) != 0)
+			break;
+
+		if (args) {
+			int seen = (p1 == p2) && ((p1_ctx == p2_ctx) || (p1->flags & FLAG_GROUND));
+
+			if (!seen && (p1 == save1) && (p2 == save2)
+				&& (p1_ctx == save1_ctx) && (p2_ctx == save2_ctx))
+				seen = 1;
+
+			if (++lam == power) {
+				save1 = p1; save1_ctx = p1_ctx;
+				save2 = p2; save2_ctx = p2_ctx;
+				power *= 2;
+				lam = 0;
+			}
+
+			if (!seen) {
+				if (sp == size) {
+					size *= 2;
+
+					if (stack == local) {
+						stack = malloc(sizeof(compare_frame)*size);
+						memcpy(stack, local, sizeof(local));
+					} else
+						stack = realloc(stack, sizeof(compare_frame)*size);
+				}
+
+				compare_frame *f = stack + sp++;
+				f->c1 = p1 + 1;
+				f->c2 = p2 + 1;
+				f->c1_ctx = p1_ctx;
+				f->c2_ctx = p2_ctx;
+				f->nbr = p1->arity;
+			}
+		}
+
+		if (!sp)
+			break;
+
+		compare_frame *f = stack + sp - 1;
+		cell *c1 = f->c1, *c2 = f->c2;
+		f->c1 += c1->nbr_cells;
+		f->c2 += c2->nbr_cells;
+
+		if (!--f->nbr)
+			sp--;
+
+		p1 = deref(q, c1, f->c1_ctx);
+		p1_ctx = q->latest_ctx;
+		p2 = deref(q, c2, f->c2_ctx);
+		p2_ctx = q->latest_ctx;
 	}
 
-	return 0;
+	if (stack != local)
+		free(stack);
+
+	return val;
 }
 
 static int fn_iso_seq_2(query *q)
 {
 	GET_FIRST_ARG(p1,any);
 	GET_NEXT_ARG(p2,any);
-	return compare(q, p1, p1_ctx, p2, p2_ctx, 0) == 0;
+	return compare(q, p1, p1_ctx, p2, p2_ctx) == 0;
 }
 
 static int fn_iso_sne_2(query *q)
 {
 	GET_FIRST_ARG(p1,any);
 	GET_NEXT_ARG(p2,any);
-	return compare(q, p1, p1_ctx, p2, p2_ctx, 0) != 0;
+	return compare(q, p1, p1_ctx, p2, p2_ctx) != 0;
 }
 
 static int fn_iso_slt_2(query *q)
 {
 	GET_FIRST_ARG(p1,any);
 	GET_NEXT_ARG(p2,any);
-	return compare(q, p1, p1_ctx, p2, p2_ctx, 0) < 0;
+	return compare(q, p1, p1_ctx, p2, p2_ctx) < 0;
 }
 
 static int fn_iso_sle_2(query *q)
 {
 	GET_FIRST_ARG(p1,any);
 	GET_NEXT_ARG(p2,any);
-	return compare(q, p1, p1_ctx, p2, p2_ctx, 0) <= 0;
+	return compare(q, p1, p1_ctx, p2, p2_ctx) <= 0;
 }
 
 static int fn_iso_sgt_2(query *q)
 {
 	GET_FIRST_ARG(p1,any);
 	GET_NEXT_ARG(p2,any);
-	return compare(q, p1, p1_ctx, p2, p2_ctx, 0) > 0;
+	return compare(q, p1, p1_ctx, p2, p2_ctx) > 0;
 }
 
 static int fn_iso_sge_2(query *q)
 {
 	GET_FIRST_ARG(p1,any);
 	GET_NEXT_ARG(p2,any);
-	return compare(q, p1, p1_ctx, p2, p2_ctx, 0) >= 0;
+	return compare(q, p1, p1_ctx, p2, p2_ctx) >= 0;
 }
 
 static int fn_iso_compare_3(query *q)
@@ -3796,7 +4924,7 @@ static int fn_iso_compare_3(query *q)
 	GET_NEXT_ARG(p2,any);
 	GET_NEXT_ARG(p3,any);
 
-	int status = compare(q, p2, p2_ctx, p3, p3_ctx, 0);
+	int status = compare(q, p2, p2_ctx, p3, p3_ctx);
 	cell tmp;
 	make_literal(&tmp, status<0?g_lt_s:status>0?g_gt_s:g_eq_s);
 	return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
@@ -3809,12 +4937,12 @@ static int fn_iso_neq_2(query *q)
 	cell p1 = calc(q, p1_tmp);
 	cell p2 = calc(q, p2_tmp);
 
-	if (is_integer(&p1) && is_integer(&p2))
+	if (is_bigint(&p1) || is_bigint(&p2))
+		return (compare_numbers(q, &p1, &p2) == 0) && !q->error;
+	else if (is_integer(&p1) && is_integer(&p2))
 		return p1.val_num == p2.val_num;
 	else if (is_rational(&p1) && is_rational(&p2)) {
-		p1.val_num *= p2.val_den;
-		p2.val_num *= p1.val_den;
-		return p1.val_num == p2.val_num;
+		return rat_cmp(&p1, &p2) == 0;
 	} else if (is_integer(&p1) && is_float(&p2))
 		return p1.val_num == p2.val_flt;
 	else if (is_float(&p1) && is_float(&p2))
@@ -3833,12 +4961,12 @@ static int fn_iso_nne_2(query *q)
 	cell p1 = calc(q, p1_tmp);
 	cell p2 = calc(q, p2_tmp);
 
-	if (is_integer(&p1) && is_integer(&p2))
+	if (is_bigint(&p1) || is_bigint(&p2))
+		return (compare_numbers(q, &p1, &p2) != 0) && !q->error;
+	else if (is_integer(&p1) && is_integer(&p2))
 		return p1.val_num != p2.val_num;
 	else if (is_rational(&p1) && is_rational(&p2)) {
-		p1.val_num *= p2.val_den;
-		p2.val_num *= p1.val_den;
-		return p1.val_num != p2.val_num;
+		return rat_cmp(&p1, &p2) != 0;
 	} else if (is_integer(&p1) && is_float(&p2))
 		return p1.val_num != p2.val_flt;
 	else if (is_float(&p1) && is_float(&p2))
@@ -3857,12 +4985,12 @@ static int fn_iso_nge_2(query *q)
 	cell p1 = calc(q, p1_tmp);
 	cell p2 = calc(q, p2_tmp);
 
-	if (is_integer(&p1) && is_integer(&p2))
+	if (is_bigint(&p1) || is_bigint(&p2))
+		return (compare_numbers(q, &p1, &p2) >= 0) && !q->error;
+	else if (is_integer(&p1) && is_integer(&p2))
 		return p1.val_num >= p2.val_num;
 	else if (is_rational(&p1) && is_rational(&p2)) {
-		p1.val_num *= p2.val_den;
-		p2.val_num *= p1.val_den;
-		return p1.val_num >= p2.val_num;
+		return rat_cmp(&p1, &p2) >= 0;
 	} else if (is_integer(&p1) && is_float(&p2))
 		return p1.val_num >= p2.val_flt;
 	else if (is_float(&p1) && is_float(&p2))
@@ -3881,12 +5009,12 @@ static int fn_iso_ngt_2(query *q)
 	cell p1 = calc(q, p1_tmp);
 	cell p2 = calc(q, p2_tmp);
 
-	if (is_integer(&p1) && is_integer(&p2))
+	if (is_bigint(&p1) || is_bigint(&p2))
+		return (compare_numbers(q, &p1, &p2) > 0) && !q->error;
+	else if (is_integer(&p1) && is_integer(&p2))
 		return p1.val_num > p2.val_num;
 	else if (is_rational(&p1) && is_rational(&p2)) {
-		p1.val_num *= p2.val_den;
-		p2.val_num *= p1.val_den;
-		return p1.val_num > p2.val_num;
+		return rat_cmp(&p1, &p2) > 0;
 	} else if (is_integer(&p1) && is_float(&p2))
 		return p1.val_num > p2.val_flt;
 	else if (is_float(&p1) && is_float(&p2))
@@ -3905,12 +5033,12 @@ static int fn_iso_nle_2(query *q)
 	cell p1 = calc(q, p1_tmp);
 	cell p2 = calc(q, p2_tmp);
 
-	if (is_integer(&p1) && is_integer(&p2))
+	if (is_bigint(&p1) || is_bigint(&p2))
+		return (compare_numbers(q, &p1, &p2) <= 0) && !q->error;
+	else if (is_integer(&p1) && is_integer(&p2))
 		return p1.val_num <= p2.val_num;
 	else if (is_rational(&p1) && is_rational(&p2)) {
-		p1.val_num *= p2.val_den;
-		p2.val_num *= p1.val_den;
-		return p1.val_num <= p2.val_num;
+		return rat_cmp(&p1, &p2) <= 0;
 	} else if (is_integer(&p1) && is_float(&p2))
 		return p1.val_num <= p2.val_flt;
 	else if (is_float(&p1) && is_float(&p2))
@@ -3929,12 +5057,12 @@ static int fn_iso_nlt_2(query *q)
 	cell p1 = calc(q, p1_tmp);
 	cell p2 = calc(q, p2_tmp);
 
-	if (is_integer(&p1) && is_integer(&p2))
+	if (is_bigint(&p1) || is_bigint(&p2))
+		return (compare_numbers(q, &p1, &p2) < 0) && !q->error;
+	else if (is_integer(&p1) && is_integer(&p2))
 		return p1.val_num < p2.val_num;
 	else if (is_rational(&p1) && is_rational(&p2)) {
-		p1.val_num *= p2.val_den;
-		p2.val_num *= p1.val_den;
-		return p1.val_num < p2.val_num;
+		return rat_cmp(&p1, &p2) < 0;
 	} else if (is_integer(&p1) && is_float(&p2))
 		return p1.val_num < p2.val_flt;
 	else if (is_float(&p1) && is_float(&p2))
@@ -3946,6 +5074,22 @@ static int fn_iso_nlt_2(query *q)
 	return 0;
 }
 
+// A term whose arguments are all one cell is laid out like an array,
+// so the n-th argument is found without walking the others.
+
+static cell *get_arg(cell *p, unsigned n)
+{
+	if (p->nbr_cells == ((idx_t)p->arity + 1))
+		return p + n;
+
+	cell *c = p + 1;
+
+	while (--n)
+		c += c->nbr_cells;
+
+	return c;
+}
+
 static int fn_iso_arg_3(query *q)
 {
 	GET_FIRST_ARG(p1,any);
@@ -3979,16 +5123,9 @@ static int fn_iso_arg_3(query *q)
 		if ((arg_nbr == 0) || (arg_nbr > p2->arity))
 			return 0;
 
-		cell *c = p2 + 1;
-
-		for (int i = 1; i <= arg_nbr; i++) {
-			if (i == arg_nbr) {
-				c = deref(q, c, p2_ctx);
-				return unify(q, p3, p3_ctx, c, q->latest_ctx);
-			}
-
-			c += c->nbr_cells;
-		}
+		cell *c = get_arg(p2, arg_nbr);
+		c = deref(q, c, p2_ctx);
+		return unify(q, p3, p3_ctx, c, q->latest_ctx);
 	}
 
 	if (is_variable(p1) && is_variable(p3)) {
@@ -4005,6 +5142,185 @@ static int fn_iso_arg_3(query *q)
 	return 0;
 }
 
+static int fresh_vars(query *q, unsigned nbr, unsigned *var_nbr);
+
+// Rebind every slot holding the compound p2 to v. A slot holding a
+// term that has p2 inside it can't be changed that way, so give up
+// before touching anything if there is one.
+
+static int rebind_aliases(query *q, cell *p2, idx_t p2_ctx, cell *v, idx_t v_ctx, int trailed)
+{
+	for (int pass = 0; pass < 2; pass++) {
+		for (idx_t i = 0; i < q->st.fp; i++) {
+			frame *g = GET_FRAME(i);
+
+			for (unsigned j = 0; j < g->nbr_vars; j++) {
+				slot *e = GET_SLOT(g, j);
+
+				if (!is_indirect(&e->c) || (e->ctx != p2_ctx))
+					continue;
+
+				cell *c = e->c.val_ptr;
+
+				if (pass && (c == p2))
+					rebind_slot(q, i, j, v, v_ctx, trailed);
+				else if (!pass && (p2 > c) && (p2 < (c + c->nbr_cells)))
+					return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+// setarg/3 and nb_setarg/3 overwrite the argument in place when the
+// term is on the heap and the old and new values are single cells, so
+// a term made by functor/3 works as an array.
+//
+// Otherwise setarg/3 moves the term to the heap once, with each
+// argument a private variable (see FLAG_PRIVATE) bound to its value,
+// and binds every variable holding the old term to the copy. Setting
+// an argument after that is just rebinding its private variable, and
+// all references see the change. Slots made now don't survive
+// backtracking, so nb_setarg/3 instead copies the whole term with the
+// new value to the nb heap and rebinds the references to that.
+
+static int do_setarg(query *q, int trailed)
+{
+	GET_FIRST_ARG(p1,integer);
+	GET_NEXT_ARG(p2,structure);
+	GET_NEXT_ARG(p3,any);
+
+	if ((p1->val_num <= 0) || (p1->val_num > p2->arity))
+		return 0;
+
+	unsigned n = p1->val_num;
+	cell *c = get_arg(p2, n);
+	int atomic = !is_structure(p3) && !is_variable(p3) && !is_blob(p3) && !is_bigint(p3);
+	int owner = (is_blob(c) && !is_const_cstring(c)) || (is_bigint(c) && !is_const_bigint(c));
+
+	if (atomic && (c->nbr_cells == 1) && !owner && is_heap_cell(q, p2)) {
+		overwrite_cell(q, c, p3, trailed);
+		return 1;
+	}
+
+	frame *g = GET_FRAME(q->st.curr_frame);
+
+	if (is_variable(c) && (c->flags & FLAG_PRIVATE)) {
+		cell *v = p3;
+		idx_t v_ctx = p3_ctx;
+
+		if (!trailed) {
+			init_tmp_heap(q);
+			g_varno = g->nbr_vars;
+			g_tab_idx = 0;
+			deep_copy2_to_tmp(q, p3, p3_ctx);
+			idx_t nbr_cells = tmp_heap_used(q);
+
+			if ((g_varno != g->nbr_vars) && !create_vars(q, g_varno-g->nbr_vars)) {
+				throw_error(q, p3, "resource_error", "too_many_vars");
+				return 0;
+			}
+
+			v = alloc_nb_heap(q, nbr_cells);
+			copy_cells(v, get_tmp_heap(q, 0), nbr_cells);
+			v_ctx = q->st.curr_frame;
+		}
+
+		rebind_slot(q, p2_ctx, c->var_nbr, v, v_ctx, trailed);
+		return 1;
+	}
+
+	GET_RAW_ARG(2,p2_raw);
+
+	if (!is_variable(p2_raw))
+		return 1;
+
+	cell *t;
+
+	if (!trailed) {
+		init_tmp_heap(q);
+		g_varno = g->nbr_vars;
+		g_tab_idx = 0;
+		cell *tmp = alloc_tmp_heap(q, 1);
+		*tmp = *p2;
+		c = p2 + 1;
+
+		for (unsigned i = 1; i <= p2->arity; i++) {
+			if (i == n)
+				deep_copy2_to_tmp(q, p3, p3_ctx);
+			else
+				deep_copy2_to_tmp(q, c, p2_ctx);
+
+			c += c->nbr_cells;
+		}
+
+		idx_t nbr_cells = tmp_heap_used(q);
+		tmp = get_tmp_heap(q, 0);
+		tmp->flags &= ~FLAG_GROUND;
+		tmp->nbr_cells = nbr_cells;
+
+		if ((g_varno != g->nbr_vars) && !create_vars(q, g_varno-g->nbr_vars)) {
+			throw_error(q, p2, "resource_error", "too_many_vars");
+			return 0;
+		}
+
+		t = alloc_nb_heap(q, nbr_cells);
+		copy_cells(t, tmp, nbr_cells);
+	} else {
+		unsigned var_nbr;
+
+		if (!fresh_vars(q, p2->arity, &var_nbr)) {
+			throw_error(q, p2, "resource_error", "too_many_vars");
+			return 0;
+		}
+
+		t = alloc_heap(q, 1+p2->arity);
+		*t = *p2;
+		t->flags &= ~FLAG_GROUND;
+		t->nbr_cells = 1 + p2->arity;
+		c = p2 + 1;
+
+		for (unsigned i = 1; i <= p2->arity; i++, var_nbr++) {
+			cell *tmp = t + i;
+			tmp->val_type = TYPE_VARIABLE;
+			tmp->nbr_cells = 1;
+			tmp->arity = 0;
+			tmp->flags = FLAG_FRESH | FLAG_PRIVATE;
+			tmp->val_off = g_anon_s;
+			tmp->var_nbr = var_nbr;
+
+			if (i == n)
+				rebind_slot(q, q->st.curr_frame, var_nbr, p3, p3_ctx, 1);
+			else {
+				cell *v = deref(q, c, p2_ctx);
+				rebind_slot(q, q->st.curr_frame, var_nbr, v, q->latest_ctx, 1);
+			}
+
+			c += c->nbr_cells;
+		}
+
+		g->no_tco = 1;
+	}
+
+	if (!rebind_aliases(q, p2, p2_ctx, t, q->st.curr_frame, trailed)) {
+		throw_error(q, p2, "permission_error", "modify,subterm");
+		return 0;
+	}
+
+	return 1;
+}
+
+static int fn_setarg_3(query *q)
+{
+	return do_setarg(q, 1);
+}
+
+static int fn_nb_setarg_3(query *q)
+{
+	return do_setarg(q, 0);
+}
+
 static int fn_iso_univ_2(query *q)
 {
 	GET_FIRST_ARG(p1,any);
@@ -4059,6 +5375,11 @@ static int fn_iso_univ_2(query *q)
 			return 0;
 		}
 
+		if (arity > MAX_ARITY) {
+			throw_error(q, p2, "representation_error", "max_arity");
+			return 0;
+		}
+
 		tmp->nbr_cells = nbr_cells;
 		tmp->arity = arity;
 		cell *tmp2 = alloc_heap(q, nbr_cells);
@@ -4083,25 +5404,45 @@ static int fn_iso_univ_2(query *q)
 	return unify(q, p2, p2_ctx, l, p1_ctx);
 }
 
-static int do_collect_vars(query *q, cell *p1, idx_t p1_ctx, idx_t nbr_cells, cell **slots)
+// Variables are collected by number into a table that grows as
+// needed, since terms built by functor/3 can hold more variables than
+// a clause.
+
+typedef struct {
+	cell **slots;
+	unsigned size;
+} var_table;
+
+static int collect_vars(query *q, cell *p1, idx_t p1_ctx, var_table *vt)
 {
+	term_walker w;
+	walk_init(&w, p1, p1_ctx);
+	vt->slots = NULL;
+	vt->size = 0;
 	int cnt = 0;
+	cell *c;
 
-	for (idx_t i = 0; i < nbr_cells; i++, p1++) {
-		cell *c = deref(q, p1, p1_ctx);
+	while ((c = walk_next(q, &w, &p1_ctx)) != NULL) {
+		if (!is_variable(c))
+			continue;
 
-		if (is_structure(c)) {
-			cnt += do_collect_vars(q, c+1, q->latest_ctx, c->nbr_cells-1, slots);
-		} else if (is_variable(c)) {
-			assert(c->var_nbr < MAX_ARITY);
+		if (c->var_nbr >= vt->size) {
+			unsigned size = vt->size;
 
-			if (!slots[c->var_nbr]) {
-				slots[c->var_nbr] = c;
-				cnt++;
-			}
+			while (c->var_nbr >= vt->size)
+				vt->size = vt->size ? vt->size * 2 : MAX_TERM_VARS;
+
+			vt->slots = realloc(vt->slots, sizeof(cell*)*vt->size);
+			memset(vt->slots+size, 0, sizeof(cell*)*(vt->size-size));
+		}
+
+		if (!vt->slots[c->var_nbr]) {
+			vt->slots[c->var_nbr] = c;
+			cnt++;
 		}
 	}
 
+	walk_done(&w);
 	return cnt;
 }
 
@@ -4110,28 +5451,22 @@ static int fn_iso_term_variables_2(query *q)
 	GET_FIRST_ARG(p1,any);
 	GET_NEXT_ARG(p2,list_or_nil_or_var);
 
-	cell *slots[MAX_ARITY] = {0};
-	int cnt = 0;
-
-	if (is_structure(p1))
-		cnt = do_collect_vars(q, p1+1, p1_ctx, p1->nbr_cells-1, slots);
-	else
-		cnt = do_collect_vars(q, p1, p1_ctx, p1->nbr_cells, slots);
-
+	var_table vt;
+	int cnt = collect_vars(q, p1, p1_ctx, &vt);
 	cell *tmp = calloc((cnt*2)+1, sizeof(cell));
 	int idx = 0;
 
 	if (cnt) {
 		int done = 0;
 
-		for (unsigned i = 0; i < MAX_ARITY; i++) {
-			if (!slots[i])
+		for (unsigned i = 0; i < vt.size; i++) {
+			if (!vt.slots[i])
 				continue;
 
 			make_literal(tmp+idx++, g_dot_s);
 			tmp[idx-1].arity = 2;
 			tmp[idx-1].nbr_cells = ((cnt-done)*2)+1;
-			tmp[idx++] = *slots[i];
+			tmp[idx++] = *vt.slots[i];
 			done++;
 		}
 
@@ -4142,6 +5477,8 @@ static int fn_iso_term_variables_2(query *q)
 		make_literal(tmp+idx++, g_nil_s);
 	}
 
+	free(vt.slots);
+
 	if (is_variable(p2)) {
 		cell *save = tmp;
 		tmp = alloc_heap(q, idx);
@@ -4165,6 +5502,8 @@ static cell *clone2_to_tmp(query *q, cell *p1)
 	for (idx_t i = 0; i < p1->nbr_cells; i++, c++) {
 		if (is_blob(c))
 			c->flags |= FLAG_CONST_CSTRING;
+		else if (is_bigint(c))
+			c->flags |= FLAG_CONST_BIGINT;
 	}
 
 	return tmp;
@@ -4194,6 +5533,8 @@ static cell *clone2_to_heap(query *q, int prefix, cell *p1, idx_t nbr_cells, idx
 	for (idx_t i = 0; i < nbr_cells; i++, c++) {
 		if (is_blob(c))
 			c->flags |= FLAG_CONST_CSTRING;
+		else if (is_bigint(c))
+			c->flags |= FLAG_CONST_BIGINT;
 	}
 
 	return tmp;
@@ -4225,6 +5566,8 @@ static cell *copy_to_heap2(query *q, int prefix, cell *p1, idx_t nbr_cells, idx_
 
 		if (is_blob(src))
 			dst->flags |= FLAG_CONST_CSTRING;
+		else if (is_bigint(src))
+			dst->flags |= FLAG_CONST_BIGINT;
 
 		if (!is_variable(src))
 			continue;
@@ -4291,15 +5634,10 @@ static int fn_iso_copy_term_2(query *q)
 
 static void stash_me(query *q, term *t)
 {
-	int last_match = !q->st.curr_clause->next && !q->st.iter;
+	choice *ch = q->choices + q->cp - 1;
 
-	if (last_match)
+	if (!ch->st.iter && (ch->st.by_index || !q->st.curr_clause->next))
 		drop_choice(q);
-	else {
-		idx_t curr_choice = q->cp - 1;
-		choice *ch = q->choices + curr_choice;
-		ch->st.curr_clause = q->st.curr_clause;
-	}
 
 	unsigned nbr_vars = t->nbr_vars;
 	idx_t new_frame = q->st.fp++;
@@ -4341,7 +5679,7 @@ static int fn_iso_clause_2(query *q)
 			break;
 		}
 
-		drop_choice(q);
+		retry_choice(q);
 		q->retry = 1;
 	}
 
@@ -4416,17 +5754,17 @@ static void db_log(query *q, clause *r, enum log_type l)
 
 	switch(l) {
 		case LOG_ASSERTA: {
-			size_t len = write_term_to_buf(q, NULL, 0, r->t.cells, q->st.curr_frame, 1, 0, 0);
-			char *dst = malloc(len+1);
-			write_term_to_buf(q, dst, len+1, r->t.cells, q->st.curr_frame, 1, 0, 0);
+			cell *c = unshare_clause(r);
+			char *dst = write_term_to_strbuf(q, c, q->st.curr_frame, 1);
+			if (c != r->t.cells) free(c);
 			uuid_to_buf(&r->u, tmpbuf, sizeof(tmpbuf));
 			fprintf(q->m->fp, "a_(%s,'%s').\n", dst, tmpbuf);
 			free(dst);
 			break;
 		} case LOG_ASSERTZ: {
-			size_t len = write_term_to_buf(q, NULL, 0, r->t.cells, q->st.curr_frame, 1, 0, 0);
-			char *dst = malloc(len+1);
-			write_term_to_buf(q, dst, len+1, r->t.cells, q->st.curr_frame, 1, 0, 0);
+			cell *c = unshare_clause(r);
+			char *dst = write_term_to_strbuf(q, c, q->st.curr_frame, 1);
+			if (c != r->t.cells) free(c);
 			uuid_to_buf(&r->u, tmpbuf, sizeof(tmpbuf));
 			fprintf(q->m->fp, "z_(%s,'%s').\n", dst, tmpbuf);
 			free(dst);
@@ -4445,16 +5783,24 @@ static int fn_iso_retract_1(query *q)
 {
 	GET_FIRST_ARG(p1,callable);
 
-	if (!do_match(q, p1, p1_ctx))
-		return 0;
+	// A clause seen by this call may since have been retracted by
+	// another, and then it is skipped...
 
-	clause *r = retract_from_db(q->m, q->st.curr_clause);
-	if (!r) return 0;
+	while (do_match(q, p1, p1_ctx)) {
+		clause *r = retract_from_db(q->m, q->st.curr_clause);
 
-	if (!q->m->loading && r->t.is_persist)
-		db_log(q, r, LOG_ERASE);
+		if (r) {
+			if (!q->m->loading && r->t.is_persist)
+				db_log(q, r, LOG_ERASE);
 
-	return 1;
+			return 1;
+		}
+
+		retry_choice(q);
+		q->retry = 1;
+	}
+
+	return 0;
 }
 
 static int fn_iso_retractall_1(query *q)
@@ -4467,8 +5813,10 @@ static int fn_iso_retractall_1(query *q)
 		return 1;
 	}
 
-	while (fn_iso_retract_1(q))
+	while (fn_iso_retract_1(q)) {
 		retry_choice(q);
+		q->retry = 1;
+	}
 
 	return 1;
 }
@@ -4483,21 +5831,16 @@ static int do_abolish(query *q, cell *c)
 		return 0;
 	}
 
-	for (clause *r = h->head; r;) {
-		if (!q->m->loading && r->t.is_persist && !r->t.is_deleted)
-			db_log(q, r, LOG_ERASE);
-
-		clause *save = r->next;
-		clear_term(&r->t);
-		free(r);
-		r = save;
+	if (!q->m->loading && h->is_persist) {
+		for (clause *r = h->head; r; r = r->next) {
+			if (r->t.is_persist && !r->t.is_deleted)
+				db_log(q, r, LOG_ERASE);
+		}
 	}
 
 	h->is_abolished = 1;
-	sl_destroy(h->index);
-	h->index = NULL;
-	h->head = h->tail = NULL;
-	h->cnt = 0;
+	h->is_indexed = 0;
+	clear_rule(h);
 	return 1;
 }
 
@@ -4550,7 +5893,14 @@ static int fn_iso_asserta_1(query *q)
 	}
 
 	p->t->cidx = copy_cells(p->t->cells, tmp, nbr_cells);
-	parser_assign_vars(p);
+	if (!parser_assign_vars(p)) {
+		p->t->cidx = 0;
+		cell tmp;
+		make_int(&tmp, MAX_TERM_VARS);
+		throw_error(q, &tmp, "resource_error", "too_many_vars");
+		return 0;
+	}
+
 	clause *r = asserta_to_db(q->m, p->t, 0);
 	if (!r) return 0;
 	uuid_gen(&r->u);
@@ -4574,7 +5924,14 @@ static int fn_iso_assertz_1(query *q)
 	}
 
 	p->t->cidx = copy_cells(p->t->cells, tmp, nbr_cells);
-	parser_assign_vars(p);
+	if (!parser_assign_vars(p)) {
+		p->t->cidx = 0;
+		cell tmp;
+		make_int(&tmp, MAX_TERM_VARS);
+		throw_error(q, &tmp, "resource_error", "too_many_vars");
+		return 0;
+	}
+
 	clause *r = assertz_to_db(q->m, p->t, 0);
 	if (!r) return 0;
 	uuid_gen(&r->u);
@@ -4598,9 +5955,10 @@ int call_me(query *q, cell *p1)
 		return 0;
 	}
 
-	static const char *fudge = ",;->";
+	const char *functor = GET_STR(p1);
 
-	if (is_structure(p1) && is_op(p1) && strstr(fudge,GET_STR(p1))) {
+	if (is_structure(p1) && is_op(p1)
+		&& (!strcmp(functor, ",") || !strcmp(functor, ";") || !strcmp(functor, "->"))) {
 		unsigned arity = p1->arity;
 		cell *p = p1 + 1;
 
@@ -4806,20 +6164,123 @@ static int fn_iso_catch_3(query *q)
 	return 1;
 }
 
-static int do_throw_term(query *q, cell *c)
-{
-	idx_t c_ctx = q->latest_ctx;
-	q->exception = c;
+// The control constructs of a consulted clause are compiled in place
+// (see compile_goal()) into these cells, each jumping by its 'jmp'
+// offset to another control cell, which is then stepped over.
 
-	while (retry_choice(q)) {
-		choice *ch = q->choices + q->cp;
+static cell g_proceed[2] = {{.nbr_cells=1}, {.val_type=TYPE_END, .nbr_cells=1}};
 
-		if (!ch->catchme1)
-			continue;
+static int fn_sys_try_0(query *q)
+{
+	cell *c = q->st.curr_cell;
 
-		q->retry = 2;
+	if (q->retry) {
+		if (!c->jmp)
+			return 0;
+
+		q->st.curr_cell = c + c->jmp;
+		return 1;
+	}
+
+	make_barrier(q);
+	return 1;
+}
+
+static int fn_sys_cut_0(query *q)
+{
+	cell *c = q->st.curr_cell;
+	cut_barrier(q, c - c->jmp);
+	return 1;
+}
+
+static int fn_sys_cut_fail_0(query *q)
+{
+	cell *c = q->st.curr_cell;
+	cut_barrier(q, c - c->jmp);
+	return 0;
+}
+
+static int fn_sys_or_0(query *q)
+{
+	cell *c = q->st.curr_cell;
+
+	if (q->retry) {
+		q->st.curr_cell = c + c->jmp;
+		return 1;
+	}
+
+	make_choice(q);
+	return 1;
+}
+
+static int fn_sys_jump_0(query *q)
+{
+	cell *c = q->st.curr_cell;
+	q->st.curr_cell = c->jmp ? c + c->jmp : g_proceed;
+	return 1;
+}
+
+static int fn_sys_catch_0(query *q)
+{
+	cell *c = q->st.curr_cell, *rec = c + c->jmp;
+
+	if (q->retry && q->exception) {
+		cell *p2 = deref(q, rec+1, q->st.curr_frame);
+		idx_t p2_ctx = q->latest_ctx;
+		return unify(q, p2, p2_ctx, q->exception, q->st.curr_frame);
+	}
+
+	if (q->retry == 2) {
+		q->retry = 0;
+		make_catcher(q, 2);
+		q->st.curr_cell = rec;
+		return 1;
+	}
+
+	if (q->retry)
+		return 0;
+
+	make_catcher(q, 1);
+	return 1;
+}
+
+// Makes heap cells own their blobs and bigints, for when the term
+// they were cloned from may be freed first.
+
+static void own_cells_on_heap(cell *c, idx_t nbr_cells)
+{
+	for (idx_t i = 0; i < nbr_cells; i++, c++) {
+		if (is_blob(c)) {
+			char *s = malloc(c->len_str+1);
+			memcpy(s, c->val_str, c->len_str);
+			s[c->len_str] = '\0';
+			c->val_str = s;
+			c->flags &= ~(FLAG_CONST_CSTRING|FLAG_DUP_CSTRING);
+		} else if (is_bigint(c))
+			dup_bigint(c);
+	}
+}
+
+static int do_throw_term(query *q, cell *c)
+{
+	idx_t c_ctx = q->latest_ctx;
+	q->exception = c;
+
+	while (retry_choice(q)) {
+		choice *ch = q->choices + q->cp;
+
+		if (!ch->catchme1)
+			continue;
+
+		// The ball is copied to the heap above the catcher, so that it
+		// outlives the tmp heap should the recovery goal throw it on,
+		// and the term from throw_error() that it was parsed into.
+
+		q->exception = clone_to_heap(q, 0, c, 0);
+		own_cells_on_heap(q->exception, c->nbr_cells);
+		q->retry = 2;
 
-		if (!fn_iso_catch_3(q))
+		if (!q->st.curr_cell->fn(q))
 			continue;
 
 		q->exception = NULL;
@@ -4849,7 +6310,166 @@ static int fn_iso_throw_1(query *q)
 	if (!do_throw_term(q, c))
 		return 0;
 
-	return fn_iso_catch_3(q);
+	return q->st.curr_cell->fn(q);
+}
+
+// A limit is raised by run_query() making the next goal a throw/1 of
+// its ball, so it unwinds exactly as a throw in the program would.
+
+cell *limit_goal(query *q, const uint64_t *limit)
+{
+	if (limit == &q->mem_limit) {
+		// error(resource_error(memory),call_with_memory_limit/2)
+
+		cell *tmp = alloc_heap(q, 8);
+		make_structure(tmp, find_in_pool("throw"), fn_iso_throw_1, 1, 6);
+		make_literal(tmp+1, find_in_pool("error"));
+		tmp[1].arity = 2;
+		tmp[1].nbr_cells = 6;
+		make_literal(tmp+2, find_in_pool("resource_error"));
+		tmp[2].arity = 1;
+		tmp[2].nbr_cells = 2;
+		make_literal(tmp+3, find_in_pool("memory"));
+		make_literal(tmp+4, find_in_pool("/"));
+		tmp[4].arity = 2;
+		tmp[4].nbr_cells = 3;
+		tmp[4].flags = OP_YFX;
+		make_literal(tmp+5, find_in_pool("call_with_memory_limit"));
+		make_int(tmp+6, 2);
+		make_end(tmp+7);
+		return tmp;
+	}
+
+	cell *tmp = alloc_heap(q, 3);
+	make_structure(tmp, find_in_pool("throw"), fn_iso_throw_1, 1, 1);
+	make_literal(tmp+1, find_in_pool(limit == &q->inf_limit ?
+		"inference_limit_exceeded" : "time_limit_exceeded"));
+	make_end(tmp+2);
+	return tmp;
+}
+
+static uint64_t *get_limit(query *q, cell *c)
+{
+	const char *src = GET_STR(c);
+
+	if (!strcmp(src, "inferences"))
+		return &q->inf_limit;
+	else if (!strcmp(src, "time"))
+		return &q->time_limit;
+	else if (!strcmp(src, "memory"))
+		return &q->mem_limit;
+
+	return NULL;
+}
+
+// '$limit'(+Kind,+Amount,-Limit): the absolute limit for Amount more
+// inferences, seconds or bytes of heap, or the one already in force if
+// that is tighter.
+
+static int fn_sys_limit_3(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,any);
+	GET_NEXT_ARG(p3,variable);
+	uint64_t *limit = get_limit(q, p1);
+
+	if (!limit) {
+		throw_error(q, p1, "domain_error", "limit");
+		return 0;
+	}
+
+	if (!is_integer(p2) && !is_float(p2)) {
+		throw_error(q, p2, "type_error", "number");
+		return 0;
+	}
+
+	double amount = is_integer(p2) ? p2->val_num : p2->val_flt;
+
+	if (amount < 0) {
+		throw_error(q, p2, "domain_error", "not_less_than_zero");
+		return 0;
+	}
+
+	uint64_t v;
+
+	if (limit == &q->inf_limit)
+		v = q->tot_goals + (uint64_t)amount;
+	else if (limit == &q->time_limit)
+		v = get_time_in_usec() + (uint64_t)(amount * 1000 * 1000);
+	else
+		v = mem_used(q) + (uint64_t)amount;
+
+	if (*limit && (*limit < v))
+		v = *limit;
+
+	cell tmp;
+	make_int(&tmp, v);
+	return unify(q, p3, p3_ctx, &tmp, q->st.curr_frame);
+}
+
+// '$set_limit'(+Kind,+Limit,-Prev): put Limit in force, 0 for none,
+// and on backtracking put back the one it replaced.
+
+static int fn_sys_set_limit_3(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,integer);
+	GET_NEXT_ARG(p3,any);
+	uint64_t *limit = get_limit(q, p1);
+
+	if (!limit) {
+		throw_error(q, p1, "domain_error", "limit");
+		return 0;
+	}
+
+	if (q->retry) {
+		*limit = p3->val_num;
+		q->limited = q->inf_limit || q->time_limit || q->mem_limit;
+		return 0;
+	}
+
+	cell tmp;
+	make_int(&tmp, *limit);
+
+	if (!unify(q, p3, p3_ctx, &tmp, q->st.curr_frame))
+		return 0;
+
+	*limit = p2->val_num;
+	q->limited = q->inf_limit || q->time_limit || q->mem_limit;
+	make_choice(q);
+	return 1;
+}
+
+static int fn_sys_choice_1(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	cell tmp;
+	make_int(&tmp, q->cp);
+	return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+}
+
+// '$det'(+Choice,-Det): Det is '!' if the goal called since
+// '$choice'(Choice) left no alternatives behind, else true. Catchers
+// and call barriers are not alternatives.
+
+static int fn_sys_det_2(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	GET_NEXT_ARG(p2,any);
+	idx_t s = g_cut_s;
+
+	for (idx_t i = p1->val_num; i < q->cp; i++) {
+		const choice *ch = q->choices + i;
+
+		if (!ch->catchme1 && !ch->catchme2 && !ch->local_cut) {
+			s = g_true_s;
+			break;
+		}
+	}
+
+	cell tmp;
+	make_literal(&tmp, s);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 }
 
 static int fn_iso_functor_3(query *q)
@@ -4859,6 +6479,9 @@ static int fn_iso_functor_3(query *q)
 	GET_NEXT_ARG(p3,any);
 
 	if (is_variable(p1)) {
+		if (is_integer(p3) && !p3->val_num && is_atomic(p2))
+			return unify(q, p1, p1_ctx, p2, p2_ctx);
+
 		if (!is_atom(p2)){
 			throw_error(q, p2, "type_error", "atom");
 			return 0;
@@ -4869,12 +6492,16 @@ static int fn_iso_functor_3(query *q)
 			return 0;
 		}
 
-		if ((p3->val_num <= 0) || (p3->val_num > MAX_ARITY/2)){
+		if ((p3->val_num <= 0) || (p3->val_num > MAX_ARITY)){
 			throw_error(q, p3, "domain_error", "integer");
 			return 0;
 		}
 
+		// Making the vars can move the slots p1 and p2 may be in...
+
 		unsigned arity = p3->val_num;
+		idx_t val_off = p2->val_off;
+		cell v = *p1;
 		unsigned var_nbr;
 
 		if (!(var_nbr = create_vars(q, arity))) {
@@ -4886,7 +6513,7 @@ static int fn_iso_functor_3(query *q)
 		tmp[0].val_type = TYPE_LITERAL;
 		tmp[0].arity = arity;
 		tmp[0].nbr_cells = 1 + arity;
-		tmp[0].val_off = p2->val_off;
+		tmp[0].val_off = val_off;
 
 		for (unsigned i = 1; i <= arity; i++) {
 			tmp[i].val_type = TYPE_VARIABLE;
@@ -4896,7 +6523,7 @@ static int fn_iso_functor_3(query *q)
 			tmp[i].flags = FLAG_FRESH;
 		}
 
-		set_var(q, p1, p1_ctx, tmp, q->st.curr_frame);
+		set_var(q, &v, p1_ctx, tmp, q->st.curr_frame);
 		return 1;
 	}
 
@@ -4954,6 +6581,16 @@ static int fn_iso_current_prolog_flag_2(query *q)
 		else
 			make_literal(&tmp, g_false_s);
 
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return 1;
+	} else if (!strcmp(GET_STR(p1), "share_ground")) {
+		cell tmp;
+
+		if (q->m->flag.share_ground)
+			make_literal(&tmp, g_true_s);
+		else
+			make_literal(&tmp, g_false_s);
+
 		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 		return 1;
 	} else if (!strcmp(GET_STR(p1), "rational_syntax")) {
@@ -4981,11 +6618,21 @@ static int fn_iso_current_prolog_flag_2(query *q)
 		make_literal(&tmp, g_false_s);
 		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 		return 1;
+	} else if (!strcmp(GET_STR(p1), "max_arity")) {
+		cell tmp;
+		make_int(&tmp, MAX_ARITY);
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return 1;
 	} else if (!strcmp(GET_STR(p1), "cpu_count")) {
 		cell tmp;
 		make_int(&tmp, q->m->cpu_count);
 		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 		return 1;
+	} else if (!strcmp(GET_STR(p1), "time_slice")) {
+		cell tmp;
+		make_int(&tmp, q->m->time_slice);
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return 1;
 	} else if (!strcmp(GET_STR(p1), "version")) {
 		unsigned v1 = 0;
 		sscanf(VERSION, "v%u", &v1);
@@ -5048,6 +6695,16 @@ static int fn_iso_set_prolog_flag_2(query *q)
 		return 1;
 	}
 
+	if (!strcmp(GET_STR(p1), "time_slice") && is_integer(p2)) {
+		if (p2->val_num < 0) {
+			throw_error(q, p2, "domain_error", "not_less_than_zero");
+			return 0;
+		}
+
+		q->m->time_slice = p2->val_num;
+		return 1;
+	}
+
 	if (!is_atom(p2)) {
 		throw_error(q, p2, "type_error", "atom");
 		return 0;
@@ -5082,6 +6739,11 @@ static int fn_iso_set_prolog_flag_2(query *q)
 			q->m->flag.prefer_rationals = 1;
 		else if (!strcmp(GET_STR(p2), "flase"))
 			q->m->flag.prefer_rationals = 0;
+	} else if (!strcmp(GET_STR(p1), "share_ground")) {
+		if (!strcmp(GET_STR(p2), "true"))
+			q->m->flag.share_ground = 1;
+		else if (!strcmp(GET_STR(p2), "false"))
+			q->m->flag.share_ground = 0;
 	} else {
 		throw_error(q, p1, "domain_error", "flag");
 		return 0;
@@ -5117,7 +6779,7 @@ static cell *convert_to_list(query *q, cell *c, idx_t nbr_cells)
 	return end_list(q);
 }
 
-static void do_sys_listn(query *q, cell *p1, idx_t p1_ctx)
+static cell *make_queuen_list(query *q)
 {
 	cell *l = convert_to_list(q, get_queuen(q), queuen_used(q));
 	fix_list(l);
@@ -5135,13 +6797,21 @@ static void do_sys_listn(query *q, cell *p1, idx_t p1_ctx)
 
 	if (new_varno != g->nbr_vars) {
 		if (!create_vars(q, new_varno-g->nbr_vars)) {
-			throw_error(q, p1, "resource_error", "too_many_vars");
-			return;
+			throw_error(q, l, "resource_error", "too_many_vars");
+			return NULL;
 		}
 	}
 
-	unify(q, p1, p1_ctx, l, q->st.curr_frame);
 	init_queuen(q);
+	return l;
+}
+
+static void do_sys_listn(query *q, cell *p1, idx_t p1_ctx)
+{
+	cell *l = make_queuen_list(q);
+
+	if (l)
+		unify(q, p1, p1_ctx, l, q->st.curr_frame);
 }
 
 static void do_sys_listn2(query *q, cell *p1, idx_t p1_ctx, cell *tail)
@@ -5279,7 +6949,7 @@ static int do_collect_vars2(query *q, cell *p1, idx_t nbr_cells, cell **slots)
 
 	for (idx_t i = 0; i < nbr_cells; i++, p1++) {
 		if (is_variable(p1)) {
-			assert(p1->var_nbr < MAX_ARITY);
+			assert(p1->var_nbr < MAX_TERM_VARS);
 
 			if (!slots[p1->var_nbr]) {
 				slots[p1->var_nbr] = p1;
@@ -5294,12 +6964,12 @@ static int do_collect_vars2(query *q, cell *p1, idx_t nbr_cells, cell **slots)
 static uint64_t get_vars(query *q, cell *p, idx_t p_ctx)
 {
         (void) p_ctx;
-	cell *slots[MAX_ARITY] = {0};
+	cell *slots[MAX_TERM_VARS] = {0};
 	int cnt = do_collect_vars2(q, p, p->nbr_cells, slots);
 	uint64_t mask = 0;
 
 	if (cnt) {
-		for (unsigned i = 0; i < MAX_ARITY; i++) {
+		for (unsigned i = 0; i < MAX_TERM_VARS; i++) {
 			if (slots[i])
 				mask |= 1ULL << i;
 		}
@@ -5438,7 +7108,7 @@ static int fn_iso_op_3(query *q)
 	}
 
 	if (!set_op(q->m, GET_STR(p3), optype, p1->val_num)) {
-		throw_error(q, p3, "domain_error", "too_many_ops");
+		throw_error(q, p3, "resource_error", "memory");
 		return 0;
 	}
 
@@ -5467,7 +7137,15 @@ static int fn_instance_2(query *q)
 	uuid_from_buf(GET_STR(p1), &u);
 	clause *r = find_in_db(q->m, &u);
 	if (!r) return 0;
-	return unify(q, p2, p2_ctx, r->t.cells, q->st.curr_frame);
+
+	if (!r->nbr_shared)
+		return unify(q, p2, p2_ctx, r->t.cells, q->st.curr_frame);
+
+	cell *c = unshare_clause(r);
+	cell *tmp = alloc_heap(q, c->nbr_cells);
+	copy_cells(tmp, c, c->nbr_cells);
+	free(c);
+	return unify(q, p2, p2_ctx, tmp, q->st.curr_frame);
 }
 
 static int fn_clause_3(query *q)
@@ -5512,6 +7190,11 @@ static int fn_clause_3(query *q)
 			break;
 		}
 
+		if (is_variable(p3))
+			retry_choice(q);
+		else
+			return 0;
+
 		q->retry = 1;
 	}
 
@@ -5532,7 +7215,14 @@ static int do_asserta_2(query *q)
 	}
 
 	p->t->cidx = copy_cells(p->t->cells, tmp, nbr_cells);
-	parser_assign_vars(p);
+	if (!parser_assign_vars(p)) {
+		p->t->cidx = 0;
+		cell tmp;
+		make_int(&tmp, MAX_TERM_VARS);
+		throw_error(q, &tmp, "resource_error", "too_many_vars");
+		return 0;
+	}
+
 	clause *r = asserta_to_db(q->m, p->t, 0);
 	if (!r) return 0;
 
@@ -5581,7 +7271,14 @@ static int do_assertz_2(query *q)
 	}
 
 	p->t->cidx = copy_cells(p->t->cells, tmp, nbr_cells);
-	parser_assign_vars(p);
+	if (!parser_assign_vars(p)) {
+		p->t->cidx = 0;
+		cell tmp;
+		make_int(&tmp, MAX_TERM_VARS);
+		throw_error(q, &tmp, "resource_error", "too_many_vars");
+		return 0;
+	}
+
 	clause *r = assertz_to_db(q->m, p->t, 0);
 	if (!r) return 0;
 
@@ -5635,7 +7332,9 @@ static void save_db(FILE *fp, query *q, int logging)
 			if (logging)
 				fprintf(fp, "z_(");
 
-			write_term(q, fp, r->t.cells, q->st.curr_frame, 0, 0, 0);
+			cell *c = unshare_clause(r);
+			write_term(q, fp, c, q->st.curr_frame, 0, 0, 0);
+			if (c != r->t.cells) free(c);
 
 			if (logging) {
 				char tmpbuf[256];
@@ -5674,7 +7373,9 @@ static void save_name(FILE *fp, query *q, idx_t name, unsigned arity)
 			if (r->t.is_deleted)
 				continue;
 
-			write_term(q, fp, r->t.cells, q->st.curr_frame, 0, 0, 0);
+			cell *c = unshare_clause(r);
+			write_term(q, fp, c, q->st.curr_frame, 0, 0, 0);
+			if (c != r->t.cells) free(c);
 			fprintf(fp, ".\n");
 		}
 	}
@@ -5759,6 +7460,24 @@ static int fn_statistics_2(query *q)
 		return 1;
 	}
 
+	if (!strcmp(GET_STR(p1), "inferences") && is_variable(p2)) {
+		cell tmp;
+		make_int(&tmp, q->tot_goals);
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return 1;
+	}
+
+	if (!strcmp(GET_STR(p1), "db_memory")) {
+		cell tmp;
+		make_int(&tmp, g_db_reserved);
+		alloc_list(q, &tmp);
+		make_int(&tmp, g_db_used);
+		append_list(q, &tmp);
+		cell *l = end_list(q);
+		fix_list(l);
+		return unify(q, p2, p2_ctx, l, q->st.curr_frame);
+	}
+
 	if (!strcmp(GET_STR(p1), "gctime") && is_variable(p2)) {
 		cell tmp;
 		make_float(&tmp, 0);
@@ -5782,6 +7501,32 @@ static int fn_statistics_2(query *q)
 	return 0;
 }
 
+// Limits are checked between goals, so a sleep that would run past
+// the time limit stops at it and raises time_limit_exceeded there.
+
+static int do_sleep(query *q, uint64_t ms)
+{
+	uint64_t now = get_time_in_usec() / 1000, until = q->time_limit / 1000;
+
+	if (!q->time_limit || ((now + ms) < until)) {
+		msleep(ms);
+		return 1;
+	}
+
+	if (until > now)
+		msleep(until - now);
+
+	q->time_limit = 0;
+	q->limited = q->inf_limit || q->mem_limit;
+	cell tmp;
+	make_literal(&tmp, find_in_pool("time_limit_exceeded"));
+
+	if (!do_throw_term(q, &tmp))
+		return 0;
+
+	return q->st.curr_cell->fn(q);
+}
+
 static int fn_sleep_1(query *q)
 {
 	if (q->retry)
@@ -5794,6 +7539,9 @@ static int fn_sleep_1(query *q)
 		return 0;
 	}
 
+	if (q->time_limit)
+		return do_sleep(q, (uint64_t)p1->val_num * 1000);
+
 	sleep((unsigned)p1->val_num);
 	return 1;
 }
@@ -5810,8 +7558,7 @@ static int fn_delay_1(query *q)
 		return 0;
 	}
 
-	msleep((unsigned)p1->val_num);
-	return 1;
+	return do_sleep(q, (unsigned)p1->val_num);
 }
 
 static int fn_busy_1(query *q)
@@ -6027,328 +7774,659 @@ static int fn_split_4(query *q)
 	return unify(q, p4, p4_ctx, &tmp, q->st.curr_frame);
 }
 
-static int fn_savefile_2(query *q)
-{
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,atom);
-	char *filename = strdup(GET_STR(p1));
-	FILE *fp = fopen(filename, "wb");
-	fwrite(GET_STR(p2), 1, LEN_STR(p2), fp);
-	fclose(fp);
-	free(filename);
-	return 1;
-}
+// CSV rows are read into a row(F1,...,Fn) term, or a term of the
+// given functor, a line at a time with RFC 4180 quoting: a quoted
+// field may hold separators, doubled quotes and line breaks.
 
-static int fn_loadfile_2(query *q)
-{
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,variable);
-	char *filename = strdup(GET_STR(p1));
-	FILE *fp = fopen(filename, "rb");
+typedef struct {
+	cell *cells;
+	size_t size;
+	char *buf;
+	size_t buf_size, buf_len;
+	idx_t functor;
+	int sep;
+	unsigned convert:1;
+	unsigned strings:1;
+	unsigned assert:1;
+	unsigned skip_header:1;
+} csv_state;
+
+static void csv_options(query *q, csv_state *cs, cell *p, idx_t p_ctx)
+{
+	cs->functor = find_in_pool("row");
+	cs->sep = ',';
+	cs->convert = 1;
+
+	while (is_list(p)) {
+		cell *h = LIST_HEAD(p);
+		cell *c = deref(q, h, p_ctx);
 
-	if (!fp) {
-		throw_error(q, p1, "existence_error", "cannot_open_file");
-		free(filename);
-		return 0;
-	}
+		if (is_structure(c) && (c->arity == 1)) {
+			cell *v = deref(q, c+1, p_ctx);
+			int on = is_atom(v) && !strcmp(GET_STR(v), "true");
 
-	struct stat st = {0};
+			if (!strcmp(GET_STR(c), "separator") && is_atom(v))
+				cs->sep = *GET_STR(v);
+			else if (!strcmp(GET_STR(c), "functor") && is_atom(v))
+				cs->functor = find_in_pool(GET_STR(v));
+			else if (!strcmp(GET_STR(c), "convert"))
+				cs->convert = on;
+			else if (!strcmp(GET_STR(c), "strings"))
+				cs->strings = on;
+			else if (!strcmp(GET_STR(c), "assert"))
+				cs->assert = on;
+			else if (!strcmp(GET_STR(c), "skip_header"))
+				cs->skip_header = on;
+		}
 
-	if (stat(filename, &st)) {
-		free(filename);
-		return 0;
+		p = LIST_TAIL(p);
+		p = deref(q, p, p_ctx);
+		p_ctx = q->latest_ctx;
 	}
+}
 
-	char *s = malloc(st.st_size+1);
-
-	if (fread(s, 1, st.st_size, fp) != (size_t)st.st_size) {
-		throw_error(q, p1, "domain_error", "cannot_read");
-		free(filename);
-		return 0;
+static void csv_append(csv_state *cs, const char *s, size_t n)
+{
+	if ((cs->buf_len + n + 1) > cs->buf_size) {
+		cs->buf_size = (cs->buf_len + n + 1) * 2;
+		cs->buf = realloc(cs->buf, cs->buf_size);
+		if (!cs->buf) abort();
 	}
 
-	s[st.st_size] = '\0';
-	fclose(fp);
-	cell tmp = make_string(q, s, st.st_size);
-	set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-	free(s);
-	free(filename);
-	return 1;
+	memcpy(cs->buf+cs->buf_len, s, n);
+	cs->buf_len += n;
+	cs->buf[cs->buf_len] = '\0';
 }
 
-static int fn_getfile_2(query *q)
+// Digits with an optional fraction and exponent, as strtod() takes
+// hex and the like as well.
+
+static int csv_is_decimal(const char *s)
 {
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,variable);
-	char *filename = strdup(GET_STR(p1));
-	FILE *fp = fopen(filename, "r");
+	if ((*s == '-') || (*s == '+'))
+		s++;
 
-	if (!fp) {
-		throw_error(q, p1, "existence_error", "cannot_open_file");
-		free(filename);
+	if (!isdigit(*s))
 		return 0;
+
+	while (isdigit(*s))
+		s++;
+
+	if (*s == '.') {
+		if (!isdigit(*++s))
+			return 0;
+
+		while (isdigit(*s))
+			s++;
 	}
 
-	char *line = NULL;
-	size_t len = 0;
-	int nbr = 1, in_list = 0;
+	if ((*s == 'e') || (*s == 'E')) {
+		s++;
 
-	while (getline(&line, &len, fp) != -1) {
-		size_t len = strlen(line);
-		if (line[len-1] == '\n') {
-			line[len-1] = '\0';
-			len--;
-		}
+		if ((*s == '-') || (*s == '+'))
+			s++;
 
-		if (line[len-1] == '\r') {
-			line[len-1] = '\0';
-			len--;
-		}
+		if (!isdigit(*s))
+			return 0;
 
-		cell tmp = tmp_cstringn(q, line, len);
-		tmp.flags |= FLAG_STRING;
+		while (isdigit(*s))
+			s++;
+	}
 
-		if (nbr++ == 1)
-			alloc_list(q, &tmp);
-		else
-			append_list(q, &tmp);
+	return !*s;
+}
 
-		in_list = 1;
+// Unquoted fields that look like numbers become numbers, the rest
+// atoms or strings. The text isn't kept on the heap here as the cell
+// goes on to be copied to wherever it ends up.
+
+static void csv_field(csv_state *cs, cell *c, const char *s, size_t n, int quoted)
+{
+	if (!quoted && cs->convert && n
+		&& (isdigit(*s) || (((*s == '-') || (*s == '+')) && isdigit(s[1])))) {
+		char tmpbuf[64], *buf = n < sizeof(tmpbuf) ? tmpbuf : malloc(n+1), *end;
+		memcpy(buf, s, n);
+		buf[n] = '\0';
+		errno = 0;
+		long long v = strtoll(buf, &end, 10);
+		int done = 1;
+
+		if (!*end && !errno && ((int_t)v == v)) {
+			make_int(c, v);
+		} else if (!*end) {
+#if USE_GMP
+			// Integers too big for a cell are bigints, which the
+			// cell owns as it would a blob.
+
+			int neg = *buf == '-';
+			make_bigint_str(c, isdigit(*buf) ? buf : buf+1, 10, neg);
+			c->nbr_cells = 1;
+			c->arity = c->flags = 0;
+#else
+			done = 0;
+#endif
+		} else if (csv_is_decimal(buf) && strpbrk(buf, ".eE")) {
+			make_float(c, strtod(buf, NULL));
+		} else
+			done = 0;
+
+		if (buf != tmpbuf)
+			free(buf);
+
+		if (done)
+			return;
 	}
 
-	free(line);
-	fclose(fp);
-	free(filename);
+	if (!n && !cs->strings) {
+		make_literal(c, g_empty_s);
+		return;
+	}
 
-	if (!in_list) {
-		cell tmp;
-		make_literal(&tmp, g_nil_s);
-		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	if (n < MAX_SMALL_STRING) {
+		make_smalln(c, s, n);
 	} else {
-		cell *l = end_list(q);
-		fix_list(l);
-		set_var(q, p2, p2_ctx, l, q->st.curr_frame);
+		c->val_type = TYPE_CSTRING;
+		c->flags = FLAG_BLOB;
+		c->nbr_cells = 1;
+		c->arity = 0;
+		c->val_str = malloc(n+1);
+		memcpy(c->val_str, s, n);
+		c->val_str[n] = '\0';
+		c->len_str = n;
 	}
 
-	return 1;
+	if (cs->strings)
+		c->flags |= FLAG_STRING;
 }
 
-static void parse_host(const char *src, char *hostname, char *path, unsigned *port, int *ssl)
+static int csv_getline(char **line, size_t *n, stream *str)
 {
-	if (!strncmp(src, "https://", 8)) {
-		src += 8;
-		*ssl = 1;
-		*port = 443;
-	} else if (!strncmp(src, "http://", 7)) {
-		src += 7;
-		*ssl = 0;
-		*port = 80;
-	}
+	if (net_getline(line, n, str) == -1)
+		return 0;
 
-	if (*src == ':')
-		sscanf(src, ":%u/%4095s", port, path);
-	else
-		sscanf(src, "%1023[^:/]:%u/%4095s", hostname, port, path);
+	size_t len = strlen(*line);
 
-	hostname[1023] = '\0';
-	path[4095] = '\0';
+	if (len && ((*line)[len-1] == '\n'))
+		(*line)[--len] = '\0';
+
+	if (len && ((*line)[len-1] == '\r'))
+		(*line)[--len] = '\0';
+
+	return 1;
 }
 
-static int fn_server_3(query *q)
+// Reads the next row into cs->cells, returning the number of fields
+// or 0 at end of file. Blank lines are skipped. A row of more than
+// MAX_ARITY fields is read but is no term, so callers must check.
+
+static unsigned csv_read_row(csv_state *cs, stream *str, char **line, size_t *n)
 {
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,variable);
-	GET_NEXT_ARG(p3,list_or_nil);
-	char hostname[1024], path[4096];
-	char *keyfile = "privkey.pem", *certfile = "fullchain.pem";
-	int udp = 0, nodelay = 1, nonblock = 0, ssl = 0, level = 0;
-	unsigned port = 80;
-	strcpy(hostname, "localhost");
-	path[0] = '\0';
+	do {
+		if (!csv_getline(line, n, str))
+			return 0;
+	}
+	 while (!**line);
 
-	while (is_list(p3)) {
-		cell *h = LIST_HEAD(p3);
-		cell *c = deref(q, h, p3_ctx);
+	const char *src = *line;
+	unsigned nbr = 0;
 
-		if (is_structure(c) && (c->arity == 1)) {
-			if (!strcmp(GET_STR(c), "udp")) {
-				c = c + 1;
+	for (;;) {
+		if ((nbr+2) > cs->size) {
+			cs->size = (nbr+2) * 2;
+			cs->cells = realloc(cs->cells, sizeof(cell)*cs->size);
+			if (!cs->cells) abort();
+		}
 
-				if (is_atom(c))
-					udp = !strcmp(GET_STR(c), "true") ? 1 : 0;
-			} else if (!strcmp(GET_STR(c), "nodelay")) {
-				c = c + 1;
+		cell *c = cs->cells + 1 + nbr++;
 
-				if (is_atom(c))
-					nodelay = !strcmp(GET_STR(c), "true") ? 1 : 0;
-			} else if (!strcmp(GET_STR(c), "ssl")) {
-				c = c + 1;
+		if (*src == '"') {
+			cs->buf_len = 0;
+			csv_append(cs, "", 0);
+			src++;
 
-				if (is_atom(c))
-					ssl = !strcmp(GET_STR(c), "true") ? 1 : 0;
-			} else if (!strcmp(GET_STR(c), "keyfile")) {
-				c = c + 1;
+			for (;;) {
+				const char *e = strchr(src, '"');
 
-				if (is_atom(c))
-					keyfile = GET_STR(c);
-			} else if (!strcmp(GET_STR(c), "certfile")) {
-				c = c + 1;
+				if (!e) {
+					csv_append(cs, src, strlen(src));
 
-				if (is_atom(c))
-					certfile = GET_STR(c);
-			} else if (!strcmp(GET_STR(c), "hostname")) {
-				c = c + 1;
+					if (!csv_getline(line, n, str))
+						break;
 
-				if (is_atom(c)) {
-					strncpy(hostname, GET_STR(c), sizeof(hostname));
-					hostname[sizeof(hostname)-1] = '\0';
+					csv_append(cs, "\n", 1);
+					src = *line;
+					continue;
 				}
-			} else if (!strcmp(GET_STR(c), "scheme")) {
-				c = c + 1;
 
-				if (is_atom(c)) {
-					ssl = !strcmp(GET_STR(c), "https") ? 1 : 0;
-					port = 443;
-				}
-			} else if (!strcmp(GET_STR(c), "port")) {
-				c = c + 1;
+				csv_append(cs, src, e-src);
+				src = e + 1;
 
-				if (is_integer(c))
-					port = c->val_num;
-			} else if (!strcmp(GET_STR(c), "level")) {
-				c = c + 1;
+				if (*src != '"')
+					break;
 
-				if (is_integer(c))
-					level = (int)c->val_num;
+				csv_append(cs, "\"", 1);
+				src++;
 			}
+
+			csv_field(cs, c, cs->buf, cs->buf_len, 1);
+
+			// Anything between the closing quote and the separator
+			// is dropped...
+
+			const char *e = strchr(src, cs->sep);
+			src = e ? e : src + strlen(src);
+		} else {
+			const char *e = strchr(src, cs->sep);
+			size_t len = e ? (size_t)(e - src) : strlen(src);
+			csv_field(cs, c, src, len, 0);
+			src += len;
 		}
 
-		p3 = LIST_TAIL(p3);
-		p3 = deref(q, p3, p3_ctx);
-		p3_ctx = q->latest_ctx;
+		if (*src != cs->sep)
+			break;
+
+		src++;
 	}
 
-	const char *url = GET_STR(p1);
-	parse_host(url, hostname, path, &port, &ssl);
-	nonblock = q->is_task;
+	cell *c = cs->cells;
+	c->val_type = TYPE_LITERAL;
+	c->nbr_cells = 1 + nbr;
+	c->arity = nbr <= MAX_ARITY ? nbr : 0;
+	c->flags = 0;
+	c->val_off = cs->functor;
+	return nbr;
+}
 
-	int fd = net_server(hostname, port, udp, ssl?keyfile:NULL, ssl?certfile:NULL);
+static void csv_free_row(csv_state *cs)
+{
+	for (idx_t i = 1; i < cs->cells->nbr_cells; i++) {
+		cell *c = cs->cells + i;
 
-	if (fd == -1) {
-		throw_error(q, p1, "existence_error", "server_failed");
-		return 0;
+		if (is_blob(c))
+			free(c->val_str);
+		else if (is_bigint(c))
+			free_bigint(c);
 	}
+}
 
-	int n = new_stream(q);
+static int csv_assert(query *q, csv_state *cs)
+{
+	idx_t nbr_cells = cs->cells->nbr_cells;
+	parser *p = q->m->p;
 
-	if (n < 0) {
-		throw_error(q, p1, "resource_error", "too_many_open_streams");
-		close(fd);
-		return 0;
+	if (nbr_cells > p->t->nbr_cells) {
+		p->t = realloc(p->t, sizeof(term)+(sizeof(cell)*(nbr_cells+1)));
+		p->t->nbr_cells = nbr_cells;
 	}
 
-	stream *str = &g_streams[n];
-	str->filename = strdup(GET_STR(p1));
-	str->name = strdup(hostname);
-	str->mode = strdup("update");
-	str->nodelay = nodelay;
-	str->nonblock = nonblock;
-	str->udp = udp;
-	str->fp = fdopen(fd, "r+");
-	str->ssl = ssl;
-	str->level = level;
-	str->sslptr = NULL;
+	p->t->cidx = copy_cells(p->t->cells, cs->cells, nbr_cells);
+	parser_assign_vars(p);
+	clause *r = assertz_to_db(q->m, p->t, 0);
 
-	if (str->fp == NULL) {
-		throw_error(q, p1, "existence_error", "cannot_open_stream");
-		close(fd);
+	if (!r) {
+		csv_free_row(cs);
+		return 0;
 	}
 
-	net_set_nonblocking(str);
-	cell *tmp = alloc_heap(q, 1);
-	make_int(tmp, n);
-	tmp->flags |= FLAG_STREAM | FLAG_HEX;
-	set_var(q, p2, p2_ctx, tmp, q->st.curr_frame);
+	uuid_gen(&r->u);
+
+	if (!q->m->loading && r->t.is_persist)
+		db_log(q, r, LOG_ASSERTZ);
+
 	return 1;
 }
 
-static int fn_accept_2(query *q)
+static int fn_csv_read_row_3(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
-	GET_NEXT_ARG(p1,variable);
+	GET_NEXT_ARG(p1,any);
+	GET_NEXT_ARG(p2,list_or_nil);
 	int n = get_stream(q, pstr);
 	stream *str = &g_streams[n];
+	csv_state cs = {0};
+	csv_options(q, &cs, p2, p2_ctx);
+	char *line = NULL;
+	size_t len = 0;
+	unsigned nbr = csv_read_row(&cs, str, &line, &len);
+	free(line);
+	free(cs.buf);
 
-	int fd = net_accept(str);
-
-	if (fd == -1) {
-		if (q->is_task) {
-			do_yield_0(q, 10);
-			return 0;
-		}
-
-		printf("*** here\n");
+	if (nbr > MAX_ARITY) {
+		csv_free_row(&cs);
+		free(cs.cells);
+		cell tmp;
+		make_int(&tmp, nbr);
+		throw_error(q, &tmp, "representation_error", "max_arity");
 		return 0;
 	}
 
-	n = new_stream(q);
-
-	if (n < 0) {
-		throw_error(q, p1, "resource_error", "too_many_open_streams");
-		close(fd);
-		return 0;
+	if (!nbr) {
+		free(cs.cells);
+		cell tmp;
+		make_literal(&tmp, g_eof_s);
+		return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
 	}
 
-	stream *str2 = &g_streams[n];
-	str2->filename = strdup(str->filename);
-	str2->name = strdup(str->name);
-	str2->mode = strdup("update");
-	str2->nodelay = str->nodelay;
-	str2->nonblock = str->nonblock;
-	str2->udp = str->udp;
-	str2->ssl = str->ssl;
-	str2->fp = fdopen(fd, "r+");
+	cell *tmp = alloc_heap(q, cs.cells->nbr_cells);
+	copy_cells(tmp, cs.cells, cs.cells->nbr_cells);
+	free(cs.cells);
+	return unify(q, p1, p1_ctx, tmp, q->st.curr_frame);
+}
 
-	if (str2->fp == NULL) {
-		throw_error(q, p1, "existence_error", "cannot_open_stream");
-		close(fd);
+// With assert(true) each row is added as a fact as it's read, and
+// Rows is the number of rows.
+
+static int fn_csv_read_3(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,any);
+	GET_NEXT_ARG(p3,list_or_nil);
+	char *filename = strdup(GET_STR(p1));
+	FILE *fp = fopen(filename, "r");
+	free(filename);
+
+	if (!fp) {
+		throw_error(q, p1, "existence_error", "cannot_open_file");
 		return 0;
 	}
 
-	if (str->ssl) {
-		str2->sslptr = net_enable_ssl(fd, str->name, 1, str->level, NULL);
+	stream str = {0};
+	str.fp = fp;
+	csv_state cs = {0};
+	csv_options(q, &cs, p3, p3_ctx);
+	char *line = NULL;
+	size_t len = 0;
+	int_t cnt = 0;
+	int ok = 1;
+	init_tmp_heap(q);
 
-		if (!str2->sslptr) {
-			close(fd);
-			return 0;
+	unsigned nbr;
+
+	if (cs.skip_header && csv_read_row(&cs, &str, &line, &len))
+		csv_free_row(&cs);
+
+	while ((nbr = csv_read_row(&cs, &str, &line, &len)) != 0) {
+		if (nbr > MAX_ARITY) {
+			csv_free_row(&cs);
+			ok = 0;
+			break;
 		}
+
+		if (cs.assert) {
+			if (!(ok = csv_assert(q, &cs)))
+				break;
+		} else if (!cnt)
+			alloc_list(q, cs.cells);
+		else
+			append_list(q, cs.cells);
+
+		cnt++;
 	}
 
-	net_set_nonblocking(str2);
-	make_choice(q);
+	fclose(fp);
+	free(line);
+	free(cs.buf);
+	free(cs.cells);
+
+	if (nbr > MAX_ARITY) {
+		cell tmp;
+		make_int(&tmp, nbr);
+		throw_error(q, &tmp, "representation_error", "max_arity");
+		return 0;
+	}
+
+	if (!ok)
+		return 0;
+
 	cell tmp;
-	make_int(&tmp, n);
-	tmp.flags |= FLAG_STREAM | FLAG_HEX;
-	set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+
+	if (cs.assert) {
+		make_int(&tmp, cnt);
+		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	}
+
+	if (!cnt) {
+		make_literal(&tmp, g_nil_s);
+		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	}
+
+	cell *l = end_list(q);
+	fix_list(l);
+	return unify(q, p2, p2_ctx, l, q->st.curr_frame);
+}
+
+static void csv_write_field(query *q, FILE *fp, int sep, cell *c, idx_t c_ctx)
+{
+	const char *src;
+	size_t len;
+	char *dst = NULL;
+
+	if (is_atom(c)) {
+		src = GET_STR(c);
+		len = LEN_STR(c);
+	} else {
+		src = dst = write_term_to_strbuf(q, c, c_ctx, 1);
+		len = strlen(dst);
+	}
+
+	if (!memchr(src, sep, len) && !strpbrk(src, "\"\r\n")) {
+		fwrite(src, 1, len, fp);
+		free(dst);
+		return;
+	}
+
+	fputc('"', fp);
+
+	for (const char *e; (e = memchr(src, '"', len)) != NULL; ) {
+		fwrite(src, 1, e-src+1, fp);
+		fputc('"', fp);
+		len -= e - src + 1;
+		src = e + 1;
+	}
+
+	fwrite(src, 1, len, fp);
+	fputc('"', fp);
+	free(dst);
+}
+
+// Rows are compound terms or lists, fields are quoted only when they
+// need to be.
+
+static int fn_csv_write_3(query *q)
+{
+	GET_FIRST_ARG(pstr,stream);
+	GET_NEXT_ARG(p1,list_or_nil);
+	GET_NEXT_ARG(p2,list_or_nil);
+	int n = get_stream(q, pstr);
+	stream *str = &g_streams[n];
+	csv_state cs = {0};
+	csv_options(q, &cs, p2, p2_ctx);
+
+	while (is_list(p1)) {
+		cell *h = LIST_HEAD(p1);
+		cell *row = deref(q, h, p1_ctx);
+		idx_t row_ctx = q->latest_ctx;
+
+		if (is_list(row) || is_nil(row)) {
+			for (int first = 1; is_list(row); first = 0) {
+				cell *c = LIST_HEAD(row);
+				c = deref(q, c, row_ctx);
+
+				if (!first)
+					fputc(cs.sep, str->fp);
+
+				csv_write_field(q, str->fp, cs.sep, c, q->latest_ctx);
+				row = LIST_TAIL(row);
+				row = deref(q, row, row_ctx);
+				row_ctx = q->latest_ctx;
+			}
+		} else if (is_structure(row)) {
+			cell *c = row + 1;
+
+			for (unsigned i = 0; i < row->arity; i++, c += c->nbr_cells) {
+				cell *v = deref(q, c, row_ctx);
+
+				if (i)
+					fputc(cs.sep, str->fp);
+
+				csv_write_field(q, str->fp, cs.sep, v, q->latest_ctx);
+			}
+		} else {
+			throw_error(q, row, "type_error", "compound");
+			return 0;
+		}
+
+		fputc('\n', str->fp);
+		p1 = LIST_TAIL(p1);
+		p1 = deref(q, p1, p1_ctx);
+		p1_ctx = q->latest_ctx;
+	}
+
+	return !ferror(str->fp);
+}
+
+static int fn_savefile_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,atom);
+	char *filename = strdup(GET_STR(p1));
+	FILE *fp = fopen(filename, "wb");
+	fwrite(GET_STR(p2), 1, LEN_STR(p2), fp);
+	fclose(fp);
+	free(filename);
 	return 1;
 }
 
-static int fn_client_5(query *q)
+static int fn_loadfile_2(query *q)
 {
 	GET_FIRST_ARG(p1,atom);
 	GET_NEXT_ARG(p2,variable);
-	GET_NEXT_ARG(p3,variable);
-	GET_NEXT_ARG(p4,variable);
-	GET_NEXT_ARG(p5,list_or_nil);
+	char *filename = strdup(GET_STR(p1));
+	FILE *fp = fopen(filename, "rb");
+
+	if (!fp) {
+		throw_error(q, p1, "existence_error", "cannot_open_file");
+		free(filename);
+		return 0;
+	}
+
+	struct stat st = {0};
+
+	if (stat(filename, &st)) {
+		free(filename);
+		return 0;
+	}
+
+	char *s = malloc(st.st_size+1);
+
+	if (fread(s, 1, st.st_size, fp) != (size_t)st.st_size) {
+		throw_error(q, p1, "domain_error", "cannot_read");
+		free(filename);
+		return 0;
+	}
+
+	s[st.st_size] = '\0';
+	fclose(fp);
+	cell tmp = make_string(q, s, st.st_size);
+	set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	free(s);
+	free(filename);
+	return 1;
+}
+
+static int fn_getfile_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,variable);
+	char *filename = strdup(GET_STR(p1));
+	FILE *fp = fopen(filename, "r");
+
+	if (!fp) {
+		throw_error(q, p1, "existence_error", "cannot_open_file");
+		free(filename);
+		return 0;
+	}
+
+	char *line = NULL;
+	size_t len = 0;
+	int nbr = 1, in_list = 0;
+
+	while (getline(&line, &len, fp) != -1) {
+		size_t len = strlen(line);
+		if (line[len-1] == '\n') {
+			line[len-1] = '\0';
+			len--;
+		}
+
+		if (line[len-1] == '\r') {
+			line[len-1] = '\0';
+			len--;
+		}
+
+		cell tmp = tmp_cstringn(q, line, len);
+		tmp.flags |= FLAG_STRING;
+
+		if (nbr++ == 1)
+			alloc_list(q, &tmp);
+		else
+			append_list(q, &tmp);
+
+		in_list = 1;
+	}
+
+	free(line);
+	fclose(fp);
+	free(filename);
+
+	if (!in_list) {
+		cell tmp;
+		make_literal(&tmp, g_nil_s);
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	} else {
+		cell *l = end_list(q);
+		fix_list(l);
+		set_var(q, p2, p2_ctx, l, q->st.curr_frame);
+	}
+
+	return 1;
+}
+
+static void parse_host(const char *src, char *hostname, char *path, unsigned *port, int *ssl)
+{
+	if (!strncmp(src, "https://", 8)) {
+		src += 8;
+		*ssl = 1;
+		*port = 443;
+	} else if (!strncmp(src, "http://", 7)) {
+		src += 7;
+		*ssl = 0;
+		*port = 80;
+	}
+
+	if (*src == ':')
+		sscanf(src, ":%u/%4095s", port, path);
+	else
+		sscanf(src, "%1023[^:/]:%u/%4095s", hostname, port, path);
+
+	hostname[1023] = '\0';
+	path[4095] = '\0';
+}
+
+static int fn_server_3(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,variable);
+	GET_NEXT_ARG(p3,list_or_nil);
 	char hostname[1024], path[4096];
-	char *certfile = NULL;
+	char *keyfile = "privkey.pem", *certfile = "fullchain.pem";
 	int udp = 0, nodelay = 1, nonblock = 0, ssl = 0, level = 0;
-	hostname[0] = path[0] = '\0';
 	unsigned port = 80;
+	strcpy(hostname, "localhost");
+	path[0] = '\0';
 
-	while (is_list(p5)) {
-		cell *h = LIST_HEAD(p5);
-		cell *c = deref(q, h, p5_ctx);
+	while (is_list(p3)) {
+		cell *h = LIST_HEAD(p3);
+		cell *c = deref(q, h, p3_ctx);
 
 		if (is_structure(c) && (c->arity == 1)) {
 			if (!strcmp(GET_STR(c), "udp")) {
@@ -6366,11 +8444,23 @@ static int fn_client_5(query *q)
 
 				if (is_atom(c))
 					ssl = !strcmp(GET_STR(c), "true") ? 1 : 0;
+			} else if (!strcmp(GET_STR(c), "keyfile")) {
+				c = c + 1;
+
+				if (is_atom(c))
+					keyfile = GET_STR(c);
 			} else if (!strcmp(GET_STR(c), "certfile")) {
 				c = c + 1;
 
 				if (is_atom(c))
 					certfile = GET_STR(c);
+			} else if (!strcmp(GET_STR(c), "hostname")) {
+				c = c + 1;
+
+				if (is_atom(c)) {
+					strncpy(hostname, GET_STR(c), sizeof(hostname));
+					hostname[sizeof(hostname)-1] = '\0';
+				}
 			} else if (!strcmp(GET_STR(c), "scheme")) {
 				c = c + 1;
 
@@ -6382,7 +8472,175 @@ static int fn_client_5(query *q)
 				c = c + 1;
 
 				if (is_integer(c))
-					port = (int)c->val_num;
+					port = c->val_num;
+			} else if (!strcmp(GET_STR(c), "level")) {
+				c = c + 1;
+
+				if (is_integer(c))
+					level = (int)c->val_num;
+			}
+		}
+
+		p3 = LIST_TAIL(p3);
+		p3 = deref(q, p3, p3_ctx);
+		p3_ctx = q->latest_ctx;
+	}
+
+	const char *url = GET_STR(p1);
+	parse_host(url, hostname, path, &port, &ssl);
+	nonblock = q->is_task;
+
+	int fd = net_server(hostname, port, udp, ssl?keyfile:NULL, ssl?certfile:NULL);
+
+	if (fd == -1) {
+		throw_error(q, p1, "existence_error", "server_failed");
+		return 0;
+	}
+
+	int n = new_stream(q);
+
+	if (n < 0) {
+		throw_error(q, p1, "resource_error", "too_many_open_streams");
+		close(fd);
+		return 0;
+	}
+
+	stream *str = &g_streams[n];
+	str->filename = strdup(GET_STR(p1));
+	str->name = strdup(hostname);
+	str->mode = strdup("update");
+	str->nodelay = nodelay;
+	str->nonblock = nonblock;
+	str->udp = udp;
+	str->fp = fdopen(fd, "r+");
+	str->ssl = ssl;
+	str->level = level;
+	str->sslptr = NULL;
+
+	if (str->fp == NULL) {
+		throw_error(q, p1, "existence_error", "cannot_open_stream");
+		close(fd);
+	}
+
+	net_set_nonblocking(str);
+	cell *tmp = alloc_heap(q, 1);
+	make_int(tmp, n);
+	tmp->flags |= FLAG_STREAM | FLAG_HEX;
+	set_var(q, p2, p2_ctx, tmp, q->st.curr_frame);
+	return 1;
+}
+
+static int fn_accept_2(query *q)
+{
+	GET_FIRST_ARG(pstr,stream);
+	GET_NEXT_ARG(p1,variable);
+	int n = get_stream(q, pstr);
+	stream *str = &g_streams[n];
+
+	int fd = net_accept(str);
+
+	if (fd == -1) {
+		if (q->is_task) {
+			do_yield_0(q, 10);
+			return 0;
+		}
+
+		printf("*** here\n");
+		return 0;
+	}
+
+	n = new_stream(q);
+
+	if (n < 0) {
+		throw_error(q, p1, "resource_error", "too_many_open_streams");
+		close(fd);
+		return 0;
+	}
+
+	stream *str2 = &g_streams[n];
+	str2->filename = strdup(str->filename);
+	str2->name = strdup(str->name);
+	str2->mode = strdup("update");
+	str2->nodelay = str->nodelay;
+	str2->nonblock = str->nonblock;
+	str2->udp = str->udp;
+	str2->ssl = str->ssl;
+	str2->fp = fdopen(fd, "r+");
+
+	if (str2->fp == NULL) {
+		throw_error(q, p1, "existence_error", "cannot_open_stream");
+		close(fd);
+		return 0;
+	}
+
+	if (str->ssl) {
+		str2->sslptr = net_enable_ssl(fd, str->name, 1, str->level, NULL);
+
+		if (!str2->sslptr) {
+			close(fd);
+			return 0;
+		}
+	}
+
+	net_set_nonblocking(str2);
+	make_choice(q);
+	cell tmp;
+	make_int(&tmp, n);
+	tmp.flags |= FLAG_STREAM | FLAG_HEX;
+	set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	return 1;
+}
+
+static int fn_client_5(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,variable);
+	GET_NEXT_ARG(p3,variable);
+	GET_NEXT_ARG(p4,variable);
+	GET_NEXT_ARG(p5,list_or_nil);
+	char hostname[1024], path[4096];
+	char *certfile = NULL;
+	int udp = 0, nodelay = 1, nonblock = 0, ssl = 0, level = 0;
+	hostname[0] = path[0] = '\0';
+	unsigned port = 80;
+
+	while (is_list(p5)) {
+		cell *h = LIST_HEAD(p5);
+		cell *c = deref(q, h, p5_ctx);
+
+		if (is_structure(c) && (c->arity == 1)) {
+			if (!strcmp(GET_STR(c), "udp")) {
+				c = c + 1;
+
+				if (is_atom(c))
+					udp = !strcmp(GET_STR(c), "true") ? 1 : 0;
+			} else if (!strcmp(GET_STR(c), "nodelay")) {
+				c = c + 1;
+
+				if (is_atom(c))
+					nodelay = !strcmp(GET_STR(c), "true") ? 1 : 0;
+			} else if (!strcmp(GET_STR(c), "ssl")) {
+				c = c + 1;
+
+				if (is_atom(c))
+					ssl = !strcmp(GET_STR(c), "true") ? 1 : 0;
+			} else if (!strcmp(GET_STR(c), "certfile")) {
+				c = c + 1;
+
+				if (is_atom(c))
+					certfile = GET_STR(c);
+			} else if (!strcmp(GET_STR(c), "scheme")) {
+				c = c + 1;
+
+				if (is_atom(c)) {
+					ssl = !strcmp(GET_STR(c), "https") ? 1 : 0;
+					port = 443;
+				}
+			} else if (!strcmp(GET_STR(c), "port")) {
+				c = c + 1;
+
+				if (is_integer(c))
+					port = (int)c->val_num;
 			} else if (!strcmp(GET_STR(c), "level")) {
 				c = c + 1;
 
@@ -6493,7 +8751,7 @@ static int fn_getline_1(query *q)
 	if (line[strlen(line)-1] == '\n')
 		line[strlen(line)-1] = '\0';
 
-	if (line[strlen(line)-1] == '\r')
+	if (*line && (line[strlen(line)-1] == '\r'))
 		line[strlen(line)-1] = '\0';
 
 	cell tmp = make_cstring(q, line);
@@ -6531,7 +8789,7 @@ static int fn_getline_2(query *q)
 	if (line[strlen(line)-1] == '\n')
 		line[strlen(line)-1] = '\0';
 
-	if (line[strlen(line)-1] == '\r')
+	if (*line && (line[strlen(line)-1] == '\r'))
 		line[strlen(line)-1] = '\0';
 
 	cell tmp = make_cstring(q, line);
@@ -6655,2360 +8913,6129 @@ static int fn_bwrite_2(query *q)
 	return 1;
 }
 
-static int fn_read_term_from_chars_3(query *q)
+// Terms in the external binary format are a header, of a magic byte, a
+// version and then the number of cells, variables and body bytes as
+// varints, followed by the cells in prefix order each led by a tag.
+// Atoms go once per message, later uses referring to them by the order
+// they were sent. Integers are zigzag varints, floats little-endian.
+
+#define TB_MAGIC 0x83
+#define TB_VERSION 1
+#define TB_MAX_HEADER (2+(3*10))
+#define TB_ATOM_CACHE 256
+#define TB_OP_MASK (OP_FX|OP_FY|OP_XF|OP_YF|OP_YFX|OP_XFX|OP_XFY)
+
+enum {
+	TB_VAR='V', TB_ATOM='A', TB_ATOM_REF='a', TB_FUNCTOR='F', TB_OP='O', TB_CONS='L',
+	TB_NIL='N', TB_CSTRING='C', TB_STRING='S', TB_INT='I', TB_RATIONAL='R',
+	TB_FLOAT='D', TB_BIGINT='B'
+};
+
+typedef struct {
+	uint8_t *buf;
+	size_t len, size;
+} tb_buf;
+
+static void tb_need(tb_buf *b, size_t n)
 {
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,any);
-	GET_NEXT_ARG(p3,any);
-	int n = get_named_stream(q, "user_input");
-	stream *str = &g_streams[n];
-	const char *p = GET_STR(p1);
-	char *src = malloc(strlen(p)+10);
-	sprintf(src, "%s", p);
+	if ((b->len + n) <= b->size)
+		return;
 
-	if (src[strlen(src)-1] != '.')
-		strcat(src, ".");
+	b->size = (b->len + n) * 2;
+	b->buf = realloc(b->buf, b->size);
+}
 
-	int ok = do_read_term(q, str, p2, p2_ctx, p3, p3_ctx, src);
-	free(src);
-	return ok;
+static void tb_byte(tb_buf *b, uint8_t ch)
+{
+	tb_need(b, 1);
+	b->buf[b->len++] = ch;
 }
 
-static int fn_write_term_to_chars_3(query *q)
+static void tb_varint(tb_buf *b, uint_t v)
 {
-	GET_FIRST_ARG(p2,any);
-	GET_NEXT_ARG(p1,any);
-	GET_NEXT_ARG(p3,any);
+	tb_need(b, (sizeof(uint_t)*8+6)/7);
 
-	if (is_number(p1)) {
-		char tmpbuf[256], *dst = tmpbuf;
-		write_term_to_buf(q, dst, sizeof(tmpbuf), p1, p1_ctx, 1, 0, 0);
-		cell tmp = make_cstring(q, dst);
-		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	while (v >= 0x80) {
+		b->buf[b->len++] = (uint8_t)v | 0x80;
+		v >>= 7;
 	}
 
-	size_t len = write_term_to_buf(q, NULL, 0, p1, p1_ctx, 1, 0, 0);
-	char *dst = malloc(len+1);
-	write_term_to_buf(q, dst, len+1, p1, p1_ctx, 1, 0, 0);
-	idx_t offset;
-
-	if (is_in_pool(dst, &offset)) {
-		cell tmp;
-		make_literal(&tmp, offset);
-		free(dst);
-		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-	} else {
-		cell tmp = make_cstring(q, dst);
-		free(dst);
-		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-	}
+	b->buf[b->len++] = (uint8_t)v;
 }
 
-static int fn_is_list_1(query *q)
+static void tb_zigzag(tb_buf *b, int_t v)
 {
-	GET_FIRST_ARG(p1,any);
+	tb_varint(b, ((uint_t)v << 1) ^ (uint_t)(v >> (sizeof(int_t)*8-1)));
+}
 
-	if (!is_list(p1) && !is_nil(p1))
-		return 0;
+static void tb_bytes(tb_buf *b, const void *src, size_t n)
+{
+	tb_varint(b, n);
+	tb_need(b, n);
+	memcpy(b->buf+b->len, src, n);
+	b->len += n;
+}
 
-	while (is_list(p1)) {
-		LIST_HEAD(p1);
-		p1 = LIST_TAIL(p1);
-		p1 = deref(q, p1, p1_ctx);
-		p1_ctx = q->latest_ctx;
-	}
+// A lossy cache maps atoms to their index: a miss just sends the atom
+// again, which the reader appends to its table like any other.
 
-	return is_nil(p1);
-}
+typedef struct {
+	tb_buf b;
+	struct { idx_t off; unsigned idx; } atoms[TB_ATOM_CACHE];
+	skiplist *vars;
+	unsigned nbr_atoms, nbr_vars;
+	uint64_t nbr_cells;
+} tb_writer;
 
-static int fn_is_stream_1(query *q)
+static int tb_compkey(const void *k1, const void *k2)
 {
-	GET_FIRST_ARG(p1,any);
-	return is_stream(p1);
+	uintptr_t v1 = (uintptr_t)k1, v2 = (uintptr_t)k2;
+	return v1 < v2 ? -1 : v1 > v2 ? 1 : 0;
 }
 
-static void push_task(module *m, query *task)
+static void tb_atom(tb_writer *w, idx_t off)
 {
-	task->next = m->tasks;
+	unsigned h = (off ^ (off >> 8)) % TB_ATOM_CACHE;
 
-	if (m->tasks)
-		m->tasks->prev = task;
+	if (w->atoms[h].idx && (w->atoms[h].off == off)) {
+		tb_byte(&w->b, TB_ATOM_REF);
+		tb_varint(&w->b, w->atoms[h].idx-1);
+		return;
+	}
 
-	m->tasks = task;
+	tb_byte(&w->b, TB_ATOM);
+	tb_bytes(&w->b, g_pool+off, strlen(g_pool+off));
+	w->atoms[h].off = off;
+	w->atoms[h].idx = ++w->nbr_atoms;
 }
 
-static query *pop_task(module *m, query *task)
+static void tb_var(tb_writer *w, const cell *c, idx_t c_ctx)
 {
-	if (task->prev)
-		task->prev->next = task->next;
+	if (!w->vars)
+		w->vars = sl_create(tb_compkey);
 
-	if (task->next)
-		task->next->prev = task->prev;
+	const void *key = (const void*)(((uintptr_t)c_ctx << 32) | c->var_nbr);
+	const void *val;
 
-	if (task == m->tasks)
-		m->tasks = task->next;
+	if (!sl_get(w->vars, key, &val)) {
+		val = (const void*)(uintptr_t)w->nbr_vars++;
+		sl_set(w->vars, key, val);
+	}
 
-	return task->next;
+	tb_byte(&w->b, TB_VAR);
+	tb_varint(&w->b, (uintptr_t)val);
 }
 
-static int fn_wait_0(query *q)
+static void tb_cell(tb_writer *w, cell *c, idx_t c_ctx)
 {
-	while (!g_tpl_interrupt && q->m->tasks) {
-		int_t now = get_time_in_usec() / 1000;
-		query *task = q->m->tasks;
-		unsigned did_something = 0, spawn_cnt = 0;
-
-		while (!g_tpl_interrupt && task) {
-			if (task->spawned) {
-				spawn_cnt++;
+	tb_buf *b = &w->b;
 
-				if (spawn_cnt >= q->m->cpu_count)
-					break;
-			}
-
-			if (task->tmo_msecs) {
-				if (now <= task->tmo_msecs) {
-					task = task->next;
-					continue;
-				}
-
-				task->tmo_msecs = 0;
-			}
-
-			if (!task->yielded || !task->st.curr_cell) {
-				query *save = task;
-				task = pop_task(q->m, task);
-				destroy_query(save);
-				continue;
-			}
-
-			run_query(task);
-			task = task->next;
-			did_something = 1;
-		}
-
-		if (!did_something)
-			msleep(1);
+	if (is_variable(c)) {
+		tb_var(w, c, c_ctx);
+	} else if (is_literal(c)) {
+		if (!c->arity && (c->val_off == g_nil_s))
+			tb_byte(b, TB_NIL);
+		else if ((c->arity == 2) && (c->val_off == g_dot_s))
+			tb_byte(b, TB_CONS);
+		else if (!c->arity)
+			tb_atom(w, c->val_off);
+		else if (c->flags & TB_OP_MASK) {
+			tb_byte(b, TB_OP);
+			tb_varint(b, c->arity);
+			tb_byte(b, (c->flags & TB_OP_MASK) >> 8);
+			tb_atom(w, c->val_off);
+		} else {
+			tb_byte(b, TB_FUNCTOR);
+			tb_varint(b, c->arity);
+			tb_atom(w, c->val_off);
+		}
+	} else if (is_cstring(c)) {
+		tb_byte(b, is_string(c) ? TB_STRING : TB_CSTRING);
+		tb_bytes(b, GET_STR(c), LEN_STR(c));
+	} else if (is_integer(c)) {
+		tb_byte(b, TB_INT);
+		tb_zigzag(b, c->val_num);
+	} else if (is_rational(c)) {
+		tb_byte(b, TB_RATIONAL);
+		tb_zigzag(b, c->val_num);
+		tb_zigzag(b, c->val_den);
+	} else if (is_float(c)) {
+		uint64_t v;
+		memcpy(&v, &c->val_flt, sizeof(v));
+		tb_byte(b, TB_FLOAT);
+		tb_need(b, 8);
+
+		for (int i = 0; i < 8; i++, v >>= 8)
+			b->buf[b->len++] = (uint8_t)v;
+	} else if (is_bigint(c)) {
+		char *dst = bigint_to_str(c, 16);
+		tb_byte(b, TB_BIGINT);
+		tb_bytes(b, dst, strlen(dst));
+		free(dst);
 	}
 
-	return 1;
+	w->nbr_cells++;
 }
 
-static int fn_await_0(query *q)
-{
-	while (!g_tpl_interrupt && q->m->tasks) {
-		int_t now = get_time_in_usec() / 1000;
-		query *task = q->m->tasks;
-		unsigned did_something = 0, spawn_cnt = 0;
-
-		while (!g_tpl_interrupt && task) {
-			if (task->spawned) {
-				spawn_cnt++;
-
-				if (spawn_cnt >= q->m->cpu_count)
-					break;
-			}
+// Encode straight from the term as it stands, following bindings. The
+// result is malloc'd, or NULL if the term is cyclic.
 
-			if (task->tmo_msecs) {
-				if (now <= task->tmo_msecs) {
-					task = task->next;
-					continue;
-				}
+static uint8_t *term_to_binary(query *q, cell *p1, idx_t p1_ctx, size_t *len)
+{
+	tb_writer w = {0};
+	w.b.size = 256;
+	w.b.buf = malloc(w.b.size);
+	w.b.len = TB_MAX_HEADER;
+	term_walker tw;
+	walk_init(&tw, p1, p1_ctx);
+	cell *c;
+	idx_t c_ctx;
 
-				task->tmo_msecs = 0;
-			}
+	while ((c = walk_next(q, &tw, &c_ctx)) != NULL) {
+		if (tw.cyclic)
+			break;
 
-			if (!task->yielded || !q->st.curr_cell) {
-				query *save = task;
-				task = pop_task(q->m, task);
-				destroy_query(save);
-				continue;
-			}
+		tb_cell(&w, c, c_ctx);
+	}
 
-			run_query(task);
+	int cyclic = tw.cyclic;
+	walk_done(&tw);
 
-			if (!task->tmo_msecs && task->yielded) {
-				did_something = 1;
-				break;
-			}
-		}
+	if (w.vars)
+		sl_destroy(w.vars);
 
-		if (!did_something)
-			msleep(1);
-		else
-			break;
+	if (cyclic) {
+		free(w.b.buf);
+		return NULL;
 	}
 
-	if (!q->m->tasks)
-		return 0;
-
-	make_choice(q);
-	return 1;
+	size_t body_len = w.b.len - TB_MAX_HEADER;
+	tb_buf h = {0};
+	tb_byte(&h, TB_MAGIC);
+	tb_byte(&h, TB_VERSION);
+	tb_varint(&h, w.nbr_cells);
+	tb_varint(&h, w.nbr_vars);
+	tb_varint(&h, body_len);
+	uint8_t *dst = w.b.buf + TB_MAX_HEADER - h.len;
+	memcpy(dst, h.buf, h.len);
+	free(h.buf);
+	memmove(w.b.buf, dst, h.len + body_len);
+	*len = h.len + body_len;
+	return w.b.buf;
 }
 
-static int fn_yield_0(query *q)
-{
-	if (q->retry)
-		return 1;
-
-	return do_yield_0(q, 0);
-}
+typedef struct {
+	const uint8_t *src, *end;
+	idx_t *atoms;
+	unsigned nbr_atoms, atoms_size;
+} tb_reader;
 
-static int fn_spawn_1(query *q)
+static int tb_get_varint(tb_reader *r, uint_t *v)
 {
-	GET_FIRST_ARG(p1,callable);
-	cell *tmp = deep_clone_to_tmp(q, p1, p1_ctx);
-	query *task = create_task(q, tmp);
-	task->yielded = 1;
-	task->spawned = 1;
-	push_task(q->m, task);
-	return 1;
-}
+	unsigned shift = 0;
+	*v = 0;
 
-static int fn_spawn_n(query *q)
-{
-	GET_FIRST_ARG(p1,callable);
-	clone_to_tmp(q, p1);
-	unsigned arity = p1->arity;
-	unsigned args = 1;
+	while (r->src < r->end) {
+		uint8_t ch = *r->src++;
 
-	while (args++ < q->st.curr_cell->arity) {
-		cell *p2 = get_next_raw_arg(q);
-		clone2_to_tmp(q, p2);
-		arity++;
-	}
+		if (shift >= sizeof(uint_t)*8)
+			return 0;
 
-	cell *tmp2 = get_tmp_heap(q, 0);
-	tmp2->nbr_cells = tmp_heap_used(q);
-	tmp2->arity = arity;
+		*v |= (uint_t)(ch & 0x7F) << shift;
 
-	if ((tmp2->fn = get_builtin(q->m, GET_STR(tmp2), arity)) != NULL)
-		tmp2->flags |= FLAG_BUILTIN;
-	else {
-		tmp2->match = find_matching_rule(q->m, tmp2);
-		tmp2->flags &= ~FLAG_BUILTIN;
-	}
+		if (!(ch & 0x80))
+			return 1;
 
-	cell *tmp = clone_to_heap(q, 0, tmp2, 0);
-	query *task = create_task(q, tmp);
-	task->yielded = task->spawned = 1;
-	push_task(q->m, task);
-	return 1;
-}
+		shift += 7;
+	}
 
-static int fn_fork_0(query *q)
-{
-	cell *curr_cell = q->st.curr_cell + q->st.curr_cell->nbr_cells;
-	query *task = create_task(q, curr_cell);
-	task->yielded = 1;
-	push_task(q->m, task);
 	return 0;
 }
 
-static int fn_send_1(query *q)
+static int tb_get_zigzag(tb_reader *r, int_t *v)
 {
-	GET_FIRST_ARG(p1,nonvar);
-	query *dstq = q->parent ? q->parent : q;
-	cell *c = deep_clone_to_tmp(q, p1, p1_ctx);
+	uint_t u;
 
-	for (idx_t i = 0; i < c->nbr_cells; i++) {
-		cell *c2 = c + i;
-
-		if (is_blob(c2)) {
-			size_t nbytes = c2->len_str;
-			char *tmp = malloc(nbytes + 1);
-			memcpy(tmp, c2->val_str, nbytes+1);
-			c2->val_str = tmp;
-		}
-	}
+	if (!tb_get_varint(r, &u))
+		return 0;
 
-	alloc_queue(dstq, c);
-	q->yielded = 1;
+	*v = (int_t)(u >> 1) ^ -(int_t)(u & 1);
 	return 1;
 }
 
-static int fn_recv_1(query *q)
-{
-	GET_FIRST_ARG(p1,variable);
-	cell *c = pop_queue(q);
-	return unify(q, p1, p1_ctx, c, q->st.curr_frame);
-}
-
-static int fn_log10_1(query *q)
+static int tb_get_bytes(tb_reader *r, const char **s, size_t *n)
 {
-	GET_FIRST_ARG(p1_tmp,any);
-	cell p1 = calc(q, p1_tmp);
+	uint_t v;
 
-	if (is_integer(&p1)) {
-		q->accum.val_flt = log10(p1.val_num);
-		q->accum.val_type = TYPE_FLOAT;
-	} else if (is_float(&p1)) {
-		q->accum.val_flt = log10(p1.val_flt);
-		q->accum.val_type = TYPE_FLOAT;
-	} else {
-		throw_error(q, &p1, "type_error", "number");
+	if (!tb_get_varint(r, &v) || (v > (uint_t)(r->end - r->src)))
 		return 0;
-	}
 
+	*s = (const char*)r->src;
+	*n = v;
+	r->src += v;
 	return 1;
 }
 
-static int fn_srandom_1(query *q)
+static int tb_get_atom(tb_reader *r, idx_t *off)
 {
-	GET_FIRST_ARG(p1,integer);
-	srandom(p1->val_num);
-	return 1;
-}
+	if (r->src == r->end)
+		return 0;
 
-static int fn_random_1(query *q)
-{
-	GET_FIRST_ARG(p1,integer_or_var);
+	uint8_t tag = *r->src++;
 
-	if (is_variable(p1)) {
-		cell tmp;
-		make_float(&tmp, ((double)random())/UINT32_MAX);
-		set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	if (tag == TB_ATOM_REF) {
+		uint_t v;
+
+		if (!tb_get_varint(r, &v) || (v >= r->nbr_atoms))
+			return 0;
+
+		*off = r->atoms[v];
 		return 1;
 	}
 
-	if (p1->val_num < 1) {
-		throw_error(q, p1, "domain_error", "positive_integer");
+	const char *s;
+	size_t n;
+
+	if ((tag != TB_ATOM) || !tb_get_bytes(r, &s, &n) || memchr(s, 0, n))
 		return 0;
+
+	char *tmpbuf = malloc(n+1);
+	memcpy(tmpbuf, s, n);
+	tmpbuf[n] = '\0';
+	*off = find_in_pool(tmpbuf);
+	free(tmpbuf);
+
+	if (r->nbr_atoms == r->atoms_size) {
+		r->atoms_size = r->atoms_size ? r->atoms_size * 2 : 64;
+		r->atoms = realloc(r->atoms, sizeof(idx_t)*r->atoms_size);
 	}
 
-	q->accum.val_type = TYPE_INTEGER;
-	q->accum.val_num = llabs((long long)(random()%p1->val_num));
+	r->atoms[r->nbr_atoms++] = *off;
 	return 1;
 }
 
-static int fn_rand_0(query *q)
+static int tb_get_cell(tb_reader *r, cell *c, unsigned var_nbr, unsigned nbr_vars)
 {
-	q->accum.val_type = TYPE_INTEGER;
-	q->accum.val_num = random()%RAND_MAX;
-	return 1;
-}
+	if (r->src == r->end)
+		return 0;
 
-static int fn_rand_1(query *q)
-{
-	GET_FIRST_ARG(p1,variable);
-	cell tmp;
-	make_int(&tmp, random()%RAND_MAX);
-	set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
-	return 1;
-}
+	const char *s;
+	size_t n;
+	uint_t v;
+	idx_t off;
 
-static int do_consult(query *q, cell *p1, idx_t p1_ctx)
-{
-	if (is_atom(p1)) {
-		const char *src = GET_STR(p1);
-		deconsult(src);
+	uint8_t tag = *r->src;
+	c->nbr_cells = 1;
 
-		if (!module_load_file(q->m, src)) {
-			throw_error(q, p1, "existence_error", "cannot_open_file");
+	if ((tag == TB_ATOM) || (tag == TB_ATOM_REF)) {
+		if (!tb_get_atom(r, &off))
 			return 0;
-		}
 
+		make_literal(c, off);
 		return 1;
 	}
 
-	if (strcmp(GET_STR(p1), ":")) {
-		throw_error(q, p1, "type_error", "not_a_file_spec");
-		return 0;
-	}
+	switch (r->src++, tag) {
+	case TB_VAR:
+		if (!tb_get_varint(r, &v) || (v >= nbr_vars))
+			return 0;
 
-	cell *mod = deref(q, p1+1, p1_ctx);
-	cell *file = deref(q, p1+2, p1_ctx);
+		c->val_type = TYPE_VARIABLE;
+		c->var_nbr = var_nbr + v;
+		c->val_off = g_anon_s;
+		return 1;
 
-	if (!is_atom(mod) || !is_atom(file)) {
-		throw_error(q, p1, "type_error", "not_a_file_spec");
-		return 0;
-	}
+	case TB_NIL:
+		make_literal(c, g_nil_s);
+		return 1;
 
-	module *tmp_m = create_module(GET_STR(mod));
-	const char *src = GET_STR(file);
-	deconsult(src);
-	tmp_m->make_public = 1;
+	case TB_CONS:
+		make_literal(c, g_dot_s);
+		c->arity = 2;
+		return 1;
 
-	if (!module_load_file(tmp_m, src)) {
-		throw_error(q, p1, "existence_error", "cannot_open_file");
-		destroy_module(tmp_m);
-		return 0;
-	}
+	case TB_FUNCTOR:
+	case TB_OP: {
+		uint16_t flags = 0;
 
-	return 1;
-}
+		if (!tb_get_varint(r, &v) || !v || (v > MAX_ARITY))
+			return 0;
 
-static int fn_consult_1(query *q)
-{
-	GET_FIRST_ARG(p1,atom_or_structure);
+		if (tag == TB_OP) {
+			if (r->src == r->end)
+				return 0;
 
-	if (!is_list(p1)) {
-		if (!do_consult(q, p1, p1_ctx))
+			flags = (*r->src++ << 8) & TB_OP_MASK;
+		}
+
+		if (!tb_get_atom(r, &off))
 			return 0;
 
+		make_literal(c, off);
+		c->arity = v;
+		c->flags = flags;
 		return 1;
 	}
 
-	while (is_list(p1)) {
-		cell *h = LIST_HEAD(p1);
-		cell *c = deref(q, h, p1_ctx);
-
-		if (!do_consult(q, c, q->latest_ctx))
+	case TB_CSTRING:
+	case TB_STRING:
+		if (!tb_get_bytes(r, &s, &n))
 			return 0;
 
-		p1 = LIST_TAIL(p1);
-		p1 = deref(q, p1, p1_ctx);
-		p1_ctx = q->latest_ctx;
-	}
+		if ((tag == TB_CSTRING) && (n < MAX_SMALL_STRING) && !memchr(s, 0, n)) {
+			make_smalln(c, s, n);
+			return 1;
+		}
 
-	return 1;
-}
+		c->val_type = TYPE_CSTRING;
+		c->flags = tag == TB_STRING ? FLAG_BLOB|FLAG_STRING : FLAG_BLOB;
+		c->arity = 0;
+		c->val_str = malloc(n+1);
+		memcpy(c->val_str, s, n);
+		c->val_str[n] = '\0';
+		c->len_str = n;
+		return 1;
 
-static int format_integer(char *dst, int_t v, int grouping, int sep, int decimals)
-{
-	char tmpbuf1[256], tmpbuf2[256];
-	sprint_int(tmpbuf1, sizeof(tmpbuf1), v, 10);
-	const char *src = tmpbuf1 + (strlen(tmpbuf1) - 1);
-	char *dst2 = tmpbuf2;
-	int i = 1, j = 1;
+	case TB_INT:
+		if (!tb_get_zigzag(r, &c->val_num))
+			return 0;
 
-	while (src >= tmpbuf1) {
-		*dst2++ = *src--;
+		make_int(c, c->val_num);
+		return 1;
 
-		if (grouping && !decimals && !(i++%grouping) && *src)
-			*dst2++ = sep;
+	case TB_RATIONAL: {
+		int_t num, den;
 
-		if (decimals && (j++ == decimals)) {
-			*dst2++ = '.';
-			decimals = 0;
-			i = 1;
-		}
+		if (!tb_get_zigzag(r, &num) || !tb_get_zigzag(r, &den) || (den <= 0))
+			return 0;
+
+		make_int(c, num);
+		c->val_den = den;
+		return 1;
 	}
 
-	*dst2 = '\0';
-	src = tmpbuf2 + (strlen(tmpbuf2) - 1);
-	dst2 = dst;
+	case TB_FLOAT: {
+		if ((r->end - r->src) < 8)
+			return 0;
 
-	while (src >= tmpbuf2)
-		*dst2++ = *src--;
+		uint64_t u = 0;
 
-	*dst2 = '\0';
-	return dst2 - dst;
-}
+		for (int i = 7; i >= 0; i--)
+			u = (u << 8) | r->src[i];
 
-static int do_format(query *q, cell *str, idx_t str_ctx, cell* p1, idx_t p1_ctx, cell* p2, idx_t p2_ctx)
-{
-        (void) p1_ctx;
-	char *srcbuf = GET_STR(p1);
-	const char *src = srcbuf;
-	size_t bufsiz;
-	char *tmpbuf = malloc(bufsiz=strlen(src)+100);
-	char *dst = tmpbuf;
-	cell *c = NULL;
-	size_t nbytes = bufsiz;
+		r->src += 8;
+		double d;
+		memcpy(&d, &u, sizeof(d));
+		make_float(c, d);
+		return 1;
+	}
 
-	while (*src) {
-		int ch = get_char_utf8(&src);
-		int argval = 0, noargval = 1;
+	case TB_BIGINT: {
+		if (!tb_get_bytes(r, &s, &n) || !n || memchr(s, 0, n))
+			return 0;
 
-		if (ch != '~') {
-			dst += put_char_bare_utf8(dst, ch);
-			continue;
-		}
+		char *tmpbuf = malloc(n+1);
+		memcpy(tmpbuf, s, n);
+		tmpbuf[n] = '\0';
+		int neg = *tmpbuf == '-';
+		make_bigint_str(c, tmpbuf+neg, 16, neg);
+		c->nbr_cells = 1;
+		c->arity = c->flags = 0;
+		free(tmpbuf);
+		return 1;
+	}
+	}
 
-		ch = get_char_utf8(&src);
+	return 0;
+}
 
-		while (isdigit(ch)) {
-			noargval = 0;
-			argval *= 10;
-			argval += ch - '0';
-			ch = get_char_utf8(&src);
-			continue;
-		}
+// Decode straight into the heap, with fresh variables in the current
+// frame. Returns NULL if the data is not a well-formed term.
 
-		if (ch == 'N') {
-			if ((dst != tmpbuf) && (dst[-1] == '\n'))
-				continue;
+static cell *binary_to_term(query *q, const uint8_t *src, size_t len)
+{
+	tb_reader r = {.src = src, .end = src + len};
+	uint_t nbr_cells, nbr_vars, body_len;
 
-			*dst++ = '\n';
-			continue;
-		}
+	if ((len < 2) || (src[0] != TB_MAGIC) || (src[1] != TB_VERSION))
+		return NULL;
 
-		if (ch == 'n') {
-			*dst++ = '\n';
-			continue;
-		}
+	r.src += 2;
 
-		if (ch == '~') {
-			*dst++ = '~';
-			continue;
-		}
+	if (!tb_get_varint(&r, &nbr_cells) || !tb_get_varint(&r, &nbr_vars)
+		|| !tb_get_varint(&r, &body_len))
+		return NULL;
 
-		if (ch == 't')
-			continue;
+	if ((body_len != (uint_t)(r.end - r.src)) || !nbr_cells
+		|| (nbr_cells > body_len) || (nbr_vars > nbr_cells))
+		return NULL;
 
-		if (ch == '|') {
-			while ((dst - tmpbuf) < argval)
-				*dst++ = ' ';
+	frame *g = GET_FRAME(q->st.curr_frame);
+	unsigned var_nbr = g->nbr_vars;
 
-			continue;
-		}
+	if (nbr_vars) {
+		create_vars(q, nbr_vars);
 
-		if (!p2 || !is_list(p2))
-			break;
+		if (g->nbr_vars != (var_nbr + nbr_vars))
+			return NULL;
+	}
 
-		cell *head = LIST_HEAD(p2);
-		c = deref(q, head, p2_ctx);
-		idx_t c_ctx = q->latest_ctx;
-		p2 = LIST_TAIL(p2);
+	cell *cells = alloc_heap(q, nbr_cells);
+	struct { idx_t start; unsigned nbr; } local[64], *stack = local;
+	unsigned sp = 0, size = 64;
+	idx_t i = 0;
 
-		if (ch == 'i')
-			continue;
+	while (i < nbr_cells) {
+		cell *c = cells + i++;
 
-		int canonical = 0;
-		size_t len;
+		if (!tb_get_cell(&r, c, var_nbr, nbr_vars))
+			break;
 
-		if (ch == 'k')
-			canonical = 1;
+		if (c->arity) {
+			if (sp == size) {
+				size *= 2;
 
-		if ((ch == 'a') && !is_atom(c)) {
-			free(tmpbuf);
-			throw_error(q, c, "type_error", "atom");
-			return 0;
-		}
+				if (stack == local) {
+					stack = malloc(sizeof(local[0])*size);
+					memcpy(stack, local, sizeof(local));
+				} else
+					stack = realloc(stack, sizeof(local[0])*size);
+			}
 
-		if (((ch == 'd') || (ch == 'D')) && !is_integer(c)) {
-			free(tmpbuf);
-			throw_error(q, c, "type_error", "integer");
-			return 0;
+			stack[sp].start = i - 1;
+			stack[sp++].nbr = c->arity;
+			continue;
 		}
 
-		if (ch == 'c') {
-			if (!is_integer(c)) {
-				free(tmpbuf);
-				throw_error(q, c, "type_error", "integer");
-				return 0;
-			}
+		while (sp && !--stack[sp-1].nbr) {
+			sp--;
+			cells[stack[sp].start].nbr_cells = i - stack[sp].start;
+		}
 
-			len = 10;
+		if (!sp)
+			break;
+	}
 
-			while (nbytes < len) {
-				size_t save = dst - tmpbuf;
-				tmpbuf = realloc(tmpbuf, bufsiz*=2);
-				dst = tmpbuf + save;
-				nbytes = bufsiz - save;
-			}
+	if (stack != local)
+		free(stack);
 
-			len = put_char_utf8(dst, (int)c->val_num);
-		} else if ((ch == 'e') || (ch == 'E')) {
-			if (!is_float(c)) {
-				free(tmpbuf);
-				throw_error(q, c, "type_error", "float");
-				return 0;
-			}
+	free(r.atoms);
 
-			len = 40;
+	if (sp || (i != nbr_cells) || (r.src != r.end))
+		return NULL;
 
-			while (nbytes < len) {
-				size_t save = dst - tmpbuf;
-				tmpbuf = realloc(tmpbuf, bufsiz*=2);
-				dst = tmpbuf + save;
-				nbytes = bufsiz - save;
-			}
+	return cells;
+}
 
-			if (ch == 'e')
-				len = sprintf(dst, "%e", c->val_flt);
-			else
-				len = sprintf(dst, "%E", c->val_flt);
-		} else if (ch == 'f') {
-			if (!is_float(c)) {
-				free(tmpbuf);
-				throw_error(q, c, "type_error", "float");
-				return 0;
-			}
+static int fn_term_to_binary_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,variable);
+	size_t len;
+	uint8_t *dst = term_to_binary(q, p1, p1_ctx, &len);
 
-			len = 40;
+	if (!dst) {
+		throw_error(q, p1, "domain_error", "acyclic_term");
+		return 0;
+	}
 
-			while (nbytes < len) {
-				size_t save = dst - tmpbuf;
-				tmpbuf = realloc(tmpbuf, bufsiz*=2);
-				dst = tmpbuf + save;
-				nbytes = bufsiz - save;
-			}
+	cell tmp = make_string(q, (char*)dst, len);
+	free(dst);
+	set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	return 1;
+}
 
-			len = sprintf(dst, "%.*f", argval, c->val_flt);
-		} else if (ch == 'I') {
-			if (!is_integer(c)) {
-				free(tmpbuf);
-				throw_error(q, c, "type_error", "integer");
-				return 0;
-			}
+static int unify_binary_term(query *q, cell *p1, cell *p2, idx_t p2_ctx, const uint8_t *src, size_t len)
+{
+	cell *c = binary_to_term(q, src, len);
 
-			len = 40;
+	if (!c) {
+		throw_error(q, p1, "domain_error", "binary_term");
+		return 0;
+	}
 
-			while (nbytes < len) {
-				size_t save = dst - tmpbuf;
-				tmpbuf = realloc(tmpbuf, bufsiz*=2);
-				dst = tmpbuf + save;
-				nbytes = bufsiz - save;
-			}
+	// An atomic result is given to the variable, as make_string() is...
 
-			len = format_integer(dst, c->val_num, noargval?3:argval, '_', 0);
-		} else if (ch == 'd') {
-			if (!is_integer(c)) {
-				free(tmpbuf);
-				throw_error(q, c, "type_error", "integer");
-				return 0;
-			}
+	if (c->nbr_cells == 1) {
+		cell tmp = *c;
+		c->val_type = TYPE_EMPTY;
+		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	}
 
-			len = 40;
+	return unify(q, p2, p2_ctx, c, q->st.curr_frame);
+}
 
-			while (nbytes < len) {
-				size_t save = dst - tmpbuf;
-				tmpbuf = realloc(tmpbuf, bufsiz*=2);
-				dst = tmpbuf + save;
-				nbytes = bufsiz - save;
-			}
+static int fn_binary_to_term_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,any);
+	return unify_binary_term(q, p1, p2, p2_ctx, (const uint8_t*)GET_STR(p1), LEN_STR(p1));
+}
 
-			len = format_integer(dst, c->val_num, 0, ',', noargval?2:argval);
-		} else if (ch == 'D') {
-			if (!is_integer(c)) {
-				free(tmpbuf);
-				throw_error(q, c, "type_error", "integer");
-				return 0;
-			}
+static int fn_bwrite_term_2(query *q)
+{
+	GET_FIRST_ARG(pstr,stream);
+	GET_NEXT_ARG(p1,any);
+	int n = get_stream(q, pstr);
+	stream *str = &g_streams[n];
+	size_t len;
+	uint8_t *dst = term_to_binary(q, p1, p1_ctx, &len);
 
-			len = 40;
+	if (!dst) {
+		throw_error(q, p1, "domain_error", "acyclic_term");
+		return 0;
+	}
 
-			while (nbytes < len) {
-				size_t save = dst - tmpbuf;
-				tmpbuf = realloc(tmpbuf, bufsiz*=2);
-				dst = tmpbuf + save;
-				nbytes = bufsiz - save;
-			}
+	const uint8_t *src = dst;
 
-			len = format_integer(dst, c->val_num, 3, ',', noargval?2:argval);
-		} else {
-			int saveq = q->quoted;
+	while (len) {
+		size_t nbytes = net_write(src, len, str);
 
-			if (ch == 'q')
-				q->quoted = 1;
+		if (!nbytes && (feof(str->fp) || ferror(str->fp))) {
+			free(dst);
+			return 0;
+		}
 
-			if (is_string(c) && !q->quoted)
-				q->quoted = -1;
+		clearerr(str->fp);
+		len -= nbytes;
+		src += nbytes;
+	}
 
-			if (canonical)
-				len = write_canonical_to_buf(q, NULL, 0, c, c_ctx, 1, 0);
-			else
-				len = write_term_to_buf(q, NULL, 0, c, c_ctx, 1, 0, 0);
+	free(dst);
+	return 1;
+}
 
-			while (nbytes < len) {
-				size_t save = dst - tmpbuf;
-				tmpbuf = realloc(tmpbuf, bufsiz*=2);
-				dst = tmpbuf + save;
-				nbytes = bufsiz - save;
-			}
+static int tb_read(stream *str, tb_buf *b, size_t len)
+{
+	tb_need(b, len);
 
-			if (canonical)
-				len = write_canonical_to_buf(q, dst, nbytes, c, c_ctx, 1, 0);
-			else
-				len = write_term_to_buf(q, dst, nbytes, c, c_ctx, 1, 0, 0);
+	while (len) {
+		size_t nbytes = net_read(b->buf+b->len, len, str);
 
-			q->quoted = saveq;
-		}
+		if (!nbytes)
+			return 0;
 
-		dst += len;
-		nbytes -= len;
+		b->len += nbytes;
+		len -= nbytes;
 	}
 
-	*dst = '\0';
-	size_t len = dst - tmpbuf;
+	return 1;
+}
 
-	if (str == NULL) {
-		int n = get_named_stream(q, "user_output");
-		stream *str = &g_streams[n];
-		net_write(tmpbuf, len, str);
-	} else if (is_structure(str) && ((strcmp(GET_STR(str),"atom") && strcmp(GET_STR(str),"chars") && strcmp(GET_STR(str),"string")) || (str->arity > 1) || !is_variable(str+1))) {
-		free(tmpbuf);
-		throw_error(q, c, "type_error", "structure");
-		return 0;
-	} else if (is_structure(str)) {
-		cell *c = deref(q, str+1, str_ctx);
-		cell tmp = make_cstring(q, tmpbuf);
-		set_var(q, c, q->latest_ctx, &tmp, q->st.curr_frame);
-	} else if (is_stream(str)) {
-		int n = get_stream(q, str);
-		stream *str = &g_streams[n];
-		const char *src = tmpbuf;
+static int fn_bread_term_2(query *q)
+{
+	GET_FIRST_ARG(pstr,stream);
+	GET_NEXT_ARG(p1,any);
+	int n = get_stream(q, pstr);
+	stream *str = &g_streams[n];
+	tb_buf b = {0};
 
-		while (len) {
-			size_t nbytes = net_write(src, len, str);
+	if (!tb_read(str, &b, 1)) {
+		free(b.buf);
+		cell tmp;
+		make_literal(&tmp, g_eof_s);
+		return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	}
 
-			if (!nbytes) {
-				if (feof(str->fp) || ferror(str->fp)) {
-					free(tmpbuf);
-					fprintf(stderr, "Error: end of file on write\n");
-					return 0;
-				}
-			}
+	// The header's three varints, the last being the body length...
 
-			clearerr(str->fp);
-			len -= nbytes;
-			src += nbytes;
+	unsigned cnt = 0;
+	int ok = (b.buf[0] == TB_MAGIC) && tb_read(str, &b, 1) && (b.buf[1] == TB_VERSION);
+
+	while (ok && (cnt < 3)) {
+		if (!tb_read(str, &b, 1)) {
+			ok = 0;
+			break;
 		}
-	} else {
-		free(tmpbuf);
-		throw_error(q, p1, "type_error", "stream");
-		return 0;
+
+		if (!(b.buf[b.len-1] & 0x80))
+			cnt++;
 	}
 
-	free(tmpbuf);
-	return 1;
-}
+	if (ok) {
+		tb_reader r = {.src = b.buf + 2, .end = b.buf + b.len};
+		uint_t v;
+		tb_get_varint(&r, &v);
+		tb_get_varint(&r, &v);
+		ok = tb_get_varint(&r, &v) && (v <= (uint_t)(SIZE_MAX - b.len))
+			&& tb_read(str, &b, v);
+	}
 
-static int fn_format_2(query *q)
-{
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,list_or_nil);
-	return do_format(q, NULL, 0, p1, p1_ctx, !is_nil(p2)?p2:NULL, p2_ctx);
-}
+	if (!ok) {
+		free(b.buf);
+		throw_error(q, pstr, "domain_error", "binary_term");
+		return 0;
+	}
 
-static int fn_format_3(query *q)
-{
-	GET_FIRST_ARG(pstr,stream_or_structure);
-	GET_NEXT_ARG(p1,atom);
-	GET_NEXT_ARG(p2,list_or_nil);
-	return do_format(q, pstr, pstr_ctx, p1, p1_ctx, !is_nil(p2)?p2:NULL, p2_ctx);
+	ok = unify_binary_term(q, pstr, p1, p1_ctx, b.buf, b.len);
+	free(b.buf);
+	return ok;
 }
 
-#if USE_OPENSSL
-static int fn_sha1_2(query *q)
+static int fn_read_term_from_chars_3(query *q)
 {
 	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,atom_or_var);
-	const char *str = GET_STR(p1);
-	unsigned char digest[SHA_DIGEST_LENGTH];
-	SHA1((unsigned char*)str, LEN_STR(p1), digest);
-	char tmpbuf[512];
-	char *dst = tmpbuf;
-	size_t buflen = sizeof(tmpbuf);
+	GET_NEXT_ARG(p2,any);
+	GET_NEXT_ARG(p3,any);
+	int n = get_named_stream(q, "user_input");
+	stream *str = &g_streams[n];
+	const char *p = GET_STR(p1);
+	char *src = malloc(strlen(p)+10);
+	sprintf(src, "%s", p);
 
-	for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-		size_t len = snprintf(dst, buflen, "%02X", digest[i]);
-		dst += len;
-		buflen -= len;
-	}
+	if (src[strlen(src)-1] != '.')
+		strcat(src, ".");
 
-	cell tmp = make_string(q, tmpbuf, strlen(tmpbuf));
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	int ok = do_read_term(q, str, p2, p2_ctx, p3, p3_ctx, src);
+	free(src);
+	return ok;
 }
 
-static int fn_sha256_2(query *q)
+static int fn_write_term_to_chars_3(query *q)
 {
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,atom_or_var);
-	const char *str = GET_STR(p1);
-	unsigned char digest[SHA256_DIGEST_LENGTH];
-	SHA256((unsigned char*)str, LEN_STR(p1), digest);
-	char tmpbuf[512];
-	char *dst = tmpbuf;
-	size_t buflen = sizeof(tmpbuf);
+	GET_FIRST_ARG(p2,any);
+	GET_NEXT_ARG(p1,any);
+	GET_NEXT_ARG(p3,any);
 
-	for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-		size_t len = snprintf(dst, buflen, "%02X", digest[i]);
-		dst += len;
-		buflen -= len;
+	if (is_number(p1) && !is_bigint(p1)) {
+		char tmpbuf[256], *dst = tmpbuf;
+		write_term_to_buf(q, dst, sizeof(tmpbuf), p1, p1_ctx, 1, 0, 0);
+		cell tmp = make_cstring(q, dst);
+		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 	}
 
-	cell tmp = make_string(q, tmpbuf, strlen(tmpbuf));
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	char *dst = write_term_to_strbuf(q, p1, p1_ctx, 1);
+	idx_t offset;
+
+	if (is_in_pool(dst, &offset)) {
+		cell tmp;
+		make_literal(&tmp, offset);
+		free(dst);
+		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	} else {
+		cell tmp = make_cstring(q, dst);
+		free(dst);
+		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	}
 }
 
-static int fn_sha512_2(query *q)
+static int fn_is_list_1(query *q)
 {
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,atom_or_var);
-	const char *str = GET_STR(p1);
-	unsigned char digest[SHA512_DIGEST_LENGTH];
-	SHA512((unsigned char*)str, LEN_STR(p1), digest);
-	char tmpbuf[512];
-	char *dst = tmpbuf;
-	size_t buflen = sizeof(tmpbuf);
+	GET_FIRST_ARG(p1,any);
 
-	for (int i = 0; i < SHA512_DIGEST_LENGTH; i++) {
-		size_t len = snprintf(dst, buflen, "%02X", digest[i]);
-		dst += len;
-		buflen -= len;
-	}
+	if (!is_list(p1) && !is_nil(p1))
+		return 0;
 
-	cell tmp = make_string(q, tmpbuf, strlen(tmpbuf));
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-}
-#endif
+	while (is_list(p1)) {
+		LIST_HEAD(p1);
+		p1 = LIST_TAIL(p1);
+		p1 = deref(q, p1, p1_ctx);
+		p1_ctx = q->latest_ctx;
+	}
 
-static int do_b64encode_2(query *q)
-{
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,variable);
-	const char *str = GET_STR(p1);
-	size_t len = LEN_STR(p1);
-	char *dstbuf = malloc((len*3)+1);
-	b64_encode(str, len, &dstbuf, 0, 0);
-	cell tmp = make_string(q, dstbuf, strlen(dstbuf));
-	free(dstbuf);
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	return is_nil(p1);
 }
 
-static int do_b64decode_2(query *q)
+static int fn_is_stream_1(query *q)
 {
-	GET_FIRST_ARG(p1,variable);
-	GET_NEXT_ARG(p2,atom);
-	const char *str = GET_STR(p2);
-	size_t len = LEN_STR(p1);
-	char *dstbuf = malloc(len+1);
-	b64_decode(str, len, &dstbuf);
-	cell tmp = make_string(q, dstbuf, strlen(dstbuf));
-	if (is_string(p1)) tmp.flags |= FLAG_STRING;
-	free(dstbuf);
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	GET_FIRST_ARG(p1,any);
+	return is_stream(p1);
 }
 
-static int fn_base64_2(query *q)
+static void push_task(module *m, query *task)
 {
-	GET_FIRST_ARG(p1,atom_or_var);
-	GET_NEXT_ARG(p2,atom_or_var);
+	task->next = m->tasks;
 
-	if ((is_atom(p1) || is_list(p1)) && is_variable(p2))
-		return do_b64encode_2(q);
-	else if (is_variable(p1) && (is_atom(p2) || is_string(p2)))
-		return do_b64decode_2(q);
+	if (m->tasks)
+		m->tasks->prev = task;
 
-	throw_error(q, p1, "instantiation_error", "atom");
-	return 0;
+	m->tasks = task;
 }
 
-static char *url_encode(const char *src, int len, char *dstbuf)
+static query *pop_task(module *m, query *task)
 {
-	char *dst = dstbuf;
+	if (task->prev)
+		task->prev->next = task->next;
 
-	// As per RFC3986 (2005)
+	if (task->next)
+		task->next->prev = task->prev;
 
-	while (len-- > 0) {
-		if (!isalnum(*src) && (*src != '-') && (*src != '_') && (*src != '.') && (*src != '~'))
-			dst += sprintf(dst, "%%%02X", *src++);
-		else
-			*dst++ = *src++;
-	}
+	if (task == m->tasks)
+		m->tasks = task->next;
 
-	*dst = '\0';
-	return dstbuf;
+	return task->next;
 }
 
-char *url_decode(const char *src, char *dstbuf)
+static int fn_wait_0(query *q)
 {
-	char *dst = dstbuf;
+	while (!g_tpl_interrupt && q->m->tasks) {
+		int_t now = get_time_in_usec() / 1000;
+		query *task = q->m->tasks;
+		unsigned did_something = 0, spawn_cnt = 0;
 
-	while (*src) {
-		if (*src == '%') {
-			src++;
-			unsigned ch = 0;
-			sscanf(src, "%02X", &ch);
-			src += 2;
-			*dst++ = (unsigned char)ch;
-		} else if (*src == '+') {
-			*dst++ = ' ';
-			src++;
-		} else
-			*dst++ = *src++;
-	}
+		while (!g_tpl_interrupt && task) {
+			if (task->spawned) {
+				spawn_cnt++;
 
-	*dst = '\0';
-	return dstbuf;
-}
+				if (spawn_cnt >= q->m->cpu_count)
+					break;
+			}
 
-static int do_urlencode_2(query *q)
-{
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,variable);
-	const char *str = GET_STR(p1);
-	size_t len = LEN_STR(p1);
-	char *dstbuf = malloc((len*3)+1);
-	url_encode(str, len, dstbuf);
-	cell tmp = make_string(q, dstbuf, strlen(dstbuf));
-	free(dstbuf);
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-}
+			if (task->tmo_msecs) {
+				if (now <= task->tmo_msecs) {
+					task = task->next;
+					continue;
+				}
 
-static int do_urldecode_2(query *q)
-{
-	GET_FIRST_ARG(p1,variable);
-	GET_NEXT_ARG(p2,atom);
-	const char *str = GET_STR(p1);
-	size_t len = LEN_STR(p1);
-	char *dstbuf = malloc(len+1);
-	url_decode(str, dstbuf);
-	cell tmp = make_string(q, dstbuf, strlen(dstbuf));
-	free(dstbuf);
-	return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
-}
+				task->tmo_msecs = 0;
+			}
 
-static int fn_urlenc_2(query *q)
-{
-	GET_FIRST_ARG(p1,atom_or_var);
-	GET_NEXT_ARG(p2,atom_or_var);
+			if (!task->yielded || !task->st.curr_cell) {
+				query *save = task;
+				task = pop_task(q->m, task);
+				destroy_query(save);
+				continue;
+			}
 
-	if ((is_atom(p1) || is_string(p1)) && is_variable(p2))
-		return do_urlencode_2(q);
-	else if (is_variable(p1) && (is_atom(p2) || is_string(p2)))
-		return do_urldecode_2(q);
+			run_query(task);
+			task = task->next;
+			did_something = 1;
+		}
 
-	throw_error(q, p1, "instantiation_error", "atom");
-	return 0;
+		if (!did_something)
+			msleep(1);
+	}
+
+	return 1;
 }
 
-static int fn_string_lower_2(query *q)
+static int fn_await_0(query *q)
 {
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,atom_or_var);
-	size_t len = LEN_STR(p1);
-	char *tmps = malloc(len+1);
-	memcpy(tmps, GET_STR(p1), len);
-	tmps[len] = '\0';
-	char *s = tmps;
+	while (!g_tpl_interrupt && q->m->tasks) {
+		int_t now = get_time_in_usec() / 1000;
+		query *task = q->m->tasks;
+		unsigned did_something = 0, spawn_cnt = 0;
 
-	while (*s) {
-		*s = tolower(*s);
-		s++;
-	}
+		while (!g_tpl_interrupt && task) {
+			if (task->spawned) {
+				spawn_cnt++;
 
-	cell tmp = make_string(q, tmps, len);
-	free(tmps);
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-}
+				if (spawn_cnt >= q->m->cpu_count)
+					break;
+			}
 
-static int fn_string_upper_2(query *q)
-{
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,atom_or_var);
-	size_t len = LEN_STR(p1);
-	char *tmps = malloc(len+1);
-	memcpy(tmps, GET_STR(p1), len);
-	tmps[len] = '\0';
-	char *s = tmps;
+			if (task->tmo_msecs) {
+				if (now <= task->tmo_msecs) {
+					task = task->next;
+					continue;
+				}
 
-	while (*s) {
-		*s = toupper(*s);
-		s++;
-	}
+				task->tmo_msecs = 0;
+			}
 
-	cell tmp = make_string(q, tmps, len);
-	free(tmps);
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-}
+			if (!task->yielded || !q->st.curr_cell) {
+				query *save = task;
+				task = pop_task(q->m, task);
+				destroy_query(save);
+				continue;
+			}
 
-static int fn_exists_file_1(query *q)
-{
-	GET_FIRST_ARG(p1,atom);
-	const char *filename = GET_STR(p1);
-	struct stat st = {0};
+			run_query(task);
 
-	if (stat(filename, &st))
-		return 0;
+			if (task->preempted) {
+				task = task->next;
+				did_something = 1;
+				continue;
+			}
 
-	if ((st.st_mode & S_IFMT) != S_IFREG)
+			if (!task->tmo_msecs && task->yielded) {
+				did_something = 1;
+				break;
+			}
+		}
+
+		if (!did_something)
+			msleep(1);
+		else
+			break;
+	}
+
+	if (!q->m->tasks)
 		return 0;
 
+	make_choice(q);
 	return 1;
 }
 
-static int fn_delete_file_1(query *q)
+static int fn_yield_0(query *q)
 {
-	GET_FIRST_ARG(p1,atom);
-	const char *filename = GET_STR(p1);
-	remove(filename);
-	return 1;
-}
+	if (q->retry)
+		return 1;
 
-static int fn_rename_file_2(query *q)
-{
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,atom);
-	const char *filename1 = GET_STR(p1);
-	const char *filename2 = GET_STR(p2);
-	return !rename(filename1, filename2);
+	return do_yield_0(q, 0);
 }
 
-static int fn_time_file_2(query *q)
+static int fn_time_slice_1(query *q)
 {
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,variable);
-	const char *filename = GET_STR(p1);
-	struct stat st = {0};
+	GET_FIRST_ARG(p1,integer);
 
-	if (stat(filename, &st)) {
-		throw_error(q, p1, "existence_error", "cannot_open_file");
+	if (p1->val_num < 0) {
+		throw_error(q, p1, "domain_error", "not_less_than_zero");
 		return 0;
 	}
 
-	cell tmp;
-	make_float(&tmp, st.st_mtime);
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	q->time_slice = p1->val_num;
+	q->yield_at = q->is_task && q->time_slice ? q->tot_goals + q->time_slice : 0;
+	return 1;
 }
 
-static int fn_size_file_2(query *q)
+static int fn_spawn_1(query *q)
 {
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,variable);
-	const char *filename = GET_STR(p1);
-	struct stat st = {0};
-
-	if (stat(filename, &st)) {
-		throw_error(q, p1, "existence_error", "cannot_open_file");
-		return 0;
-	}
-
-	cell tmp;
-	make_int(&tmp, st.st_size);
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	GET_FIRST_ARG(p1,callable);
+	cell *tmp = deep_clone_to_tmp(q, p1, p1_ctx);
+	query *task = create_task(q, tmp);
+	task->yielded = 1;
+	task->spawned = 1;
+	push_task(q->m, task);
+	return 1;
 }
 
-static int fn_exists_directory_1(query *q)
+static int fn_spawn_n(query *q)
 {
-	GET_FIRST_ARG(p1,atom);
-	const char *filename = GET_STR(p1);
-	struct stat st = {0};
+	GET_FIRST_ARG(p1,callable);
+	clone_to_tmp(q, p1);
+	unsigned arity = p1->arity;
+	unsigned args = 1;
 
-	if (stat(filename, &st))
-		return 0;
+	while (args++ < q->st.curr_cell->arity) {
+		cell *p2 = get_next_raw_arg(q);
+		clone2_to_tmp(q, p2);
+		arity++;
+	}
 
-	if ((st.st_mode & S_IFMT) != S_IFDIR)
-		return 0;
+	cell *tmp2 = get_tmp_heap(q, 0);
+	tmp2->nbr_cells = tmp_heap_used(q);
+	tmp2->arity = arity;
+
+	if ((tmp2->fn = get_builtin(q->m, GET_STR(tmp2), arity)) != NULL)
+		tmp2->flags |= FLAG_BUILTIN;
+	else {
+		tmp2->match = find_matching_rule(q->m, tmp2);
+		tmp2->flags &= ~FLAG_BUILTIN;
+	}
 
+	cell *tmp = clone_to_heap(q, 0, tmp2, 0);
+	query *task = create_task(q, tmp);
+	task->yielded = task->spawned = 1;
+	push_task(q->m, task);
 	return 1;
 }
 
-static int fn_make_directory_1(query *q)
+static int fn_fork_0(query *q)
 {
-	GET_FIRST_ARG(p1,atom);
-	const char *filename = GET_STR(p1);
-	struct stat st = {0};
-
-	if (!stat(filename, &st))
-		return 0;
-
-	return !mkdir(filename, 0777);
+	cell *curr_cell = q->st.curr_cell + q->st.curr_cell->nbr_cells;
+	query *task = create_task(q, curr_cell);
+	task->yielded = 1;
+	push_task(q->m, task);
+	return 0;
 }
 
-static int fn_working_directory_2(query *q)
+static int fn_send_1(query *q)
 {
-	GET_FIRST_ARG(p1,variable);
-	GET_NEXT_ARG(p2,atom_or_var);
-	char tmpbuf[PATH_MAX], tmpbuf2[PATH_MAX];
-	char *oldpath = getcwd(tmpbuf, sizeof(tmpbuf));
-	snprintf(tmpbuf2, sizeof(tmpbuf2), "%s%s", oldpath, PATH_SEP);
-	oldpath = tmpbuf2;
-	cell tmp = make_cstring(q, oldpath);
+	GET_FIRST_ARG(p1,nonvar);
+	query *dstq = q->parent ? q->parent : q;
+	cell *c = deep_clone_to_tmp(q, p1, p1_ctx);
 
-	if (is_atom(p2)) {
-		const char *pathname = GET_STR(p2);
+	for (idx_t i = 0; i < c->nbr_cells; i++) {
+		cell *c2 = c + i;
 
-		if (!chdir(pathname))
-			return 0;
+		if (is_blob(c2)) {
+			size_t nbytes = c2->len_str;
+			char *tmp = malloc(nbytes + 1);
+			memcpy(tmp, c2->val_str, nbytes+1);
+			c2->val_str = tmp;
+		}
+
+		if (is_bigint(c2) && is_const_bigint(c2))
+			dup_bigint(c2);
 	}
 
-	return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	alloc_queue(dstq, c);
+	q->yielded = 1;
+	return 1;
 }
 
-static int fn_chdir_1(query *q)
+static int fn_recv_1(query *q)
 {
-	GET_FIRST_ARG(p1,atom);
-	const char *filename = GET_STR(p1);
-	return !chdir(filename);
+	GET_FIRST_ARG(p1,variable);
+	cell *c = pop_queue(q);
+	return unify(q, p1, p1_ctx, c, q->st.curr_frame);
 }
 
-static int fn_edin_skip_1(query *q)
+// An engine is a query of its own, suspended after each solution of
+// its goal. The template and goal are copied in with fresh variables,
+// and each answer copied out, using the binary term encoding.
+
+static int fn_sys_engine_yield_0(query *q)
 {
-	GET_FIRST_ARG(p1,integer);
-	int n = get_named_stream(q, "user_input");
-	stream *str = &g_streams[n];
+	if (q->retry)
+		return 0;
 
-	if (isatty(fileno(str->fp)) && !str->did_getc && !str->ungetch) {
-		printf("| ");
-		fflush(str->fp);
-	}
+	q->yielded = 1;
+	make_choice(q);
+	return 0;
+}
 
-	for (;;) {
-		str->did_getc = 1;
-		int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
-		str->ungetch = 0;
+static query *get_engine(query *q, cell *p1)
+{
+	if (!is_structure(p1) || (p1->arity != 1) || strcmp(GET_STR(p1), "$engine"))
+		return NULL;
 
-		if (feof(str->fp)) {
-			str->did_getc = 0;
-			break;
-		} else if (ch == '\n')
-			str->did_getc = 0;
+	cell *c = deref(q, p1+1, q->latest_ctx);
 
-		if (ch == p1->val_num)
-			break;
+	if (!is_integer(c))
+		return NULL;
+
+	for (query *e = q->engines; e; e = e->next) {
+		if (e->qid == (uint64_t)c->val_num)
+			return e;
 	}
 
-	return 1;
+	return NULL;
 }
 
-static int fn_edin_skip_2(query *q)
+static int fn_sys_engine_create_3(query *q)
 {
-	GET_FIRST_ARG(pstr,stream);
-	int n = get_stream(q, pstr);
-	stream *str = &g_streams[n];
-	GET_NEXT_ARG(p1,integer);
+	GET_FIRST_ARG(p1,structure);
+	GET_NEXT_ARG(p2,callable);
+	GET_NEXT_ARG(p3,variable);
+	size_t len;
+	uint8_t *buf = term_to_binary(q, p1, p1_ctx, &len);
 
-	if (isatty(fileno(str->fp)) && !str->did_getc && !str->ungetch) {
-		printf("| ");
-		fflush(str->fp);
+	if (!buf) {
+		throw_error(q, p1, "domain_error", "acyclic_term");
+		return 0;
 	}
 
-	for (;;) {
-		str->did_getc = 1;
-		int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
-		str->ungetch = 0;
+	query *e = create_query(q->m, 1);
+	e->parent = q;
+	e->st.fp = 1;
+	e->current_input = q->current_input;
+	e->current_output = q->current_output;
+	cell *c = binary_to_term(e, buf, len);
+	free(buf);
 
-		if (feof(str->fp)) {
-			str->did_getc = 0;
-			break;
-		} else if (ch == '\n')
-			str->did_getc = 0;
+	// '$engine'(Template, Error, Goal)...
 
-		if (ch == p1->val_num)
-			break;
+	e->engine_term = c;
+	cell *goal = c + 1;
+	goal += goal->nbr_cells;
+	goal += goal->nbr_cells;
+
+	// As parser_xref() does, so control constructs can be called...
+
+	for (idx_t i = 0; i < goal->nbr_cells; i++) {
+		cell *c2 = goal + i;
+
+		if (!is_literal(c2))
+			continue;
+
+		if ((c2->fn = get_builtin(q->m, GET_STR(c2), c2->arity)) != NULL)
+			c2->flags |= FLAG_BUILTIN;
+		else if (check_builtin(q->m, GET_STR(c2), c2->arity))
+			c2->flags |= FLAG_BUILTIN;
 	}
 
-	return 1;
+	cell *tmp = clone_to_heap(e, 0, goal, 1);
+	make_end(tmp+tmp->nbr_cells);
+	e->st.curr_cell = tmp;
+	e->yielded = 1;
+
+	e->next = q->engines;
+
+	if (q->engines)
+		q->engines->prev = e;
+
+	q->engines = e;
+
+	tmp = alloc_heap(q, 2);
+	make_literal(tmp, find_in_pool("$engine"));
+	tmp->arity = 1;
+	tmp->nbr_cells = 2;
+	make_int(tmp+1, e->qid);
+	return unify(q, p3, p3_ctx, tmp, q->st.curr_frame);
 }
 
-static int fn_edin_tab_1(query *q)
+static int fn_engine_next_2(query *q)
 {
-	GET_FIRST_ARG(p1_tmp,any);
-	cell p1 = calc(q, p1_tmp);
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,any);
+	query *e = get_engine(q, p1);
 
-	if (!is_integer(&p1)) {
-		throw_error(q, &p1, "type_error", "integer");
+	if (!e) {
+		throw_error(q, p1, "existence_error", "engine");
 		return 0;
 	}
 
-	int n = get_named_stream(q, "user_output");
-	stream *str = &g_streams[n];
+	if (!e->yielded)
+		return 0;
 
-	for (int i = 0; i < p1.val_num; i++)
-		fputc(' ', str->fp);
+	// Something other than an answer, such as yield/0, may stop it...
 
-	return !ferror(str->fp);
-}
+	do {
+		run_query(e);
+	} while (e->yielded && (e->st.curr_cell->fn != fn_sys_engine_yield_0));
 
-static int fn_edin_tab_2(query *q)
-{
-	GET_FIRST_ARG(pstr,stream);
-	GET_FIRST_ARG(p1_tmp,any);
-	cell p1 = calc(q, p1_tmp);
+	if (e->halt) {
+		q->halt_code = e->halt_code;
+		q->halt = q->error = 1;
+		return 0;
+	}
 
-	if (!is_integer(&p1)) {
-		throw_error(q, &p1, "type_error", "integer");
+	if (!e->yielded)
+		return 0;
+
+	cell *c = e->engine_term + 1;
+	cell *err = deref(e, c + c->nbr_cells, 0);
+	idx_t err_ctx = e->latest_ctx;
+	int thrown = !is_variable(err);
+	size_t len;
+	uint8_t *buf = thrown ?
+		term_to_binary(e, err, err_ctx, &len) :
+		term_to_binary(e, c, 0, &len);
+
+	if (!buf) {
+		throw_error(q, p1, "domain_error", "acyclic_term");
 		return 0;
 	}
 
-	int n = get_stream(q, pstr);
-	stream *str = &g_streams[n];
+	if (!thrown) {
+		int ok = unify_binary_term(q, p1, p2, p2_ctx, buf, len);
+		free(buf);
+		return ok;
+	}
 
-	for (int i = 0; i < p1.val_num; i++)
-		fputc(' ', str->fp);
+	// An uncaught error ends the engine and is raised in the caller.
 
-	return !ferror(str->fp);
+	e->yielded = 0;
+	c = binary_to_term(q, buf, len);
+	free(buf);
+	c = deep_clone_to_tmp(q, c, q->st.curr_frame);
+	q->latest_ctx = q->st.curr_frame;
+
+	if (!do_throw_term(q, c))
+		return 0;
+
+	return q->st.curr_cell->fn(q);
 }
 
-static int fn_edin_seen_0(query *q)
+static int fn_engine_destroy_1(query *q)
 {
-	int n = get_named_stream(q, "user_input");
-	stream *str = &g_streams[n];
+	GET_FIRST_ARG(p1,any);
+	query *e = get_engine(q, p1);
 
-	if (n <= 2)
-		return 1;
+	if (!e) {
+		throw_error(q, p1, "existence_error", "engine");
+		return 0;
+	}
 
-	fclose(str->fp ? str->fp : str->fp);
-	free(str->filename);
-	free(str->mode);
-	free(str->name);
-	memset(str, 0, sizeof(stream));
-	q->current_input = 0;
+	if (e->prev)
+		e->prev->next = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+
+	if (e == q->engines)
+		q->engines = e->next;
+
+	destroy_query(e);
 	return 1;
 }
 
-static int fn_edin_told_0(query *q)
+static int fn_log10_1(query *q)
 {
-	int n = get_named_stream(q, "user_output");
-	stream *str = &g_streams[n];
+	GET_FIRST_ARG(p1_tmp,any);
+	cell p1 = calc(q, p1_tmp);
 
-	if (n <= 2)
-		return 1;
+	if (is_integer(&p1)) {
+		q->accum.val_flt = log10(p1.val_num);
+		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_float(&p1)) {
+		q->accum.val_flt = log10(p1.val_flt);
+		q->accum.val_type = TYPE_FLOAT;
+	} else if (is_bigint(&p1)) {
+		q->accum.val_flt = log10(num_to_float(&p1));
+		q->accum.val_type = TYPE_FLOAT;
+	} else {
+		throw_error(q, &p1, "type_error", "number");
+		return 0;
+	}
 
-	fclose(str->fp ? str->fp : str->fp);
-	free(str->filename);
-	free(str->mode);
-	free(str->name);
-	memset(str, 0, sizeof(stream));
-	q->current_output = 0;
 	return 1;
 }
 
-static int fn_edin_seeing_1(query *q)
+// The position of the most significant bit of a positive integer.
+
+static int fn_msb_1(query *q)
 {
-	GET_FIRST_ARG(p1,variable);
-	char *name = q->current_input==0?"user":g_streams[q->current_input].name;
-	cell tmp = make_cstring(q, name);
-	set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	GET_FIRST_ARG(p1_tmp,any);
+	cell p1 = calc(q, p1_tmp);
+
+	if (!is_integer_or_bigint(&p1)) {
+		throw_error(q, &p1, "type_error", "integer");
+		return 0;
+	}
+
+	if (num_to_float(&p1) < 1.0) {
+		throw_error(q, &p1, "domain_error", "not_less_than_one");
+		return 0;
+	}
+
+	int_t n = -1;
+
+	if (is_bigint(&p1))
+		n = bigint_msb(&p1);
+	else {
+		for (uint_t v = p1.val_num; v; v >>= 1)
+			n++;
+	}
+
+	q->accum.val_num = n;
+	q->accum.val_den = 1;
+	q->accum.val_type = TYPE_INTEGER;
 	return 1;
 }
 
-static int fn_edin_telling_1(query *q)
+static int fn_srandom_1(query *q)
 {
-	GET_FIRST_ARG(p1,variable);
-	char *name =q->current_output==1?"user":g_streams[q->current_output].name;
-	cell tmp = make_cstring(q, name);
-	set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	GET_FIRST_ARG(p1,integer);
+	srandom(p1->val_num);
 	return 1;
 }
 
-static idx_t do_jenkins_one_at_a_time_hash(const char *key)
+static int fn_random_1(query *q)
 {
-	idx_t hash = 0;
+	GET_FIRST_ARG(p1,integer_or_var);
 
-	while (*key != 0) {
-		hash += *key++;
-		hash += (hash << 10);
-		hash ^= (hash >> 6);
+	if (is_variable(p1)) {
+		cell tmp;
+		make_float(&tmp, ((double)random())/UINT32_MAX);
+		set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+		return 1;
 	}
 
-	hash += (hash << 3);
-	hash ^= (hash >> 11);
-	hash += (hash << 15);
-	return hash;
+	if (p1->val_num < 1) {
+		throw_error(q, p1, "domain_error", "positive_integer");
+		return 0;
+	}
+
+	q->accum.val_type = TYPE_INTEGER;
+	q->accum.val_num = llabs((long long)(random()%p1->val_num));
+	return 1;
 }
 
-static int fn_term_hash_2(query *q)
+static int fn_rand_0(query *q)
 {
-	GET_FIRST_ARG(p1,nonvar);
-	GET_NEXT_ARG(p2,integer_or_var);
-	size_t len = write_term_to_buf(q, NULL, 0, p1, p1_ctx, 1, 0, 0);
-	char *dst = malloc(len+1);
-	write_term_to_buf(q, dst, len+1, p1, p1_ctx, 1, 0, 0);
+	q->accum.val_type = TYPE_INTEGER;
+	q->accum.val_num = random()%RAND_MAX;
+	return 1;
+}
+
+static int fn_rand_1(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
 	cell tmp;
-	make_int(&tmp, do_jenkins_one_at_a_time_hash(dst));
-	free(dst);
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	make_int(&tmp, random()%RAND_MAX);
+	set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	return 1;
 }
 
-static int fn_hex_chars_2(query *q)
+static int do_consult(query *q, cell *p1, idx_t p1_ctx)
 {
-	GET_FIRST_ARG(p2,integer_or_var);
-	GET_NEXT_ARG(p1,atom_or_var);
+	if (is_atom(p1)) {
+		const char *src = GET_STR(p1);
+		deconsult(src);
 
-	if (is_variable(p1) && is_variable(p2)) {
-		throw_error(q, p1, "instantiation_error", "atom");
-		return 0;
-	}
+		if (!module_load_file(q->m, src)) {
+			throw_error(q, p1, "existence_error", "cannot_open_file");
+			return 0;
+		}
 
-	if (is_variable(p1)) {
-		char tmpbuf[256];
-		sprintf(tmpbuf, "%llx", (long long)p2->val_num);
-		cell tmp = make_string(q, tmpbuf, strlen(tmpbuf));
-		set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
 		return 1;
 	}
 
-	const char *src = GET_STR(p1);
-	uint_t p1_val = strtoull(src, NULL, 16);
+	if (strcmp(GET_STR(p1), ":")) {
+		throw_error(q, p1, "type_error", "not_a_file_spec");
+		return 0;
+	}
+
+	cell *mod = deref(q, p1+1, p1_ctx);
+	cell *file = deref(q, p1+2, p1_ctx);
+
+	if (!is_atom(mod) || !is_atom(file)) {
+		throw_error(q, p1, "type_error", "not_a_file_spec");
+		return 0;
+	}
+
+	module *tmp_m = create_module(GET_STR(mod));
+	const char *src = GET_STR(file);
+	deconsult(src);
+	tmp_m->make_public = 1;
+
+	if (!module_load_file(tmp_m, src)) {
+		throw_error(q, p1, "existence_error", "cannot_open_file");
+		destroy_module(tmp_m);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int fn_consult_1(query *q)
+{
+	GET_FIRST_ARG(p1,atom_or_structure);
+
+	if (!is_list(p1)) {
+		if (!do_consult(q, p1, p1_ctx))
+			return 0;
+
+		return 1;
+	}
+
+	while (is_list(p1)) {
+		cell *h = LIST_HEAD(p1);
+		cell *c = deref(q, h, p1_ctx);
+
+		if (!do_consult(q, c, q->latest_ctx))
+			return 0;
+
+		p1 = LIST_TAIL(p1);
+		p1 = deref(q, p1, p1_ctx);
+		p1_ctx = q->latest_ctx;
+	}
+
+	return 1;
+}
+
+static int fn_make_0(query *q)
+{
+	unsigned cnt = make_changed();
+
+	if (cnt && !q->m->quiet)
+		fprintf(stdout, "%% Updated %u predicate%s\n", cnt, cnt > 1 ? "s" : "");
+
+	return 1;
+}
+
+// Returns the digits of an integer or bigint with 'sep' every
+// 'grouping' digits and a point 'decimals' digits from the right.
+// The result is malloc'd.
+
+static char *format_integer(const cell *c, int grouping, int sep, int decimals)
+{
+	char tmpbuf1[256], *src1 = tmpbuf1;
+
+	if (is_bigint(c))
+		src1 = bigint_to_str(c, 10);
+	else
+		sprint_int(tmpbuf1, sizeof(tmpbuf1), c->val_num, 10);
+
+	size_t n = strlen(src1);
+	char *tmpbuf2 = malloc((n*2)+2), *dst = malloc((n*2)+2);
+	const char *src = src1 + (n - 1);
+	char *dst2 = tmpbuf2;
+	int i = 1, j = 1;
+
+	while (src >= src1) {
+		*dst2++ = *src--;
+
+		if (grouping && !decimals && !(i++%grouping) && (src >= src1) && isdigit(*src))
+			*dst2++ = sep;
+
+		if (decimals && (j++ == decimals)) {
+			*dst2++ = '.';
+			decimals = 0;
+			i = 1;
+		}
+	}
+
+	*dst2 = '\0';
+	src = tmpbuf2 + (strlen(tmpbuf2) - 1);
+	dst2 = dst;
+
+	while (src >= tmpbuf2)
+		*dst2++ = *src--;
+
+	*dst2 = '\0';
+	free(tmpbuf2);
+
+	if (src1 != tmpbuf1)
+		free(src1);
+
+	return dst;
+}
+
+static int do_format(query *q, cell *str, idx_t str_ctx, cell* p1, idx_t p1_ctx, cell* p2, idx_t p2_ctx)
+{
+        (void) p1_ctx;
+	char *srcbuf = GET_STR(p1);
+	const char *src = srcbuf;
+	size_t bufsiz;
+	char *tmpbuf = malloc(bufsiz=strlen(src)+100);
+	char *dst = tmpbuf;
+	cell *c = NULL;
+	size_t nbytes = bufsiz;
+
+	while (*src) {
+		int ch = get_char_utf8(&src);
+		int argval = 0, noargval = 1;
+
+		if (ch != '~') {
+			dst += put_char_bare_utf8(dst, ch);
+			continue;
+		}
+
+		ch = get_char_utf8(&src);
+
+		while (isdigit(ch)) {
+			noargval = 0;
+			argval *= 10;
+			argval += ch - '0';
+			ch = get_char_utf8(&src);
+			continue;
+		}
+
+		if (ch == 'N') {
+			if ((dst != tmpbuf) && (dst[-1] == '\n'))
+				continue;
+
+			*dst++ = '\n';
+			continue;
+		}
+
+		if (ch == 'n') {
+			*dst++ = '\n';
+			continue;
+		}
+
+		if (ch == '~') {
+			*dst++ = '~';
+			continue;
+		}
+
+		if (ch == 't')
+			continue;
+
+		if (ch == '|') {
+			while ((dst - tmpbuf) < argval)
+				*dst++ = ' ';
+
+			continue;
+		}
+
+		if (!p2 || !is_list(p2))
+			break;
+
+		cell *head = LIST_HEAD(p2);
+		c = deref(q, head, p2_ctx);
+		idx_t c_ctx = q->latest_ctx;
+		p2 = LIST_TAIL(p2);
+
+		if (ch == 'i')
+			continue;
+
+		int canonical = 0;
+		size_t len;
+
+		if (ch == 'k')
+			canonical = 1;
+
+		if ((ch == 'a') && !is_atom(c)) {
+			free(tmpbuf);
+			throw_error(q, c, "type_error", "atom");
+			return 0;
+		}
+
+		if (((ch == 'd') || (ch == 'D') || (ch == 'I')) && !is_integer_or_bigint(c)) {
+			free(tmpbuf);
+			throw_error(q, c, "type_error", "integer");
+			return 0;
+		}
+
+		if (ch == 'c') {
+			if (!is_integer(c)) {
+				free(tmpbuf);
+				throw_error(q, c, "type_error", "integer");
+				return 0;
+			}
+
+			len = 10;
+
+			while (nbytes < len) {
+				size_t save = dst - tmpbuf;
+				tmpbuf = realloc(tmpbuf, bufsiz*=2);
+				dst = tmpbuf + save;
+				nbytes = bufsiz - save;
+			}
+
+			len = put_char_utf8(dst, (int)c->val_num);
+		} else if ((ch == 'e') || (ch == 'E')) {
+			if (!is_float(c)) {
+				free(tmpbuf);
+				throw_error(q, c, "type_error", "float");
+				return 0;
+			}
+
+			len = 40;
+
+			while (nbytes < len) {
+				size_t save = dst - tmpbuf;
+				tmpbuf = realloc(tmpbuf, bufsiz*=2);
+				dst = tmpbuf + save;
+				nbytes = bufsiz - save;
+			}
+
+			if (ch == 'e')
+				len = sprintf(dst, "%e", c->val_flt);
+			else
+				len = sprintf(dst, "%E", c->val_flt);
+		} else if (ch == 'f') {
+			if (!is_float(c)) {
+				free(tmpbuf);
+				throw_error(q, c, "type_error", "float");
+				return 0;
+			}
+
+			len = 40;
+
+			while (nbytes < len) {
+				size_t save = dst - tmpbuf;
+				tmpbuf = realloc(tmpbuf, bufsiz*=2);
+				dst = tmpbuf + save;
+				nbytes = bufsiz - save;
+			}
+
+			len = sprintf(dst, "%.*f", argval, c->val_flt);
+		} else if ((ch == 'I') || (ch == 'd') || (ch == 'D')) {
+			char *src = ch == 'I' ?
+				format_integer(c, noargval?3:argval, '_', 0) :
+				format_integer(c, ch == 'D' ? 3 : 0, ',', noargval?2:argval);
+			len = strlen(src);
+
+			while (nbytes <= len) {
+				size_t save = dst - tmpbuf;
+				tmpbuf = realloc(tmpbuf, bufsiz*=2);
+				dst = tmpbuf + save;
+				nbytes = bufsiz - save;
+			}
+
+			memcpy(dst, src, len+1);
+			free(src);
+		} else {
+			int saveq = q->quoted;
+
+			if (ch == 'q')
+				q->quoted = 1;
+
+			if (is_string(c) && !q->quoted)
+				q->quoted = -1;
+
+			char *src = canonical ?
+				write_canonical_to_strbuf(q, c, c_ctx, 1) :
+				write_term_to_strbuf(q, c, c_ctx, 1);
+			len = strlen(src);
+
+			while (nbytes <= len) {
+				size_t save = dst - tmpbuf;
+				tmpbuf = realloc(tmpbuf, bufsiz*=2);
+				dst = tmpbuf + save;
+				nbytes = bufsiz - save;
+			}
+
+			memcpy(dst, src, len+1);
+			free(src);
+			q->quoted = saveq;
+		}
+
+		dst += len;
+		nbytes -= len;
+	}
+
+	*dst = '\0';
+	size_t len = dst - tmpbuf;
+
+	if (str == NULL) {
+		int n = get_named_stream(q, "user_output");
+		stream *str = &g_streams[n];
+		net_write(tmpbuf, len, str);
+	} else if (is_structure(str) && ((strcmp(GET_STR(str),"atom") && strcmp(GET_STR(str),"chars") && strcmp(GET_STR(str),"string")) || (str->arity > 1) || !is_variable(str+1))) {
+		free(tmpbuf);
+		throw_error(q, c, "type_error", "structure");
+		return 0;
+	} else if (is_structure(str)) {
+		cell *c = deref(q, str+1, str_ctx);
+		cell tmp = make_cstring(q, tmpbuf);
+		set_var(q, c, q->latest_ctx, &tmp, q->st.curr_frame);
+	} else if (is_stream(str)) {
+		int n = get_stream(q, str);
+		stream *str = &g_streams[n];
+		const char *src = tmpbuf;
+
+		while (len) {
+			size_t nbytes = net_write(src, len, str);
+
+			if (!nbytes) {
+				if (feof(str->fp) || ferror(str->fp)) {
+					free(tmpbuf);
+					fprintf(stderr, "Error: end of file on write\n");
+					return 0;
+				}
+			}
+
+			clearerr(str->fp);
+			len -= nbytes;
+			src += nbytes;
+		}
+	} else {
+		free(tmpbuf);
+		throw_error(q, p1, "type_error", "stream");
+		return 0;
+	}
+
+	free(tmpbuf);
+	return 1;
+}
+
+static int fn_format_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,list_or_nil);
+	return do_format(q, NULL, 0, p1, p1_ctx, !is_nil(p2)?p2:NULL, p2_ctx);
+}
+
+static int fn_format_3(query *q)
+{
+	GET_FIRST_ARG(pstr,stream_or_structure);
+	GET_NEXT_ARG(p1,atom);
+	GET_NEXT_ARG(p2,list_or_nil);
+	return do_format(q, pstr, pstr_ctx, p1, p1_ctx, !is_nil(p2)?p2:NULL, p2_ctx);
+}
+
+#if USE_OPENSSL
+static int fn_sha1_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,atom_or_var);
+	const char *str = GET_STR(p1);
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	SHA1((unsigned char*)str, LEN_STR(p1), digest);
+	char tmpbuf[512];
+	char *dst = tmpbuf;
+	size_t buflen = sizeof(tmpbuf);
+
+	for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+		size_t len = snprintf(dst, buflen, "%02X", digest[i]);
+		dst += len;
+		buflen -= len;
+	}
+
+	cell tmp = make_string(q, tmpbuf, strlen(tmpbuf));
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_sha256_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,atom_or_var);
+	const char *str = GET_STR(p1);
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	SHA256((unsigned char*)str, LEN_STR(p1), digest);
+	char tmpbuf[512];
+	char *dst = tmpbuf;
+	size_t buflen = sizeof(tmpbuf);
+
+	for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		size_t len = snprintf(dst, buflen, "%02X", digest[i]);
+		dst += len;
+		buflen -= len;
+	}
+
+	cell tmp = make_string(q, tmpbuf, strlen(tmpbuf));
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_sha512_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,atom_or_var);
+	const char *str = GET_STR(p1);
+	unsigned char digest[SHA512_DIGEST_LENGTH];
+	SHA512((unsigned char*)str, LEN_STR(p1), digest);
+	char tmpbuf[512];
+	char *dst = tmpbuf;
+	size_t buflen = sizeof(tmpbuf);
+
+	for (int i = 0; i < SHA512_DIGEST_LENGTH; i++) {
+		size_t len = snprintf(dst, buflen, "%02X", digest[i]);
+		dst += len;
+		buflen -= len;
+	}
+
+	cell tmp = make_string(q, tmpbuf, strlen(tmpbuf));
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+#endif
+
+static int do_b64encode_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,variable);
+	const char *str = GET_STR(p1);
+	size_t len = LEN_STR(p1);
+	char *dstbuf = malloc((len*3)+1);
+	b64_encode(str, len, &dstbuf, 0, 0);
+	cell tmp = make_string(q, dstbuf, strlen(dstbuf));
+	free(dstbuf);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int do_b64decode_2(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	GET_NEXT_ARG(p2,atom);
+	const char *str = GET_STR(p2);
+	size_t len = LEN_STR(p1);
+	char *dstbuf = malloc(len+1);
+	b64_decode(str, len, &dstbuf);
+	cell tmp = make_string(q, dstbuf, strlen(dstbuf));
+	if (is_string(p1)) tmp.flags |= FLAG_STRING;
+	free(dstbuf);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_base64_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom_or_var);
+	GET_NEXT_ARG(p2,atom_or_var);
+
+	if ((is_atom(p1) || is_list(p1)) && is_variable(p2))
+		return do_b64encode_2(q);
+	else if (is_variable(p1) && (is_atom(p2) || is_string(p2)))
+		return do_b64decode_2(q);
+
+	throw_error(q, p1, "instantiation_error", "atom");
+	return 0;
+}
+
+static char *url_encode(const char *src, int len, char *dstbuf)
+{
+	char *dst = dstbuf;
+
+	// As per RFC3986 (2005)
+
+	while (len-- > 0) {
+		if (!isalnum(*src) && (*src != '-') && (*src != '_') && (*src != '.') && (*src != '~'))
+			dst += sprintf(dst, "%%%02X", *src++);
+		else
+			*dst++ = *src++;
+	}
+
+	*dst = '\0';
+	return dstbuf;
+}
+
+char *url_decode(const char *src, char *dstbuf)
+{
+	char *dst = dstbuf;
+
+	while (*src) {
+		if (*src == '%') {
+			src++;
+			unsigned ch = 0;
+			sscanf(src, "%02X", &ch);
+			src += 2;
+			*dst++ = (unsigned char)ch;
+		} else if (*src == '+') {
+			*dst++ = ' ';
+			src++;
+		} else
+			*dst++ = *src++;
+	}
+
+	*dst = '\0';
+	return dstbuf;
+}
+
+static int do_urlencode_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,variable);
+	const char *str = GET_STR(p1);
+	size_t len = LEN_STR(p1);
+	char *dstbuf = malloc((len*3)+1);
+	url_encode(str, len, dstbuf);
+	cell tmp = make_string(q, dstbuf, strlen(dstbuf));
+	free(dstbuf);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int do_urldecode_2(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	GET_NEXT_ARG(p2,atom);
+	const char *str = GET_STR(p1);
+	size_t len = LEN_STR(p1);
+	char *dstbuf = malloc(len+1);
+	url_decode(str, dstbuf);
+	cell tmp = make_string(q, dstbuf, strlen(dstbuf));
+	free(dstbuf);
+	return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_urlenc_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom_or_var);
+	GET_NEXT_ARG(p2,atom_or_var);
+
+	if ((is_atom(p1) || is_string(p1)) && is_variable(p2))
+		return do_urlencode_2(q);
+	else if (is_variable(p1) && (is_atom(p2) || is_string(p2)))
+		return do_urldecode_2(q);
+
+	throw_error(q, p1, "instantiation_error", "atom");
+	return 0;
+}
+
+static int fn_string_lower_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,atom_or_var);
+	size_t len = LEN_STR(p1);
+	char *tmps = malloc(len+1);
+	memcpy(tmps, GET_STR(p1), len);
+	tmps[len] = '\0';
+	char *s = tmps;
+
+	while (*s) {
+		*s = tolower(*s);
+		s++;
+	}
+
+	cell tmp = make_string(q, tmps, len);
+	free(tmps);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_string_upper_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,atom_or_var);
+	size_t len = LEN_STR(p1);
+	char *tmps = malloc(len+1);
+	memcpy(tmps, GET_STR(p1), len);
+	tmps[len] = '\0';
+	char *s = tmps;
+
+	while (*s) {
+		*s = toupper(*s);
+		s++;
+	}
+
+	cell tmp = make_string(q, tmps, len);
+	free(tmps);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_exists_file_1(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	const char *filename = GET_STR(p1);
+	struct stat st = {0};
+
+	if (stat(filename, &st))
+		return 0;
+
+	if ((st.st_mode & S_IFMT) != S_IFREG)
+		return 0;
+
+	return 1;
+}
+
+static int fn_delete_file_1(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	const char *filename = GET_STR(p1);
+	remove(filename);
+	return 1;
+}
+
+static int fn_rename_file_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,atom);
+	const char *filename1 = GET_STR(p1);
+	const char *filename2 = GET_STR(p2);
+	return !rename(filename1, filename2);
+}
+
+static int fn_time_file_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,variable);
+	const char *filename = GET_STR(p1);
+	struct stat st = {0};
+
+	if (stat(filename, &st)) {
+		throw_error(q, p1, "existence_error", "cannot_open_file");
+		return 0;
+	}
+
+	cell tmp;
+	make_float(&tmp, st.st_mtime);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_size_file_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,variable);
+	const char *filename = GET_STR(p1);
+	struct stat st = {0};
+
+	if (stat(filename, &st)) {
+		throw_error(q, p1, "existence_error", "cannot_open_file");
+		return 0;
+	}
+
+	cell tmp;
+	make_int(&tmp, st.st_size);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_exists_directory_1(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	const char *filename = GET_STR(p1);
+	struct stat st = {0};
+
+	if (stat(filename, &st))
+		return 0;
+
+	if ((st.st_mode & S_IFMT) != S_IFDIR)
+		return 0;
+
+	return 1;
+}
+
+static int fn_make_directory_1(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	const char *filename = GET_STR(p1);
+	struct stat st = {0};
+
+	if (!stat(filename, &st))
+		return 0;
+
+	return !mkdir(filename, 0777);
+}
+
+static int fn_working_directory_2(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	GET_NEXT_ARG(p2,atom_or_var);
+	char tmpbuf[PATH_MAX], tmpbuf2[PATH_MAX];
+	char *oldpath = getcwd(tmpbuf, sizeof(tmpbuf));
+	snprintf(tmpbuf2, sizeof(tmpbuf2), "%s%s", oldpath, PATH_SEP);
+	oldpath = tmpbuf2;
+	cell tmp = make_cstring(q, oldpath);
+
+	if (is_atom(p2)) {
+		const char *pathname = GET_STR(p2);
+
+		if (!chdir(pathname))
+			return 0;
+	}
+
+	return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_chdir_1(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	const char *filename = GET_STR(p1);
+	return !chdir(filename);
+}
+
+static int fn_edin_skip_1(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	int n = get_named_stream(q, "user_input");
+	stream *str = &g_streams[n];
+
+	if (isatty(fileno(str->fp)) && !str->did_getc && !str->ungetch) {
+		printf("| ");
+		fflush(str->fp);
+	}
+
+	for (;;) {
+		str->did_getc = 1;
+		int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+		str->ungetch = 0;
+
+		if (feof(str->fp)) {
+			str->did_getc = 0;
+			break;
+		} else if (ch == '\n')
+			str->did_getc = 0;
+
+		if (ch == p1->val_num)
+			break;
+	}
+
+	return 1;
+}
+
+static int fn_edin_skip_2(query *q)
+{
+	GET_FIRST_ARG(pstr,stream);
+	int n = get_stream(q, pstr);
+	stream *str = &g_streams[n];
+	GET_NEXT_ARG(p1,integer);
+
+	if (isatty(fileno(str->fp)) && !str->did_getc && !str->ungetch) {
+		printf("| ");
+		fflush(str->fp);
+	}
+
+	for (;;) {
+		str->did_getc = 1;
+		int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+		str->ungetch = 0;
+
+		if (feof(str->fp)) {
+			str->did_getc = 0;
+			break;
+		} else if (ch == '\n')
+			str->did_getc = 0;
+
+		if (ch == p1->val_num)
+			break;
+	}
+
+	return 1;
+}
+
+static int fn_edin_tab_1(query *q)
+{
+	GET_FIRST_ARG(p1_tmp,any);
+	cell p1 = calc(q, p1_tmp);
+
+	if (!is_integer(&p1)) {
+		throw_error(q, &p1, "type_error", "integer");
+		return 0;
+	}
+
+	int n = get_named_stream(q, "user_output");
+	stream *str = &g_streams[n];
+
+	for (int i = 0; i < p1.val_num; i++)
+		fputc(' ', str->fp);
+
+	return !ferror(str->fp);
+}
+
+static int fn_edin_tab_2(query *q)
+{
+	GET_FIRST_ARG(pstr,stream);
+	GET_FIRST_ARG(p1_tmp,any);
+	cell p1 = calc(q, p1_tmp);
+
+	if (!is_integer(&p1)) {
+		throw_error(q, &p1, "type_error", "integer");
+		return 0;
+	}
+
+	int n = get_stream(q, pstr);
+	stream *str = &g_streams[n];
+
+	for (int i = 0; i < p1.val_num; i++)
+		fputc(' ', str->fp);
+
+	return !ferror(str->fp);
+}
+
+static int fn_edin_seen_0(query *q)
+{
+	int n = get_named_stream(q, "user_input");
+	stream *str = &g_streams[n];
+
+	if (n <= 2)
+		return 1;
+
+	fclose(str->fp ? str->fp : str->fp);
+	free(str->filename);
+	free(str->mode);
+	free(str->name);
+	memset(str, 0, sizeof(stream));
+	q->current_input = 0;
+	return 1;
+}
+
+static int fn_edin_told_0(query *q)
+{
+	int n = get_named_stream(q, "user_output");
+	stream *str = &g_streams[n];
+
+	if (n <= 2)
+		return 1;
+
+	fclose(str->fp ? str->fp : str->fp);
+	free(str->filename);
+	free(str->mode);
+	free(str->name);
+	memset(str, 0, sizeof(stream));
+	q->current_output = 0;
+	return 1;
+}
+
+static int fn_edin_seeing_1(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	char *name = q->current_input==0?"user":g_streams[q->current_input].name;
+	cell tmp = make_cstring(q, name);
+	set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	return 1;
+}
+
+static int fn_edin_telling_1(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	char *name =q->current_output==1?"user":g_streams[q->current_output].name;
+	cell tmp = make_cstring(q, name);
+	set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	return 1;
+}
+
+static idx_t do_jenkins_one_at_a_time_hash(const char *key)
+{
+	idx_t hash = 0;
+
+	while (*key != 0) {
+		hash += *key++;
+		hash += (hash << 10);
+		hash ^= (hash >> 6);
+	}
+
+	hash += (hash << 3);
+	hash ^= (hash >> 11);
+	hash += (hash << 15);
+	return hash;
+}
+
+static int fn_term_hash_2(query *q)
+{
+	GET_FIRST_ARG(p1,nonvar);
+	GET_NEXT_ARG(p2,integer_or_var);
+	char *dst = write_term_to_strbuf(q, p1, p1_ctx, 1);
+	cell tmp;
+	make_int(&tmp, do_jenkins_one_at_a_time_hash(dst));
+	free(dst);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_hex_chars_2(query *q)
+{
+	GET_FIRST_ARG(p2,integer_or_var);
+	GET_NEXT_ARG(p1,atom_or_var);
+
+	if (is_variable(p1) && is_variable(p2)) {
+		throw_error(q, p1, "instantiation_error", "atom");
+		return 0;
+	}
+
+	if (is_variable(p1)) {
+		char tmpbuf[256];
+		sprintf(tmpbuf, "%llx", (long long)p2->val_num);
+		cell tmp = make_string(q, tmpbuf, strlen(tmpbuf));
+		set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+		return 1;
+	}
+
+	const char *src = GET_STR(p1);
+	uint_t p1_val = strtoull(src, NULL, 16);
+
+	if (is_variable(p2)) {
+		cell tmp;
+		make_int(&tmp, p1_val);
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return 1;
+	}
+
+	return p1_val == (uint_t)p2->val_num;  //FIXME: cehteh: is this cast correct?
+}
+
+static int fn_octal_chars_2(query *q)
+{
+	GET_FIRST_ARG(p2,integer_or_var);
+	GET_NEXT_ARG(p1,atom_or_var);
+
+	if (is_variable(p1) && is_variable(p2)) {
+		throw_error(q, p1, "instantiation_error", "not_sufficiently_instantiated");
+		return 0;
+	}
+
+	if (is_variable(p1)) {
+		char tmpbuf[256];
+		sprintf(tmpbuf, "%llo", (long long)p2->val_num);
+		cell tmp = make_string(q, tmpbuf, strlen(tmpbuf));
+		set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+		return 1;
+	}
+
+	const char *src = GET_STR(p1);
+	uint_t p1_val = strtoull(src, NULL, 8);
+
+	if (is_variable(p2)) {
+		cell tmp;
+		make_int(&tmp, p1_val);
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return 1;
+	}
+
+	return p1_val == (uint_t)p2->val_num;  //FIXME: cehteh: is this cast correct?
+}
+
+static int fn_rdiv_2(query *q)
+{
+	GET_FIRST_ARG(p1_tmp,any);
+	GET_NEXT_ARG(p2_tmp,any);
+	cell p1 = calc(q, p1_tmp);
+	cell p2 = calc(q, p2_tmp);
+
+	if (is_rational(&p1) && is_rational(&p2)) {
+		return rat_op(q, RAT_DIV, &p1, &p2);
+	} else if (is_integer_or_bigint(&p1) && is_integer_or_bigint(&p2)) {
+		return do_bigint_rdiv(q, &p1, &p2);
+	} else {
+		throw_error(q, is_rational(&p1) || is_bigint(&p1) ? &p2 : &p1, "type_error", "integer");
+		return 0;
+	}
+
+	return 1;
+}
+
+static void do_real_to_fraction(double v, double accuracy, int_t *num, int_t *den)
+{
+	if (accuracy <= 0.0 || accuracy >= 1.0)
+		abort();
+
+	int_t sign = v < 0 ? -1 : 1;
+
+	if (sign == -1) {
+		v = fabs(v);
+	}
+
+	double maxError = sign == 0 ? accuracy : v * accuracy;
+	int_t n = floor(v);
+	v -= n;
+
+	if (v < maxError) {
+		*num = n * sign;
+		*den = 1;
+		return;
+	}
+
+	if ((1 - maxError) < v) {
+		*num = (n+1) * sign;
+		*den = 1;
+		return;
+	}
+
+	double z = v;
+	int_t previous_denominator = 0;
+	int_t denominator = 1;
+	int_t numerator;
+
+	do
+	{
+		z = 1.0 / (z - (int_t) z);
+		int_t tmp = denominator;
+		denominator = denominator * (int_t)z + previous_denominator;
+		previous_denominator = tmp;
+		numerator = v * denominator;
+	}
+	while (fabs(v-(double)numerator/denominator) > maxError && (z != (int_t)z));
+
+	*num = (n * denominator + numerator) * sign;
+	*den = denominator;
+	return;
+}
+
+static int fn_atom_1(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	return is_string(p1);
+}
+
+static int fn_rational_1(query *q)
+{
+	GET_FIRST_ARG(p1_tmp,any);
+
+	if (q->calc) {
+		cell p1 = calc(q, p1_tmp);
+
+		if (is_rational(&p1)) {
+			reduce(&p1);
+			q->accum.val_num = p1.val_num;
+			q->accum.val_den = p1.val_den;
+			q->accum.val_type = TYPE_INTEGER;
+			return 1;
+		}
+
+		if (is_float(&p1)) {
+			do_real_to_fraction(p1.val_flt, 0.00001, &q->accum.val_num, &q->accum.val_den);
+			q->accum.val_type = TYPE_INTEGER;
+			return 1;
+		}
+
+		throw_error(q, &p1, "type_error", "number");
+		return 0;
+	}
+
+	return is_rational(p1_tmp);
+}
+
+static int fn_getenv_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,atom_or_var)
+	const char *value = getenv(GET_STR(p1));
+
+	if (!value)
+		return 0;
+
+	cell tmp = make_cstring(q, (char*)value);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_setenv_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,atom_or_int)
+
+	if (is_atom(p2)) {
+		setenv(GET_STR(p1), GET_STR(p2), 1);
+	} else {
+		char tmpbuf[256];
+		sprint_int(tmpbuf, sizeof(tmpbuf), p2->val_num, 10);
+		setenv(GET_STR(p1), tmpbuf, 1);
+	}
+
+	return 1;
+}
+
+static int fn_unsetenv_1(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	unsetenv(GET_STR(p1));
+	return 1;
+}
+
+static int fn_uuid_1(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+    uuid u;
+    uuid_gen(&u);
+    char tmpbuf[128];
+    uuid_to_buf(&u, tmpbuf, sizeof(tmpbuf));
+	cell tmp = make_cstring(q, tmpbuf);
+	tmp.flags |= FLAG_STRING;
+	set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	return 1;
+}
+
+static int fn_atomic_concat_3(query *q)
+{
+	if (q->retry)
+		return do_atom_concat_3(q);
+
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,any);
+	GET_NEXT_ARG(p3,any);
+
+	if (is_variable(p1) && is_variable(p2))
+		return do_atom_concat_3(q);
+
+	if (is_variable(p3)) {
+		if (!is_atomic(p1)) {
+			throw_error(q, p1, "type_error", "atomic");
+			return 0;
+		}
+
+		if (!is_atomic(p2)) {
+			throw_error(q, p2, "type_error", "atomic");
+			return 0;
+		}
+
+		const char *src1, *src2;
+		size_t len1, len2;
+		char tmpbuf1[256], tmpbuf2[256];
+
+		if (is_atom(p1)) {
+			len1 = LEN_STR(p1);
+			src1 = GET_STR(p1);
+		} else if (is_integer(p1)) {
+			len1 = sprint_int(tmpbuf1, sizeof(tmpbuf1), p1->val_num, 10);
+			src1 = tmpbuf1;
+		} else if (is_rational(p1)) {
+			len1 = sprint_int(tmpbuf1, sizeof(tmpbuf1), p1->val_num, 10);
+			len1 += sprint_int(tmpbuf1+len1, sizeof(tmpbuf1)-len1, p1->val_den, 10);
+			src1 = tmpbuf1;
+		} else {
+			len1 = sprint_float(tmpbuf1, sizeof(tmpbuf1), p1->val_flt);
+			src1 = tmpbuf1;
+		}
+
+		if (is_atom(p2)) {
+			len2 = LEN_STR(p2);
+			src2 = GET_STR(p2);
+		} else if (is_integer(p2)) {
+			len2 = sprint_int(tmpbuf2, sizeof(tmpbuf2), p2->val_num, 10);
+			src2 = tmpbuf2;
+		} else if (is_rational(p2)) {
+			len2 = sprint_int(tmpbuf2, sizeof(tmpbuf2), p2->val_num, 10);
+			len2 += sprint_int(tmpbuf2+len2, sizeof(tmpbuf2)-len2, p2->val_den, 10);
+			src2 = tmpbuf2;
+		} else {
+			len2 = sprint_float(tmpbuf2, sizeof(tmpbuf2), p2->val_flt);
+			src2 = tmpbuf2;
+		}
+
+		size_t nbytes = len1 + len2;
+		char *dst = malloc(nbytes + 1);
+		memcpy(dst, src1, len1);
+		memcpy(dst+len1, src2, len2);
+		dst[nbytes] = '\0';
+		cell tmp = make_cstringn(q, dst, nbytes);
+		tmp.flags |= FLAG_STRING;
+		set_var(q, p3, p3_ctx, &tmp, q->st.curr_frame);
+		free(dst);
+		return 1;
+	}
+
+	if (is_variable(p1)) {
+		if (strcmp(GET_STR(p3)+(LEN_STR(p3)-LEN_STR(p2)), GET_STR(p2)))
+			return 0;
+
+		char *dst = strndup(GET_STR(p3), LEN_STR(p3)-LEN_STR(p2));
+		cell tmp = make_cstring(q, dst);
+		tmp.flags |= FLAG_STRING;
+		set_var(q, p3, p3_ctx, &tmp, q->st.curr_frame);
+		free(dst);
+		return 1;
+	}
+
+	if (is_variable(p2)) {
+		if (strncmp(GET_STR(p3), GET_STR(p1), LEN_STR(p1)))
+			return 0;
+
+		char *dst = strdup(GET_STR(p3)+LEN_STR(p1));
+		cell tmp = make_cstring(q, dst);
+		tmp.flags |= FLAG_STRING;
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		free(dst);
+		return 1;
+	}
+
+	if (strncmp(GET_STR(p3), GET_STR(p1), LEN_STR(p1)))
+		return 0;
+
+	if (strcmp(GET_STR(p3)+LEN_STR(p1), GET_STR(p2)))
+		return 0;
+
+	return 1;
+}
+
+static int fn_replace_4(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,atom);
+	GET_NEXT_ARG(p3,atom);
+	GET_NEXT_ARG(p4,variable);
+
+	int srclen = LEN_STR(p1);
+	int dstlen = srclen * 2;
+	const char *src = GET_STR(p1);
+	const char *s1 = GET_STR(p2);
+	const char *s2 = GET_STR(p3);
+	int s1len = LEN_STR(p2);
+	int s2len = LEN_STR(p3);
+	char *dstbuf = (char*)malloc(dstlen + 1);
+	char *dst = dstbuf;
+
+	while (srclen > 0) {
+		if (!strncmp(src, s1, s1len)) {
+			if (dstlen < s2len) {
+				size_t save_len = dst - dstbuf;
+				dstlen = ((save_len)*2) + s2len;
+				dstbuf = (char *)realloc(dstbuf, dstlen + 1);
+				dst = dstbuf + save_len;
+			}
+
+			strcpy(dst, s2);
+			dst += s2len;
+			dstlen -= s2len;
+			src += s1len;
+			srclen -= s1len;
+		} else {
+			if (dstlen < 1) {
+				size_t max_len = dst - dstbuf;
+				dstlen = max_len *= 2;
+				dstbuf = (char *)realloc(dstbuf, dstlen + 1);
+				dst = dstbuf + max_len;
+			}
+
+			*dst++ = *src++;
+			dstlen--;
+			srclen--;
+		}
+	}
+
+	*dst = '\0';
+	cell tmp = make_cstring(q, dstbuf);
+	tmp.flags |= FLAG_STRING;
+	free(dstbuf);
+	set_var(q, p4, p4_ctx, &tmp, q->st.curr_frame);
+	return 1;
+}
+
+static int fn_predicate_property_2(query *q)
+{
+	GET_FIRST_ARG(p1,callable);
+	GET_NEXT_ARG(p2,atom_or_var)
+	cell tmp;
+
+	rule *h = find_functor(q->m, GET_STR(p1), p1->arity);
+
+	if (check_builtin(q->m, GET_STR(p1), p1->arity)) {
+		make_literal(&tmp, find_in_pool("built_in"));
+		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+			return 1;
+	}
+
+	if (h && !h->is_dynamic) {
+		make_literal(&tmp, find_in_pool("built_in"));
+		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+			return 1;
+	}
+
+	if (h && h->is_dynamic) {
+		make_literal(&tmp, find_in_pool("dynamic"));
+		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+			return 1;
+	}
+
+	if (h && h->is_persist) {
+		make_literal(&tmp, find_in_pool("persist"));
+		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+			return 1;
+	}
+
+	if (h && h->is_public) {
+		make_literal(&tmp, find_in_pool("public"));
+		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+			return 1;
+	}
+
+	if (h && h->is_public) {
+		make_literal(&tmp, find_in_pool("exported"));
+		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+			return 1;
+	}
+
+	if (h) {
+		make_literal(&tmp, find_in_pool("visible"));
+		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+			return 1;
+	}
+
+	if (h) {
+		make_literal(&tmp, find_in_pool("static"));
+		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int fn_numbervars_1(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+
+	var_table vt;
+	collect_vars(q, p1, p1_ctx, &vt);
+
+	q->nv_mask = 0;
+	unsigned end = q->nv_start = 0;
+
+	for (unsigned i = 0; i < vt.size; i++) {
+		if (!vt.slots[i])
+			continue;
+
+		q->nv_mask |= 1ULL << vt.slots[i]->var_nbr;
+		end++;
+	}
+
+	free(vt.slots);
+
+	return 1;
+}
+
+static int fn_numbervars_3(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,integer)
+	GET_NEXT_ARG(p3,integer_or_var)
+
+	var_table vt;
+	collect_vars(q, p1, p1_ctx, &vt);
+
+	q->nv_mask = 0;
+	unsigned end = q->nv_start = p2->val_num;
+
+	for (unsigned i = 0; i < vt.size; i++) {
+		if (!vt.slots[i])
+			continue;
+
+		q->nv_mask |= 1ULL << vt.slots[i]->var_nbr;
+		end++;
+	}
+
+	free(vt.slots);
+
+	cell tmp;
+	make_int(&tmp, end);
+	return unify(q, p3, p3_ctx, &tmp, q->st.curr_frame);
+}
+
+unsigned count_bits(uint64_t mask, unsigned bit)
+{
+	unsigned bits = 0;
+
+	for (unsigned i = 0; i < bit; i++) {
+		if ((1ULL << i) & mask)
+			bits++;
+	}
+
+	return bits;
+}
+
+static int fn_var_number_2(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	GET_NEXT_ARG(p2,integer_or_var)
+	unsigned pos = count_bits(q->nv_mask, p1->var_nbr);
+	cell tmp;
+	make_int(&tmp, q->nv_start+pos);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_char_type_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom_or_int);
+	GET_NEXT_ARG(p2,atom);
+	int ch;
+
+	if (is_atom(p1)) {
+		if (LEN_STR(p1) != 1)
+			return 0;
+
+		ch = peek_char_utf8(GET_STR(p1));
+	} else
+		ch = p1->val_num;
+
+	if (!strcmp(GET_STR(p2), "alpha"))
+		return isalpha(ch);
+	else if (!strcmp(GET_STR(p2), "digit"))
+		return isdigit(ch);
+	else if (!strcmp(GET_STR(p2), "xdigit"))
+		return isxdigit(ch);
+	else if (!strcmp(GET_STR(p2), "whitespace"))
+		return isblank(ch) || isspace(ch);
+	else if (!strcmp(GET_STR(p2), "white"))
+		return isblank(ch);
+	else if (!strcmp(GET_STR(p2), "space"))
+		return isspace(ch);
+	else if (!strcmp(GET_STR(p2), "lower"))
+		return islower(ch);
+	else if (!strcmp(GET_STR(p2), "upper"))
+		return isupper(ch);
+	else if (!strcmp(GET_STR(p2), "punct"))
+		return ispunct(ch);
+	else if (!strcmp(GET_STR(p2), "cntrl"))
+		return iscntrl(ch);
+	else if (!strcmp(GET_STR(p2), "graph"))
+		return isgraph(ch);
+	else if (!strcmp(GET_STR(p2), "ascii"))
+		return ch < 128;
+	else if (!strcmp(GET_STR(p2), "newline"))
+		return ch == 10;
+	else if (!strcmp(GET_STR(p2), "end_of_line"))
+		return (ch >= 10) && (ch <= 13);
+	else if (!strcmp(GET_STR(p2), "end_of_file"))
+		return ch == -1;
+	else if (!strcmp(GET_STR(p2), "quote"))
+		return (ch == '\'') || (ch == '"') || (ch == '`');
+	else if (!strcmp(GET_STR(p2), "period"))
+		return (ch == '.') || (ch == '!') || (ch == '?');
+
+	return 0;
+}
+
+static void restore_db(module *m, FILE *fp)
+{
+	parser *p = create_parser(m);
+	query *q = create_query(m, 0);
+	p->one_shot = 1;
+	p->fp = fp;
+	m->loading = 1;
+
+	for (;;) {
+		if (getline(&p->save_line, &p->n_line, p->fp) == -1)
+			break;
+
+		p->srcptr = p->save_line;
+		parser_tokenize(p, 0, 0);
+		parser_xref(p, p->t, NULL);
+		query_execute(q, p->t);
+		clear_term(p->t);
+	}
+
+	m->loading = 0;
+	destroy_query(q);
+	free(p->save_line);
+	destroy_parser(p);
+}
+
+void do_db_load(module *m)
+{
+	if (!m->use_persist)
+		return;
+
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s.db", m->name);
+	char filename2[1024];
+	snprintf(filename2, sizeof(filename2), "%s.TMP", m->name);
+	struct stat st;
+
+	if (!stat(filename2, &st) && !stat(filename, &st))
+		remove(filename2);
+	else if (!stat(filename2, &st))
+		rename(filename2, filename);
+
+	if (!stat(filename, &st)) {
+		FILE *fp = fopen(filename, "rb");
+		restore_db(m, fp);
+		fclose(fp);
+	}
+
+	m->fp = fopen(filename, "ab");
+}
+
+static int fn_db_load_0(query *q)
+{
+	do_db_load(q->m);
+	return 1;
+}
+
+static int fn_db_save_0(query *q)
+{
+	if (!q->m->fp)
+		return 0;
+
+	fclose(q->m->fp);
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s.db", q->m->name);
+	char filename2[1024];
+	snprintf(filename2, sizeof(filename2), "%s.TMP", q->m->name);
+	FILE *fp = fopen(filename2, "wb");
+	if (!fp) return 0;
+	save_db(q->m->fp, q, 1);
+	fclose(fp);
+	remove(filename);
+	rename(filename2, filename);
+	q->m->fp = fopen(filename, "ab");
+	return 1;
+}
+
+static int fn_abolish_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,integer);
+	cell tmp = *p1;
+	tmp.arity = p2->val_num;
+	return do_abolish(q, &tmp);
+}
+
+static int fn_sys_lt_2(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	GET_NEXT_ARG(p2,integer);
+
+	if (p1->val_num++ < p2->val_num)
+		return 1;
+
+	drop_choice(q);
+	return 1;
+}
+
+// Sets q->accum to P1 + P2 or P1 - P2, promoting to a bigint on
+// overflow as is/2 does.
+
+static int plus_accum(query *q, int op, cell *p1, cell *p2)
+{
+	int_t v;
+
+	if (is_integer(p1) && is_integer(p2)
+		&& !(op == BIG_ADD ?
+			__builtin_add_overflow(p1->val_num, p2->val_num, &v) :
+			__builtin_sub_overflow(p1->val_num, p2->val_num, &v))) {
+		make_int(&q->accum, v);
+		return 1;
+	}
+
+	return do_bigint_op(q, op, p1, p2);
+}
+
+static int plus_unify(query *q, cell *p1, idx_t p1_ctx)
+{
+	cell tmp = q->accum;
+
+	if (is_bigint(&tmp))
+		tmp.flags |= FLAG_CONST_BIGINT;
+
+	set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	return 1;
+}
+
+static int fn_plus_3(query *q)
+{
+	GET_FIRST_ARG(p1,integer_or_bigint_or_var);
+	GET_NEXT_ARG(p2,integer_or_bigint_or_var);
+	GET_NEXT_ARG(p3,integer_or_bigint_or_var);
+
+	if (is_variable(p1)) {
+		if (!is_integer_or_bigint(p2)) {
+			throw_error(q, p2, "type_error", "integer");
+			return 0;
+		}
+
+		if (!is_integer_or_bigint(p3)) {
+			throw_error(q, p3, "type_error", "integer");
+			return 0;
+		}
+
+		if (!plus_accum(q, BIG_SUB, p3, p2))
+			return 0;
+
+		return plus_unify(q, p1, p1_ctx);
+	}
+
+	if (is_variable(p2)) {
+		if (!is_integer_or_bigint(p1)) {
+			throw_error(q, p1, "type_error", "integer");
+			return 0;
+		}
+
+		if (!is_integer_or_bigint(p3)) {
+			throw_error(q, p3, "type_error", "integer");
+			return 0;
+		}
+
+		if (!plus_accum(q, BIG_SUB, p3, p1))
+			return 0;
+
+		return plus_unify(q, p2, p2_ctx);
+	}
+
+	if (!plus_accum(q, BIG_ADD, p1, p2))
+		return 0;
+
+	if (is_variable(p3))
+		return plus_unify(q, p3, p3_ctx);
+
+	if (is_bigint(&q->accum) || is_bigint(p3))
+		return is_bigint(&q->accum) && is_bigint(p3) && !bigint_cmp(&q->accum, p3);
+
+	return p3->val_num == q->accum.val_num;
+}
+
+static int fn_limit_2(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	GET_NEXT_ARG(p2,callable);
+	cell *tmp = clone_to_heap(q, 1, p2, 4);
+	idx_t nbr_cells = 1 + p2->nbr_cells;
+	make_structure(tmp+nbr_cells++, g_fail_s, fn_sys_lt_2, 2, 2);
+	make_int(tmp+nbr_cells++, 1);
+	make_int(tmp+nbr_cells++, p1->val_num);
+	make_end_return(tmp+nbr_cells, q->st.curr_cell);
+	q->st.curr_cell = tmp;
+	return 1;
+}
+
+static int fn_sys_gt_2(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	GET_NEXT_ARG(p2,integer);
+
+	if (p1->val_num++ <= p2->val_num)
+		return 0;
+
+	return 1;
+}
+
+static int fn_offset_2(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	GET_NEXT_ARG(p2,callable);
+	cell *tmp = clone_to_heap(q, 1, p2, 4);
+	idx_t nbr_cells = 1 + p2->nbr_cells;
+	make_structure(tmp+nbr_cells++, g_fail_s, fn_sys_gt_2, 2, 2);
+	make_int(tmp+nbr_cells++, 1);
+	make_int(tmp+nbr_cells++, p1->val_num);
+	make_end_return(tmp+nbr_cells, q->st.curr_cell);
+	q->st.curr_cell = tmp;
+	return 1;
+}
+
+// Attributes are kept with the unbound variable as a chain of nodes
+// on the heap, one for each module. A node is three cells: a header
+// linking to the next node and holding the context of the value, the
+// module name and the value. Frozen goals are nodes of the 'freeze'
+// module, of which there may be several.
+
+static cell *new_attr(query *q, idx_t m_off, cell *v, idx_t v_ctx, cell *next)
+{
+	cell *n = alloc_heap(q, 3);
+	n->val_type = TYPE_EMPTY;
+	n->nbr_cells = 3;
+	n->attrs = next;
+	n->attrs_ctx = v_ctx;
+	make_literal(n+1, m_off);
+
+	if (is_structure(v) || is_variable(v))
+		GET_FRAME(v_ctx)->no_tco = 1;
+
+	if (is_structure(v)) {
+		cell *tmp = clone_to_heap(q, 0, v, 0);
+		make_indirect(n+2, tmp);
+	} else {
+		n[2] = *v;
+
+		if (is_blob(v))
+			n[2].flags |= FLAG_CONST_CSTRING;
+		else if (is_bigint(v))
+			n[2].flags |= FLAG_CONST_BIGINT;
+	}
+
+	return n;
+}
+
+static cell *attr_value(cell *n)
+{
+	cell *v = n + 2;
+	return is_indirect(v) ? v->val_ptr : v;
+}
+
+static cell *find_attr(cell *attrs, idx_t m_off)
+{
+	for (cell *n = attrs; n; n = n->attrs) {
+		if (n[1].val_off == m_off)
+			return n;
+	}
+
+	return NULL;
+}
+
+static cell *get_attrs(query *q, cell *c, idx_t c_ctx)
+{
+	frame *g = GET_FRAME(c_ctx);
+	slot *e = GET_SLOT(g, c->var_nbr);
+	return e->c.attrs;
+}
+
+// A fresh variable in the current frame bound to v, so that terms
+// from several frames can be put together into one.
+
+static void make_fresh_bound(query *q, cell *tmp, unsigned var_nbr, cell *v, idx_t v_ctx)
+{
+	tmp->val_type = TYPE_VARIABLE;
+	tmp->nbr_cells = 1;
+	tmp->arity = 0;
+	tmp->flags = FLAG_FRESH;
+	tmp->val_off = g_anon_s;
+	tmp->var_nbr = var_nbr;
+	set_var(q, tmp, q->st.curr_frame, v, v_ctx);
+}
+
+// Like create_vars(), which can't tell an error from a first
+// variable numbered zero.
+
+static int fresh_vars(query *q, unsigned nbr, unsigned *var_nbr)
+{
+	frame *g = GET_FRAME(q->st.curr_frame);
+	*var_nbr = g->nbr_vars;
+	create_vars(q, nbr);
+	return g->nbr_vars == (*var_nbr + nbr);
+}
+
+static void add_attr(query *q, cell *c, idx_t c_ctx, cell *n)
+{
+	cell *attrs = get_attrs(q, c, c_ctx), *last = attrs;
+
+	if (!attrs) {
+		set_attrs(q, c, c_ctx, n);
+		return;
+	}
+
+	while (last->attrs)
+		last = last->attrs;
+
+	cell tmp = *last;
+	tmp.attrs = n;
+	overwrite_cell(q, last, &tmp, 1);
+}
+
+static void del_attr(query *q, cell *c, idx_t c_ctx, idx_t m_off)
+{
+	cell *prev = NULL;
+
+	for (cell *n = get_attrs(q, c, c_ctx); n; n = n->attrs) {
+		if (n[1].val_off != m_off) {
+			prev = n;
+			continue;
+		}
+
+		if (!prev) {
+			set_attrs(q, c, c_ctx, n->attrs);
+			continue;
+		}
+
+		cell tmp = *prev;
+		tmp.attrs = n->attrs;
+		overwrite_cell(q, prev, &tmp, 1);
+	}
+}
+
+static int fn_freeze_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,callable);
+
+	if (is_variable(p1)) {
+		add_attr(q, p1, p1_ctx, new_attr(q, g_freeze_s, p2, p2_ctx, NULL));
+		return 1;
+	}
+
+	cell *tmp = clone_to_heap(q, 1, p2, 1);
+	idx_t nbr_cells = 1 + p2->nbr_cells;
+	make_end_return(tmp+nbr_cells, q->st.curr_cell);
+	q->st.curr_cell = tmp;
+	return 1;
+}
+
+// Run the goals of the attributed variables bound during the step
+// just done, all spliced in at once. Frozen goals are called, or
+// re-frozen on the new variable when bound to another attributed one.
+// Other modules have their attr_unify_hook/2 called, if they have one.
+// After a clause head the goals run before its body, otherwise prefix
+// makes the first cell a no-op that follow_me() steps over.
+
+// Copy a term from frame c_ctx to dst, to be run in the current
+// frame. Its variables are renamed to fresh ones bound to the old.
+
+static idx_t import_term(query *q, cell *dst, cell *c, idx_t c_ctx)
+{
+	if ((c_ctx != q->st.curr_frame) && (is_structure(c) || is_variable(c))) {
+		cell *tmp = copy_to_heap(q, 0, c, 0);
+
+		if (!tmp)
+			return 0;
+
+		unify(q, c, c_ctx, tmp, q->st.curr_frame);
+		c = tmp;
+	}
+
+	idx_t nbr_cells = copy_cells(dst, c, c->nbr_cells);
+
+	for (idx_t i = 0; i < nbr_cells; i++) {
+		if (is_blob(dst+i))
+			dst[i].flags |= FLAG_CONST_CSTRING;
+		else if (is_bigint(dst+i))
+			dst[i].flags |= FLAG_CONST_BIGINT;
+	}
+
+	return nbr_cells;
+}
+
+// The goals for one bound attributed variable, or with dst NULL
+// just their size.
+
+static idx_t wake_goals(query *q, const wake *w, cell *dst)
+{
+	cell v = {0};
+	v.val_type = TYPE_VARIABLE;
+	v.nbr_cells = 1;
+	v.val_off = g_anon_s;
+	v.var_nbr = w->var_nbr;
+	cell *val = deref(q, &v, w->ctx);
+	idx_t val_ctx = q->latest_ctx, nbr_cells = 0;
+
+	for (cell *n = w->attrs; n && !q->error; n = n->attrs) {
+		cell *goal = deref(q, attr_value(n), n->attrs_ctx);
+		idx_t goal_ctx = q->latest_ctx;
+		rule *h = NULL;
+
+		if (n[1].val_off != g_freeze_s) {
+			module *m = find_module(GET_STR(n+1));
+
+			if (!m || !(h = find_functor(m, "attr_unify_hook", 2)))
+				continue;
+		}
+
+		if (!dst) {
+			nbr_cells += goal->nbr_cells;
+
+			if (h || is_variable(val))
+				nbr_cells += 1 + val->nbr_cells;
+
+			continue;
+		}
+
+		cell *c = dst + nbr_cells;
+
+		if (h) {
+			c->val_type = TYPE_LITERAL;
+			c->arity = 2;
+			c->flags = 0;
+			c->match = h;
+			c->val_off = g_attr_hook_s;
+			nbr_cells++;
+			nbr_cells += import_term(q, dst+nbr_cells, goal, goal_ctx);
+			nbr_cells += import_term(q, dst+nbr_cells, val, val_ctx);
+			c->nbr_cells = (dst + nbr_cells) - c;
+		} else if (is_variable(val)) {
+			make_structure(c, g_freeze_s, fn_freeze_2, 2, 0);
+			nbr_cells++;
+			nbr_cells += import_term(q, dst+nbr_cells, val, val_ctx);
+			nbr_cells += import_term(q, dst+nbr_cells, goal, goal_ctx);
+			c->nbr_cells = (dst + nbr_cells) - c;
+		} else
+			nbr_cells += import_term(q, dst+nbr_cells, goal, goal_ctx);
+	}
+
+	return nbr_cells;
+}
+
+void call_attrs(query *q, int prefix)
+{
+	idx_t nbr_wakes = q->nbr_wakes, nbr_cells = 0;
+	q->nbr_wakes = 0;
+
+	for (idx_t i = 0; i < nbr_wakes; i++)
+		nbr_cells += wake_goals(q, q->wakes+i, NULL);
+
+	if (!nbr_cells)
+		return;
+
+	cell *tmp = alloc_heap(q, (prefix?1:0)+nbr_cells+1), *dst = tmp;
+
+	if (prefix) {
+		dst->val_type = TYPE_EMPTY;
+		dst->nbr_cells = 1;
+		dst->flags = FLAG_BUILTIN;
+		dst++;
+	}
+
+	// Binding the copies can't queue more wakes: the fresh variables
+	// have no attributes of their own, so at most they get some.
+
+	for (idx_t i = 0; (i < nbr_wakes) && !q->error; i++)
+		dst += wake_goals(q, q->wakes+i, dst);
+
+	if (q->error)
+		return;
+
+	if (prefix) {
+		make_end_return(dst, q->st.curr_cell);
+	} else {
+		make_end(dst);
+		dst->val_ptr = q->st.curr_cell;
+	}
+
+	q->st.curr_cell = tmp;
+}
+
+static int fn_frozen_2(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	GET_NEXT_ARG(p2,any);
+	unsigned nbr_goals = 0;
+
+	for (cell *n = get_attrs(q, p1, p1_ctx); n; n = n->attrs) {
+		if (n[1].val_off == g_freeze_s)
+			nbr_goals++;
+	}
+
+	cell tmp;
+
+	if (!nbr_goals) {
+		make_literal(&tmp, g_true_s);
+		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	}
+
+	if (nbr_goals == 1) {
+		cell *n = find_attr(get_attrs(q, p1, p1_ctx), g_freeze_s);
+		cell *v = deref(q, attr_value(n), n->attrs_ctx);
+		return unify(q, p2, p2_ctx, v, q->latest_ctx);
+	}
+
+	unsigned var_nbr;
+
+	if (!fresh_vars(q, nbr_goals, &var_nbr)) {
+		throw_error(q, p1, "resource_error", "too_many_vars");
+		return 0;
+	}
+
+	// As a conjunction (G1,(G2,...))
+
+	cell *c = alloc_heap(q, (nbr_goals*2)-1), *dst = c;
+	idx_t nbr_cells = (nbr_goals*2) - 1;
+
+	for (cell *n = get_attrs(q, p1, p1_ctx); n; n = n->attrs) {
+		if (n[1].val_off != g_freeze_s)
+			continue;
+
+		if (--nbr_goals) {
+			dst->val_type = TYPE_LITERAL;
+			dst->nbr_cells = nbr_cells;
+			dst->arity = 2;
+			dst->flags = OP_XFY;
+			dst->val_off = find_in_pool(",");
+			dst++;
+			nbr_cells -= 2;
+		}
+
+		make_fresh_bound(q, dst++, var_nbr++, attr_value(n), n->attrs_ctx);
+	}
+
+	return unify(q, p2, p2_ctx, c, q->st.curr_frame);
+}
+
+static int fn_put_attr_3(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	GET_NEXT_ARG(p2,atom);
+	GET_NEXT_ARG(p3,any);
+	cell *n = find_attr(get_attrs(q, p1, p1_ctx), p2->val_off);
+
+	if (!n) {
+		add_attr(q, p1, p1_ctx, new_attr(q, p2->val_off, p3, p3_ctx, NULL));
+		return 1;
+	}
+
+	cell *tmp = new_attr(q, p2->val_off, p3, p3_ctx, n->attrs);
+	overwrite_cell(q, n, tmp, 1);
+	overwrite_cell(q, n+2, tmp+2, 1);
+	return 1;
+}
+
+static int fn_get_attr_3(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,atom);
+	GET_NEXT_ARG(p3,any);
+
+	if (!is_variable(p1))
+		return 0;
+
+	cell *n = find_attr(get_attrs(q, p1, p1_ctx), p2->val_off);
+
+	if (!n)
+		return 0;
+
+	return unify(q, p3, p3_ctx, attr_value(n), n->attrs_ctx);
+}
+
+static int fn_del_attr_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,atom);
+
+	if (is_variable(p1))
+		del_attr(q, p1, p1_ctx, p2->val_off);
+
+	return 1;
+}
+
+static int fn_del_attrs_1(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+
+	if (is_variable(p1) && get_attrs(q, p1, p1_ctx))
+		set_attrs(q, p1, p1_ctx, NULL);
+
+	return 1;
+}
+
+static int fn_put_attrs_2(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	GET_NEXT_ARG(p2,list_or_nil);
+	cell *attrs = NULL, *last = NULL;
+
+	while (is_list(p2)) {
+		cell *h = LIST_HEAD(p2);
+		h = deref(q, h, p2_ctx);
+		idx_t h_ctx = q->latest_ctx;
+
+		if (!is_structure(h) || (h->arity != 2) || strcmp(GET_STR(h), "-") || !is_atom(h+1)) {
+			throw_error(q, h, "type_error", "attribute");
+			return 0;
+		}
+
+		cell *v = deref(q, h+2, h_ctx);
+		cell *n = new_attr(q, h[1].val_off, v, q->latest_ctx, NULL);
+
+		if (last)
+			last->attrs = n;
+		else
+			attrs = n;
+
+		last = n;
+		p2 = LIST_TAIL(p2);
+		p2 = deref(q, p2, p2_ctx);
+		p2_ctx = q->latest_ctx;
+	}
+
+	set_attrs(q, p1, p1_ctx, attrs);
+	return 1;
+}
+
+static int fn_get_attrs_2(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	GET_NEXT_ARG(p2,any);
+	unsigned nbr_attrs = 0;
+
+	for (cell *n = get_attrs(q, p1, p1_ctx); n; n = n->attrs)
+		nbr_attrs++;
+
+	cell tmp;
+
+	if (!nbr_attrs) {
+		make_literal(&tmp, g_nil_s);
+		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	}
+
+	unsigned var_nbr;
+
+	if (!fresh_vars(q, nbr_attrs, &var_nbr)) {
+		throw_error(q, p1, "resource_error", "too_many_vars");
+		return 0;
+	}
+
+	init_tmp_heap(q);
+
+	for (cell *n = get_attrs(q, p1, p1_ctx); n; n = n->attrs) {
+		cell pair[3];
+		pair[0].val_type = TYPE_LITERAL;
+		pair[0].nbr_cells = 3;
+		pair[0].arity = 2;
+		pair[0].flags = OP_YFX;
+		pair[0].val_off = find_in_pool("-");
+		pair[1] = n[1];
+		make_fresh_bound(q, pair+2, var_nbr++, attr_value(n), n->attrs_ctx);
+		append_list(q, pair);
+	}
+
+	cell *l = end_list(q);
+	fix_list(l);
+	return unify(q, p2, p2_ctx, l, q->st.curr_frame);
+}
+
+// A finite domain solver. The domain of a constrained variable is its
+// 'clpfd' attribute, '$fd'(Min,Max,Ivls,N). With N zero all values
+// from Min to Max are in the domain. Otherwise Ivls is the address of
+// N sorted, disjoint intervals on the heap, a cell each with the ends
+// as numerator and denominator, of which only the values from Min to
+// Max count, so narrowing the bounds leaves them alone. Intervals are
+// never changed once made and can be shared. The header cell of the
+// record links to the propagators the variable takes part in.
+//
+// Domains are narrowed in place, undone on backtracking. Propagators
+// are queued when a domain they watch changes and are run to a
+// fixpoint by the builtin that made the change. A variable left with
+// a single value is bound, which wakes any other attributes it has.
+// Binding a constrained variable from Prolog calls the hook in
+// library(clpfd), which comes back here through '$fd_unify'/2.
+
+#define FD_INF INT64_MIN
+#define FD_SUP INT64_MAX
+
+enum { FD_LIN_EQ, FD_LIN_LE, FD_LIN_NE, FD_ALLDIFF, FD_ELEMENT };
+
+typedef struct {
+	idx_t ctx, var_nbr;
+	int64_t a;							// coefficient, or the constant
+	unsigned is_const:1;
+} fd_ref;
+
+typedef struct {
+	unsigned kind:7;
+	unsigned queued:1;
+	unsigned nbr;
+	int64_t k;
+	fd_ref v[];
+} fd_prop;
+
+typedef struct fd_link_ fd_link;
+
+struct fd_link_ {
+	fd_link *next;
+	fd_prop *p;
+};
+
+typedef struct {
+	int64_t lo, hi;
+} fd_ivl;
+
+typedef struct {
+	cell var, *rec;						// rec is NULL once bound
+	idx_t var_ctx;
+	int64_t min, max;
+	const cell *ivl;
+	unsigned nbr_ivls;
+} fd_dom;
+
+typedef struct {
+	query *q;
+	fd_prop **queue;
+	fd_dom *doms;
+	fd_ivl *ivls;
+	unsigned nbr_queued, queue_size, doms_size, ivls_size;
+} fd_solver;
+
+static void *fd_alloc(query *q, size_t bytes)
+{
+	return alloc_heap(q, (bytes + sizeof(cell) - 1) / sizeof(cell));
+}
+
+static fd_link *fd_props(const cell *rec)
+{
+	return (fd_link*)rec->attrs;
+}
+
+static fd_dom fd_interval(int64_t min, int64_t max)
+{
+	fd_dom d = {0};
+	d.min = min;
+	d.max = max;
+	return d;
+}
+
+static unsigned fd_count(const fd_dom *d)
+{
+	return d->nbr_ivls ? d->nbr_ivls : 1;
+}
+
+// The i'th interval of d cut to its bounds.
+
+static fd_ivl fd_ivl_at(const fd_dom *d, unsigned i)
+{
+	fd_ivl r = {d->min, d->max};
+
+	if (!d->nbr_ivls)
+		return r;
+
+	if (i)
+		r.lo = d->ivl[i].val_num;
+
+	if (i < (d->nbr_ivls - 1))
+		r.hi = d->ivl[i].val_den;
+
+	return r;
+}
+
+// The index of the last interval of d starting at or below v.
+
+static unsigned fd_find(const fd_dom *d, int64_t v)
+{
+	unsigned lo = 0, hi = d->nbr_ivls;
+
+	while ((hi - lo) > 1) {
+		unsigned mid = (lo + hi) / 2;
+
+		if (d->ivl[mid].val_num <= v)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int fd_has(const fd_dom *d, int64_t v)
+{
+	if ((v < d->min) || (v > d->max))
+		return 0;
+
+	return !d->nbr_ivls || (v <= d->ivl[fd_find(d, v)].val_den);
+}
+
+static uint64_t fd_size(const fd_dom *d)
+{
+	if ((d->min == FD_INF) || (d->max == FD_SUP))
+		return UINT64_MAX;
+
+	uint64_t n = 0;
+
+	for (unsigned i = 0; i < fd_count(d); i++) {
+		fd_ivl a = fd_ivl_at(d, i);
+		n += (uint64_t)a.hi - (uint64_t)a.lo + 1;
+	}
+
+	return n;
+}
+
+// Drop the intervals outside Min..Max and bring Min and Max onto the
+// ones left. Fails on an empty domain.
+
+static int fd_normalize(fd_dom *d)
+{
+	if (d->min > d->max)
+		return 0;
+
+	if (!d->nbr_ivls)
+		return 1;
+
+	while (d->nbr_ivls && (d->ivl[0].val_den < d->min)) {
+		d->ivl++;
+		d->nbr_ivls--;
+	}
+
+	while (d->nbr_ivls && (d->ivl[d->nbr_ivls-1].val_num > d->max))
+		d->nbr_ivls--;
+
+	if (!d->nbr_ivls)
+		return 0;
+
+	if (d->min < d->ivl[0].val_num)
+		d->min = d->ivl[0].val_num;
+
+	if (d->max > d->ivl[d->nbr_ivls-1].val_den)
+		d->max = d->ivl[d->nbr_ivls-1].val_den;
+
+	if (d->nbr_ivls == 1) {
+		d->ivl = NULL;
+		d->nbr_ivls = 0;
+	}
+
+	return 1;
+}
+
+// Intervals to keep in a domain. They go on the heap, which is read a
+// cell at a time when backtracking frees it.
+
+static void fd_set_ivls(query *q, fd_dom *d, const fd_ivl *ivl, unsigned nbr)
+{
+	cell *c = alloc_heap(q, nbr);
+
+	for (unsigned i = 0; i < nbr; i++) {
+		c[i].val_type = TYPE_INTEGER;
+		c[i].nbr_cells = 1;
+		c[i].val_num = ivl[i].lo;
+		c[i].val_den = ivl[i].hi;
+	}
+
+	d->ivl = c;
+	d->nbr_ivls = nbr;
+	d->min = ivl[0].lo;
+	d->max = ivl[nbr-1].hi;
+}
+
+// Count the intervals in both d and o, storing them if out is given.
+
+static unsigned fd_meet(const fd_dom *d, const fd_dom *o, fd_ivl *out)
+{
+	unsigned i = 0, j = 0, n = 0;
+
+	while ((i < fd_count(d)) && (j < fd_count(o))) {
+		fd_ivl a = fd_ivl_at(d, i), b = fd_ivl_at(o, j);
+		int64_t lo = a.lo > b.lo ? a.lo : b.lo;
+		int64_t hi = a.hi < b.hi ? a.hi : b.hi;
+
+		if (lo <= hi) {
+			if (out) {
+				out[n].lo = lo;
+				out[n].hi = hi;
+			}
+
+			n++;
+		}
+
+		if (a.hi < b.hi)
+			i++;
+		else
+			j++;
+	}
+
+	return n;
+}
+
+static int fd_same(const fd_dom *d, const fd_ivl *ivl, unsigned nbr)
+{
+	if (nbr != fd_count(d))
+		return 0;
+
+	for (unsigned i = 0; i < nbr; i++) {
+		fd_ivl a = fd_ivl_at(d, i);
+
+		if ((a.lo != ivl[i].lo) || (a.hi != ivl[i].hi))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int fd_and(query *q, fd_dom *d, const fd_dom *o)
+{
+	if (o->min > d->min)
+		d->min = o->min;
+
+	if (o->max < d->max)
+		d->max = o->max;
+
+	if (d->min > d->max)
+		return 0;
+
+	if (o->nbr_ivls && !d->nbr_ivls) {
+		d->ivl = o->ivl;
+		d->nbr_ivls = o->nbr_ivls;
+	} else if (o->nbr_ivls) {
+		unsigned n = fd_meet(d, o, NULL);
+
+		if (!n)
+			return 0;
+
+		fd_ivl *tmp = malloc(sizeof(fd_ivl)*n);
+		fd_meet(d, o, tmp);
+
+		// Keep the intervals of d when nothing was taken out, so
+		// that it doesn't look changed.
+
+		if (!fd_same(d, tmp, n))
+			fd_set_ivls(q, d, tmp, n);
+
+		free(tmp);
+	}
+
+	return fd_normalize(d);
+}
+
+static void fd_or(query *q, fd_dom *d, const fd_dom *o)
+{
+	unsigned ni = fd_count(d), nj = fd_count(o), i = 0, j = 0, n = 0;
+	fd_ivl *ivl = malloc(sizeof(fd_ivl)*(ni+nj));
+
+	while ((i < ni) || (j < nj)) {
+		fd_ivl a;
+
+		if ((j == nj) || ((i < ni) && (fd_ivl_at(d, i).lo <= fd_ivl_at(o, j).lo)))
+			a = fd_ivl_at(d, i++);
+		else
+			a = fd_ivl_at(o, j++);
+
+		if (n && ((ivl[n-1].hi == FD_SUP) || (a.lo <= (ivl[n-1].hi + 1)))) {
+			if (a.hi > ivl[n-1].hi)
+				ivl[n-1].hi = a.hi;
+		} else
+			ivl[n++] = a;
+	}
+
+	fd_set_ivls(q, d, ivl, n);
+	free(ivl);
+	fd_normalize(d);
+}
+
+static void fd_read(fd_dom *d, cell *rec)
+{
+	d->rec = rec;
+	d->min = rec[1].val_num;
+	d->max = rec[2].val_num;
+	d->ivl = (const cell*)(intptr_t)rec[3].val_num;
+	d->nbr_ivls = rec[4].val_num;
+}
+
+static cell *fd_attach(query *q, cell *c, idx_t c_ctx, const fd_dom *d, fd_link *props)
+{
+	cell tmp[5];
+	tmp->val_type = TYPE_LITERAL;
+	tmp->nbr_cells = 5;
+	tmp->arity = 4;
+	tmp->flags = 0;
+	tmp->val_off = g_fd_s;
+	make_int(tmp+1, d->min);
+	make_int(tmp+2, d->max);
+	make_int(tmp+3, (intptr_t)d->ivl);
+	make_int(tmp+4, d->nbr_ivls);
+	cell *n = new_attr(q, g_clpfd_s, tmp, c_ctx, NULL);
+	cell *rec = attr_value(n);
+	rec->attrs = (cell*)props;
+	add_attr(q, c, c_ctx, n);
+	return rec;
+}
+
+// Look up the current domain of the variable of d, which may have
+// been narrowed or bound since. A variable with no domain yet gets
+// inf..sup.
+
+static int fd_load(query *q, fd_dom *d)
+{
+	cell *c = deref(q, &d->var, d->var_ctx);
+	idx_t c_ctx = q->latest_ctx;
+
+	if (is_integer(c)) {
+		int64_t v = c->val_num;
+		d->rec = NULL;
+		d->min = d->max = v;
+		d->ivl = NULL;
+		d->nbr_ivls = 0;
+		make_int(&d->var, v);
+		return 1;
+	}
+
+	if (!is_variable(c))
+		return 0;
+
+	d->var = *c;
+	d->var_ctx = c_ctx;
+	cell *n = find_attr(get_attrs(q, c, c_ctx), g_clpfd_s);
+
+	if (n) {
+		fd_read(d, attr_value(n));
+		return 1;
+	}
+
+	fd_dom tmp = fd_interval(FD_INF, FD_SUP);
+	fd_read(d, fd_attach(q, c, c_ctx, &tmp, NULL));
+	return 1;
+}
+
+static int fd_get(query *q, const fd_ref *r, fd_dom *d)
+{
+	if (r->is_const) {
+		make_int(&d->var, r->a);
+	} else {
+		cell *v = &d->var;
+		v->val_type = TYPE_VARIABLE;
+		v->nbr_cells = 1;
+		v->arity = 0;
+		v->flags = 0;
+		v->val_off = g_anon_s;
+		v->var_nbr = r->var_nbr;
+	}
+
+	d->var_ctx = r->ctx;
+	return fd_load(q, d);
+}
+
+static int fd_ref_var(query *q, fd_ref *r, cell *c, idx_t c_ctx)
+{
+	if (is_integer(c)) {
+		r->is_const = 1;
+		r->a = c->val_num;
+		return 1;
+	}
+
+	if (!is_variable(c)) {
+		throw_error(q, c, "type_error", "integer");
+		return 0;
+	}
+
+	r->is_const = 0;
+	r->ctx = c_ctx;
+	r->var_nbr = c->var_nbr;
+	GET_FRAME(c_ctx)->no_tco = 1;
+	return 1;
+}
+
+static void fd_queue(fd_solver *s, fd_prop *p)
+{
+	if (p->queued)
+		return;
+
+	if (s->nbr_queued == s->queue_size) {
+		s->queue_size = s->queue_size ? s->queue_size * 2 : 64;
+		s->queue = realloc(s->queue, sizeof(fd_prop*)*s->queue_size);
+		assert(s->queue);
+	}
+
+	p->queued = 1;
+	s->queue[s->nbr_queued++] = p;
+}
+
+static fd_dom *fd_doms(fd_solver *s, unsigned nbr)
+{
+	if (nbr > s->doms_size) {
+		s->doms_size = nbr;
+		s->doms = realloc(s->doms, sizeof(fd_dom)*s->doms_size);
+		assert(s->doms);
+	}
+
+	return s->doms;
+}
+
+static int fd_done(fd_solver *s, int ok)
+{
+	free(s->queue);
+	free(s->doms);
+	free(s->ivls);
+	return ok;
+}
+
+// Replace the domain of d with nd, a subset of it. The propagators
+// watching it are queued.
+
+static int fd_commit(fd_solver *s, fd_dom *d, const fd_dom *nd)
+{
+	query *q = s->q;
+
+	if (!d->rec)
+		return 1;
+
+	if ((nd->min == d->min) && (nd->max == d->max)
+		&& (nd->ivl == d->ivl) && (nd->nbr_ivls == d->nbr_ivls))
+		return 1;
+
+	for (fd_link *l = fd_props(d->rec); l; l = l->next)
+		fd_queue(s, l->p);
+
+	if (nd->min == nd->max) {
+		cell tmp;
+		make_int(&tmp, nd->min);
+		cell v = d->var;
+		idx_t v_ctx = d->var_ctx;
+		del_attr(q, &v, v_ctx, g_clpfd_s);
+		*d = fd_interval(nd->min, nd->max);
+		d->var = tmp;
+		return unify(q, &v, v_ctx, &tmp, q->st.curr_frame);
+	}
+
+	cell tmp;
+
+	if (nd->min != d->min) {
+		make_int(&tmp, nd->min);
+		overwrite_cell(q, d->rec+1, &tmp, 1);
+	}
+
+	if (nd->max != d->max) {
+		make_int(&tmp, nd->max);
+		overwrite_cell(q, d->rec+2, &tmp, 1);
+	}
+
+	if (nd->ivl != d->ivl) {
+		make_int(&tmp, (intptr_t)nd->ivl);
+		overwrite_cell(q, d->rec+3, &tmp, 1);
+	}
+
+	if (nd->nbr_ivls != d->nbr_ivls) {
+		make_int(&tmp, nd->nbr_ivls);
+		overwrite_cell(q, d->rec+4, &tmp, 1);
+	}
+
+	d->min = nd->min;
+	d->max = nd->max;
+	d->ivl = nd->ivl;
+	d->nbr_ivls = nd->nbr_ivls;
+	return 1;
+}
+
+static int fd_narrow(fd_solver *s, fd_dom *d, const fd_dom *o)
+{
+	if (!fd_load(s->q, d))
+		return 0;
+
+	fd_dom nd = *d;
+
+	if (!fd_and(s->q, &nd, o))
+		return 0;
+
+	return fd_commit(s, d, &nd);
+}
+
+static int fd_remove(fd_solver *s, fd_dom *d, int64_t v)
+{
+	if (!fd_load(s->q, d))
+		return 0;
+
+	if (!fd_has(d, v))
+		return 1;
+
+	fd_dom nd = *d;
+
+	if (v == nd.min)
+		nd.min++;
+	else if (v == nd.max)
+		nd.max--;
+	else {
+		// Split the interval holding v, which is neither bound.
+
+		unsigned n = fd_count(&nd), k = nd.nbr_ivls ? fd_find(&nd, v) : 0, j = 0;
+		fd_ivl *ivl = malloc(sizeof(fd_ivl)*(n+1));
+
+		for (unsigned i = 0; i < n; i++) {
+			fd_ivl a = fd_ivl_at(&nd, i);
+
+			if (i != k) {
+				ivl[j++] = a;
+				continue;
+			}
+
+			if (a.lo < v) {
+				ivl[j].lo = a.lo;
+				ivl[j++].hi = v - 1;
+			}
+
+			if (a.hi > v) {
+				ivl[j].lo = v + 1;
+				ivl[j++].hi = a.hi;
+			}
+		}
+
+		fd_set_ivls(s->q, &nd, ivl, j);
+		free(ivl);
+	}
+
+	if (!fd_normalize(&nd))
+		return 0;
+
+	return fd_commit(s, d, &nd);
+}
+
+static void fd_watch(query *q, fd_dom *d, fd_prop *p)
+{
+	if (!d->rec)
+		return;
+
+	fd_link *l = fd_alloc(q, sizeof(fd_link));
+	l->next = fd_props(d->rec);
+	l->p = p;
+	cell tmp = *d->rec;
+	tmp.attrs = (cell*)l;
+	overwrite_cell(q, d->rec, &tmp, 1);
+}
+
+// Bounds of a*x over d, FD_INF and FD_SUP standing for none.
+
+static int64_t fd_mul(int64_t a, int64_t x)
+{
+	int64_t r;
+
+	if ((x == FD_INF) || (x == FD_SUP))
+		return (a > 0) == (x == FD_SUP) ? FD_SUP : FD_INF;
+
+	if (__builtin_mul_overflow(a, x, &r))
+		return (a < 0) != (x < 0) ? FD_INF : FD_SUP;
+
+	return r;
+}
+
+static void fd_term(int64_t a, const fd_dom *d, int64_t *lo, int64_t *hi)
+{
+	*lo = fd_mul(a, a > 0 ? d->min : d->max);
+	*hi = fd_mul(a, a > 0 ? d->max : d->min);
+}
+
+static int64_t fd_div_floor(int64_t a, int64_t b)
+{
+	if ((b == -1) && (a == FD_INF))
+		return FD_SUP;
+
+	int64_t q = a / b;
+
+	if ((a % b) && ((a < 0) != (b < 0)))
+		q--;
+
+	return q;
+}
+
+static int64_t fd_div_ceil(int64_t a, int64_t b)
+{
+	if ((b == -1) && (a == FD_INF))
+		return FD_SUP;
+
+	int64_t q = a / b;
+
+	if ((a % b) && ((a < 0) == (b < 0)))
+		q++;
+
+	return q;
+}
+
+// Narrow x to a*x =< b, or with ge to a*x >= b.
+
+static int fd_bound(fd_solver *s, fd_dom *d, int64_t a, int64_t b, int ge)
+{
+	fd_dom o;
+
+	if ((a > 0) != ge)
+		o = fd_interval(FD_INF, fd_div_floor(b, a));
+	else
+		o = fd_interval(fd_div_ceil(b, a), FD_SUP);
+
+	return fd_narrow(s, d, &o);
+}
+
+// Sum(a*x) = k and sum(a*x) =< k, keeping the bounds of each x within
+// what the bounds of the others leave over. A sum that can't be
+// worked out in 64 bits prunes nothing.
+
+static int fd_linear(fd_solver *s, fd_prop *p)
+{
+	fd_dom *d = fd_doms(s, p->nbr);
+	int64_t lo = 0, hi = 0;
+	unsigned lo_inf = 0, hi_inf = 0;
+
+	for (unsigned i = 0; i < p->nbr; i++) {
+		if (!fd_get(s->q, p->v+i, d+i))
+			return 0;
+
+		int64_t tlo, thi;
+		fd_term(p->v[i].a, d+i, &tlo, &thi);
+
+		if (tlo == FD_INF)
+			lo_inf++;
+		else if (__builtin_add_overflow(lo, tlo, &lo))
+			return 1;
+
+		if (thi == FD_SUP)
+			hi_inf++;
+		else if (__builtin_add_overflow(hi, thi, &hi))
+			return 1;
+	}
+
+	if (!lo_inf && (lo > p->k))
+		return 0;
+
+	if ((p->kind == FD_LIN_EQ) && !hi_inf && (hi < p->k))
+		return 0;
+
+	for (unsigned i = 0; i < p->nbr; i++) {
+		int64_t a = p->v[i].a, tlo, thi, b;
+
+		if (!d[i].rec)
+			continue;
+
+		fd_term(a, d+i, &tlo, &thi);
+
+		if ((lo_inf == (tlo == FD_INF))
+			&& !__builtin_sub_overflow(p->k, lo - (tlo == FD_INF ? 0 : tlo), &b)
+			&& !fd_bound(s, d+i, a, b, 0))
+			return 0;
+
+		if ((p->kind == FD_LIN_EQ) && (hi_inf == (thi == FD_SUP))
+			&& !__builtin_sub_overflow(p->k, hi - (thi == FD_SUP ? 0 : thi), &b)
+			&& !fd_bound(s, d+i, a, b, 1))
+			return 0;
+	}
+
+	return 1;
+}
+
+// Sum(a*x) =\= k, acted on once all but one x are bound.
+
+static int fd_linear_ne(fd_solver *s, fd_prop *p)
+{
+	fd_dom *d = fd_doms(s, p->nbr);
+	int64_t sum = 0, v;
+	unsigned nbr_free = 0, j = 0;
+
+	for (unsigned i = 0; i < p->nbr; i++) {
+		if (!fd_get(s->q, p->v+i, d+i))
+			return 0;
+
+		if (d[i].rec) {
+			if (nbr_free++)
+				return 1;
+
+			j = i;
+		} else if (__builtin_mul_overflow(p->v[i].a, d[i].min, &v)
+			|| __builtin_add_overflow(sum, v, &sum))
+			return 1;
+	}
+
+	if (!nbr_free)
+		return sum != p->k;
+
+	if (__builtin_sub_overflow(p->k, sum, &v) || (v % p->v[j].a))
+		return 1;
+
+	return fd_remove(s, d+j, v / p->v[j].a);
+}
+
+static int fd_ivl_cmp(const void *p1, const void *p2)
+{
+	const fd_ivl *a = p1, *b = p2;
+	return a->lo < b->lo ? -1 : a->lo > b->lo;
+}
+
+// Each bound value is taken from the others. Then if fewer values are
+// left between the unbound ones than there are of them, fail.
+
+static int fd_all_different(fd_solver *s, fd_prop *p)
+{
+	fd_dom *d = fd_doms(s, p->nbr);
+
+	for (unsigned i = 0; i < p->nbr; i++) {
+		if (!fd_get(s->q, p->v+i, d+i))
+			return 0;
+	}
+
+	for (unsigned i = 0; i < p->nbr; i++) {
+		if (d[i].rec)
+			continue;
+
+		for (unsigned j = 0; j < p->nbr; j++) {
+			if ((j != i) && !fd_remove(s, d+j, d[i].min))
+				return 0;
+		}
+	}
+
+	unsigned nbr_free = 0, nbr = 0;
+	int64_t lo = FD_SUP, hi = FD_INF;
+
+	for (unsigned i = 0; i < p->nbr; i++) {
+		if (!d[i].rec)
+			continue;
+
+		nbr_free++;
+		nbr += fd_count(d+i);
+		if (d[i].min < lo) lo = d[i].min;
+		if (d[i].max > hi) hi = d[i].max;
+	}
+
+	// A domain as large as the number left can't run out...
+
+	for (unsigned i = 0; i < p->nbr; i++) {
+		if (d[i].rec && (fd_size(d+i) >= nbr_free))
+			return 1;
+	}
+
+	// ...otherwise count the values in the union of them all, in a
+	// mask when they fit in one.
+
+	if (nbr_free && ((uint64_t)hi - (uint64_t)lo < 64)) {
+		uint64_t mask = 0;
+
+		for (unsigned i = 0; i < p->nbr; i++) {
+			for (unsigned k = 0; d[i].rec && (k < fd_count(d+i)); k++) {
+				fd_ivl a = fd_ivl_at(d+i, k);
+				uint64_t w = (uint64_t)a.hi - (uint64_t)a.lo + 1;
+				uint64_t m = w < 64 ? (((uint64_t)1 << w) - 1) : ~(uint64_t)0;
+				mask |= m << (a.lo - lo);
+			}
+		}
+
+		return (unsigned)__builtin_popcountll(mask) >= nbr_free;
+	}
+
+	if (nbr > s->ivls_size) {
+		s->ivls_size = nbr;
+		s->ivls = realloc(s->ivls, sizeof(fd_ivl)*s->ivls_size);
+		assert(s->ivls);
+	}
+
+	for (unsigned i = 0, j = 0; i < p->nbr; i++) {
+		for (unsigned k = 0; d[i].rec && (k < fd_count(d+i)); k++)
+			s->ivls[j++] = fd_ivl_at(d+i, k);
+	}
+
+	qsort(s->ivls, nbr, sizeof(fd_ivl), fd_ivl_cmp);
+	uint64_t size = 0;
+
+	for (unsigned i = 0; i < nbr; i++) {
+		fd_ivl a = s->ivls[i];
+
+		if (size && (a.hi <= hi))
+			continue;
+
+		if (size && (a.lo <= hi))
+			a.lo = hi + 1;
+
+		size += (uint64_t)a.hi - (uint64_t)a.lo + 1;
+		hi = a.hi;
+
+		if (size >= nbr_free)
+			return 1;
+	}
+
+	return size >= nbr_free;
+}
+
+// element(I, [X1,...,Xn], V): I is in 1..n, and only where Xi and V
+// can still meet. V is kept within the bounds of those Xi.
+
+static int fd_element(fd_solver *s, fd_prop *p)
+{
+	fd_dom *d = fd_doms(s, p->nbr), *di = d, *dv = d + 1, *dx = d + 2;
+	unsigned n = p->nbr - 2;
+
+	for (unsigned i = 0; i < p->nbr; i++) {
+		if (!fd_get(s->q, p->v+i, d+i))
+			return 0;
+	}
+
+	fd_dom o = fd_interval(1, n);
+
+	if (!fd_narrow(s, di, &o))
+		return 0;
+
+	if (!di->rec) {
+		fd_dom *e = dx + (di->min - 1);
+
+		if (!fd_narrow(s, dv, e))
+			return 0;
+
+		return fd_narrow(s, e, dv);
+	}
+
+	int64_t lo = FD_SUP, hi = FD_INF;
+
+	for (int64_t i = di->min; i <= di->max; i++) {
+		if (!fd_has(di, i))
+			continue;
+
+		fd_dom *e = dx + (i - 1);
+
+		if (!fd_meet(e, dv, NULL)) {
+			if (!fd_remove(s, di, i))
+				return 0;
+
+			continue;
+		}
+
+		if (e->min < lo)
+			lo = e->min;
+
+		if (e->max > hi)
+			hi = e->max;
+	}
+
+	o = fd_interval(lo, hi);
+	return fd_narrow(s, dv, &o);
+}
+
+static int fd_run(fd_solver *s, fd_prop *p)
+{
+	switch (p->kind) {
+	case FD_LIN_EQ:
+	case FD_LIN_LE:
+		return fd_linear(s, p);
+	case FD_LIN_NE:
+		return fd_linear_ne(s, p);
+	case FD_ALLDIFF:
+		return fd_all_different(s, p);
+	case FD_ELEMENT:
+		return fd_element(s, p);
+	}
+
+	return 1;
+}
+
+static int fd_propagate(fd_solver *s)
+{
+	int ok = 1;
+
+	for (unsigned i = 0; i < s->nbr_queued; i++) {
+		fd_prop *p = s->queue[i];
+		p->queued = 0;
+
+		if (ok)
+			ok = fd_run(s, p);
+	}
+
+	s->nbr_queued = 0;
+	return ok;
+}
+
+static fd_prop *fd_new_prop(query *q, unsigned kind, unsigned nbr)
+{
+	fd_prop *p = fd_alloc(q, sizeof(fd_prop)+(sizeof(fd_ref)*nbr));
+	p->kind = kind;
+	p->nbr = nbr;
+	return p;
+}
+
+static int fd_post(fd_solver *s, fd_prop *p)
+{
+	for (unsigned i = 0; i < p->nbr; i++) {
+		fd_dom d;
+
+		if (p->v[i].is_const)
+			continue;
+
+		if (!fd_get(s->q, p->v+i, &d))
+			return 0;
+
+		fd_watch(s->q, &d, p);
+	}
+
+	fd_queue(s, p);
+	return fd_propagate(s);
+}
+
+// Dom is N, L..H with inf and sup for no bound, or D1 \/ D2.
+
+static int fd_bound_value(query *q, cell *c, idx_t c_ctx, int64_t *v)
+{
+	c = deref(q, c, c_ctx);
+
+	if (is_integer(c))
+		*v = c->val_num;
+	else if (is_atom(c) && !strcmp(GET_STR(c), "inf"))
+		*v = FD_INF;
+	else if (is_atom(c) && !strcmp(GET_STR(c), "sup"))
+		*v = FD_SUP;
+	else {
+		throw_error(q, c, "type_error", "integer");
+		return 0;
+	}
+
+	return 1;
+}
+
+static int fd_parse_dom(query *q, cell *c, idx_t c_ctx, fd_dom *d)
+{
+	c = deref(q, c, c_ctx);
+	c_ctx = q->latest_ctx;
+
+	if (is_integer(c)) {
+		*d = fd_interval(c->val_num, c->val_num);
+		return 1;
+	}
+
+	if (is_structure(c) && (c->arity == 2) && !strcmp(GET_STR(c), "..")) {
+		cell *p1 = c + 1, *p2 = p1 + p1->nbr_cells;
+		*d = fd_interval(0, 0);
+
+		if (!fd_bound_value(q, p1, c_ctx, &d->min) || !fd_bound_value(q, p2, c_ctx, &d->max))
+			return 0;
+
+		if (d->min > d->max)
+			return 1;
+
+		fd_normalize(d);
+		return 1;
+	}
+
+	if (is_structure(c) && (c->arity == 2) && !strcmp(GET_STR(c), "\\/")) {
+		cell *p1 = c + 1, *p2 = p1 + p1->nbr_cells;
+		fd_dom o;
+
+		if (!fd_parse_dom(q, p1, c_ctx, d) || !fd_parse_dom(q, p2, c_ctx, &o))
+			return 0;
+
+		if (d->min > d->max)
+			*d = o;
+		else if (o.min <= o.max)
+			fd_or(q, d, &o);
+
+		return 1;
+	}
+
+	if (is_variable(c))
+		throw_error(q, c, "instantiation_error", "not_sufficiently_instantiated");
+	else
+		throw_error(q, c, "type_error", "clpfd_domain");
+
+	return 0;
+}
+
+static int fn_sys_fd_in_2(query *q)
+{
+	GET_FIRST_ARG(p1,integer_or_var);
+	GET_NEXT_ARG(p2,any);
+	fd_dom o, d;
+
+	if (!fd_parse_dom(q, p2, p2_ctx, &o))
+		return 0;
+
+	if (o.min > o.max)
+		return 0;
+
+	fd_solver s = {0};
+	s.q = q;
+	d.var = *p1;
+	d.var_ctx = p1_ctx;
+	int ok = fd_narrow(&s, &d, &o) && fd_propagate(&s);
+	return fd_done(&s, ok);
+}
+
+// A linear expression gathered into sum(a*x)+k.
+
+typedef struct {
+	fd_ref *v;
+	unsigned nbr, size;
+	int64_t k;
+} fd_sum;
+
+static int fd_sum_add(fd_sum *e, const fd_ref *r, int64_t m)
+{
+	int64_t a;
+
+	if (__builtin_mul_overflow(r->a, m, &a))
+		return 0;
+
+	if (r->is_const)
+		return !__builtin_add_overflow(e->k, a, &e->k);
+
+	for (unsigned i = 0; i < e->nbr; i++) {
+		if ((e->v[i].ctx == r->ctx) && (e->v[i].var_nbr == r->var_nbr))
+			return !__builtin_add_overflow(e->v[i].a, a, &e->v[i].a);
+	}
+
+	if (e->nbr == e->size) {
+		e->size = e->size ? e->size * 2 : 8;
+		e->v = realloc(e->v, sizeof(fd_ref)*e->size);
+		assert(e->v);
+	}
+
+	e->v[e->nbr] = *r;
+	e->v[e->nbr++].a = a;
+	return 1;
+}
+
+static int fd_linearize(query *q, fd_sum *e, cell *c, idx_t c_ctx, int64_t m)
+{
+	c = deref(q, c, c_ctx);
+	c_ctx = q->latest_ctx;
+	const char *f = is_structure(c) ? GET_STR(c) : "";
+	fd_ref r = {0};
+
+	if (is_integer(c) || is_variable(c)) {
+		fd_ref_var(q, &r, c, c_ctx);
+
+		if (!r.is_const)
+			r.a = 1;
+
+		if (!fd_sum_add(e, &r, m)) {
+			throw_error(q, c, "domain_error", "integer_overflow");
+			return 0;
+		}
+
+		return 1;
+	}
+
+	if ((c->arity == 2) && (!strcmp(f, "+") || !strcmp(f, "-"))) {
+		cell *p1 = c + 1, *p2 = p1 + p1->nbr_cells;
+		return fd_linearize(q, e, p1, c_ctx, m)
+			&& fd_linearize(q, e, p2, c_ctx, *f == '-' ? -m : m);
+	}
+
+	if ((c->arity == 1) && !strcmp(f, "-"))
+		return fd_linearize(q, e, c+1, c_ctx, -m);
+
+	if ((c->arity == 2) && !strcmp(f, "*")) {
+		cell *p1 = c + 1, *p2 = p1 + p1->nbr_cells;
+		fd_sum e1 = {0}, e2 = {0};
+		int ok = fd_linearize(q, &e1, p1, c_ctx, 1) && fd_linearize(q, &e2, p2, c_ctx, 1);
+
+		if (ok && e1.nbr && e2.nbr) {
+			throw_error(q, c, "domain_error", "clpfd_linear_expression");
+			ok = 0;
+		} else if (ok) {
+			fd_sum *s = e1.nbr ? &e1 : &e2;
+			int64_t k = e1.nbr ? e2.k : e1.k;
+			r.is_const = 1;
+			r.a = s->k;
+			ok = !__builtin_mul_overflow(m, k, &k) && fd_sum_add(e, &r, k);
+
+			for (unsigned i = 0; ok && (i < s->nbr); i++)
+				ok = fd_sum_add(e, s->v+i, k);
+
+			if (!ok)
+				throw_error(q, c, "domain_error", "integer_overflow");
+		}
+
+		free(e1.v);
+		free(e2.v);
+		return ok;
+	}
+
+	if (is_structure(c))
+		throw_error(q, c, "domain_error", "clpfd_linear_expression");
+	else
+		throw_error(q, c, "type_error", "integer");
+
+	return 0;
+}
+
+// '$fd_linear'(L, Op, R) for Op one of #=, #\=, #=<, #<, #>= and #>.
+
+static int fn_sys_fd_linear_3(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,atom);
+	GET_NEXT_ARG(p3,any);
+	const char *op = GET_STR(p2);
+	unsigned kind;
+	int64_t m = 1, bias = 0;
+
+	if (!strcmp(op, "#="))
+		kind = FD_LIN_EQ;
+	else if (!strcmp(op, "#\\="))
+		kind = FD_LIN_NE;
+	else if (!strcmp(op, "#=<"))
+		kind = FD_LIN_LE;
+	else if (!strcmp(op, "#<"))
+		kind = FD_LIN_LE, bias = 1;
+	else if (!strcmp(op, "#>="))
+		kind = FD_LIN_LE, m = -1;
+	else if (!strcmp(op, "#>"))
+		kind = FD_LIN_LE, m = -1, bias = 1;
+	else {
+		throw_error(q, p2, "domain_error", "clpfd_operator");
+		return 0;
+	}
+
+	// As sum(a*x) op k, from L-R op 0.
+
+	fd_sum e = {0};
+
+	if (!fd_linearize(q, &e, p1, p1_ctx, m) || !fd_linearize(q, &e, p3, p3_ctx, -m)) {
+		free(e.v);
+		return 0;
+	}
+
+	unsigned nbr = 0;
+
+	for (unsigned i = 0; i < e.nbr; i++) {
+		if (e.v[i].a)
+			e.v[nbr++] = e.v[i];
+	}
+
+	fd_prop *p = fd_new_prop(q, kind, nbr);
+	p->k = -e.k - bias;
+	memcpy(p->v, e.v, sizeof(fd_ref)*nbr);
+	free(e.v);
+	fd_solver s = {0};
+	s.q = q;
+	return fd_done(&s, fd_post(&s, p));
+}
+
+static unsigned fd_list_length(query *q, cell *l, idx_t l_ctx)
+{
+	unsigned nbr = 0;
+
+	while (is_list(l)) {
+		LIST_HEAD(l);
+		nbr++;
+		l = LIST_TAIL(l);
+		l = deref(q, l, l_ctx);
+		l_ctx = q->latest_ctx;
+	}
+
+	return is_nil(l) ? nbr : 0;
+}
+
+static int fd_list_refs(query *q, fd_ref *r, cell *l, idx_t l_ctx)
+{
+	while (is_list(l)) {
+		cell *h = LIST_HEAD(l);
+		h = deref(q, h, l_ctx);
+
+		if (!fd_ref_var(q, r++, h, q->latest_ctx))
+			return 0;
+
+		l = LIST_TAIL(l);
+		l = deref(q, l, l_ctx);
+		l_ctx = q->latest_ctx;
+	}
+
+	return 1;
+}
+
+static int fn_sys_fd_all_different_1(query *q)
+{
+	GET_FIRST_ARG(p1,list_or_nil);
+	unsigned nbr = fd_list_length(q, p1, p1_ctx);
+	fd_prop *p = fd_new_prop(q, FD_ALLDIFF, nbr);
+
+	if (!fd_list_refs(q, p->v, p1, p1_ctx))
+		return 0;
+
+	fd_solver s = {0};
+	s.q = q;
+	return fd_done(&s, fd_post(&s, p));
+}
+
+static int fn_sys_fd_element_3(query *q)
+{
+	GET_FIRST_ARG(p1,integer_or_var);
+	GET_NEXT_ARG(p2,list);
+	GET_NEXT_ARG(p3,integer_or_var);
+	unsigned nbr = fd_list_length(q, p2, p2_ctx);
+
+	if (!nbr) {
+		throw_error(q, p2, "type_error", "list");
+		return 0;
+	}
+
+	fd_prop *p = fd_new_prop(q, FD_ELEMENT, 2+nbr);
+
+	if (!fd_ref_var(q, p->v, p1, p1_ctx) || !fd_ref_var(q, p->v+1, p3, p3_ctx)
+		|| !fd_list_refs(q, p->v+2, p2, p2_ctx))
+		return 0;
+
+	fd_solver s = {0};
+	s.q = q;
+	return fd_done(&s, fd_post(&s, p));
+}
+
+// Called from attr_unify_hook/2 with (a copy of) the record of a
+// variable just bound to p2.
+
+static int fn_sys_fd_unify_2(query *q)
+{
+	GET_FIRST_ARG(p1,structure);
+	GET_NEXT_ARG(p2,any);
+	fd_link *props = fd_props(p1);
+	fd_solver s = {0};
+	s.q = q;
+	fd_dom o;
+	fd_read(&o, p1);
+	int ok;
+
+	if (is_integer(p2)) {
+		ok = fd_has(&o, p2->val_num);
+	} else if (is_variable(p2) && !find_attr(get_attrs(q, p2, p2_ctx), g_clpfd_s)) {
+		fd_attach(q, p2, p2_ctx, &o, props);
+		return 1;
+	} else if (is_variable(p2)) {
+		fd_dom d;
+		d.var = *p2;
+		d.var_ctx = p2_ctx;
+		ok = fd_narrow(&s, &d, &o);
+
+		for (fd_link *l = props; ok && l; l = l->next)
+			fd_watch(q, &d, l->p);
+	} else
+		ok = 0;
+
+	for (fd_link *l = props; ok && l; l = l->next)
+		fd_queue(&s, l->p);
+
+	ok = ok && fd_propagate(&s);
+	return fd_done(&s, ok);
+}
+
+static int fn_sys_fd_remove_2(query *q)
+{
+	GET_FIRST_ARG(p1,integer_or_var);
+	GET_NEXT_ARG(p2,integer);
+	fd_solver s = {0};
+	s.q = q;
+	fd_dom d;
+	d.var = *p1;
+	d.var_ctx = p1_ctx;
+	int ok = fd_remove(&s, &d, p2->val_num) && fd_propagate(&s);
+	return fd_done(&s, ok);
+}
+
+static void fd_make_bound(cell *tmp, int64_t v)
+{
+	if (v == FD_INF)
+		make_literal(tmp, find_in_pool("inf"));
+	else if (v == FD_SUP)
+		make_literal(tmp, find_in_pool("sup"));
+	else
+		make_int(tmp, v);
+}
+
+static int fd_arg_dom(query *q, cell *c, idx_t c_ctx, fd_dom *d)
+{
+	if (!is_integer(c) && !is_variable(c)) {
+		throw_error(q, c, "type_error", "integer");
+		return 0;
+	}
+
+	d->var = *c;
+	d->var_ctx = c_ctx;
+	return fd_load(q, d);
+}
+
+static int fn_sys_fd_inf_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,any);
+	fd_dom d;
+
+	if (!fd_arg_dom(q, p1, p1_ctx, &d))
+		return 0;
+
+	cell tmp;
+	fd_make_bound(&tmp, d.min);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_sys_fd_sup_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,any);
+	fd_dom d;
+
+	if (!fd_arg_dom(q, p1, p1_ctx, &d))
+		return 0;
+
+	cell tmp;
+	fd_make_bound(&tmp, d.max);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static int fn_sys_fd_size_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,any);
+	fd_dom d;
+
+	if (!fd_arg_dom(q, p1, p1_ctx, &d))
+		return 0;
+
+	uint64_t n = fd_size(&d);
+	cell tmp;
+
+	if (n > INT64_MAX)
+		make_literal(&tmp, find_in_pool("sup"));
+	else
+		make_int(&tmp, n);
+
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+// The domain as a list of Lo-Hi intervals.
+
+static int fn_sys_fd_intervals_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,any);
+	fd_dom d;
+
+	if (!fd_arg_dom(q, p1, p1_ctx, &d))
+		return 0;
+
+	init_tmp_heap(q);
+
+	for (unsigned i = 0; i < fd_count(&d); i++) {
+		fd_ivl a = fd_ivl_at(&d, i);
+		cell pair[3];
+		pair[0].val_type = TYPE_LITERAL;
+		pair[0].nbr_cells = 3;
+		pair[0].arity = 2;
+		pair[0].flags = OP_YFX;
+		pair[0].val_off = find_in_pool("-");
+		fd_make_bound(pair+1, a.lo);
+		fd_make_bound(pair+2, a.hi);
+		append_list(q, pair);
+	}
+
+	cell *l = end_list(q);
+	fix_list(l);
+	return unify(q, p2, p2_ctx, l, q->st.curr_frame);
+}
+
+// '$fd_select'(Vars, Strategy, X) picks the unbound variable to label
+// next: the leftmost, ff the one with the smallest domain, ffc the
+// same breaking ties by the most propagators, min and max the one with
+// the smallest lower or largest upper bound.
+
+static unsigned fd_degree(const fd_dom *d)
+{
+	unsigned n = 0;
+
+	for (fd_link *l = fd_props(d->rec); l; l = l->next)
+		n++;
+
+	return n;
+}
+
+static int fn_sys_fd_select_3(query *q)
+{
+	GET_FIRST_ARG(p1,list_or_nil);
+	GET_NEXT_ARG(p2,atom);
+	GET_NEXT_ARG(p3,any);
+	const char *strategy = GET_STR(p2);
+	int ff = !strcmp(strategy, "ff"), ffc = !strcmp(strategy, "ffc");
+	int min = !strcmp(strategy, "min"), max = !strcmp(strategy, "max");
+	cell *l = p1, best = {0};
+	idx_t l_ctx = p1_ctx, best_ctx = 0;
+	fd_dom bd = {0};
+	int any = 0;
+
+	if (!ff && !ffc && !min && !max && strcmp(strategy, "leftmost")) {
+		throw_error(q, p2, "domain_error", "labeling_option");
+		return 0;
+	}
+
+	while (is_list(l)) {
+		cell *h = LIST_HEAD(l);
+		h = deref(q, h, l_ctx);
+		idx_t h_ctx = q->latest_ctx;
+		fd_dom d;
+
+		if (is_variable(h)) {
+			if (!fd_arg_dom(q, h, h_ctx, &d))
+				return 0;
+
+			if ((d.min == FD_INF) || (d.max == FD_SUP)) {
+				throw_error(q, h, "instantiation_error", "not_sufficiently_instantiated");
+				return 0;
+			}
+
+			int better = !any;
+
+			if (any && (ff || ffc)) {
+				uint64_t n1 = fd_size(&d), n2 = fd_size(&bd);
+				better = (n1 < n2) || (ffc && (n1 == n2) && (fd_degree(&d) > fd_degree(&bd)));
+			} else if (any && min)
+				better = d.min < bd.min;
+			else if (any && max)
+				better = d.max > bd.max;
+
+			if (better) {
+				best = *h;
+				best_ctx = h_ctx;
+				bd = d;
+				any = 1;
+
+				if (!ff && !ffc && !min && !max)
+					break;
+			}
+		} else if (!is_integer(h)) {
+			throw_error(q, h, "type_error", "integer");
+			return 0;
+		}
+
+		l = LIST_TAIL(l);
+		l = deref(q, l, l_ctx);
+		l_ctx = q->latest_ctx;
+	}
+
+	if (!any)
+		return 0;
+
+	return unify(q, p3, p3_ctx, &best, best_ctx);
+}
+
+static int fn_sys_ne_2(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	GET_NEXT_ARG(p2,integer);
+
+	if (p1->val_num++ != p2->val_num)
+		return 0;
+
+	drop_choice(q);
+	return 1;
+}
+
+static int fn_call_nth_2(query *q)
+{
+	GET_FIRST_ARG(p1,callable);
+	GET_NEXT_ARG(p2,integer_or_var);
 
 	if (is_variable(p2)) {
+		cell *tmp = clone_to_heap(q, 1, p1, 1);
+		idx_t nbr_cells = 1 + p1->nbr_cells;
+		make_end_return(tmp+nbr_cells, q->st.curr_cell);
+		q->st.curr_cell = tmp;
+		return 1;
+	}
+
+	cell *tmp = clone_to_heap(q, 1, p1, 4);
+	idx_t nbr_cells = 1 + p1->nbr_cells;
+	make_structure(tmp+nbr_cells++, g_fail_s, fn_sys_ne_2, 2, 2);
+	make_int(tmp+nbr_cells++, 1);
+	make_int(tmp+nbr_cells++, p2->val_num);
+	make_end_return(tmp+nbr_cells, q->st.curr_cell);
+	q->st.curr_cell = tmp;
+	return 1;
+}
+
+static int fn_dcg_translate_rule_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,any);
+	return 0;
+}
+
+static int fn_call_dcg_3(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,any);
+	GET_NEXT_ARG(p3,any);
+
+	if (is_list_or_nil(p1))
+		return unify(q, p1, p1_ctx, p2, p2_ctx);
+
+	if (is_structure(p1) && (p1->val_off == g_braces_s)) {
+		if (!unify(q, p2, p2_ctx, p3, p3_ctx))
+			return 0;
+
+		p1 = p1 + 1;
+		cell *tmp = clone_to_heap(q, 1, p1, 1);
+		idx_t nbr_cells = 1 + p1->nbr_cells;
+		make_end_return(tmp+nbr_cells, q->st.curr_cell);
+		q->st.curr_cell = tmp;
+		return 1;
+	}
+
+	return fn_iso_call_n(q);
+}
+
+static int fn_phrase_3(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,list_or_nil_or_var);
+	GET_NEXT_ARG(p3,list_or_nil_or_var);
+	return fn_call_dcg_3(q);
+}
+
+static int fn_phrase_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,list_or_nil_or_var);
+	cell *this = q->st.curr_cell;
+	cell *tmp = clone_to_heap(q, 1, this, this->nbr_cells+2);
+	idx_t nbr_cells = 1 + this->nbr_cells;
+	make_literal(tmp+nbr_cells++, g_nil_s);
+	make_end_return(tmp+nbr_cells, q->st.curr_cell);
+	tmp[1].arity = 3;
+	tmp[1].fn = fn_call_dcg_3;
+	tmp[1].nbr_cells += 1;
+	q->st.curr_cell = tmp;
+	return 1;
+}
+
+static int do_length(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,integer);
+	unsigned nbr = p2->val_num;
+	GET_RAW_ARG(2, p2_orig);
+	cell tmp;
+	make_int(&tmp, ++nbr);
+	reset_value(q, p2_orig, p2_orig_ctx, &tmp, q->st.curr_frame);
+	make_choice(q);
+
+	if (is_anon(p1))
+		return 1;
+
+	if (nbr >= MAX_VARS) {
+		drop_choice(q);
+		throw_error(q, p2, "resource_error", "too_many_vars");
+		return 0;
+	}
+
+	cell v = *p1;
+	unsigned var_nbr;
+
+	if (!(var_nbr = create_vars(q, nbr))) {
+		drop_choice(q);
+		throw_error(q, p1, "resource_error", "too_many_vars");
+		return 0;
+	}
+
+	tmp.val_type = TYPE_VARIABLE;
+	tmp.nbr_cells = 1;
+	tmp.flags = FLAG_FRESH;
+	tmp.val_off = g_anon_s;
+	tmp.var_nbr = var_nbr++;
+	tmp.arity = 0;
+	alloc_list(q, &tmp);
+
+	for (unsigned i = 1; i < nbr; i++) {
+		tmp.var_nbr = var_nbr++;
+		append_list(q, &tmp);
+	}
+
+	cell *l = end_list(q);
+	fix_list(l);
+	set_var(q, &v, p1_ctx, l, q->st.curr_frame);
+	return 1;
+}
+
+static int fn_iso_length_2(query *q)
+{
+	if (q->retry)
+		return do_length(q);
+
+	GET_FIRST_ARG(p1,list_or_nil_or_var);
+	GET_NEXT_ARG(p2,integer_or_var);
+
+	if (is_variable(p1) && is_variable(p2)) {
 		cell tmp;
-		make_int(&tmp, p1_val);
+		make_int(&tmp, 0);
 		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		make_choice(q);
+
+		if (!is_anon(p1)) {
+			make_literal(&tmp, g_nil_s);
+			set_var(q, p1,p1_ctx, &tmp, q->st.curr_frame);
+		}
+
 		return 1;
 	}
 
-	return p1_val == (uint_t)p2->val_num;  //FIXME: cehteh: is this cast correct?
-}
+	if (!is_variable(p1) && is_variable(p2)) {
+		if (!is_list(p1) && !is_nil(p1))
+			return 0;
+
+		unsigned cnt = 0;
+
+		if (is_string(p1)) {
+			cnt = strlen_utf8(p1->val_str);
+		} else {
+			cell *l = p1;
+
+			while (is_list(l)) {
+				LIST_HEAD(l);
+				l = LIST_TAIL(l);
+				l = deref(q, l, p1_ctx);
+				p1_ctx = q->latest_ctx;
+				cnt++;
+			}
+		}
+
+		cell tmp;
+		make_int(&tmp, cnt);
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return 1;
+	}
+
+	if (is_integer(p2) && !is_variable(p1)) {
+		if (p2->val_num < 0) {
+			throw_error(q, p2, "domain_error", "out_of_range");
+			return 0;
+		}
+
+		if (p2->val_num == 0) {
+			cell tmp;
+			make_literal(&tmp, g_nil_s);
+			return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+		}
+
+		int cnt = 0;
+
+		if (is_string(p1)) {
+			cnt = strlen_utf8(p1->val_str);
+		} else {
+			cell *l = p1;
+
+			while (is_list(l)) {
+				LIST_HEAD(l);
+				l = LIST_TAIL(l);
+				l = deref(q, l, p1_ctx);
+				p1_ctx = q->latest_ctx;
+				cnt++;
+			}
+		}
+
+		return p2->val_num == cnt;
+	}
+
+
+	if (is_variable(p1) && is_integer(p2)) {
+		if (is_anon(p1))
+			return 1;
+
+		if (p2->val_num < 0) {
+			throw_error(q, p2, "domain_error", "positive_integers");
+			return 0;
+		}
+
+		if (p2->val_num >= MAX_VARS) {
+			throw_error(q, p2, "resource_error", "too_many_vars");
+			return 0;
+		}
+
+		idx_t nbr = p2->val_num;
+
+		if (nbr == 0) {
+			cell tmp;
+			make_literal(&tmp, g_nil_s);
+			set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+			return 1;
+		}
 
-static int fn_octal_chars_2(query *q)
-{
-	GET_FIRST_ARG(p2,integer_or_var);
-	GET_NEXT_ARG(p1,atom_or_var);
+		cell v = *p1;
+		unsigned var_nbr;
 
-	if (is_variable(p1) && is_variable(p2)) {
-		throw_error(q, p1, "instantiation_error", "not_sufficiently_instantiated");
-		return 0;
-	}
+		if (!(var_nbr = create_vars(q, nbr))) {
+			throw_error(q, p2, "resource_error", "too_many_vars");
+			return 0;
+		}
 
-	if (is_variable(p1)) {
-		char tmpbuf[256];
-		sprintf(tmpbuf, "%llo", (long long)p2->val_num);
-		cell tmp = make_string(q, tmpbuf, strlen(tmpbuf));
-		set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
-		return 1;
-	}
+		cell tmp;
+		tmp.val_type = TYPE_VARIABLE;
+		tmp.nbr_cells = 1;
+		tmp.arity = 0;
+		tmp.flags = FLAG_FRESH;
+		tmp.val_off = g_anon_s;
+		tmp.var_nbr = var_nbr++;
+		alloc_list(q, &tmp);
 
-	const char *src = GET_STR(p1);
-	uint_t p1_val = strtoull(src, NULL, 8);
+		for (idx_t i = 1; i < nbr; i++) {
+			tmp.var_nbr = var_nbr++;
+			append_list(q, &tmp);
+		}
 
-	if (is_variable(p2)) {
-		cell tmp;
-		make_int(&tmp, p1_val);
-		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		cell *l = end_list(q);
+		fix_list(l);
+		set_var(q, &v, p1_ctx, l, q->st.curr_frame);
 		return 1;
 	}
 
-	return p1_val == (uint_t)p2->val_num;  //FIXME: cehteh: is this cast correct?
+	throw_error(q, p1, "type_error", "arg_invalid");
+	return 0;
 }
 
-static int fn_rdiv_2(query *q)
-{
-	GET_FIRST_ARG(p1_tmp,any);
-	GET_NEXT_ARG(p2_tmp,any);
-	cell p1 = calc(q, p1_tmp);
-	cell p2 = calc(q, p2_tmp);
-
-	if (is_rational(&p1) && is_rational(&p2)) {
-		p1.val_num *= p2.val_den;
-		p2.val_num *= p1.val_den;
-		q->accum.val_num = p1.val_num;
-		q->accum.val_den = p2.val_num;
-		q->accum.val_type = TYPE_INTEGER;
-	} else {
-		throw_error(q, &p1, "type_error", "integer");
-		return 0;
-	}
+// List kernels. These walk the list cells directly instead of going
+// through the Prolog definitions in library(lists)...
 
-	return 1;
-}
+typedef struct {
+	cell c, *p;
+	idx_t ctx;
+	unsigned has_vars:1;
+} list_item;
 
-static void do_real_to_fraction(double v, double accuracy, int_t *num, int_t *den)
-{
-	if (accuracy <= 0.0 || accuracy >= 1.0)
-		abort();
+#define LIST_ITEM(e) (is_structure(&(e)->c) ? (e)->p : &(e)->c)
 
-	int_t sign = v < 0 ? -1 : 1;
+// Gather the elements of a proper list. Atomic elements are copied
+// as slots may move when vars are created.
 
-	if (sign == -1) {
-		v = fabs(v);
-	}
+static list_item *collect_list(query *q, cell *l, idx_t l_ctx, size_t *nbr)
+{
+	size_t cnt = 0, max = 64;
+	list_item *items = malloc(sizeof(list_item)*max);
 
-	double maxError = sign == 0 ? accuracy : v * accuracy;
-	int_t n = floor(v);
-	v -= n;
+	while (is_list(l)) {
+		cell *h = LIST_HEAD(l);
+		h = deref(q, h, l_ctx);
 
-	if (v < maxError) {
-		*num = n * sign;
-		*den = 1;
-		return;
-	}
+		if (cnt == max) {
+			max *= 2;
+			items = realloc(items, sizeof(list_item)*max);
+		}
 
-	if ((1 - maxError) < v) {
-		*num = (n+1) * sign;
-		*den = 1;
-		return;
+		list_item *e = items + cnt++;
+		e->c = *h;
+		e->p = h;
+		e->ctx = q->latest_ctx;
+		e->has_vars = 0;
+		l = LIST_TAIL(l);
+		l = deref(q, l, l_ctx);
+		l_ctx = q->latest_ctx;
 	}
 
-	double z = v;
-	int_t previous_denominator = 0;
-	int_t denominator = 1;
-	int_t numerator;
-
-	do
-	{
-		z = 1.0 / (z - (int_t) z);
-		int_t tmp = denominator;
-		denominator = denominator * (int_t)z + previous_denominator;
-		previous_denominator = tmp;
-		numerator = v * denominator;
+	if (!is_nil(l)) {
+		free(items);
+		return NULL;
 	}
-	while (fabs(v-(double)numerator/denominator) > maxError && (z != (int_t)z));
 
-	*num = (n * denominator + numerator) * sign;
-	*den = denominator;
-	return;
+	*nbr = cnt;
+	return items;
 }
 
-static int fn_atom_1(query *q)
-{
-	GET_FIRST_ARG(p1,any);
-	return is_string(p1);
-}
+// Make a list on the heap from the given items, ending in 'tail'
+// (or [] if NULL). The new list belongs to the current frame, so
+// anything still containing variables is passed in by binding a
+// fresh variable to it.
 
-static int fn_rational_1(query *q)
+static cell *make_list_from_items(query *q, list_item *items, size_t nbr, cell *tail, idx_t tail_ctx)
 {
-	GET_FIRST_ARG(p1_tmp,any);
-
-	if (q->calc) {
-		cell p1 = calc(q, p1_tmp);
+	unsigned nbr_vars = 0;
 
-		if (is_rational(&p1)) {
-			reduce(&p1);
-			q->accum.val_num = p1.val_num;
-			q->accum.val_den = p1.val_den;
-			q->accum.val_type = TYPE_INTEGER;
-			return 1;
-		}
+	for (size_t i = 0; i < nbr; i++) {
+		list_item *e = items + i;
+		e->has_vars = has_vars(q, LIST_ITEM(e), e->ctx);
+		nbr_vars += e->has_vars;
+	}
 
-		if (is_float(&p1)) {
-			do_real_to_fraction(p1.val_flt, 0.00001, &q->accum.val_num, &q->accum.val_den);
-			q->accum.val_type = TYPE_INTEGER;
-			return 1;
-		}
+	int tail_vars = tail && !is_atomic(tail);
+	nbr_vars += tail_vars;
+	frame *g = GET_FRAME(q->st.curr_frame);
 
-		throw_error(q, &p1, "type_error", "number");
-		return 0;
+	if ((g->nbr_vars + nbr_vars) >= MAX_VARS) {
+		throw_error(q, q->st.curr_cell, "resource_error", "too_many_vars");
+		return NULL;
 	}
 
-	return is_rational(p1_tmp);
-}
+	unsigned var_nbr = nbr_vars ? create_vars(q, nbr_vars) : 0;
 
-static int fn_getenv_2(query *q)
-{
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,atom_or_var)
-	const char *value = getenv(GET_STR(p1));
+	cell v;
+	v.val_type = TYPE_VARIABLE;
+	v.nbr_cells = 1;
+	v.arity = 0;
+	v.flags = FLAG_FRESH;
+	v.val_off = g_anon_s;
+	init_tmp_heap(q);
 
-	if (!value)
-		return 0;
+	for (size_t i = 0; i < nbr; i++) {
+		list_item *e = items + i;
+		cell *tmp = alloc_tmp_heap(q, 1);
+		make_literal(tmp, g_dot_s);
+		tmp->arity = 2;
 
-	cell tmp = make_cstring(q, (char*)value);
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-}
+		if (!e->has_vars) {
+			deep_clone2_to_tmp(q, LIST_ITEM(e), e->ctx);
+			continue;
+		}
 
-static int fn_setenv_2(query *q)
-{
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,atom_or_int)
+		v.var_nbr = var_nbr++;
+		set_var(q, &v, q->st.curr_frame, LIST_ITEM(e), e->ctx);
+		tmp = alloc_tmp_heap(q, 1);
+		*tmp = v;
+	}
 
-	if (is_atom(p2)) {
-		setenv(GET_STR(p1), GET_STR(p2), 1);
+	if (!tail) {
+		cell *tmp = alloc_tmp_heap(q, 1);
+		make_literal(tmp, g_nil_s);
+	} else if (!tail_vars) {
+		deep_clone2_to_tmp(q, tail, tail_ctx);
 	} else {
-		char tmpbuf[256];
-		sprint_int(tmpbuf, sizeof(tmpbuf), p2->val_num, 10);
-		setenv(GET_STR(p1), tmpbuf, 1);
+		v.var_nbr = var_nbr++;
+		set_var(q, &v, q->st.curr_frame, tail, tail_ctx);
+		cell *tmp = alloc_tmp_heap(q, 1);
+		*tmp = v;
 	}
 
-	return 1;
-}
-
-static int fn_unsetenv_1(query *q)
-{
-	GET_FIRST_ARG(p1,atom);
-	unsetenv(GET_STR(p1));
-	return 1;
-}
-
-static int fn_uuid_1(query *q)
-{
-	GET_FIRST_ARG(p1,variable);
-    uuid u;
-    uuid_gen(&u);
-    char tmpbuf[128];
-    uuid_to_buf(&u, tmpbuf, sizeof(tmpbuf));
-	cell tmp = make_cstring(q, tmpbuf);
-	tmp.flags |= FLAG_STRING;
-	set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
-	return 1;
+	idx_t nbr_cells = tmp_heap_used(q);
+	cell *l = alloc_heap(q, nbr_cells);
+	copy_cells(l, get_tmp_heap(q, 0), nbr_cells);
+	l->nbr_cells = nbr_cells;
+	init_tmp_heap(q);
+	fix_list(l);
+	return l;
 }
 
-static int fn_atomic_concat_3(query *q)
+static int unify_items(query *q, cell *p1, idx_t p1_ctx, list_item *items, size_t nbr)
 {
-	if (q->retry)
-		return do_atom_concat_3(q);
+	cell *l = make_list_from_items(q, items, nbr, NULL, 0);
+	free(items);
 
-	GET_FIRST_ARG(p1,any);
-	GET_NEXT_ARG(p2,any);
-	GET_NEXT_ARG(p3,any);
+	if (!l)
+		return 0;
 
-	if (is_variable(p1) && is_variable(p2))
-		return do_atom_concat_3(q);
+	return unify(q, p1, p1_ctx, l, q->st.curr_frame);
+}
 
-	if (is_variable(p3)) {
-		if (!is_atomic(p1)) {
-			throw_error(q, p1, "type_error", "atomic");
-			return 0;
-		}
+// Atoms and numbers can be hashed on value. Anything else has to be
+// matched by unification (or compare/3 when testing identity).
 
-		if (!is_atomic(p2)) {
-			throw_error(q, p2, "type_error", "atomic");
-			return 0;
-		}
+#define is_hashable(c) (is_atomic(c) && !is_string(c) && !is_bigint(c))
 
-		const char *src1, *src2;
-		size_t len1, len2;
-		char tmpbuf1[256], tmpbuf2[256];
+static uint64_t hash_atomic(const cell *c)
+{
+	uint64_t h = 14695981039346656037ULL;
 
-		if (is_atom(p1)) {
-			len1 = LEN_STR(p1);
-			src1 = GET_STR(p1);
-		} else if (is_integer(p1)) {
-			len1 = sprint_int(tmpbuf1, sizeof(tmpbuf1), p1->val_num, 10);
-			src1 = tmpbuf1;
-		} else if (is_rational(p1)) {
-			len1 = sprint_int(tmpbuf1, sizeof(tmpbuf1), p1->val_num, 10);
-			len1 += sprint_int(tmpbuf1+len1, sizeof(tmpbuf1)-len1, p1->val_den, 10);
-			src1 = tmpbuf1;
-		} else {
-			len1 = sprintf(tmpbuf1, "%.17g", p1->val_flt);
-			src1 = tmpbuf1;
-		}
+	if (is_atom(c)) {
+		const char *s = GET_STR(c);
 
-		if (is_atom(p2)) {
-			len2 = LEN_STR(p2);
-			src2 = GET_STR(p2);
-		} else if (is_integer(p2)) {
-			len2 = sprint_int(tmpbuf2, sizeof(tmpbuf2), p2->val_num, 10);
-			src2 = tmpbuf2;
-		} else if (is_rational(p2)) {
-			len2 = sprint_int(tmpbuf2, sizeof(tmpbuf2), p2->val_num, 10);
-			len2 += sprint_int(tmpbuf2+len2, sizeof(tmpbuf2)-len2, p2->val_den, 10);
-			src2 = tmpbuf2;
-		} else {
-			len2 = sprintf(tmpbuf2, "%.17g", p2->val_flt);
-			src2 = tmpbuf2;
+		for (size_t len = LEN_STR(c); len--; s++) {
+			h ^= (uint8_t)*s;
+			h *= 1099511628211ULL;
 		}
 
-		size_t nbytes = len1 + len2;
-		char *dst = malloc(nbytes + 1);
-		memcpy(dst, src1, len1);
-		memcpy(dst+len1, src2, len2);
-		dst[nbytes] = '\0';
-		cell tmp = make_cstringn(q, dst, nbytes);
-		tmp.flags |= FLAG_STRING;
-		set_var(q, p3, p3_ctx, &tmp, q->st.curr_frame);
-		free(dst);
-		return 1;
-	}
-
-	if (is_variable(p1)) {
-		if (strcmp(GET_STR(p3)+(LEN_STR(p3)-LEN_STR(p2)), GET_STR(p2)))
-			return 0;
-
-		char *dst = strndup(GET_STR(p3), LEN_STR(p3)-LEN_STR(p2));
-		cell tmp = make_cstring(q, dst);
-		tmp.flags |= FLAG_STRING;
-		set_var(q, p3, p3_ctx, &tmp, q->st.curr_frame);
-		free(dst);
-		return 1;
-	}
-
-	if (is_variable(p2)) {
-		if (strncmp(GET_STR(p3), GET_STR(p1), LEN_STR(p1)))
-			return 0;
-
-		char *dst = strdup(GET_STR(p3)+LEN_STR(p1));
-		cell tmp = make_cstring(q, dst);
-		tmp.flags |= FLAG_STRING;
-		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-		free(dst);
-		return 1;
+		return h;
 	}
 
-	if (strncmp(GET_STR(p3), GET_STR(p1), LEN_STR(p1)))
-		return 0;
+	if (is_rational(c)) {
+		h ^= (uint64_t)c->val_num;
+		h *= 1099511628211ULL;
+		h ^= (uint64_t)c->val_den;
+		return h * 0x9E3779B97F4A7C15ULL;
+	}
 
-	if (strcmp(GET_STR(p3)+LEN_STR(p1), GET_STR(p2)))
-		return 0;
+	double d = c->val_flt != 0.0 ? c->val_flt : 0.0;
+	memcpy(&h, &d, sizeof(h));
+	return (h ^ (h >> 29)) * 0x9E3779B97F4A7C15ULL;
+}
 
-	return 1;
+static int equal_atomic(const cell *c1, const cell *c2)
+{
+	if (is_atom(c1) && is_atom(c2))
+		return (LEN_STR(c1) == LEN_STR(c2)) && !memcmp(GET_STR(c1), GET_STR(c2), LEN_STR(c1));
+
+	if (is_rational(c1) && is_rational(c2))
+		return (c1->val_num == c2->val_num) && (c1->val_den == c2->val_den);
+
+	if (is_float(c1) && is_float(c2))
+		return c1->val_flt == c2->val_flt;
+
+	return 0;
 }
 
-static int fn_replace_4(query *q)
+static void init_atomic_set(atomic_set *s, size_t nbr)
 {
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,atom);
-	GET_NEXT_ARG(p3,atom);
-	GET_NEXT_ARG(p4,variable);
+	s->size = 16;
 
-	int srclen = LEN_STR(p1);
-	int dstlen = srclen * 2;
-	const char *src = GET_STR(p1);
-	const char *s1 = GET_STR(p2);
-	const char *s2 = GET_STR(p3);
-	int s1len = LEN_STR(p2);
-	int s2len = LEN_STR(p3);
-	char *dstbuf = (char*)malloc(dstlen + 1);
-	char *dst = dstbuf;
+	while (s->size < (nbr * 2))
+		s->size *= 2;
 
-	while (srclen > 0) {
-		if (!strncmp(src, s1, s1len)) {
-			if (dstlen < s2len) {
-				size_t save_len = dst - dstbuf;
-				dstlen = ((save_len)*2) + s2len;
-				dstbuf = (char *)realloc(dstbuf, dstlen + 1);
-				dst = dstbuf + save_len;
-			}
+	s->cells = calloc(s->size, sizeof(cell));
+	s->cnt = 0;
+}
 
-			strcpy(dst, s2);
-			dst += s2len;
-			dstlen -= s2len;
-			src += s1len;
-			srclen -= s1len;
-		} else {
-			if (dstlen < 1) {
-				size_t max_len = dst - dstbuf;
-				dstlen = max_len *= 2;
-				dstbuf = (char *)realloc(dstbuf, dstlen + 1);
-				dst = dstbuf + max_len;
-			}
+static cell *find_atomic_set(const atomic_set *s, const cell *c)
+{
+	size_t i = hash_atomic(c) & (s->size - 1);
 
-			*dst++ = *src++;
-			dstlen--;
-			srclen--;
-		}
-	}
+	while (!is_empty(s->cells+i) && !equal_atomic(s->cells+i, c))
+		i = (i + 1) & (s->size - 1);
 
-	*dst = '\0';
-	cell tmp = make_cstring(q, dstbuf);
-	tmp.flags |= FLAG_STRING;
-	free(dstbuf);
-	set_var(q, p4, p4_ctx, &tmp, q->st.curr_frame);
-	return 1;
+	return s->cells + i;
 }
 
-static int fn_predicate_property_2(query *q)
+// Returns 0 if already present. Blobs are not copied so the cell's
+// string must outlive the set.
+
+static int add_atomic_set(atomic_set *s, const cell *c)
 {
-	GET_FIRST_ARG(p1,callable);
-	GET_NEXT_ARG(p2,atom_or_var)
-	cell tmp;
+	if ((s->cnt * 2) >= s->size) {
+		cell *save = s->cells;
+		size_t save_size = s->size;
+		s->size *= 2;
+		s->cells = calloc(s->size, sizeof(cell));
 
-	rule *h = find_functor(q->m, GET_STR(p1), p1->arity);
+		for (size_t i = 0; i < save_size; i++) {
+			if (!is_empty(save+i))
+				*find_atomic_set(s, save+i) = save[i];
+		}
 
-	if (check_builtin(q->m, GET_STR(p1), p1->arity)) {
-		make_literal(&tmp, find_in_pool("built_in"));
-		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
-			return 1;
+		free(save);
 	}
 
-	if (h && !h->is_dynamic) {
-		make_literal(&tmp, find_in_pool("built_in"));
-		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
-			return 1;
-	}
+	cell *e = find_atomic_set(s, c);
 
-	if (h && h->is_dynamic) {
-		make_literal(&tmp, find_in_pool("dynamic"));
-		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
-			return 1;
-	}
+	if (!is_empty(e))
+		return 0;
 
-	if (h && h->is_persist) {
-		make_literal(&tmp, find_in_pool("persist"));
-		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
-			return 1;
-	}
+	*e = *c;
+	s->cnt++;
+	return 1;
+}
 
-	if (h && h->is_public) {
-		make_literal(&tmp, find_in_pool("public"));
-		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
-			return 1;
-	}
+static int in_atomic_set(const atomic_set *s, const cell *c)
+{
+	return !is_empty(find_atomic_set(s, c));
+}
 
-	if (h && h->is_public) {
-		make_literal(&tmp, find_in_pool("exported"));
-		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
-			return 1;
-	}
+// As memberchk/2: the first element that unifies leaves its bindings.
 
-	if (h) {
-		make_literal(&tmp, find_in_pool("visible"));
-		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+static int do_memberchk(query *q, cell *p1, idx_t p1_ctx, list_item *items, size_t nbr)
+{
+	make_choice(q);
+
+	for (size_t i = 0; i < nbr; i++) {
+		list_item *e = items + i;
+
+		if (is_hashable(p1) && is_hashable(&e->c)) {
+			if (!equal_atomic(p1, &e->c))
+				continue;
+
+			drop_choice(q);
 			return 1;
-	}
+		}
 
-	if (h) {
-		make_literal(&tmp, find_in_pool("static"));
-		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+		if (unify(q, p1, p1_ctx, LIST_ITEM(e), e->ctx)) {
+			drop_choice(q);
 			return 1;
+		}
+
+		undo_me(q);
 	}
 
+	drop_choice(q);
 	return 0;
 }
 
-static int fn_numbervars_1(query *q)
+static int do_nth(query *q, int base)
 {
-	GET_FIRST_ARG(p1,any);
+	GET_FIRST_ARG(p1,integer_or_var);
+	GET_NEXT_ARG(p2,list_or_nil);
+	GET_NEXT_ARG(p3,any);
 
-	cell *slots[MAX_ARITY] = {0};
+	if (!q->retry && is_integer(p1)) {
+		if (p1->val_num < base)
+			return 0;
 
-	if (is_structure(p1))
-		do_collect_vars(q, p1+1, p1_ctx, p1->nbr_cells-1, slots);
-	else
-		do_collect_vars(q, p1, p1_ctx, p1->nbr_cells, slots);
+		int_t n = p1->val_num - base;
+		cell *l = p2;
 
-	q->nv_mask = 0;
-	unsigned end = q->nv_start = 0;
+		while (is_list(l)) {
+			cell *h = LIST_HEAD(l);
 
-	for (unsigned i = 0; i < MAX_ARITY; i++) {
-		if (!slots[i])
-			continue;
+			if (!n--) {
+				h = deref(q, h, p2_ctx);
+				return unify(q, p3, p3_ctx, h, q->latest_ctx);
+			}
 
-		q->nv_mask |= 1ULL << slots[i]->var_nbr;
-		end++;
+			l = LIST_TAIL(l);
+			l = deref(q, l, p2_ctx);
+			p2_ctx = q->latest_ctx;
+		}
+
+		return 0;
 	}
 
-	return 1;
-}
+	int_t n = q->retry ? p1->val_num - base + 1 : 0;
+	int_t i = n;
+	cell *l = p2;
 
-static int fn_numbervars_3(query *q)
-{
-	GET_FIRST_ARG(p1,any);
-	GET_NEXT_ARG(p2,integer)
-	GET_NEXT_ARG(p3,integer_or_var)
+	while (is_list(l) && i--) {
+		LIST_HEAD(l);
+		l = LIST_TAIL(l);
+		l = deref(q, l, p2_ctx);
+		p2_ctx = q->latest_ctx;
+	}
 
-	cell *slots[MAX_ARITY] = {0};
+	if (!is_list(l))
+		return 0;
 
-	if (is_structure(p1))
-		do_collect_vars(q, p1+1, p1_ctx, p1->nbr_cells-1, slots);
-	else
-		do_collect_vars(q, p1, p1_ctx, p1->nbr_cells, slots);
+	cell *h = LIST_HEAD(l);
+	h = deref(q, h, p2_ctx);
+	cell save_h = *h;
+	idx_t h_ctx = q->latest_ctx;
+	cell *t = LIST_TAIL(l);
+	t = deref(q, t, p2_ctx);
+	cell tmp;
+	make_int(&tmp, n + base);
 
-	q->nv_mask = 0;
-	unsigned end = q->nv_start = p2->val_num;
+	if (!q->retry) {
+		set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	} else {
+		GET_RAW_ARG(1,p1_raw);
+		reset_value(q, p1_raw, p1_raw_ctx, &tmp, q->st.curr_frame);
+	}
 
-	for (unsigned i = 0; i < MAX_ARITY; i++) {
-		if (!slots[i])
-			continue;
+	if (is_list(t))
+		make_choice(q);
 
-		q->nv_mask |= 1ULL << slots[i]->var_nbr;
-		end++;
-	}
+	return unify(q, p3, p3_ctx, is_structure(h) ? h : &save_h, h_ctx);
+}
 
-	cell tmp;
-	make_int(&tmp, end);
-	return unify(q, p3, p3_ctx, &tmp, q->st.curr_frame);
+static int fn_nth0_3(query *q)
+{
+	return do_nth(q, 0);
 }
 
-unsigned count_bits(uint64_t mask, unsigned bit)
+static int fn_nth1_3(query *q)
 {
-	unsigned bits = 0;
+	return do_nth(q, 1);
+}
 
-	for (unsigned i = 0; i < bit; i++) {
-		if ((1ULL << i) & mask)
-			bits++;
+static int fn_last_2(query *q)
+{
+	GET_FIRST_ARG(p1,list_or_nil);
+	GET_NEXT_ARG(p2,any);
+	cell *l = p1, *last = NULL, save_last;
+	idx_t last_ctx = 0;
+
+	while (is_list(l)) {
+		cell *h = LIST_HEAD(l);
+		last = deref(q, h, p1_ctx);
+		save_last = *last;
+		last_ctx = q->latest_ctx;
+		l = LIST_TAIL(l);
+		l = deref(q, l, p1_ctx);
+		p1_ctx = q->latest_ctx;
 	}
 
-	return bits;
-}
+	if (!last || !is_nil(l))
+		return 0;
 
-static int fn_var_number_2(query *q)
-{
-	GET_FIRST_ARG(p1,variable);
-	GET_NEXT_ARG(p2,integer_or_var)
-	unsigned pos = count_bits(q->nv_mask, p1->var_nbr);
-	cell tmp;
-	make_int(&tmp, q->nv_start+pos);
-	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	return unify(q, p2, p2_ctx, is_structure(last) ? last : &save_last, last_ctx);
 }
 
-static int fn_char_type_2(query *q)
+// With an open first list the answers have to be enumerated, so
+// that case is handed over to the '$reverse'/2 clauses.
+
+static int fn_reverse_2(query *q)
 {
-	GET_FIRST_ARG(p1,atom_or_int);
-	GET_NEXT_ARG(p2,atom);
-	int ch;
+	GET_FIRST_ARG(p1,list_or_nil_or_var);
+	GET_NEXT_ARG(p2,list_or_nil_or_var);
+	cell *l = p1;
+	idx_t l_ctx = p1_ctx;
+
+	while (is_list(l)) {
+		LIST_HEAD(l);
+		l = LIST_TAIL(l);
+		l = deref(q, l, l_ctx);
+		l_ctx = q->latest_ctx;
+	}
+
+	if (is_variable(l)) {
+		cell *tmp = clone_to_heap(q, 1, q->st.curr_cell, 1);
+		idx_t nbr_cells = 1 + q->st.curr_cell->nbr_cells;
+		tmp[1].val_off = find_in_pool("$reverse");
+		tmp[1].flags &= ~FLAG_BUILTIN;
+		tmp[1].match = find_matching_rule(q->m, tmp+1);
+		make_end_return(tmp+nbr_cells, q->st.curr_cell);
+		q->st.curr_cell = tmp;
+		return 1;
+	}
 
-	if (is_atom(p1)) {
-		if (LEN_STR(p1) != 1)
-			return 0;
+	size_t nbr;
+	list_item *items = collect_list(q, p1, p1_ctx, &nbr);
 
-		ch = peek_char_utf8(GET_STR(p1));
-	} else
-		ch = p1->val_num;
+	if (!items) {
+		throw_error(q, p1, "type_error", "list");
+		return 0;
+	}
 
-	if (!strcmp(GET_STR(p2), "alpha"))
-		return isalpha(ch);
-	else if (!strcmp(GET_STR(p2), "digit"))
-		return isdigit(ch);
-	else if (!strcmp(GET_STR(p2), "xdigit"))
-		return isxdigit(ch);
-	else if (!strcmp(GET_STR(p2), "whitespace"))
-		return isblank(ch) || isspace(ch);
-	else if (!strcmp(GET_STR(p2), "white"))
-		return isblank(ch);
-	else if (!strcmp(GET_STR(p2), "space"))
-		return isspace(ch);
-	else if (!strcmp(GET_STR(p2), "lower"))
-		return islower(ch);
-	else if (!strcmp(GET_STR(p2), "upper"))
-		return isupper(ch);
-	else if (!strcmp(GET_STR(p2), "punct"))
-		return ispunct(ch);
-	else if (!strcmp(GET_STR(p2), "cntrl"))
-		return iscntrl(ch);
-	else if (!strcmp(GET_STR(p2), "graph"))
-		return isgraph(ch);
-	else if (!strcmp(GET_STR(p2), "ascii"))
-		return ch < 128;
-	else if (!strcmp(GET_STR(p2), "newline"))
-		return ch == 10;
-	else if (!strcmp(GET_STR(p2), "end_of_line"))
-		return (ch >= 10) && (ch <= 13);
-	else if (!strcmp(GET_STR(p2), "end_of_file"))
-		return ch == -1;
-	else if (!strcmp(GET_STR(p2), "quote"))
-		return (ch == '\'') || (ch == '"') || (ch == '`');
-	else if (!strcmp(GET_STR(p2), "period"))
-		return (ch == '.') || (ch == '!') || (ch == '?');
+	for (size_t i = 0, j = nbr-1; nbr && (i < j); i++, j--) {
+		list_item tmp = items[i];
+		items[i] = items[j];
+		items[j] = tmp;
+	}
 
-	return 0;
+	return unify_items(q, p2, p2_ctx, items, nbr);
 }
 
-static void restore_db(module *m, FILE *fp)
+static int fn_memberchk_2(query *q)
 {
-	parser *p = create_parser(m);
-	query *q = create_query(m, 0);
-	p->one_shot = 1;
-	p->fp = fp;
-	m->loading = 1;
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,list_or_nil_or_var);
+	cell *l = p2;
 
-	for (;;) {
-		if (getline(&p->save_line, &p->n_line, p->fp) == -1)
-			break;
+	if (is_hashable(p1)) {
+		while (is_list(l)) {
+			cell *h = LIST_HEAD(l);
+			h = deref(q, h, p2_ctx);
+
+			if (is_hashable(h)) {
+				if (equal_atomic(p1, h))
+					return 1;
+			} else if (!is_structure(h))
+				break;
 
-		p->srcptr = p->save_line;
-		parser_tokenize(p, 0, 0);
-		parser_xref(p, p->t, NULL);
-		query_execute(q, p->t);
-		clear_term(p->t);
+			l = LIST_TAIL(l);
+			l = deref(q, l, p2_ctx);
+			p2_ctx = q->latest_ctx;
+		}
 	}
 
-	m->loading = 0;
-	destroy_query(q);
-	free(p->save_line);
-	destroy_parser(p);
-}
+	make_choice(q);
 
-void do_db_load(module *m)
-{
-	if (!m->use_persist)
-		return;
+	while (is_list(l)) {
+		cell *h = LIST_HEAD(l);
+		h = deref(q, h, p2_ctx);
 
-	char filename[1024];
-	snprintf(filename, sizeof(filename), "%s.db", m->name);
-	char filename2[1024];
-	snprintf(filename2, sizeof(filename2), "%s.TMP", m->name);
-	struct stat st;
+		if (unify(q, p1, p1_ctx, h, q->latest_ctx)) {
+			drop_choice(q);
+			return 1;
+		}
 
-	if (!stat(filename2, &st) && !stat(filename, &st))
-		remove(filename2);
-	else if (!stat(filename2, &st))
-		rename(filename2, filename);
+		undo_me(q);
+		l = LIST_TAIL(l);
+		l = deref(q, l, p2_ctx);
+		p2_ctx = q->latest_ctx;
+	}
 
-	if (!stat(filename, &st)) {
-		FILE *fp = fopen(filename, "rb");
-		restore_db(m, fp);
-		fclose(fp);
+	drop_choice(q);
+
+	if (!is_variable(l))
+		return 0;
+
+	// An open list is extended with the element...
+
+	if (GET_FRAME(q->st.curr_frame)->nbr_vars >= MAX_VARS) {
+		throw_error(q, p2, "resource_error", "too_many_vars");
+		return 0;
 	}
 
-	m->fp = fopen(filename, "ab");
-}
+	unsigned var_nbr = create_vars(q, 1);
 
-static int fn_db_load_0(query *q)
-{
-	do_db_load(q->m);
-	return 1;
+	cell v;
+	v.val_type = TYPE_VARIABLE;
+	v.nbr_cells = 1;
+	v.arity = 0;
+	v.flags = FLAG_FRESH;
+	v.val_off = g_anon_s;
+	v.var_nbr = var_nbr;
+	list_item e = {.c=*p1, .p=p1, .ctx=p1_ctx};
+	cell *tmp = make_list_from_items(q, &e, 1, &v, q->st.curr_frame);
+
+	if (!tmp)
+		return 0;
+
+	return unify(q, l, p2_ctx, tmp, q->st.curr_frame);
 }
 
-static int fn_db_save_0(query *q)
+// A bigint sum is owned by 'sum' itself as it has to outlive
+// backtracking in aggregate_all/3.
+
+static int add_number(query *q, cell *sum, cell *n)
 {
-	if (!q->m->fp)
+	int_t v;
+
+	if (is_integer(n) && is_integer(sum) && !__builtin_add_overflow(sum->val_num, n->val_num, &v)) {
+		sum->val_num = v;
+	} else if (is_integer_or_bigint(n) && is_integer_or_bigint(sum)) {
+		if (!add_bigint(sum, n)) {
+			throw_error(q, n, "domain_error", "integer_overflow");
+			return 0;
+		}
+	} else if (is_rational(n) && is_rational(sum)) {
+		if (!rat_op(q, RAT_ADD, sum, n))
+			return 0;
+
+		*sum = q->accum;
+		reduce(sum);
+	} else if (is_number(n)) {
+		double d1 = num_to_float(sum), d2 = num_to_float(n);
+
+		if (is_bigint(sum))
+			free_bigint(sum);
+
+		make_float(sum, d1 + d2);
+	} else {
+		throw_error(q, n, "type_error", "number");
 		return 0;
+	}
 
-	fclose(q->m->fp);
-	char filename[1024];
-	snprintf(filename, sizeof(filename), "%s.db", q->m->name);
-	char filename2[1024];
-	snprintf(filename2, sizeof(filename2), "%s.TMP", q->m->name);
-	FILE *fp = fopen(filename2, "wb");
-	if (!fp) return 0;
-	save_db(q->m->fp, q, 1);
-	fclose(fp);
-	remove(filename);
-	rename(filename2, filename);
-	q->m->fp = fopen(filename, "ab");
 	return 1;
 }
 
-static int fn_abolish_2(query *q)
-{
-	GET_FIRST_ARG(p1,atom);
-	GET_NEXT_ARG(p2,integer);
-	cell tmp = *p1;
-	tmp.arity = p2->val_num;
-	return do_abolish(q, &tmp);
-}
+// Is 'n' greater (sign > 0) or less (sign < 0) than 'best'?
 
-static int fn_sys_lt_2(query *q)
+static int better_number(const cell *best, cell *n, int sign)
 {
-	GET_FIRST_ARG(p1,integer);
-	GET_NEXT_ARG(p2,integer);
+	if (is_integer(n) && is_integer(best))
+		return sign > 0 ? n->val_num > best->val_num : n->val_num < best->val_num;
 
-	if (p1->val_num++ < p2->val_num)
-		return 1;
+	if (is_bigint(n) || is_bigint(best))
+		return compare_bigint(n, best) == sign;
 
-	drop_choice(q);
-	return 1;
+	double d1 = is_float(best) ? best->val_flt : rat_to_float(best);
+	double d2 = is_float(n) ? n->val_flt : rat_to_float(n);
+	return sign > 0 ? d2 > d1 : d2 < d1;
 }
 
-static int fn_plus_3(query *q)
+static int fn_sum_list_2(query *q)
 {
-	GET_FIRST_ARG(p1,integer_or_var);
-	GET_NEXT_ARG(p2,integer_or_var);
-	GET_NEXT_ARG(p3,integer_or_var);
+	GET_FIRST_ARG(p1,list_or_nil);
+	GET_NEXT_ARG(p2,any);
+	cell *l = p1, sum;
+	make_int(&sum, 0);
 
-	if (is_variable(p1)) {
-		if (!is_integer(p2)) {
-			throw_error(q, p2, "type_error", "integer");
-			return 0;
-		}
+	while (is_list(l)) {
+		cell *h = LIST_HEAD(l);
+		h = deref(q, h, p1_ctx);
 
-		if (!is_integer(p3)) {
-			throw_error(q, p3, "type_error", "integer");
+		if (!add_number(q, &sum, h))
 			return 0;
-		}
 
-		cell tmp;
-		make_int(&tmp, p3->val_num - p2->val_num);
-		set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
-		return 1;
+		l = LIST_TAIL(l);
+		l = deref(q, l, p1_ctx);
+		p1_ctx = q->latest_ctx;
 	}
 
-	if (is_variable(p2)) {
-		if (!is_integer(p1)) {
-			throw_error(q, p1, "type_error", "integer");
-			return 0;
-		}
+	if (!is_nil(l)) {
+		throw_error(q, l, "type_error", "list");
+		return 0;
+	}
 
-		if (!is_integer(p3)) {
-			throw_error(q, p3, "type_error", "integer");
-			return 0;
-		}
+	if (is_bigint(&sum))
+		own_bigint_on_heap(q, &sum);
 
-		cell tmp;
-		make_int(&tmp, p3->val_num - p1->val_num);
-		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-		return 1;
-	}
+	return unify(q, p2, p2_ctx, &sum, q->st.curr_frame);
+}
 
-	if (is_variable(p3)) {
-		if (!is_integer(p2)) {
-			throw_error(q, p2, "type_error", "integer");
-			return 0;
-		}
+static int do_max_min_list(query *q, int sign)
+{
+	GET_FIRST_ARG(p1,list_or_nil);
+	GET_NEXT_ARG(p2,any);
+	cell *l = p1, best;
+	int any = 0;
 
-		if (!is_integer(p1)) {
-			throw_error(q, p1, "type_error", "integer");
+	while (is_list(l)) {
+		cell *h = LIST_HEAD(l);
+		h = deref(q, h, p1_ctx);
+
+		if (!is_number(h)) {
+			throw_error(q, h, "type_error", "number");
 			return 0;
 		}
 
-		cell tmp;
-		make_int(&tmp, p1->val_num + p2->val_num);
-		set_var(q, p3, p3_ctx, &tmp, q->st.curr_frame);
-		return 1;
+		if (!any++ || better_number(&best, h, sign))
+			best = *h;
+
+		l = LIST_TAIL(l);
+		l = deref(q, l, p1_ctx);
+		p1_ctx = q->latest_ctx;
 	}
 
-	return p3->val_num == p1->val_num + p2->val_num;
+	if (!any)
+		return 0;
+
+	best.nbr_cells = 1;
+	return unify(q, p2, p2_ctx, &best, q->st.curr_frame);
 }
 
-static int fn_limit_2(query *q)
+static int fn_max_list_2(query *q)
 {
-	GET_FIRST_ARG(p1,integer);
-	GET_NEXT_ARG(p2,callable);
-	cell *tmp = clone_to_heap(q, 1, p2, 4);
-	idx_t nbr_cells = 1 + p2->nbr_cells;
-	make_structure(tmp+nbr_cells++, g_fail_s, fn_sys_lt_2, 2, 2);
-	make_int(tmp+nbr_cells++, 1);
-	make_int(tmp+nbr_cells++, p1->val_num);
-	make_end_return(tmp+nbr_cells, q->st.curr_cell);
-	q->st.curr_cell = tmp;
-	return 1;
+	return do_max_min_list(q, 1);
 }
 
-static int fn_sys_gt_2(query *q)
+static int fn_min_list_2(query *q)
+{
+	return do_max_min_list(q, -1);
+}
+
+static int fn_numlist_3(query *q)
 {
 	GET_FIRST_ARG(p1,integer);
 	GET_NEXT_ARG(p2,integer);
+	GET_NEXT_ARG(p3,list_or_nil_or_var);
 
-	if (p1->val_num++ <= p2->val_num)
+	if (p1->val_num > p2->val_num)
 		return 0;
 
-	return 1;
-}
+	cell tmp;
+	make_int(&tmp, p1->val_num);
+	alloc_list(q, &tmp);
 
-static int fn_offset_2(query *q)
-{
-	GET_FIRST_ARG(p1,integer);
-	GET_NEXT_ARG(p2,callable);
-	cell *tmp = clone_to_heap(q, 1, p2, 4);
-	idx_t nbr_cells = 1 + p2->nbr_cells;
-	make_structure(tmp+nbr_cells++, g_fail_s, fn_sys_gt_2, 2, 2);
-	make_int(tmp+nbr_cells++, 1);
-	make_int(tmp+nbr_cells++, p1->val_num);
-	make_end_return(tmp+nbr_cells, q->st.curr_cell);
-	q->st.curr_cell = tmp;
-	return 1;
-}
+	for (int_t i = p1->val_num; i < p2->val_num;) {
+		make_int(&tmp, ++i);
+		append_list(q, &tmp);
+	}
 
-void call_attrs(query *q, cell *attrs)
-{
-	cell *tmp = clone_to_heap(q, 1, attrs, 1);
-	idx_t nbr_cells = 1 + attrs->nbr_cells;
-	make_end_return(tmp+nbr_cells, q->st.curr_cell);
-	q->st.curr_cell = tmp;
+	cell *l = end_list(q);
+	fix_list(l);
+	return unify(q, p3, p3_ctx, l, q->st.curr_frame);
 }
 
-static int fn_freeze_2(query *q)
+// Elements of the second list are hashed when all of them are
+// atomic, otherwise we fall back to a scan using unification.
+
+static int do_subtract_intersection(query *q, int keep)
 {
-	GET_FIRST_ARG(p1,any);
-	GET_NEXT_ARG(p2,callable);
+	GET_FIRST_ARG(p1,list_or_nil);
+	GET_NEXT_ARG(p2,list_or_nil);
+	GET_NEXT_ARG(p3,list_or_nil_or_var);
+	size_t nbr1, nbr2;
+	list_item *items1 = collect_list(q, p1, p1_ctx, &nbr1);
+	list_item *items2 = collect_list(q, p2, p2_ctx, &nbr2);
 
-	if (is_variable(p1)) {
-		cell *tmp = clone_to_heap(q, 0, p2, 0);
-		frame *g = GET_FRAME(p1_ctx);
-		slot *e = GET_SLOT(g, p1->var_nbr);
-		e->c.attrs = tmp;
-		return 1;
+	if (!items1 || !items2) {
+		free(items1);
+		free(items2);
+		throw_error(q, !items1 ? p1 : p2, "type_error", "list");
+		return 0;
 	}
 
-	cell *tmp = clone_to_heap(q, 1, p2, 1);
-	idx_t nbr_cells = 1 + p2->nbr_cells;
-	make_end_return(tmp+nbr_cells, q->st.curr_cell);
-	q->st.curr_cell = tmp;
-	return 1;
-}
+	atomic_set s;
+	int hashed = nbr2 > 8;
 
-static int fn_frozen_2(query *q)
-{
-	GET_FIRST_ARG(p1,variable);
-	GET_NEXT_ARG(p2,any);
-	frame *g = GET_FRAME(p1_ctx);
-	slot *e = GET_SLOT(g, p1->var_nbr);
+	for (size_t i = 0; hashed && (i < nbr2); i++) {
+		if (!is_hashable(&items2[i].c))
+			hashed = 0;
+	}
 
-	if (!e->c.attrs) {
-		cell tmp;
-		make_literal(&tmp, g_true_s);
-		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	if (hashed) {
+		init_atomic_set(&s, nbr2);
+
+		for (size_t i = 0; i < nbr2; i++)
+			add_atomic_set(&s, &items2[i].c);
+	}
+
+	size_t j = 0;
+
+	for (size_t i = 0; i < nbr1; i++) {
+		list_item *e = items1 + i;
+		int found;
+
+		if (hashed && is_hashable(&e->c))
+			found = in_atomic_set(&s, &e->c);
+		else
+			found = do_memberchk(q, LIST_ITEM(e), e->ctx, items2, nbr2);
+
+		if (found == keep)
+			items1[j++] = *e;
 	}
 
-	return unify(q, p2, p2_ctx, e->c.attrs, q->st.curr_frame);
+	if (hashed)
+		free(s.cells);
+
+	free(items2);
+	return unify_items(q, p3, p3_ctx, items1, j);
 }
 
-static int fn_del_attrs_1(query *q)
+static int fn_subtract_3(query *q)
 {
-	GET_FIRST_ARG(p1,variable);
-	GET_NEXT_ARG(p2,list_or_nil);
-	cell *tmp = deep_clone_to_heap(q, p2, p2_ctx);
-	frame *g = GET_FRAME(p1_ctx);
-	slot *e = GET_SLOT(g, p1->var_nbr);
-	e->c.attrs = tmp;
-	return 1;
+	return do_subtract_intersection(q, 0);
 }
 
-static int fn_put_attrs_2(query *q)
+static int fn_intersection_3(query *q)
 {
-	GET_FIRST_ARG(p1,variable);
-	GET_NEXT_ARG(p2,list_or_nil);
-	cell *tmp = deep_clone_to_heap(q, p2, p2_ctx);
-	frame *g = GET_FRAME(p1_ctx);
-	slot *e = GET_SLOT(g, p1->var_nbr);
-	e->c.attrs = tmp;
-	return 1;
+	return do_subtract_intersection(q, 1);
 }
 
-static int fn_get_attrs_2(query *q)
+static int fn_union_3(query *q)
 {
-	GET_FIRST_ARG(p1,variable);
-	GET_NEXT_ARG(p2,variable);
-	frame *g = GET_FRAME(p1_ctx);
-	slot *e = GET_SLOT(g, p1->var_nbr);
+	GET_FIRST_ARG(p1,list_or_nil);
+	GET_NEXT_ARG(p2,list_or_nil);
+	GET_NEXT_ARG(p3,list_or_nil_or_var);
+	size_t nbr1, nbr2;
+	list_item *items1 = collect_list(q, p1, p1_ctx, &nbr1);
+	list_item *items2 = collect_list(q, p2, p2_ctx, &nbr2);
 
-	if (!e->c.attrs) {
-		cell tmp;
-		make_literal(&tmp, g_nil_s);
-		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-		return 1;
+	if (!items1 || !items2) {
+		free(items1);
+		free(items2);
+		throw_error(q, !items1 ? p1 : p2, "type_error", "list");
+		return 0;
 	}
 
-	set_var(q, p2, p2_ctx, e->c.attrs, q->st.curr_frame);
-	return 1;
-}
+	atomic_set s;
+	int hashed = nbr2 > 8;
 
-static int fn_sys_ne_2(query *q)
-{
-	GET_FIRST_ARG(p1,integer);
-	GET_NEXT_ARG(p2,integer);
+	for (size_t i = 0; hashed && (i < nbr2); i++) {
+		if (!is_hashable(&items2[i].c))
+			hashed = 0;
+	}
+
+	if (hashed) {
+		init_atomic_set(&s, nbr2);
+
+		for (size_t i = 0; i < nbr2; i++)
+			add_atomic_set(&s, &items2[i].c);
+	}
+
+	size_t j = 0;
+
+	for (size_t i = 0; i < nbr1; i++) {
+		list_item *e = items1 + i;
+		int found;
+
+		if (hashed && is_hashable(&e->c))
+			found = in_atomic_set(&s, &e->c);
+		else
+			found = do_memberchk(q, LIST_ITEM(e), e->ctx, items2, nbr2);
+
+		if (!found)
+			items1[j++] = *e;
+	}
+
+	if (hashed)
+		free(s.cells);
+
+	free(items2);
+	cell *l = make_list_from_items(q, items1, j, p2, p2_ctx);
+	free(items1);
 
-	if (p1->val_num++ != p2->val_num)
+	if (!l)
 		return 0;
 
-	drop_choice(q);
-	return 1;
+	return unify(q, p3, p3_ctx, l, q->st.curr_frame);
 }
 
-static int fn_call_nth_2(query *q)
+// Duplicates are by ==, keeping the first occurrence.
+
+static int fn_list_to_set_2(query *q)
 {
-	GET_FIRST_ARG(p1,callable);
-	GET_NEXT_ARG(p2,integer_or_var);
+	GET_FIRST_ARG(p1,list_or_nil);
+	GET_NEXT_ARG(p2,list_or_nil_or_var);
+	size_t nbr;
+	list_item *items = collect_list(q, p1, p1_ctx, &nbr);
 
-	if (is_variable(p2)) {
-		cell *tmp = clone_to_heap(q, 1, p1, 1);
-		idx_t nbr_cells = 1 + p1->nbr_cells;
-		make_end_return(tmp+nbr_cells, q->st.curr_cell);
-		q->st.curr_cell = tmp;
-		return 1;
+	if (!items) {
+		throw_error(q, p1, "type_error", "list");
+		return 0;
 	}
 
-	cell *tmp = clone_to_heap(q, 1, p1, 4);
-	idx_t nbr_cells = 1 + p1->nbr_cells;
-	make_structure(tmp+nbr_cells++, g_fail_s, fn_sys_ne_2, 2, 2);
-	make_int(tmp+nbr_cells++, 1);
-	make_int(tmp+nbr_cells++, p2->val_num);
-	make_end_return(tmp+nbr_cells, q->st.curr_cell);
-	q->st.curr_cell = tmp;
-	return 1;
-}
-
-static int fn_dcg_translate_rule_2(query *q)
-{
-	GET_FIRST_ARG(p1,any);
-	GET_NEXT_ARG(p2,any);
-	return 0;
-}
+	list_item *set = malloc(sizeof(list_item)*(nbr+1));
+	atomic_set s;
+	init_atomic_set(&s, nbr);
+	size_t j = 0;
 
-static int fn_call_dcg_3(query *q)
-{
-	GET_FIRST_ARG(p1,any);
-	GET_NEXT_ARG(p2,any);
-	GET_NEXT_ARG(p3,any);
+	for (size_t i = 0; i < nbr; i++) {
+		list_item *e = items + i;
+		int found = 0;
 
-	if (is_list_or_nil(p1))
-		return unify(q, p1, p1_ctx, p2, p2_ctx);
+		if (is_hashable(&e->c)) {
+			found = !add_atomic_set(&s, &e->c);
+		} else {
+			for (size_t n = 0; !found && (n < j); n++) {
+				list_item *e2 = set + n;
 
-	if (is_structure(p1) && (p1->val_off == g_braces_s)) {
-		if (!unify(q, p2, p2_ctx, p3, p3_ctx))
-			return 0;
+				if (!is_hashable(&e2->c))
+					found = !compare(q, LIST_ITEM(e), e->ctx, LIST_ITEM(e2), e2->ctx);
+			}
+		}
 
-		p1 = p1 + 1;
-		cell *tmp = clone_to_heap(q, 1, p1, 1);
-		idx_t nbr_cells = 1 + p1->nbr_cells;
-		make_end_return(tmp+nbr_cells, q->st.curr_cell);
-		q->st.curr_cell = tmp;
-		return 1;
+		if (!found)
+			set[j++] = *e;
 	}
 
-	return fn_iso_call_n(q);
+	free(s.cells);
+	free(items);
+	return unify_items(q, p2, p2_ctx, set, j);
 }
 
-static int fn_phrase_3(query *q)
-{
-	GET_FIRST_ARG(p1,any);
-	GET_NEXT_ARG(p2,list_or_nil_or_var);
-	GET_NEXT_ARG(p3,list_or_nil_or_var);
-	return fn_call_dcg_3(q);
-}
+// aggregate_all/3 runs the goal like findall/3 does, but each
+// solution is reduced as it arrives by '$aggregate'/3 so count, sum,
+// max and min need no list at all. Set drops atomic duplicates on
+// arrival using a hash.
 
-static int fn_phrase_2(query *q)
+enum { AGGR_COUNT, AGGR_SUM, AGGR_MAX, AGGR_MIN, AGGR_BAG, AGGR_SET };
+
+static int get_aggregate_op(cell *p)
 {
-	GET_FIRST_ARG(p1,any);
-	GET_NEXT_ARG(p2,list_or_nil_or_var);
-	cell *this = q->st.curr_cell;
-	cell *tmp = clone_to_heap(q, 1, this, this->nbr_cells+2);
-	idx_t nbr_cells = 1 + this->nbr_cells;
-	make_literal(tmp+nbr_cells++, g_nil_s);
-	make_end_return(tmp+nbr_cells, q->st.curr_cell);
-	tmp[1].arity = 3;
-	tmp[1].fn = fn_call_dcg_3;
-	tmp[1].nbr_cells += 1;
-	q->st.curr_cell = tmp;
-	return 1;
+	if (is_atom(p) && !strcmp(GET_STR(p), "count"))
+		return AGGR_COUNT;
+
+	if (!is_structure(p) || (p->arity != 1))
+		return -1;
+
+	const char *name = GET_STR(p);
+
+	if (!strcmp(name, "count"))
+		return AGGR_COUNT;
+	else if (!strcmp(name, "sum"))
+		return AGGR_SUM;
+	else if (!strcmp(name, "max"))
+		return AGGR_MAX;
+	else if (!strcmp(name, "min"))
+		return AGGR_MIN;
+	else if (!strcmp(name, "bag"))
+		return AGGR_BAG;
+	else if (!strcmp(name, "set"))
+		return AGGR_SET;
+
+	return -1;
 }
 
-static int do_length(query *q)
+static int fn_sys_aggregate_3(query *q)
 {
-	GET_FIRST_ARG(p1,any);
+	GET_FIRST_ARG(p1,integer);
 	GET_NEXT_ARG(p2,integer);
-	unsigned nbr = p2->val_num;
-	GET_RAW_ARG(2, p2_orig);
-	cell tmp;
-	make_int(&tmp, ++nbr);
-	reset_value(q, p2_orig, p2_orig_ctx, &tmp, q->st.curr_frame);
-	make_choice(q);
+	GET_NEXT_ARG(p3,any);
+	unsigned qnbr = p1->val_num;
+	cell *acc = q->aggr + qnbr;
 
-	if (is_anon(p1))
+	if (p2->val_num == AGGR_COUNT) {
+		acc->val_num++;
 		return 1;
+	}
 
-	if (nbr >= MAX_VARS) {
-		drop_choice(q);
-		throw_error(q, p2, "resource_error", "too_many_vars");
-		return 0;
+	if ((p2->val_num == AGGR_BAG) || (p2->val_num == AGGR_SET)) {
+		cell *tmp = deep_clone_to_tmp(q, p3, p3_ctx);
+
+		if ((p2->val_num == AGGR_SET) && is_hashable(tmp)
+			&& !add_atomic_set(q->aggr_set+qnbr, tmp)) {
+			if (is_blob(tmp))
+				free(tmp->val_str);
+
+			return 1;
+		}
+
+		alloc_queuen(q, qnbr, tmp);
+		return 1;
 	}
 
-	unsigned var_nbr;
+	cell n = calc(q, p3);
 
-	if (!(var_nbr = create_vars(q, nbr))) {
-		drop_choice(q);
-		throw_error(q, p1, "resource_error", "too_many_vars");
+	if (q->error)
+		return 0;
+
+	if (p2->val_num == AGGR_SUM)
+		return add_number(q, acc, &n);
+
+	if (!is_number(&n)) {
+		throw_error(q, &n, "type_error", "number");
 		return 0;
 	}
 
-	tmp.val_type = TYPE_VARIABLE;
-	tmp.nbr_cells = 1;
-	tmp.flags = FLAG_FRESH;
-	tmp.val_off = g_anon_s;
-	tmp.var_nbr = var_nbr++;
-	tmp.arity = 0;
-	alloc_list(q, &tmp);
+	if (is_empty(acc) || better_number(acc, &n, p2->val_num == AGGR_MAX ? 1 : -1)) {
+		if (is_bigint(acc))
+			free_bigint(acc);
 
-	for (unsigned i = 1; i < nbr; i++) {
-		tmp.var_nbr = var_nbr++;
-		append_list(q, &tmp);
+		*acc = n;
+		acc->nbr_cells = 1;
+
+		if (is_bigint(acc))
+			dup_bigint(acc);
 	}
 
-	cell *l = end_list(q);
-	fix_list(l);
-	set_var(q, p1, p1_ctx, l, q->st.curr_frame);
 	return 1;
 }
 
-static int fn_iso_length_2(query *q)
+static void sort_cells(query *q, cell **base, size_t nbr, cell **tmp)
 {
-	if (q->retry)
-		return do_length(q);
+	if (nbr < 2)
+		return;
 
-	GET_FIRST_ARG(p1,list_or_nil_or_var);
-	GET_NEXT_ARG(p2,integer_or_var);
+	size_t mid = nbr / 2, i = 0, j = mid, k = 0;
+	sort_cells(q, base, mid, tmp);
+	sort_cells(q, base+mid, nbr-mid, tmp);
 
-	if (is_variable(p1) && is_variable(p2)) {
-		cell tmp;
-		make_int(&tmp, 0);
-		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-		make_choice(q);
+	while ((i < mid) && (j < nbr)) {
+		if (compare(q, base[j], q->st.curr_frame, base[i], q->st.curr_frame) < 0)
+			tmp[k++] = base[j++];
+		else
+			tmp[k++] = base[i++];
+	}
 
-		if (!is_anon(p1)) {
-			make_literal(&tmp, g_nil_s);
-			set_var(q, p1,p1_ctx, &tmp, q->st.curr_frame);
-		}
+	while (i < mid)
+		tmp[k++] = base[i++];
 
-		return 1;
-	}
+	while (j < nbr)
+		tmp[k++] = base[j++];
 
-	if (!is_variable(p1) && is_variable(p2)) {
-		if (!is_list(p1) && !is_nil(p1))
-			return 0;
+	memcpy(base, tmp, sizeof(cell*)*nbr);
+}
 
-		unsigned cnt = 0;
+// Sort the collected list and drop duplicates. The result is written
+// back over the list itself so each blob stays owned by one cell.
 
-		if (is_string(p1)) {
-			cnt = strlen_utf8(p1->val_str);
-		} else {
-			cell *l = p1;
+static cell *make_set_list(query *q)
+{
+	cell *l = make_queuen_list(q);
 
-			while (is_list(l)) {
-				LIST_HEAD(l);
-				l = LIST_TAIL(l);
-				l = deref(q, l, p1_ctx);
-				p1_ctx = q->latest_ctx;
-				cnt++;
-			}
-		}
+	if (!l || !is_iso_list(l))
+		return l;
 
-		cell tmp;
-		make_int(&tmp, cnt);
-		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-		return 1;
-	}
+	size_t nbr = 0;
 
-	if (is_integer(p2) && !is_variable(p1)) {
-		if (p2->val_num < 0) {
-			throw_error(q, p2, "domain_error", "out_of_range");
-			return 0;
-		}
+	for (cell *c = l; is_iso_list(c); c += 1 + c[1].nbr_cells)
+		nbr++;
 
-		if (p2->val_num == 0) {
-			cell tmp;
-			make_literal(&tmp, g_nil_s);
-			return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
-		}
+	cell **items = malloc(sizeof(cell*)*nbr*2);
+	size_t i = 0, j = 0;
 
-		int cnt = 0;
+	for (cell *c = l; is_iso_list(c); c += 1 + c[1].nbr_cells)
+		items[i++] = c + 1;
 
-		if (is_string(p1)) {
-			cnt = strlen_utf8(p1->val_str);
-		} else {
-			cell *l = p1;
+	sort_cells(q, items, nbr, items+nbr);
 
-			while (is_list(l)) {
-				LIST_HEAD(l);
-				l = LIST_TAIL(l);
-				l = deref(q, l, p1_ctx);
-				p1_ctx = q->latest_ctx;
-				cnt++;
+	for (i = 0; i < nbr; i++) {
+		if (j && !compare(q, items[j-1], q->st.curr_frame, items[i], q->st.curr_frame)) {
+			for (idx_t k = 0; k < items[i]->nbr_cells; k++) {
+				cell *c = items[i] + k;
+
+				if (is_blob(c) && !is_const_cstring(c))
+					free(c->val_str);
 			}
+
+			continue;
 		}
 
-		return p2->val_num == cnt;
+		items[j++] = items[i];
 	}
 
+	alloc_list(q, items[0]);
 
-	if (is_variable(p1) && is_integer(p2)) {
-		if (is_anon(p1))
-			return 1;
+	for (i = 1; i < j; i++)
+		append_list(q, items[i]);
 
-		if (p2->val_num < 0) {
-			throw_error(q, p2, "domain_error", "positive_integers");
-			return 0;
-		}
+	free(items);
+	cell *tmp = alloc_tmp_heap(q, 1);
+	make_literal(tmp, g_nil_s);
+	idx_t nbr_cells = tmp_heap_used(q);
+	copy_cells(l, get_tmp_heap(q, 0), nbr_cells);
 
-		if (p2->val_num >= MAX_VARS) {
-			throw_error(q, p2, "resource_error", "too_many_vars");
-			return 0;
-		}
+	for (idx_t k = nbr_cells; k < l->nbr_cells; k++)
+		l[k].val_type = TYPE_EMPTY;
 
-		idx_t nbr = p2->val_num;
+	l->nbr_cells = nbr_cells;
+	init_tmp_heap(q);
+	fix_list(l);
+	return l;
+}
 
-		if (nbr == 0) {
-			cell tmp;
-			make_literal(&tmp, g_nil_s);
-			set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
-			return 1;
-		}
+static int fn_aggregate_all_3(query *q)
+{
+	GET_FIRST_ARG(p1,callable);
+	GET_NEXT_ARG(p2,callable);
+	GET_NEXT_ARG(p3,any);
+	int op = get_aggregate_op(p1);
 
-		unsigned var_nbr;
+	if (op < 0) {
+		throw_error(q, p1, "domain_error", "aggregate_spec");
+		return 0;
+	}
 
-		if (!(var_nbr = create_vars(q, nbr))) {
-			throw_error(q, p2, "resource_error", "too_many_vars");
+	if (!q->retry) {
+		if ((q->st.qnbr+1) >= MAX_QUEUES) {
+			throw_error(q, p1, "resource_error", "too_many_queues");
 			return 0;
 		}
 
-		cell tmp;
-		tmp.val_type = TYPE_VARIABLE;
-		tmp.nbr_cells = 1;
-		tmp.arity = 0;
-		tmp.flags = FLAG_FRESH;
-		tmp.val_off = g_anon_s;
-		tmp.var_nbr = var_nbr++;
-		alloc_list(q, &tmp);
+		q->st.qnbr++;
+		unsigned qnbr = q->st.qnbr;
+		cell *v = p1->arity ? p1 + 1 : p1;
+		cell *tmp = clone_to_heap(q, 1, p2, 4+v->nbr_cells);
+		idx_t nbr_cells = 1 + p2->nbr_cells;
+		make_structure(tmp+nbr_cells++, g_sys_aggregate_s, fn_sys_aggregate_3, 3, 2+v->nbr_cells);
+		make_int(tmp+nbr_cells++, qnbr);
+		make_int(tmp+nbr_cells++, op);
+		nbr_cells += copy_cells(tmp+nbr_cells, v, v->nbr_cells);
+		make_structure(tmp+nbr_cells, g_fail_s, fn_iso_fail_0, 0, 0);
 
-		for (idx_t i = 1; i < nbr; i++) {
-			tmp.var_nbr = var_nbr++;
-			append_list(q, &tmp);
-		}
+		if ((op == AGGR_COUNT) || (op == AGGR_SUM))
+			make_int(q->aggr+qnbr, 0);
+		else
+			q->aggr[qnbr].val_type = TYPE_EMPTY;
 
-		cell *l = end_list(q);
-		fix_list(l);
-		set_var(q, p1, p1_ctx, l, q->st.curr_frame);
+		free(q->aggr_set[qnbr].cells);
+		q->aggr_set[qnbr].cells = NULL;
+
+		if (op == AGGR_SET)
+			init_atomic_set(q->aggr_set+qnbr, 0);
+
+		q->tmpq[qnbr] = NULL;
+		init_queuen(q);
+		make_barrier(q);
+		q->st.curr_cell = tmp;
 		return 1;
 	}
 
-	throw_error(q, p1, "type_error", "arg_invalid");
-	return 0;
+	unsigned qnbr = q->st.qnbr;
+	cell acc = q->aggr[qnbr], *l = NULL;
+	free(q->aggr_set[qnbr].cells);
+	q->aggr_set[qnbr].cells = NULL;
+
+	if (op == AGGR_BAG)
+		l = make_queuen_list(q);
+	else if (op == AGGR_SET)
+		l = make_set_list(q);
+
+	q->st.qnbr--;
+
+	if ((op == AGGR_BAG) || (op == AGGR_SET))
+		return l ? unify(q, p3, p3_ctx, l, q->st.curr_frame) : 0;
+
+	if (is_empty(&acc))
+		return 0;
+
+	if (is_bigint(&acc))
+		own_bigint_on_heap(q, &acc);
+
+	return unify(q, p3, p3_ctx, &acc, q->st.curr_frame);
 }
 
 static int fn_use_module_1(query *q)
@@ -9089,6 +15116,17 @@ static const struct builtins g_iso_funcs[] =
 	{"\\+", 1, fn_iso_negation_1, NULL},
 	{"once", 1, fn_iso_once_1, NULL},
 	{"catch", 3, fn_iso_catch_3, NULL},
+	{"$try", 0, fn_sys_try_0, NULL},
+	{"$cut", 0, fn_sys_cut_0, NULL},
+	{"$cut_fail", 0, fn_sys_cut_fail_0, NULL},
+	{"$or", 0, fn_sys_or_0, NULL},
+	{"$jump", 0, fn_sys_jump_0, NULL},
+	{"$end", 0, NULL, NULL},
+	{"$catch", 0, fn_sys_catch_0, NULL},
+	{"$limit", 3, fn_sys_limit_3, NULL},
+	{"$set_limit", 3, fn_sys_set_limit_3, NULL},
+	{"$choice", 1, fn_sys_choice_1, NULL},
+	{"$det", 2, fn_sys_det_2, NULL},
 	{"throw", 1, fn_iso_throw_1, NULL},
 	{"$calln", 2, fn_iso_call_n, NULL},
 	{"$calln", 3, fn_iso_call_n, NULL},
@@ -9112,6 +15150,7 @@ static const struct builtins g_iso_funcs[] =
 	{"var", 1, fn_iso_var_1, NULL},
 	{"nonvar", 1, fn_iso_nonvar_1, NULL},
 	{"ground", 1, fn_iso_ground_1, NULL},
+	{"acyclic_term", 1, fn_acyclic_term_1, NULL},
 	{"callable", 1, fn_iso_callable_1, NULL},
 	{"char_code", 2, fn_iso_char_code_2, NULL},
 	{"atom_chars", 2, fn_iso_atom_chars_2, NULL},
@@ -9214,7 +15253,7 @@ static const struct builtins g_iso_funcs[] =
 	{"//", 2, fn_iso_divint_2, NULL},
 	{"div", 2, fn_iso_div_2, NULL},
 	{"mod", 2, fn_iso_mod_2, NULL},
-	{"rem", 2, fn_iso_mod_2, NULL},
+	{"rem", 2, fn_iso_rem_2, NULL},
 	{"max", 2, fn_iso_max_2, NULL},
 	{"min", 2, fn_iso_min_2, NULL},
 	{"xor", 2, fn_iso_xor_2, NULL},
@@ -9251,6 +15290,7 @@ static const struct builtins g_iso_funcs[] =
 	{"use_module", 1, fn_use_module_1, NULL},
 	{"module", 1, fn_module_1, NULL},
 	{"consult", 1, fn_consult_1, NULL},
+	{"make", 0, fn_make_0, NULL},
 	{"listing", 0, fn_listing_0, NULL},
 	{"listing", 1, fn_listing_1, NULL},
 	{"time", 1, fn_time_1, NULL},
@@ -9283,6 +15323,10 @@ static const struct builtins g_other_funcs[] =
 	{"format", 2, fn_format_2, "+string,+list"},
 	{"format", 3, fn_format_3, "+stream,+string,+list"},
 	{"findall", 4, fn_findall_4, NULL},
+	{"aggregate_all", 3, fn_aggregate_all_3, "+term,+callable,?term"},
+	{"cyclic_term", 1, fn_cyclic_term_1, "+term"},
+	{"setarg", 3, fn_setarg_3, "+integer,+compound,+term"},
+	{"nb_setarg", 3, fn_nb_setarg_3, "+integer,+compound,+term"},
 	{"rdiv", 2, fn_rdiv_2, "+integer,+integer"},
 	{"rational", 1, fn_rational_1, "+number"},
 	{"rationalize", 1, fn_rational_1, "+number"},
@@ -9305,6 +15349,7 @@ static const struct builtins g_other_funcs[] =
 	{"srandom", 1, fn_srandom_1, "+integer"},
 	{"between", 3, fn_between_3, "+integer,+integer,-integer"},
 	{"log10", 1, fn_log10_1, "+integer"},
+	{"msb", 1, fn_msb_1, "+integer"},
 	{"client", 5, fn_client_5, "+string,-string,-string,-stream,+list"},
 	{"server", 3, fn_server_3, "+string,-stream,+list"},
 	{"accept", 2, fn_accept_2, "+stream,-stream"},
@@ -9315,6 +15360,9 @@ static const struct builtins g_other_funcs[] =
 	{"savefile", 2, fn_savefile_2, "+string,+string"},
 	{"split_atom", 4, fn_split_atom_4, "+string,+sep,+pad,-list"},
 	{"split", 4, fn_split_4, "+string,+string,?left,?right"},
+	{"csv_read_row", 3, fn_csv_read_row_3, "+stream,-term,+list"},
+	{"csv_read", 3, fn_csv_read_3, "+atom,-term,+list"},
+	{"csv_write", 3, fn_csv_write_3, "+stream,+list,+list"},
 	{"is_list", 1, fn_is_list_1, "+term"},
 	{"list", 1, fn_is_list_1, "+term"},
 	{"is_stream", 1, fn_is_stream_1, "+term"},
@@ -9330,6 +15378,8 @@ static const struct builtins g_other_funcs[] =
 	{"working_directory", 2, fn_working_directory_2, "-string,+string"},
 	{"chdir", 1, fn_chdir_1, "+string"},
 	{"name", 2, fn_iso_atom_codes_2, "?string,?list"},
+	{"read_terms", 3, fn_read_terms_3, "+stream,+integer,-list"},
+	{"read_terms", 3, fn_read_terms_3, "+stream,+integer,-list"},
 	{"read_term_from_chars", 3, fn_read_term_from_chars_3, "+string,-term,+list"},
 	{"write_term_to_chars", 3, fn_write_term_to_chars_3, "-string,+term,+list"},
 	{"base64", 2, fn_base64_2, "?string,?string"},
@@ -9338,6 +15388,10 @@ static const struct builtins g_other_funcs[] =
 	{"string_upper", 2, fn_string_upper_2, "?string,?string"},
 	{"bread", 3, fn_bread_3, "+stream,+integer,-string"},
 	{"bwrite", 2, fn_bwrite_2, "+stream,-string"},
+	{"bread_term", 2, fn_bread_term_2, "+stream,-term"},
+	{"bwrite_term", 2, fn_bwrite_term_2, "+stream,+term"},
+	{"term_to_binary", 2, fn_term_to_binary_2, "+term,-string"},
+	{"binary_to_term", 2, fn_binary_to_term_2, "+string,-term"},
 	{"hex_chars", 2, fn_hex_chars_2, "?integer,?string"},
 	{"octal_chars", 2, fn_octal_chars_2, "?integer,?string"},
 	{"predicate_property", 2, fn_predicate_property_2, "+callable,?string"},
@@ -9366,11 +15420,42 @@ static const struct builtins g_other_funcs[] =
 	{"offset", 2, fn_offset_2, "+integer,+callable"},
 	{"plus", 3, fn_plus_3, "?integer,?integer,?integer"},
 
+	{"nth", 3, fn_nth1_3, "?integer,+list,?term"},
+	{"nth0", 3, fn_nth0_3, "?integer,+list,?term"},
+	{"nth1", 3, fn_nth1_3, "?integer,+list,?term"},
+	{"last", 2, fn_last_2, "+list,?term"},
+	{"reverse", 2, fn_reverse_2, "+list,?list"},
+	{"memberchk", 2, fn_memberchk_2, "?term,?list"},
+	{"sum_list", 2, fn_sum_list_2, "+list,?number"},
+	{"sumlist", 2, fn_sum_list_2, "+list,?number"},
+	{"max_list", 2, fn_max_list_2, "+list,?number"},
+	{"min_list", 2, fn_min_list_2, "+list,?number"},
+	{"numlist", 3, fn_numlist_3, "+integer,+integer,?list"},
+	{"subtract", 3, fn_subtract_3, "+list,+list,?list"},
+	{"intersection", 3, fn_intersection_3, "+list,+list,?list"},
+	{"union", 3, fn_union_3, "+list,+list,?list"},
+	{"list_to_set", 2, fn_list_to_set_2, "+list,?list"},
+
 	{"freeze", 2, fn_freeze_2, "+variable,+callable"},
 	{"frozen", 2, fn_frozen_2, "+variable,+callable"},
+	{"put_attr", 3, fn_put_attr_3, "+variable,+atom,+term"},
+	{"get_attr", 3, fn_get_attr_3, "+variable,+atom,-term"},
+	{"del_attr", 2, fn_del_attr_2, "+variable,+atom"},
 	{"del_attrs", 1, fn_del_attrs_1, "+variable"},
-	{"put_attrs", 2, fn_put_attrs_2, "+variable,+callable"},
-	{"get_attrs", 2, fn_get_attrs_2, "+variable,+callable"},
+	{"put_attrs", 2, fn_put_attrs_2, "+variable,+list"},
+	{"get_attrs", 2, fn_get_attrs_2, "+variable,-list"},
+
+	{"$fd_in", 2, fn_sys_fd_in_2, "?integer,+term"},
+	{"$fd_linear", 3, fn_sys_fd_linear_3, "+term,+atom,+term"},
+	{"$fd_all_different", 1, fn_sys_fd_all_different_1, "+list"},
+	{"$fd_element", 3, fn_sys_fd_element_3, "?integer,+list,?integer"},
+	{"$fd_unify", 2, fn_sys_fd_unify_2, "+term,?term"},
+	{"$fd_remove", 2, fn_sys_fd_remove_2, "?integer,+integer"},
+	{"$fd_inf", 2, fn_sys_fd_inf_2, "?integer,-term"},
+	{"$fd_sup", 2, fn_sys_fd_sup_2, "?integer,-term"},
+	{"$fd_size", 2, fn_sys_fd_size_2, "?integer,-term"},
+	{"$fd_intervals", 2, fn_sys_fd_intervals_2, "?integer,-list"},
+	{"$fd_select", 3, fn_sys_fd_select_3, "+list,+atom,-variable"},
 
 #if USE_OPENSSL
 	{"sha1", 2, fn_sha1_2, "+string,?string"},
@@ -9389,9 +15474,14 @@ static const struct builtins g_other_funcs[] =
 	{"$spawnn", 8, fn_spawn_n, "+callable,+term,..."},
 	{"wait", 0, fn_wait_0, NULL},
 	{"await", 0, fn_await_0, NULL},
+	{"time_slice", 1, fn_time_slice_1, "+integer"},
 	{"yield", 0, fn_yield_0, NULL},
 	{"send", 1, fn_send_1, "+term"},
 	{"recv", 1, fn_recv_1, "?term"},
+	{"$engine_create", 3, fn_sys_engine_create_3, "+term,+callable,-term"},
+	{"$engine_yield", 0, fn_sys_engine_yield_0, NULL},
+	{"engine_next", 2, fn_engine_next_2, "+term,?term"},
+	{"engine_destroy", 1, fn_engine_destroy_1, "+term"},
 
 	// Used for database log
 
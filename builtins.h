@@ -15,7 +15,7 @@
 #define is_callable_or_var(c) (is_literal(c) || is_cstring(c) || is_variable(c))
 #define is_structure(c) (is_literal(c) && (c)->arity)
 #define is_compound(c) (is_structure(c) || is_string(c))
-#define is_number(c) (is_rational(c) || is_float(c))
+#define is_number(c) (is_rational(c) || is_float(c) || is_bigint(c))
 #define is_atomic(c) (is_atom(c) || is_number(c))
 #define is_list_or_nil(c) (is_list(c) || is_nil(c))
 #define is_list_or_nil_or_var(c) (is_list_or_nil(c) || is_variable(c))
@@ -25,6 +25,8 @@
 #define is_atom_or_int(c) (is_atom(c) || is_integer(c))
 #define is_atom_or_structure(c) (is_atom(c) || is_structure(c))
 #define is_integer_or_var(c) (is_integer(c) || is_variable(c))
+#define is_integer_or_bigint(c) (is_integer(c) || is_bigint(c))
+#define is_integer_or_bigint_or_var(c) (is_integer_or_bigint(c) || is_variable(c))
 #define is_integer_or_atom(c) (is_integer(c) || is_atom(c))
 #define is_nonvar(c) (!is_variable(c))
 #define is_stream(c) (get_stream(q,c) >= 0)
@@ -112,7 +114,7 @@ inline static cell *get_raw_arg(query *q, int n)
 	return c;
 }
 
-int unify_internal(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, int depth);
+int unify_internal(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx);
 
 #define unify(q,p1,p1_ctx,p2,p2_ctx) \
-	unify_internal(q, p1, p1_ctx, p2, p2_ctx, 0)
+	unify_internal(q, p1, p1_ctx, p2, p2_ctx)
@@ -16,6 +16,10 @@
 #define USE_LIBRESSL 0
 #endif
 
+#ifndef USE_GMP
+#define USE_GMP 0
+#endif
+
 #ifndef USE_INT128
 #define USE_INT128 0
 #endif
@@ -37,13 +41,22 @@ typedef __uint64_t uint_t;
 
 typedef uint32_t idx_t;
 
+#if USE_GMP && !USE_INT128
+#include <gmp.h>
+#define USE_BIGINT 1
+#else
+#define USE_BIGINT 0
+#endif
+
 #define MAX_SMALL_STRING (MAX(sizeof(int_t),sizeof(void*))*2)
 #define MAX_VAR_POOL_SIZE 1000
-#define MAX_ARITY UCHAR_MAX
-#define MAX_USER_OPS 100
+#define MAX_ARITY ((1<<12)-1)
+#define MAX_TERM_VARS UCHAR_MAX
 #define MAX_QUEUES 16
 #define MAX_STREAMS 64
 #define MAX_DEPTH 1000
+#define MAX_HEAD_DEPTH 64
+#define MAX_INDEX_ARGS 8
 
 #define STREAM_BUFLEN 1024
 
@@ -60,6 +73,7 @@ typedef uint32_t idx_t;
 #define is_indirect(c) ((c)->val_type == TYPE_INDIRECT)
 #define is_float(c) ((c)->val_type == TYPE_FLOAT)
 #define is_rational(c) ((c)->val_type == TYPE_INTEGER)
+#define is_bigint(c) ((c)->val_type == TYPE_BIGINT)
 
 // Derived type...
 
@@ -73,6 +87,8 @@ typedef uint32_t idx_t;
 #define is_integer(c) (((c)->val_type == TYPE_INTEGER) && ((c)->val_den == 1))
 #define is_const_cstring(c) (is_cstring(c) && ((c)->flags&FLAG_CONST_CSTRING))
 #define is_dup_cstring(c) (is_cstring(c) && ((c)->flags&FLAG_DUP_CSTRING))
+#define is_const_bigint(c) (is_bigint(c) && ((c)->flags&FLAG_CONST_BIGINT))
+#define is_dup_bigint(c) (is_bigint(c) && ((c)->flags&FLAG_DUP_BIGINT))
 #define is_nil(c) (is_literal(c) && !(c)->arity && ((c)->val_off == g_nil_s))
 #define is_quoted(c) ((c)->flags&FLAG_QUOTED)
 #define is_fresh(c) ((c)->flags&FLAG_FRESH)
@@ -91,6 +107,7 @@ enum {
 	TYPE_CSTRING,
 	TYPE_INTEGER,
 	TYPE_FLOAT,
+	TYPE_BIGINT,
 	TYPE_INDIRECT,
 	TYPE_END
 };
@@ -109,12 +126,16 @@ enum {
 	FLAG_FIRST_USE=FLAG_HEX,			// used with TYPE_VARIABLE
 	FLAG_ANON=FLAG_OCTAL,				// used with TYPE_VARIABLE
 	FLAG_FRESH=FLAG_BINARY,				// used with TYPE_VARIABLE
+	FLAG_PRIVATE=FLAG_TAIL_REC,			// used with TYPE_VARIABLE, see do_setarg()
 	FLAG_STREAM=FLAG_TAIL_REC,			// used with TYPE_INTEGER
 	FLAG_CONST_CSTRING=FLAG_HEX,		// used with TYPE_CSTRING
 	FLAG_DUP_CSTRING=FLAG_OCTAL,		// used with TYPE_CSTRING
 	FLAG_QUOTED=FLAG_BINARY,			// used with TYPE_CSTRING
+	FLAG_CONST_BIGINT=FLAG_HEX,			// used with TYPE_BIGINT
+	FLAG_DUP_BIGINT=FLAG_OCTAL,			// used with TYPE_BIGINT
 
-	//FLAG_SPARE1=1<<8,
+	FLAG_VISITED=1<<8,					// used with TYPE_INDIRECT while walking
+	FLAG_GROUND=FLAG_VISITED,			// used with TYPE_LITERAL, a shared term
 
 	OP_FX=1<<9,
 	OP_FY=1<<10,
@@ -131,10 +152,13 @@ typedef struct rule_ rule;
 typedef struct clause_ clause;
 typedef struct cell_ cell;
 typedef struct parser_ parser;
+typedef struct bigint_ bigint;
+typedef struct slab_ slab;
+typedef struct loaded_file_ loaded_file;
 
 struct cell_ {
-	uint8_t val_type;
-	uint8_t arity;
+	uint16_t val_type:4;
+	uint16_t arity:12;
 	uint16_t flags;
 	idx_t nbr_cells;
 
@@ -159,6 +183,10 @@ struct cell_ {
 			size_t len_str;
 		};
 
+		struct {
+			bigint *val_big;
+		};
+
 		struct {
 			union {
 				int (*fn)(query*);
@@ -167,11 +195,15 @@ struct cell_ {
 				uint16_t precedence;
 			};
 
-			idx_t val_off;
+			union {
+				idx_t val_off;
+				idx_t attrs_ctx;		// used with an attribute node
+			};
 
 			union {
 				idx_t var_nbr;			// used with TYPE_VAR
 				idx_t cgen;				// used with cuts
+				idx_t jmp;				// used with compiled control
 			};
 		};
 
@@ -192,21 +224,56 @@ typedef struct {
 	unsigned cut_only:1;
 	unsigned is_deleted:1;
 	unsigned is_persist:1;
+	unsigned owns_data:1;				// blobs or bigints to free
 	cell cells[];
 } term;
 
+// A clause head compiled for matching, one op per argument cell, with
+// an H_POP closing each H_STRUCT. See compile_head() and match_head().
+
+enum { H_END, H_VOID, H_FIRST, H_VAR, H_ATOM, H_INT, H_STRUCT, H_POP, H_TERM };
+
+typedef struct {
+	uint8_t op;
+	idx_t skip;							// H_STRUCT: ops to its H_POP
+	cell *c;
+} head_op;
+
 struct clause_ {
 	rule *parent;
 	clause *next;
 	module *m;
+	head_op *code;
+	uint64_t born, died;				// database generations, 0 = alive
+	slab *owner;
+	cell **shared;						// see share_clause()
+	term *inlined;						// body to run, see inline_clause()
+	uint64_t inline_gen;
+	unsigned nbr_shared;
+	unsigned size;						// bytes taken in the slab
 	uuid u;
 	term t;
 };
 
+// Clauses are carved from slabs owned by their rule. A slab is freed
+// when its last clause is, or all at once when the rule is cleared.
+
+struct slab_ {
+	slab *prev, *next;
+	size_t size, used, inuse;
+	unsigned live;
+};
+
+// A call sees the clauses that were in the database when it began,
+// the logical update view, whatever is asserted or retracted after.
+
+#define is_visible(r,gen) (((r)->born <= (gen)) && (!(r)->died || ((r)->died > (gen))))
+
 struct rule_ {
 	rule *next;
 	clause *head, *tail;
-	skiplist *index;
+	skiplist *index[MAX_INDEX_ARGS];	// by argument, built on demand
+	slab *slabs;						// the first is being filled
 	uint32_t cnt;
 	idx_t val_off;
 	uint16_t arity;
@@ -216,6 +283,24 @@ struct rule_ {
 	unsigned is_persist:1;
 	unsigned is_multifile:1;
 	unsigned is_abolished:1;
+	unsigned is_indexed:1;
+	unsigned owns_data:1;
+	unsigned is_reloaded:1;
+	unsigned is_inlined:1;				// into callers, see inline_clause()
+	uint8_t noindex;					// arguments that can't be indexed
+	loaded_file *src;					// the file that defined it
+	uint32_t src_hash, new_hash;		// of its clauses as consulted
+	clause *new_head, *new_tail;		// read by make/0, not yet in
+};
+
+// A consulted file, for make/0 to tell when it has changed. Each rule
+// notes the file it came from and a hash of its clauses as read, so
+// that only predicates whose clauses differ need be replaced.
+
+struct loaded_file_ {
+	loaded_file *next;
+	char *filename, *module_name;
+	int64_t mtime, size;
 };
 
 struct builtins {
@@ -231,11 +316,47 @@ struct op_table {
 	unsigned precedence;
 };
 
+// An operator name has at most one definition of each kind, so each
+// op_def holds a prefix, an infix and a postfix slot.
+
+enum { OP_PREFIX=0, OP_INFIX=1, OP_POSTFIX=2 };
+
+typedef struct op_def_ op_def;
+
+struct op_def_ {
+	op_def *next;
+	idx_t name_off;
+	uint32_t hash;
+
+	struct {
+		unsigned val_type, precedence;
+		int userop;
+	} slot[3];
+};
+
 typedef struct {
 	idx_t ctx;
 	idx_t var_nbr;
+	idx_t save_nbr;						// 1+index into saves if non-zero
 } trail;
 
+// The previous contents of a cell overwritten by setarg/3. If 'c' is
+// NULL it was the slot named by the trail entry.
+
+typedef struct {
+	cell *c;
+	cell val;
+	idx_t ctx;
+} saved;
+
+// An attributed variable bound during the current step, whose goals
+// and hooks are to be run once the step is done.
+
+typedef struct {
+	cell *attrs;
+	idx_t ctx, var_nbr;
+} wake;
+
 typedef struct {
 	cell c;
 	idx_t ctx;
@@ -248,6 +369,7 @@ typedef struct {
 	uint16_t nbr_vars, nbr_slots;
 	unsigned any_choices:1;
 	unsigned did_cut:1;
+	unsigned no_tco:1;					// attributes refer to its slots
 } frame;
 
 typedef struct {
@@ -272,11 +394,13 @@ typedef struct {
 	sliter *iter;
 	idx_t curr_frame, fp, hp, tp, sp;
 	uint8_t anbr, qnbr;
+	uint64_t db_gen;					// database as seen by the call
+	unsigned by_index:1;				// clauses come from iter only
 } state;
 
 typedef struct {
 	state st;
-	idx_t v1, v2, cgen;
+	idx_t v1, v2, cgen, overflow;
 	uint64_t pins;
 	uint16_t nbr_vars, nbr_slots;
 	unsigned local_cut:1;
@@ -285,6 +409,11 @@ typedef struct {
 	unsigned catchme2:1;
 } choice;
 
+typedef struct {
+	cell *cells;
+	size_t size, cnt;
+} atomic_set;
+
 typedef struct arena_ arena;
 
 struct arena_ {
@@ -295,23 +424,30 @@ struct arena_ {
 };
 
 struct query_ {
-	query *prev, *next, *parent;
+	query *prev, *next, *parent, *engines;
 	module *m;
 	frame *frames;
 	slot *slots;
 	choice *choices;
 	trail *trails;
-	cell *last_arg, *tmpq[MAX_QUEUES], *exception;
+	saved *saves;
+	wake *wakes;
+	cell *last_arg, *tmpq[MAX_QUEUES], *exception, *engine_term;
 	cell *tmp_heap, *queue[MAX_QUEUES];
-	arena *arenas;
-	cell accum;
+	char *ball;
+	arena *arenas, *nb_arenas;
+	cell accum, aggr[MAX_QUEUES];
+	atomic_set aggr_set[MAX_QUEUES];
 	state st;
 	uint64_t tot_goals, tot_retries, tot_matches, tot_tcos;
-	uint64_t nv_mask, step, qid;
+	uint64_t nv_mask, step, qid, yield_at;
+	uint64_t inf_limit, time_limit, mem_limit;
 	uint64_t time_started;
 	int max_depth, tmo_msecs;
+	unsigned time_slice;
 	idx_t cp, tmphp, nv_start, latest_ctx, popp, cgen;
-	idx_t frames_size, slots_size, trails_size, choices_size;
+	idx_t frames_size, slots_size, trails_size, choices_size, saves_size, nbr_saves;
+	idx_t wakes_size, nbr_wakes;
 	idx_t max_choices, max_frames, max_slots, max_trails;
 	idx_t h_size, tmph_size, tot_heaps, tot_heapsize;
 	idx_t q_size[MAX_QUEUES], tmpq_size[MAX_QUEUES], qp[MAX_QUEUES];
@@ -334,13 +470,15 @@ struct query_ {
 	unsigned abort:1;
 	unsigned cycle_error:1;
 	unsigned spawned:1;
+	unsigned preempted:1;
+	unsigned limited:1;
 };
 
 struct parser_ {
 	struct {
 		char var_pool[MAX_VAR_POOL_SIZE];
-		unsigned var_used[MAX_ARITY];
-		const char *var_name[MAX_ARITY];
+		unsigned var_used[MAX_TERM_VARS];
+		const char *var_name[MAX_TERM_VARS];
 	} vartab;
 
 	FILE *fp;
@@ -358,6 +496,7 @@ struct parser_ {
 	unsigned directive:1;
 	unsigned consulting:1;
 	unsigned one_shot:1;
+	unsigned buffered:1;
 	unsigned start_term:1;
 	unsigned end_of_term:1;
 	unsigned comment:1;
@@ -376,27 +515,32 @@ struct module_ {
 	rule *head, *tail;
 	parser *p;
 	FILE *fp;
-	struct op_table ops[MAX_USER_OPS+1];
+	op_def **ops;
+	size_t ops_size, ops_cnt;
         const char *keywords[1000];
 
 	struct {
 		int double_quote_codes, double_quote_chars, double_quote_atom;
 		int character_escapes;
 		int rational_syntax_natural, prefer_rationals;
+		int share_ground;
 	} flag;
 
 	int prebuilt, halt, halt_code, status, trace, quiet, dirty;
-	int user_ops, opt, stats, iso_only, use_persist, loading;
+	int opt, stats, iso_only, use_persist, loading;
 	int make_public, dump_vars;  //note by cehteh: investigate: can these be unsigned (or bool)
-	unsigned cpu_count;
+	unsigned cpu_count, time_slice;
 };
 
 extern idx_t g_empty_s, g_dot_s, g_cut_s, g_nil_s, g_true_s, g_fail_s;
 extern idx_t g_anon_s, g_clause_s, g_eof_s, g_lt_s, g_false_s;
-extern idx_t g_gt_s, g_eq_s, g_sys_elapsed_s, g_sys_queue_s, g_braces_s;
+extern idx_t g_gt_s, g_eq_s, g_sys_elapsed_s, g_sys_queue_s, g_sys_aggregate_s, g_braces_s;
+extern idx_t g_freeze_s, g_attr_hook_s, g_clpfd_s, g_fd_s;
 extern stream g_streams[MAX_STREAMS];
 extern module *g_modules;
 extern char *g_pool;
+extern uint64_t g_db_gen, g_inline_gen;
+extern size_t g_db_reserved, g_db_used;
 
 inline static idx_t copy_cells(cell *dst, const cell *src, idx_t nbr_cells)
 {
@@ -404,6 +548,16 @@ inline static idx_t copy_cells(cell *dst, const cell *src, idx_t nbr_cells)
 	return nbr_cells;
 }
 
+// Bytes a query holds in heap arenas plus those in use on its frame
+// and slot stacks, as limited by call_with_memory_limit/2.
+
+inline static uint64_t mem_used(const query *q)
+{
+	return ((uint64_t)q->tot_heapsize * sizeof(cell))
+		+ ((uint64_t)q->st.fp * sizeof(frame))
+		+ ((uint64_t)q->st.sp * sizeof(slot));
+}
+
 #define LIST_HEAD(l) list_head(l); __attribute__((unused)) cell l##_tmp
 #define LIST_TAIL(l) list_tail(l, &l##_tmp)
 
@@ -413,10 +567,15 @@ cell *list_tail(cell *l, cell *tmp);
 int is_in_pool(const char *name, idx_t *offset);
 void set_var(query *q, cell *c, idx_t ctx, cell *v, idx_t v_ctx);
 void reset_value(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx);
+void rebind_value(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx);
+void rebind_slot(query *q, idx_t ctx, idx_t var_nbr, cell *v, idx_t v_ctx, int trailed);
+void overwrite_cell(query *q, cell *c, const cell *v, int trailed);
+void set_attrs(query *q, cell *c, idx_t c_ctx, cell *attrs);
 int module_load_fp(module *m, FILE *fp);
 int module_load_file(module *m, const char *filename);
 int module_save_file(module *m, const char *filename);
 int deconsult(const char *filename);
+unsigned make_changed(void);
 module *create_module(const char *name);
 void destroy_module(module *m);
 module *find_module(const char *name);
@@ -429,13 +588,16 @@ int get_op(module *m, const char *name, unsigned *val_type, int *userop, int hin
 void write_canonical(query *q, FILE *fp, cell *c, idx_t c_ctx, int running, int depth);
 void write_canonical_to_stream(query *q, stream *str, cell *c, idx_t c_ctx, int running, int depth);
 size_t write_canonical_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ctx, int running, int depth);
+char *write_canonical_to_strbuf(query *q, cell *c, idx_t c_ctx, int running);
 void write_term(query *q, FILE *fp, cell *c, idx_t c_ctx, int running, int cons, int depth);
 void write_term_to_stream(query *q, stream *str, cell *c, idx_t c_ctx, int running, int cons, int depth);
 size_t write_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ctx, int running, int cons, int depth);
+char *write_term_to_strbuf(query *q, cell *c, idx_t c_ctx, int running);
 void make_choice(query *q);
 void make_barrier(query *q);
 void make_catcher(query *q, int type);
 void cut_me(query *q, int local_cut);
+void cut_barrier(query *q, const cell *c);
 int check_builtin(module *m, const char *name, unsigned arity);
 void *get_builtin(module *m, const char *name, unsigned arity);
 void query_execute(query *q, term *t);
@@ -452,12 +614,13 @@ int parser_attach(parser *p, int start_idx);
 void parser_xref(parser *p, term *t, rule *parent);
 idx_t drop_choice(query *q);
 int retry_choice(query *q);
-void parser_assign_vars(parser *p);
+int parser_assign_vars(parser *p);
 query *create_query(module *m, int sub_query);
 query *create_task(query *q, cell *curr_cell);
 void destroy_query(query *q);
 void run_query(query *q);
 cell *deep_clone_to_heap(query *q, cell *p1, idx_t p1_ctx);
+int is_cyclic_term(query *q, cell *c, idx_t c_ctx);
 cell *clone_to_heap(query *q, int prefix, cell *p1, idx_t suffix);
 void make_end(cell *tmp);
 int do_match(query *q, cell *p1, idx_t p1_ctx);
@@ -468,13 +631,26 @@ unsigned count_bits(uint64_t mask, unsigned bit);
 void try_me(const query *q, unsigned vars);
 void load_keywords(module *m);
 void throw_error(query *q, cell *c, const char *err_type, const char *expected);
+int raise_error(query *q);
+cell *limit_goal(query *q, const uint64_t *limit);
 uint64_t get_time_in_usec(void);
 void clear_term(term *t);
 void do_db_load(module *m);
 void set_dynamic_in_db(module *m, const char *name, unsigned arity);
+int index_rule(rule *h, unsigned arg);
+void unindex_rule(rule *h);
+void clear_rule(rule *h);
+void release_clause(clause *r);
+cell *unshare_clause(const clause *r);
 int set_op(module *m, const char *name, unsigned val_type, unsigned precedence);
 size_t sprint_int(char *dst, size_t size, int_t n, int base);
-void call_attrs(query *q, cell *attrs);
+size_t sprint_float(char *dst, size_t size, double v);
+void make_bigint_str(cell *c, const char *s, int base, int neg);
+char *bigint_to_str(const cell *c, int base);
+void free_bigint(cell *c);
+void dup_bigint(cell *c);
+int bigint_cmp(const cell *p1, const cell *p2);
+void call_attrs(query *q, int prefix);
 void alloc_list(query *q, const cell *c);
 void append_list(query *q, const cell *c);
 cell *end_list(query *q);
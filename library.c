@@ -15,6 +15,9 @@ extern uint8_t _binary_library_http_pl_end[];
 extern uint8_t _binary_library_atts_pl_start[];
 extern uint8_t _binary_library_atts_pl_end[];
 
+extern uint8_t _binary_library_clpfd_pl_start[];
+extern uint8_t _binary_library_clpfd_pl_end[];
+
 extern uint8_t _binary_library_error_pl_start[];
 extern uint8_t _binary_library_error_pl_end[];
 
@@ -24,6 +27,7 @@ library g_libs[] = {
      {"apply", _binary_library_apply_pl_start, _binary_library_apply_pl_end},
      {"http", _binary_library_http_pl_start, _binary_library_http_pl_end},
      {"atts", _binary_library_atts_pl_start, _binary_library_atts_pl_end},
+     {"clpfd", _binary_library_clpfd_pl_start, _binary_library_clpfd_pl_end},
      {"error", _binary_library_error_pl_start, _binary_library_error_pl_end},
      {0}
 };
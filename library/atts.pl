@@ -1,60 +1,41 @@
-:- use_module(library(dict)).
+:- module(atts, [put_atts/2, get_atts/2, attributed/1]).
 
-%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-
-get_attr(V, Module, Value) :-
-	var(V),
-	Access =.. [Module,Value],
-	get_atts(V, [+Access]).
-
-put_attr(V, Module, Value) :-
-	var(V),
-	Access =.. [Module,Value],
-	put_atts(V, [+Access]).
-
-del_attr(V, Module) :-
-	var(V),
-	Access =.. [Module,_],
-	put_atts(V, [-Access]).
+% get_attr/3, put_attr/3 and del_attr/2 are builtins, keyed by the
+% functor of the attribute here.
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
 put_atts(V, +(A)) :- !,
-	get_attrs(V, D),
 	functor(A, F, _),
-	dict:set(D, F, A, D2),
-	put_attrs(V, D2).
+	put_attr(V, F, A).
 
 put_atts(V, -(A)) :- !,
-	get_attrs(V, D),
 	functor(A, F, _),
-	dict:del(D, F, D2),
-	put_attrs(V, D2).
+	del_attr(V, F).
 
 put_atts(V, A) :- !,
-	get_attrs(V, D),
 	functor(A, F, _),
-	dict:set(D, F, A, D2),
-	put_attrs(V, D2).
+	put_attr(V, F, A).
 
 get_atts(V, L) :- var(L), !,
 	get_attrs(V, D),
-	dict:lst(D, L).
+	values_(D, L).
 
 get_atts(V, +(A)) :- !,
-	get_attrs(V, D),
 	functor(A, F, _),
-	dict:get(D, F, A).
+	get_attr(V, F, A).
 
 get_atts(V, -(A)) :- !,
-	get_attrs(V, D),
 	functor(A, F, _),
-	\+ dict:get(D, F, _).
+	\+ get_attr(V, F, _).
 
 get_atts(V, A) :- !,
-	get_attrs(V, D),
 	functor(A, F, _),
-	dict:get(D, F, A).
+	get_attr(V, F, A).
+
+values_([], []).
+values_([_-A|D], [A|L]) :-
+	values_(D, L).
 
 attributed(V) :-
 	get_attrs(V, D),
@@ -0,0 +1,113 @@
+:- module(clpfd, [
+	op(700, xfx, #=), op(700, xfx, #\=),
+	op(700, xfx, #<), op(700, xfx, #>), op(700, xfx, #=<),
+	op(700, xfx, #>=), op(700, xfx, in), op(700, xfx, ins),
+	op(350, xfx, ..),
+	(in)/2, (ins)/2, (#=)/2, (#\=)/2, (#<)/2, (#>)/2, (#=<)/2, (#>=)/2,
+	all_different/1, all_distinct/1, sum/3, element/3,
+	label/1, labeling/2, indomain/1,
+	fd_dom/2, fd_inf/2, fd_sup/2, fd_size/2, transpose/2
+	]).
+
+% Domains and propagators are kept by the solver in C, see the
+% '$fd_' builtins. Constraints are linear over +, - and *.
+
+attr_unify_hook(Fd, Other) :- '$fd_unify'(Fd, Other).
+
+X in Dom :- '$fd_in'(X, Dom).
+
+[] ins _.
+[X|Xs] ins Dom :- '$fd_in'(X, Dom), Xs ins Dom.
+
+L #= R :- '$fd_linear'(L, #=, R).
+L #\= R :- '$fd_linear'(L, #\=, R).
+L #< R :- '$fd_linear'(L, #<, R).
+L #> R :- '$fd_linear'(L, #>, R).
+L #=< R :- '$fd_linear'(L, #=<, R).
+L #>= R :- '$fd_linear'(L, #>=, R).
+
+all_different(Xs) :- '$fd_all_different'(Xs).
+all_distinct(Xs) :- '$fd_all_different'(Xs).
+
+element(I, Xs, V) :- '$fd_element'(I, Xs, V).
+
+sum(Xs, Op, Value) :-
+	sum_(Xs, 0, Expr),
+	sum_op_(Op, Expr, Value).
+
+sum_([], E, E).
+sum_([X|Xs], E0, E) :- sum_(Xs, E0+X, E).
+
+sum_op_(#=, L, R) :- L #= R.
+sum_op_(#\=, L, R) :- L #\= R.
+sum_op_(#<, L, R) :- L #< R.
+sum_op_(#>, L, R) :- L #> R.
+sum_op_(#=<, L, R) :- L #=< R.
+sum_op_(#>=, L, R) :- L #>= R.
+
+fd_inf(X, V) :- '$fd_inf'(X, V).
+fd_sup(X, V) :- '$fd_sup'(X, V).
+fd_size(X, N) :- '$fd_size'(X, N).
+
+fd_dom(X, Dom) :-
+	'$fd_intervals'(X, [I|Is]),
+	interval_(I, D0),
+	dom_(Is, D0, Dom).
+
+dom_([], D, D).
+dom_([I|Is], D0, D) :-
+	interval_(I, D1),
+	dom_(Is, D0 \/ D1, D).
+
+interval_(V-V, V) :- !.
+interval_(L-H, L..H).
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+
+label(Vars) :- labeling([], Vars).
+
+% Options are leftmost, ff, ffc, min and max for the variable to
+% label next, and up and down for the order of its values.
+
+labeling(Opts, Vars) :-
+	labeling_opts_(Opts, leftmost, Sel, up, Ord),
+	label_(Vars, Sel, Ord).
+
+labeling_opts_([], Sel, Sel, Ord, Ord).
+labeling_opts_([O|Os], Sel0, Sel, Ord0, Ord) :-
+	(   memberchk(O, [up,down]) -> labeling_opts_(Os, Sel0, Sel, O, Ord)
+	;   labeling_opts_(Os, O, Sel, Ord0, Ord)
+	).
+
+label_(Vars, Sel, Ord) :-
+	'$fd_select'(Vars, Sel, X), !,
+	indomain_(Ord, X),
+	label_(Vars, Sel, Ord).
+label_(_, _, _).
+
+indomain(X) :- indomain_(up, X).
+
+indomain_(up, X) :-
+	'$fd_inf'(X, V),
+	(   X = V
+	;   '$fd_remove'(X, V), indomain_(up, X)
+	).
+indomain_(down, X) :-
+	'$fd_sup'(X, V),
+	(   X = V
+	;   '$fd_remove'(X, V), indomain_(down, X)
+	).
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+
+transpose([], []).
+transpose([F|Fs], Ts) :- transpose_(F, [F|Fs], Ts).
+
+transpose_([], _, []).
+transpose_([_|Rs], Ms, [Ts|Tss]) :-
+	lists_firsts_rests(Ms, Ts, Ms1),
+	transpose_(Rs, Ms1, Tss).
+
+lists_firsts_rests([], [], []).
+lists_firsts_rests([[F|Os]|Rest], [F|Fs], [Os|Oss]) :-
+	lists_firsts_rests(Rest, Fs, Oss).
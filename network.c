@@ -258,8 +258,28 @@ size_t net_write(const void *ptr, size_t nbytes, stream *str)
 	return fwrite(ptr, 1, nbytes, str->fp);
 }
 
+// Text that read_terms/3 has read ahead but not yet parsed is read
+// before anything more from the stream itself.
+
+static const char *net_pending(stream *str)
+{
+	parser *p = str->p;
+
+	if (!p || !p->buffered || !p->srcptr || !*p->srcptr)
+		return NULL;
+
+	return p->srcptr;
+}
+
 int net_getc(stream *str)
 {
+	const char *src = net_pending(str);
+
+	if (src) {
+		str->p->srcptr++;
+		return (unsigned char)*src;
+	}
+
 #if USE_OPENSSL
 	size_t len = 1;
 	char ptr[2];
@@ -289,6 +309,15 @@ int net_getc(stream *str)
 
 size_t net_read(void *ptr, size_t len, stream *str)
 {
+	const char *src = net_pending(str);
+
+	if (src) {
+		size_t n = strnlen(src, len);
+		memcpy(ptr, src, n);
+		str->p->srcptr += n;
+		return n;
+	}
+
 #if USE_OPENSSL
 	if (str->ssl) {
 		char *dst = ptr;
@@ -312,6 +341,41 @@ size_t net_read(void *ptr, size_t len, stream *str)
 
 int net_getline(char **lineptr, size_t *n, stream *str)
 {
+	const char *src = net_pending(str);
+
+	if (src) {
+		const char *nl = strchr(src, '\n');
+		size_t len = nl ? (size_t)(nl - src) + 1 : strlen(src);
+
+		if (!*lineptr || (*n < (len + 1))) {
+			*lineptr = realloc(*lineptr, *n=len+1);
+			if (!*lineptr) abort();
+		}
+
+		memcpy(*lineptr, src, len);
+		(*lineptr)[len] = '\0';
+		str->p->srcptr += len;
+
+		if (nl)
+			return len;
+
+		// The rest of the line is still to be read...
+
+		char *line = NULL;
+		size_t more = 0;
+
+		if (net_getline(&line, &more, str) != -1) {
+			more = strlen(line);
+			*lineptr = realloc(*lineptr, *n=len+more+1);
+			if (!*lineptr) abort();
+			memcpy(*lineptr+len, line, more+1);
+			len += more;
+		}
+
+		free(line);
+		return len;
+	}
+
 #if USE_OPENSSL
 	if (str->ssl) {
 		if (!*lineptr)
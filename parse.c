@@ -5,6 +5,7 @@
 #include <ctype.h>
 #include <float.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <sys/errno.h>
 
 #ifdef _WIN32
@@ -33,6 +34,7 @@ static const unsigned INITIAL_NBR_CHOICES = 1000;
 static const unsigned INITIAL_NBR_TRAILS = 1000;
 
 static const int CPU_COUNT = 4;
+static const int TIME_SLICE = 10000;
 
 #define JUST_IN_TIME_COUNT 50
 
@@ -42,9 +44,11 @@ struct prolog_ {
 
 stream g_streams[MAX_STREAMS] = {{0}};
 char *g_pool = NULL;
+uint64_t g_db_gen = 0, g_inline_gen = 1;
 idx_t g_empty_s, g_dot_s, g_cut_s, g_nil_s, g_true_s, g_fail_s;
 idx_t g_anon_s, g_clause_s, g_eof_s, g_lt_s, g_gt_s, g_eq_s;
-idx_t g_sys_elapsed_s, g_sys_queue_s, g_false_s, g_braces_s;
+idx_t g_sys_elapsed_s, g_sys_queue_s, g_sys_aggregate_s, g_false_s, g_braces_s;
+idx_t g_freeze_s, g_attr_hook_s, g_clpfd_s, g_fd_s;
 
 static idx_t g_pool_offset = 0, g_pool_size = 0;
 static int g_tpl_count = 0;
@@ -163,61 +167,126 @@ idx_t find_in_pool(const char *name)
 	return offset;
 }
 
-int get_op(module *m, const char *name, unsigned *val_type, int *userop, int hint_prefix)
+// Operators live in a per-module chained hash keyed on the name,
+// seeded from g_ops when the module is created. Lookups happen for
+// nearly every token read and every functor written. Names are kept
+// as pool offsets as the pool may move when it grows.
+
+static uint32_t op_hash(const char *name)
 {
-	for (const struct op_table *ptr = m->ops; ptr->name; ptr++) {
-		if (hint_prefix && (ptr->val_type != OP_FX) && (ptr->val_type != OP_FY))
-			continue;
+	uint32_t h = 2166136261U;
 
-		if (!strcmp(ptr->name, name)) {
-			if (val_type) *val_type = ptr->val_type;
-			if (userop) *userop = 1;
-			return ptr->precedence;
-		}
+	while (*name) {
+		h ^= (uint8_t)*name++;
+		h *= 16777619U;
 	}
 
-	for (const struct op_table *ptr = g_ops; ptr->name; ptr++) {
-		if (hint_prefix && (ptr->val_type != OP_FX) && (ptr->val_type != OP_FY))
-			continue;
+	return h;
+}
 
-		if (!strcmp(ptr->name, name)) {
-			if (val_type) *val_type = ptr->val_type;
-			if (userop) *userop = 0;
-			return ptr->precedence;
-		}
-	}
+static unsigned op_slot(unsigned val_type)
+{
+	if ((val_type == OP_FX) || (val_type == OP_FY))
+		return OP_PREFIX;
 
-	if (hint_prefix)
-		return get_op(m, name, val_type, userop, 0);
+	if ((val_type == OP_XF) || (val_type == OP_YF))
+		return OP_POSTFIX;
 
-	return 0;
+	return OP_INFIX;
 }
 
-int set_op(module *m, const char *name, unsigned val_type, unsigned precedence)
+static op_def *find_op(module *m, const char *name, uint32_t h)
 {
-	struct op_table *ptr = m->ops;
-	name = g_pool + find_in_pool(name);
+	if (!m->ops_size)
+		return NULL;
 
-	for (; ptr->name; ptr++) {
-		if (!strcmp(ptr->name, name)) {
-			ptr->name = name;
-			ptr->val_type = val_type;
-			ptr->precedence = precedence;
-			return 1;
+	for (op_def *d = m->ops[h & (m->ops_size-1)]; d; d = d->next) {
+		if ((d->hash == h) && !strcmp(g_pool+d->name_off, name))
+			return d;
+	}
+
+	return NULL;
+}
+
+int get_op(module *m, const char *name, unsigned *val_type, int *userop, int hint_prefix)
+{
+	static const unsigned s_order[] = { OP_INFIX, OP_PREFIX, OP_POSTFIX };
+	const op_def *d = find_op(m, name, op_hash(name));
+
+	if (!d)
+		return 0;
+
+	unsigned n = OP_PREFIX;
+
+	if (!hint_prefix || !d->slot[n].precedence) {
+		for (unsigned i = 0; i < 3; i++) {
+			n = s_order[i];
+
+			if (d->slot[n].precedence)
+				break;
 		}
 	}
 
-	if (!m->user_ops)
+	if (!d->slot[n].precedence)
 		return 0;
 
-	m->user_ops--;
-	ptr->name = name;
-	ptr->val_type = val_type;
-	ptr->precedence = precedence;
+	if (val_type) *val_type = d->slot[n].val_type;
+	if (userop) *userop = d->slot[n].userop;
+	return d->slot[n].precedence;
+}
+
+static int add_op(module *m, const char *name, unsigned val_type, unsigned precedence, int userop)
+{
+	uint32_t h = op_hash(name);
+	op_def *d = find_op(m, name, h);
+
+	if (!d) {
+		if (m->ops_cnt >= m->ops_size) {
+			size_t size = m->ops_size ? m->ops_size * 2 : 128;
+			op_def **ops = calloc(size, sizeof(op_def*));
+
+			if (!ops)
+				return 0;
+
+			for (size_t i = 0; i < m->ops_size; i++) {
+				for (op_def *d = m->ops[i]; d;) {
+					op_def *save = d->next;
+					d->next = ops[d->hash & (size-1)];
+					ops[d->hash & (size-1)] = d;
+					d = save;
+				}
+			}
+
+			free(m->ops);
+			m->ops = ops;
+			m->ops_size = size;
+		}
+
+		if (!(d = calloc(1, sizeof(op_def))))
+			return 0;
+
+		d->name_off = find_in_pool(name);
+		d->hash = h;
+		d->next = m->ops[h & (m->ops_size-1)];
+		m->ops[h & (m->ops_size-1)] = d;
+		m->ops_cnt++;
+	}
+
+	unsigned n = op_slot(val_type);
+	d->slot[n].val_type = val_type;
+	d->slot[n].precedence = precedence;
+	d->slot[n].userop = userop;
 	return 1;
 }
 
+int set_op(module *m, const char *name, unsigned val_type, unsigned precedence)
+{
+	return add_op(m, name, val_type, precedence, 1);
+}
+
 module *g_modules = NULL;
+static loaded_file *g_loaded = NULL, *g_loading = NULL;
+static int g_reloading = 0;
 
 cell *list_head(cell *l)
 {
@@ -405,82 +474,772 @@ static int is_multifile_in_db(const char *mod, const char *name, idx_t arity)
 	return h->is_multifile ? 1 : 0;
 }
 
+// The index is on the first argument of the head, by type and then
+// by value, and for compound terms by name and arity only. It is a
+// total order, so equal keys keep their clauses in database order.
+
+static int key_type(const cell *c)
+{
+	if (is_bigint(c))
+		return 1;
+
+	if (c->val_type == TYPE_INTEGER)
+		return 0;
+
+	if (is_float(c))
+		return 2;
+
+	if (is_string(c))
+		return 4;
+
+	if (is_atom(c))
+		return 3;
+
+	return 5;
+}
+
 static int compkey(const void *ptr1, const void *ptr2)
 {
 	const cell *p1 = (const cell*)ptr1;
 	const cell *p2 = (const cell*)ptr2;
+	int t1 = key_type(p1), t2 = key_type(p2);
 
-	if (is_integer(p1)) {
-		if (is_integer(p2)) {
-			if (p1->val_num < p2->val_num)
-				return -1;
-			else if (p1->val_num > p2->val_num)
-				return 1;
-			else
-				return 0;
-		} else if (is_variable(p2))
+	if (t1 != t2)
+		return t1 < t2 ? -1 : 1;
+
+	switch (t1) {
+	case 0:
+		if (p1->val_num != p2->val_num)
+			return p1->val_num < p2->val_num ? -1 : 1;
+
+		if (p1->val_den != p2->val_den)
+			return p1->val_den < p2->val_den ? -1 : 1;
+
+		return 0;
+
+	case 1:
+		return bigint_cmp(p1, p2);
+
+	case 2:
+		if (p1->val_flt != p2->val_flt)
+			return p1->val_flt < p2->val_flt ? -1 : 1;
+
+		return 0;
+
+	case 5:
+		if (p1->arity != p2->arity)
+			return p1->arity < p2->arity ? -1 : 1;
+	}
+
+	return strcmp(GET_STR(p1), GET_STR(p2));
+}
+
+static cell *get_arg(cell *c, unsigned arg)
+{
+	for (c++; arg--; c += c->nbr_cells)
+		;
+
+	return c;
+}
+
+// An argument standing for a shared term is keyed by the term.
+
+static cell *clause_arg(const clause *r, cell *c)
+{
+	if (is_variable(c) && r->nbr_shared && (c->var_nbr >= (r->t.nbr_vars - r->nbr_shared)))
+		return r->shared[c->var_nbr - (r->t.nbr_vars - r->nbr_shared)];
+
+	return c;
+}
+
+// A rule gets an index on an argument the first time a call has it
+// bound. A clause with a variable there could match any key, and then
+// that argument is not indexed at all.
+
+int index_rule(rule *h, unsigned arg)
+{
+	if (h->noindex & (1U << arg))
+		return 0;
+
+	if (h->index[arg])
+		return 1;
+
+	skiplist *index = sl_create(compkey);
+
+	for (clause *r = h->head; r; r = r->next) {
+		if (r->t.is_deleted)
+			continue;
+
+		cell *c = clause_arg(r, get_arg(get_head(r->t.cells), arg));
+
+		if (is_variable(c)) {
+			h->noindex |= 1U << arg;
+			sl_destroy(index);
 			return 0;
-	} else if (is_float(p1)) {
-		if (is_float(p2)) {
-			if (p1->val_flt < p2->val_flt)
-				return -1;
-			else if (p1->val_flt > p2->val_flt)
-				return 1;
-			else
+		}
+
+		sl_app(index, c, r);
+	}
+
+	h->index[arg] = index;
+	return 1;
+}
+
+void unindex_rule(rule *h)
+{
+	for (unsigned i = 0; i < MAX_INDEX_ARGS; i++) {
+		sl_destroy(h->index[i]);
+		h->index[i] = NULL;
+	}
+
+	h->noindex = 0;
+}
+
+// An index that can't take the clause is kept until the next purge,
+// as a running call may still be walking it.
+
+static void index_clause(rule *h, clause *r, int append)
+{
+	cell *c = get_head(r->t.cells);
+	unsigned arity = c->arity < MAX_INDEX_ARGS ? c->arity : MAX_INDEX_ARGS;
+	c++;
+
+	for (unsigned i = 0; i < arity; i++, c += c->nbr_cells) {
+		if (!h->index[i] || (h->noindex & (1U << i)))
+			continue;
+
+		cell *key = clause_arg(r, c);
+
+		if (is_variable(key))
+			h->noindex |= 1U << i;
+		else if (append)
+			sl_app(h->index[i], key, r);
+		else
+			sl_set(h->index[i], key, r);
+	}
+}
+
+// Argument cells are compiled in order. Variables are split by first
+// and later occurrence, and those used only once in the clause are
+// skipped entirely.
+
+static int compile_head_args(head_op **ops, cell *c, const unsigned *uses, uint8_t *seen, unsigned depth)
+{
+	if (depth == MAX_HEAD_DEPTH)
+		return 0;
+
+	unsigned arity = c->arity;
+	c++;
+
+	while (arity--) {
+		head_op *op = (*ops)++;
+		op->c = c;
+		op->skip = 0;
+
+		if (is_variable(c)) {
+			if (uses[c->var_nbr] == 1)
+				op->op = H_VOID;
+			else if (!seen[c->var_nbr]) {
+				seen[c->var_nbr] = 1;
+				op->op = H_FIRST;
+			} else
+				op->op = H_VAR;
+		} else if (is_structure(c)) {
+			op->op = H_STRUCT;
+
+			if (!compile_head_args(ops, c, uses, seen, depth+1))
 				return 0;
-		} else if (is_variable(p2))
-			return 0;
-	} else if (is_atom(p1)) {
-		if (is_atom(p2))
-			return strcmp(GET_STR(p1), GET_STR(p2));
-		else if (is_variable(p2))
+
+			(*ops)++->op = H_POP;
+			op->skip = (*ops - 1) - op;
+		} else if (is_literal(c))
+			op->op = H_ATOM;
+		else if (is_rational(c))
+			op->op = H_INT;
+		else
+			op->op = H_TERM;
+
+		c += c->nbr_cells;
+	}
+
+	return 1;
+}
+
+// The ops go in the clause's own allocation, just past its cells, and
+// take at most two per head cell. Returns the number used, if any.
+
+#define HEAD_CODE_SIZE(c) (sizeof(head_op)*(c)->nbr_cells*2)
+
+static unsigned compile_head(clause *r, head_op *ops)
+{
+	cell *head = get_head(r->t.cells);
+
+	if (!head->arity)
+		return 0;
+
+	unsigned nbr_vars = r->t.nbr_vars, uses[MAX_TERM_VARS];
+	uint8_t seen[MAX_TERM_VARS];
+
+	if (nbr_vars > MAX_TERM_VARS)
+		return 0;
+
+	memset(uses, 0, sizeof(unsigned)*nbr_vars);
+	memset(seen, 0, nbr_vars);
+
+	// Variables standing for shared terms are bound on entry...
+
+	for (unsigned i = nbr_vars - r->nbr_shared; i < nbr_vars; i++) {
+		seen[i] = 1;
+		uses[i] = 2;
+	}
+
+	for (idx_t i = 0; i < r->t.cidx; i++) {
+		cell *c = r->t.cells + i;
+
+		if (!is_variable(c))
+			continue;
+
+		if (c->var_nbr >= nbr_vars)
 			return 0;
-	} else if (is_structure(p1)) {
-		if (is_structure(p2)) {
-			if (p1->arity < p2->arity)
-				return -1;
 
-			if (p1->arity > p2->arity)
-				return 1;
+		uses[c->var_nbr]++;
+	}
+
+	head_op *code = ops;
 
-			int i = strcmp(GET_STR(p1), GET_STR(p2));
+	if (!compile_head_args(&ops, head, uses, seen, 0))
+		return 0;
 
-			if (i != 0)
-				return i;
+	ops->op = H_END;
+	r->code = code;
+	return ops - code + 1;
+}
 
-			int arity = p1->arity;
-			p1++; p2++;
+// A rule's slabs double in size as it grows, so that the many small
+// rules don't each reserve a lot. A clause too big for a slab gets one
+// to itself.
 
-			while (arity--) {
-				int i = compkey(p1, p2);
+#define SLAB_MIN 512
+#define SLAB_SIZE (64*1024)
+#define SLAB_ALIGN 16
+#define SLAB_ROUND(n) (((n) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+#define SLAB_HDR SLAB_ROUND(sizeof(slab))
 
-				if (i != 0)
-					return i;
+size_t g_db_reserved = 0, g_db_used = 0;
 
-				p1 += p1->nbr_cells;
-				p2 += p2->nbr_cells;
-			}
+static clause *slab_alloc(rule *h, size_t size)
+{
+	size = SLAB_ROUND(size);
+	slab *s = h->slabs;
+
+	if (!s || ((s->used + size) > s->size)) {
+		size_t len = s ? s->size * 2 : SLAB_MIN;
+
+		if (len > SLAB_SIZE)
+			len = SLAB_SIZE;
+
+		if ((SLAB_HDR + size) > len)
+			len = SLAB_HDR + size;
+
+		s = malloc(len);
+		if (!s) abort();
+		s->prev = NULL;
+		s->next = h->slabs;
+		s->size = len;
+		s->used = SLAB_HDR;
+		s->inuse = 0;
+		s->live = 0;
+
+		if (h->slabs)
+			h->slabs->prev = s;
+
+		h->slabs = s;
+		g_db_reserved += len;
+	}
+
+	clause *r = (clause*)((char*)s + s->used);
+	memset(r, 0, size);
+	r->owner = s;
+	r->size = size;
+	s->used += size;
+	s->inuse += size;
+	s->live++;
+	g_db_used += size;
+	return r;
+}
+
+// Give back the unused tail of the last allocation.
+
+static void slab_trim(rule *h, clause *r, size_t size)
+{
+	slab *s = r->owner;
+	size_t old = r->size, new = SLAB_ROUND(size);
+
+	if ((s != h->slabs) || ((char*)r + old != (char*)s + s->used))
+		return;
+
+	r->size = new;
+	s->used -= old - new;
+	s->inuse -= old - new;
+	g_db_used -= old - new;
+}
+
+static void slab_free(rule *h, clause *r)
+{
+	slab *s = r->owner;
+
+	if (r->t.owns_data)
+		release_clause(r);
+
+	s->inuse -= r->size;
+	g_db_used -= r->size;
+
+	if (--s->live)
+		return;
+
+	if (s == h->slabs) {
+		s->used = SLAB_HDR;
+		return;
+	}
+
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		h->slabs = s->next;
+
+	if (s->next)
+		s->next->prev = s->prev;
+
+	g_db_reserved -= s->size;
+	free(s);
+}
+
+// Free every clause of the rule at once, only visiting those that
+// own data.
+
+void clear_rule(rule *h)
+{
+	if (h->is_inlined)
+		g_inline_gen++;
+
+	if (h->owns_data) {
+		for (clause *r = h->head; r; r = r->next) {
+			if (r->t.owns_data)
+				release_clause(r);
+		}
+	}
+
+	for (slab *s = h->slabs; s;) {
+		slab *save = s->next;
+		g_db_reserved -= s->size;
+		g_db_used -= s->inuse;
+		free(s);
+		s = save;
+	}
+
+	unindex_rule(h);
+	h->slabs = NULL;
+	h->head = h->tail = NULL;
+	h->owns_data = 0;
+	h->cnt = 0;
+}
+
+// With the share_ground flag set, ground compound arguments in clauses
+// are interned in a global store and shared. The clause gets a new
+// variable in place of each, past its own, which is bound to the term
+// whenever the clause is tried. A shared term lives for as long as a
+// clause refers to it.
+
+#define SHARE_MIN_CELLS 4
+#define SHARE_MAX_DEPTH 64
+
+typedef struct shared_ shared;
+
+struct shared_ {
+	shared *next;
+	uint32_t hash;
+	unsigned refcnt;
+	cell cells[];
+};
+
+static shared **g_shared = NULL;
+static size_t g_shared_size = 0, g_shared_cnt = 0;
 
+static uint32_t hash_bytes(uint32_t h, const void *ptr, size_t len)
+{
+	const uint8_t *p = ptr;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619U;
+
+	return h;
+}
+
+static uint32_t hash_cells(const cell *c, idx_t nbr_cells)
+{
+	uint32_t h = 2166136261U;
+
+	for (idx_t i = 0; i < nbr_cells; i++, c++) {
+		h = (h ^ c->val_type) * 16777619U;
+		h = (h ^ c->arity) * 16777619U;
+
+		if (is_literal(c))
+			h = hash_bytes(h, &c->val_off, sizeof(c->val_off));
+		else if (is_cstring(c))
+			h = hash_bytes(h, GET_STR(c), LEN_STR(c));
+		else if (is_float(c))
+			h = hash_bytes(h, &c->val_flt, sizeof(c->val_flt));
+		else {
+			h = hash_bytes(h, &c->val_num, sizeof(c->val_num));
+			h = hash_bytes(h, &c->val_den, sizeof(c->val_den));
+		}
+	}
+
+	return h;
+}
+
+#define SHARE_IGNORED_FLAGS (FLAG_BUILTIN|FLAG_TAIL_REC|FLAG_GROUND)
+#define SHARE_IGNORED_CSTRING_FLAGS (FLAG_BLOB|FLAG_CONST_CSTRING|FLAG_DUP_CSTRING)
+
+static int same_cells(const cell *c1, const cell *c2, idx_t nbr_cells)
+{
+	for (idx_t i = 0; i < nbr_cells; i++, c1++, c2++) {
+		if ((c1->val_type != c2->val_type) || (c1->arity != c2->arity)
+			|| (c1->nbr_cells != c2->nbr_cells))
 			return 0;
-		} else if (is_variable(p2))
+
+		if (is_literal(c1)) {
+			if ((c1->val_off != c2->val_off)
+				|| ((c1->flags ^ c2->flags) & ~SHARE_IGNORED_FLAGS))
+				return 0;
+		} else if (is_cstring(c1)) {
+			size_t len = LEN_STR(c1);
+
+			if ((len != LEN_STR(c2)) || memcmp(GET_STR(c1), GET_STR(c2), len)
+				|| ((c1->flags ^ c2->flags) & ~SHARE_IGNORED_CSTRING_FLAGS))
+				return 0;
+		} else if (is_float(c1)) {
+			if (memcmp(&c1->val_flt, &c2->val_flt, sizeof(c1->val_flt))
+				|| (c1->flags != c2->flags))
+				return 0;
+		} else if ((c1->val_num != c2->val_num) || (c1->val_den != c2->val_den)
+			|| (c1->flags != c2->flags))
 			return 0;
-	} else if (is_variable(p1))
+	}
+
+	return 1;
+}
+
+static int is_shareable(const cell *c)
+{
+	if (!is_structure(c) || (c->nbr_cells < SHARE_MIN_CELLS))
 		return 0;
-	else
+
+	for (idx_t i = 0; i < c->nbr_cells; i++) {
+		unsigned type = c[i].val_type;
+
+		if ((type != TYPE_LITERAL) && (type != TYPE_CSTRING)
+			&& (type != TYPE_INTEGER) && (type != TYPE_FLOAT))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void grow_shared(void)
+{
+	size_t size = g_shared_size ? g_shared_size * 2 : 1024;
+	shared **tab = calloc(size, sizeof(shared*));
+	if (!tab) abort();
+
+	for (size_t i = 0; i < g_shared_size; i++) {
+		for (shared *s = g_shared[i]; s;) {
+			shared *save = s->next;
+			s->next = tab[s->hash % size];
+			tab[s->hash % size] = s;
+			s = save;
+		}
+	}
+
+	free(g_shared);
+	g_shared = tab;
+	g_shared_size = size;
+}
+
+static cell *intern_ground(const cell *c)
+{
+	idx_t nbr_cells = c->nbr_cells;
+	uint32_t hash = hash_cells(c, nbr_cells);
+
+	for (shared *s = g_shared_size ? g_shared[hash % g_shared_size] : NULL; s; s = s->next) {
+		if ((s->hash == hash) && same_cells(s->cells, c, nbr_cells)) {
+			s->refcnt++;
+			return s->cells;
+		}
+	}
+
+	if (g_shared_cnt >= (g_shared_size / 4 * 3))
+		grow_shared();
+
+	shared *s = malloc(sizeof(shared) + (sizeof(cell)*nbr_cells));
+	if (!s) abort();
+	s->hash = hash;
+	s->refcnt = 1;
+	memcpy(s->cells, c, sizeof(cell)*nbr_cells);
+
+	for (idx_t i = 0; i < nbr_cells; i++) {
+		cell *c = s->cells + i;
+
+		if (!is_blob(c))
+			continue;
+
+		char *str = malloc(c->len_str + 1);
+		if (!str) abort();
+		memcpy(str, c->val_str, c->len_str);
+		str[c->len_str] = '\0';
+		c->val_str = str;
+		c->flags &= ~(FLAG_CONST_CSTRING|FLAG_DUP_CSTRING);
+	}
+
+	s->cells->flags |= FLAG_GROUND;
+	s->next = g_shared[hash % g_shared_size];
+	g_shared[hash % g_shared_size] = s;
+	g_shared_cnt++;
+	return s->cells;
+}
+
+static void unintern_ground(cell *c)
+{
+	shared *s = (shared*)((char*)c - offsetof(shared, cells));
+
+	if (--s->refcnt)
+		return;
+
+	shared **prev = &g_shared[s->hash % g_shared_size];
+
+	while (*prev != s)
+		prev = &(*prev)->next;
+
+	*prev = s->next;
+	g_shared_cnt--;
+
+	for (idx_t i = 0; i < s->cells->nbr_cells; i++) {
+		if (is_blob(s->cells + i))
+			free(s->cells[i].val_str);
+	}
+
+	free(s);
+}
+
+// The clause is rewritten in one pass over its cells, with a stack of
+// the compounds still open, whose sizes are filled in as they close.
+// Only arguments of the head and of goals are shared, up to a depth.
+
+enum { SH_CLAUSE, SH_HEAD, SH_BODY, SH_ARG };
+
+static int is_control(const cell *c)
+{
+	if (!is_literal(c) || (c->arity != 2))
 		return 0;
 
-	return 0;
+	const char *name = GET_STR(c);
+	return !strcmp(name, ",") || !strcmp(name, ";") || !strcmp(name, "->") || !strcmp(name, "*->");
 }
 
-static void reindex_rule(module *m, rule *h)
+typedef struct {
+	cell *c;
+	unsigned remaining, kind, child;
+} share_frame;
+
+static unsigned share_clause(clause *r, cell **shared)
 {
-        (void) m;
-	h->index = sl_create(compkey);
+	unsigned nbr_vars = r->t.nbr_vars, nbr_shared = 0;
+	cell *tmp = malloc(sizeof(cell)*r->t.cidx), *dst = tmp;
+	if (!tmp) abort();
+	share_frame stack[SHARE_MAX_DEPTH];
+	unsigned sp = 0;
+	const cell *src = r->t.cells, *end = r->t.cells + r->t.cidx - 1;
+	unsigned kind = (is_literal(src) && (src->arity == 2) && !strcmp(GET_STR(src), ":-")) ? SH_CLAUSE : SH_HEAD;
+
+	while (src < end) {
+		unsigned children = SH_ARG;
+
+		if ((kind == SH_BODY) && is_control(src))
+			children = SH_BODY;
+		else if (kind == SH_CLAUSE)
+			children = SH_CLAUSE;
+
+		if ((kind == SH_ARG) && ((nbr_vars + nbr_shared) < MAX_TERM_VARS) && is_shareable(src)) {
+			dst->val_type = TYPE_VARIABLE;
+			dst->arity = 0;
+			dst->flags = 0;
+			dst->nbr_cells = 1;
+			dst->val_off = g_anon_s;
+			dst->var_nbr = nbr_vars + nbr_shared;
+			dst++;
+			shared[nbr_shared++] = intern_ground(src);
+
+			for (idx_t i = 0; i < src->nbr_cells; i++) {
+				if (is_blob(src+i) && !is_dup_cstring(src+i))
+					free(src[i].val_str);
+			}
 
-	for (clause *r = h->head; r; r = r->next) {
-		cell *c = get_head(r->t.cells);
-		sl_set(h->index, c, r);
+			src += src->nbr_cells;
+		} else if (!is_structure(src) || (sp == SHARE_MAX_DEPTH)) {
+			dst += copy_cells(dst, src, src->nbr_cells);
+			src += src->nbr_cells;
+		} else {
+			share_frame *f = stack + sp++;
+			f->c = dst;
+			f->remaining = src->arity;
+			f->kind = children;
+			f->child = 0;
+			*dst++ = *src++;
+			kind = children == SH_CLAUSE ? SH_HEAD : children;
+			continue;
+		}
+
+		// A subterm is done: close the compounds it completes...
+
+		while (sp) {
+			share_frame *f = stack + sp - 1;
+			f->child++;
+
+			if (--f->remaining) {
+				kind = (f->kind == SH_CLAUSE) ? SH_BODY : f->kind;
+				break;
+			}
+
+			f->c->nbr_cells = dst - f->c;
+			sp--;
+		}
+	}
+
+	if (nbr_shared) {
+		idx_t nbr_cells = dst - tmp;
+		copy_cells(r->t.cells, tmp, nbr_cells);
+		r->t.cells[nbr_cells] = *end;
+		r->t.cidx = r->t.nbr_cells = nbr_cells + 1;
+		r->t.nbr_vars += nbr_shared;
+		r->nbr_shared = nbr_shared;
+	}
+
+	free(tmp);
+	return nbr_shared;
+}
+
+void release_clause(clause *r)
+{
+	clear_term(&r->t);
+	free(r->inlined);
+	r->inlined = NULL;
+
+	for (unsigned i = 0; i < r->nbr_shared; i++)
+		unintern_ground(r->shared[i]);
+
+	r->nbr_shared = 0;
+}
+
+// A copy of the clause with its shared terms put back, for writing it
+// out. Free it if it isn't the clause's own cells.
+
+cell *unshare_clause(const clause *r)
+{
+	if (!r->nbr_shared)
+		return (cell*)r->t.cells;
+
+	unsigned first = r->t.nbr_vars - r->nbr_shared;
+	idx_t nbr_cells = r->t.cidx;
+
+	for (unsigned i = 0; i < r->nbr_shared; i++)
+		nbr_cells += r->shared[i]->nbr_cells - 1;
+
+	cell *tmp = malloc(sizeof(cell)*nbr_cells), *dst = tmp;
+	share_frame *stack = malloc(sizeof(share_frame)*r->t.cidx);
+	if (!tmp || !stack) abort();
+	unsigned sp = 0;
+
+	for (const cell *c = r->t.cells, *end = c + r->t.cidx - 1; c < end; c++) {
+		if (is_variable(c) && (c->var_nbr >= first)) {
+			const cell *s = r->shared[c->var_nbr - first];
+			dst += copy_cells(dst, s, s->nbr_cells);
+			dst[-(int)s->nbr_cells].flags &= ~FLAG_GROUND;
+		} else if (is_structure(c)) {
+			stack[sp].c = dst;
+			stack[sp++].remaining = c->arity;
+			*dst++ = *c;
+			continue;
+		} else
+			*dst++ = *c;
+
+		while (sp && !--stack[sp-1].remaining) {
+			stack[sp-1].c->nbr_cells = dst - stack[sp-1].c;
+			sp--;
+		}
 	}
+
+	*dst = r->t.cells[r->t.cidx-1];
+	free(stack);
+	return tmp;
+}
+
+static clause *new_clause(module *m, rule *h, term *t, int consulting)
+{
+	cell *c = get_head(t->cells);
+	int nbr_cells = t->cidx;
+	size_t size = sizeof(clause) + (sizeof(cell)*nbr_cells);
+	size_t max_shared = 0;
+
+	if (m->flag.share_ground)
+		max_shared = MIN(MAX_TERM_VARS, nbr_cells / SHARE_MIN_CELLS);
+
+	clause *r = slab_alloc(h, size+HEAD_CODE_SIZE(c)+(sizeof(cell*)*max_shared));
+	r->parent = h;
+	memcpy(&r->t, t, sizeof(term));
+	r->t.nbr_cells = copy_cells(r->t.cells, t->cells, nbr_cells);
+	r->t.cidx = nbr_cells;
+	r->m = m;
+	r->born = ++g_db_gen;
+
+	if (!consulting) {
+		for (idx_t i = 0; i < r->t.cidx; i++) {
+			cell *c = r->t.cells + i;
+
+			if (is_blob(c) && is_const_cstring(c))
+				c->flags |= FLAG_DUP_CSTRING;
+			else if (is_const_bigint(c))
+				dup_bigint(c);
+		}
+	}
+
+	cell *shared[MAX_TERM_VARS];
+	unsigned nbr_shared = max_shared ? share_clause(r, shared) : 0;
+
+	for (idx_t i = 0; i < r->t.cidx; i++) {
+		cell *c = r->t.cells + i;
+
+		if ((is_blob(c) && !is_dup_cstring(c)) || (is_bigint(c) && !is_dup_bigint(c)))
+			r->t.owns_data = h->owns_data = 1;
+	}
+
+	head_op *code = (head_op*)(r->t.cells+r->t.cidx);
+	unsigned nbr_ops = compile_head(r, code);
+	size = (char*)(code + nbr_ops) - (char*)r;
+
+	if (nbr_shared) {
+		r->shared = (cell**)(code + nbr_ops);
+		memcpy(r->shared, shared, sizeof(cell*)*nbr_shared);
+		size += sizeof(cell*)*nbr_shared;
+		r->t.owns_data = h->owns_data = 1;
+	}
+
+	slab_trim(h, r, size);
+	t->cidx = 0;
+
+	if (h->is_persist)
+		r->t.is_persist = 1;
+
+	return r;
 }
 
 clause *asserta_to_db(module *m, term *t, int consulting)
@@ -537,22 +1296,10 @@ clause *asserta_to_db(module *m, term *t, int consulting)
 	if (m->prebuilt)
 		h->is_prebuilt = 1;
 
-	int nbr_cells = t->cidx;
-	clause *r = calloc(sizeof(clause)+(sizeof(cell)*nbr_cells), 1);
-	r->parent = h;
-	memcpy(&r->t, t, sizeof(term));
-	r->t.nbr_cells = copy_cells(r->t.cells, t->cells, nbr_cells);
-	r->m = m;
-
-	if (!consulting) {
-		for (idx_t i = 0; i < r->t.cidx; i++) {
-			cell *c = r->t.cells + i;
-
-			if (is_blob(c) && is_const_cstring(c))
-				c->flags |= FLAG_DUP_CSTRING;
-		}
-	}
+	if (h->is_inlined)
+		g_inline_gen++;
 
+	clause *r = new_clause(m, h, t, consulting);
 	r->next = h->head;
 	h->head = r;
 	h->cnt++;
@@ -560,19 +1307,34 @@ clause *asserta_to_db(module *m, term *t, int consulting)
 	if (!h->tail)
 		h->tail = r;
 
-	if (h->index && (c->arity > 0)) {
-		cell *c = get_head(r->t.cells);
-		sl_set(h->index, c, r);
-	}
+	index_clause(h, r, 0);
 
-	t->cidx = 0;
+	if (h->cnt > JUST_IN_TIME_COUNT)
+		h->is_indexed = 1;
 
-	if (h->is_persist)
-		r->t.is_persist = 1;
+	return r;
+}
 
-	if (!h->index && (h->cnt > JUST_IN_TIME_COUNT) && h->arity && !is_structure(c+1))
-		reindex_rule(m, h);
+// While make/0 reads a file again the clauses are put aside, to be
+// swapped in afterwards only if the predicate has changed.
 
+static clause *reload_clause(module *m, rule *h, term *t, uint32_t hash)
+{
+	if (!h->is_reloaded) {
+		h->is_reloaded = 1;
+		h->new_hash = 0;
+		h->new_head = h->new_tail = NULL;
+	}
+
+	h->new_hash = (h->new_hash * 31) + hash;
+	clause *r = new_clause(m, h, t, 1);
+
+	if (h->new_tail)
+		h->new_tail->next = r;
+	else
+		h->new_head = r;
+
+	h->new_tail = r;
 	return r;
 }
 
@@ -628,23 +1390,25 @@ clause *assertz_to_db(module *m, term *t, int consulting)
 	if (m->prebuilt)
 		h->is_prebuilt = 1;
 
-	int nbr_cells = t->cidx;
-	clause *r = calloc(sizeof(clause)+(sizeof(cell)*nbr_cells), 1);
-	r->parent = h;
-	memcpy(&r->t, t, sizeof(term));
-	r->t.nbr_cells = copy_cells(r->t.cells, t->cells, nbr_cells);
-	r->t.cidx = nbr_cells;
-	r->m = m;
+	int from_file = g_loading && consulting && !m->prebuilt;
+	uint32_t hash = from_file ? hash_cells(t->cells, t->cidx) : 0;
 
-	if (!consulting) {
-		for (idx_t i = 0; i < r->t.cidx; i++) {
-			cell *c = r->t.cells + i;
+	if (from_file && g_reloading)
+		return reload_clause(m, h, t, hash);
 
-			if (is_blob(c) && is_const_cstring(c))
-				c->flags |= FLAG_DUP_CSTRING;
-		}
+	if (h->is_inlined)
+		g_inline_gen++;
+
+	if (from_file) {
+		if (!h->src)
+			h->src = g_loading;
+
+		if (h->src == g_loading)
+			h->src_hash = (h->src_hash * 31) + hash;
 	}
 
+	clause *r = new_clause(m, h, t, consulting);
+
 	if (h->tail)
 		h->tail->next = r;
 
@@ -654,25 +1418,24 @@ clause *assertz_to_db(module *m, term *t, int consulting)
 	if (!h->head)
 		h->head = r;
 
-	if (h->index && (c->arity > 0)) {
-		cell *c = get_head(r->t.cells);
-		sl_app(h->index, c, r);
-	}
-
-	t->cidx = 0;
-
-	if (h->is_persist)
-		r->t.is_persist = 1;
+	index_clause(h, r, 1);
 
-	if (!h->index && (h->cnt > JUST_IN_TIME_COUNT) && h->arity && !is_structure(c+1))
-		reindex_rule(m, h);
+	if (h->cnt > JUST_IN_TIME_COUNT)
+		h->is_indexed = 1;
 
 	return r;
 }
 
 clause *retract_from_db(module *m, clause *r)
 {
+	if (r->t.is_deleted)
+		return NULL;
+
+	if (r->parent->is_inlined)
+		g_inline_gen++;
+
 	r->parent->cnt--;
+	r->died = ++g_db_gen;
 	r->t.is_deleted = 1;
 	m->dirty = 1;
 	return r;
@@ -697,9 +1460,7 @@ clause *erase_from_db(module *m, uuid *ref)
 {
 	clause *r = find_in_db(m, ref);
 	if (!r) return 0;
-	r->t.is_deleted = 1;
-	m->dirty = 1;
-	return r;
+	return retract_from_db(m, r);
 }
 
 void set_dynamic_in_db(module *m, const char *name, unsigned arity)
@@ -712,8 +1473,7 @@ void set_dynamic_in_db(module *m, const char *name, unsigned arity)
 	if (!h) h = create_rule(m, &tmp);
 	h->is_dynamic = 1;
 
-	if (!h->index)
-		h->index = sl_create(compkey);
+	h->is_indexed = 1;
 }
 
 static void set_persist_in_db(module *m, const char *name, unsigned arity)
@@ -727,8 +1487,7 @@ static void set_persist_in_db(module *m, const char *name, unsigned arity)
 	h->is_dynamic = 1;
 	h->is_persist = 1;
 
-	if (!h->index)
-		h->index = sl_create(compkey);
+	h->is_indexed = 1;
 
 	m->use_persist = 1;
 }
@@ -740,6 +1499,8 @@ void clear_term(term *t)
 
 		if (is_blob(c) && !is_dup_cstring(c))
 			free(c->val_str);
+		else if (is_bigint(c) && !is_dup_bigint(c))
+			free_bigint(c);
 
 		c->val_type = TYPE_EMPTY;
 	}
@@ -788,6 +1549,7 @@ query *create_query(module *m, int is_task)
 	q->qid = g_query_id++;
 	q->m = m;
 	q->trace = m->trace;
+	q->time_slice = m->time_slice;
 	q->current_input = 0;		// STDIN
 	q->current_output = 1;		// STDOUT
 
@@ -836,33 +1598,26 @@ query *create_task(query *q, cell *curr_cell)
 	for (unsigned i = 0; i < gsrc->nbr_vars; i++, e++) {
 		cell *c = deref(q, &e->c, e->ctx);
 		cell tmp = {0};
-		tmp.val_type = TYPE_VARIABLE;
-		tmp.var_nbr = i;
-		tmp.val_off = g_anon_s;
-		set_var(subq, &tmp, 0, c, q->latest_ctx);
-	}
-
-	subq->st.sp = gsrc->nbr_vars;
-	return subq;
-}
-
-void destroy_query(query *q)
-{
-	free(q->trails);
-	free(q->choices);
-
-	while (q->st.qnbr > 0) {
-		free(q->tmpq[q->st.qnbr]);
-		q->tmpq[q->st.qnbr] = NULL;
-		q->st.qnbr--;
+		tmp.val_type = TYPE_VARIABLE;
+		tmp.var_nbr = i;
+		tmp.val_off = g_anon_s;
+		set_var(subq, &tmp, 0, c, q->latest_ctx);
 	}
 
-	for (arena *a = q->arenas; a;) {
+	subq->st.sp = gsrc->nbr_vars;
+	return subq;
+}
+
+static void free_arenas(arena *a)
+{
+	while (a) {
 		for (idx_t i = 0; i < a->hp; i++) {
 			cell *c = a->heap + i;
 
 			if (is_blob(c) && !is_const_cstring(c))
 				free(c->val_str);
+			else if (is_bigint(c) && !is_const_bigint(c))
+				free_bigint(c);
 			else if (is_integer(c) && ((c)->flags&FLAG_STREAM)) {
 				stream *str = &g_streams[c->val_num];
 
@@ -882,12 +1637,38 @@ void destroy_query(query *q)
 		free(save->heap);
 		free(save);
 	}
+}
 
-	for (int i = 0; i < MAX_QUEUES; i++)
+void destroy_query(query *q)
+{
+	while (q->engines) {
+		query *e = q->engines;
+		q->engines = e->next;
+		destroy_query(e);
+	}
+
+	free(q->ball);
+	free(q->trails);
+	free(q->choices);
+
+	while (q->st.qnbr > 0) {
+		free(q->tmpq[q->st.qnbr]);
+		q->tmpq[q->st.qnbr] = NULL;
+		q->st.qnbr--;
+	}
+
+	free_arenas(q->arenas);
+	free_arenas(q->nb_arenas);
+
+	for (int i = 0; i < MAX_QUEUES; i++) {
 		free(q->queue[i]);
+		free(q->aggr_set[i].cells);
+	}
 
 	free(q->frames);
 	free(q->slots);
+	free(q->saves);
+	free(q->wakes);
 	free(q->tmp_heap);
 	free(q);
 }
@@ -940,6 +1721,44 @@ void consultall(parser *p, cell *l)
 	}
 }
 
+static void do_op(parser *p, module *m, cell *c)
+{
+	cell *p1 = c + 1, *p2 = c + 2, *p3 = c + 3;
+
+	if (!is_integer(p1) || !is_literal(p2) || !is_atom(p3)) {
+		fprintf(stdout, "Error: unknown op\n");
+		p->error = 1;
+		return;
+	}
+
+	unsigned optype;
+	const char *spec = GET_STR(p2);
+
+	if (!strcmp(spec, "fx"))
+		optype = OP_FX;
+	else if (!strcmp(spec, "fy"))
+		optype = OP_FY;
+	else if (!strcmp(spec, "xf"))
+		optype = OP_XF;
+	else if (!strcmp(spec, "xfx"))
+		optype = OP_XFX;
+	else if (!strcmp(spec, "xfy"))
+		optype = OP_XFY;
+	else if (!strcmp(spec, "yf"))
+		optype = OP_YF;
+	else if (!strcmp(spec, "yfx"))
+		optype = OP_YFX;
+	else {
+		fprintf(stdout, "Error: unknown op spec val_type\n");
+		return;
+	}
+
+	if (!set_op(m, GET_STR(p3), optype, p1->val_num)) {
+		fprintf(stdout, "Error: could not set op\n");
+		return;
+	}
+}
+
 static void directives(parser *p, term *t)
 {
 	p->skip = 0;
@@ -983,18 +1802,33 @@ static void directives(parser *p, term *t)
 		if (!is_literal(p1)) return;
 		const char *name = GET_STR(p1);
 
+		// When make/0 reads it again the module is already there...
+
+		if (g_reloading && find_module(name)) {
+			p->m = find_module(name);
+			return;
+		}
+
 		if (find_module(name)) {
 			fprintf(stdout, "Error: module already loaded: %s\n", name);
 			p->error = 1;
 			return;
 		}
 
+		module *save_m = p->m;
 		p->m = create_module(name);
 
 		while (is_iso_list(p2)) {
 			cell *head = LIST_HEAD(p2);
 
-			if (is_structure(head)) {
+			// Operators exported are also set in the importing module.
+
+			if (is_structure(head) && (head->arity == 3) && !strcmp(GET_STR(head), "op")) {
+				do_op(p, p->m, head);
+
+				if (save_m != p->m)
+					do_op(p, save_m, head);
+			} else if (is_structure(head)) {
 				cell *f = head+1, *a = f+1;
 				if (!is_literal(f)) return;
 				if (!is_integer(a)) return;
@@ -1185,6 +2019,11 @@ static void directives(parser *p, term *t)
 				p->m->flag.rational_syntax_natural = 1;
 			else if (!strcmp(GET_STR(p2), "compatibility"))
 				p->m->flag.rational_syntax_natural = 0;
+		} else if (!strcmp(GET_STR(p1), "share_ground")) {
+			if (!strcmp(GET_STR(p2), "true"))
+				p->m->flag.share_ground = 1;
+			else if (!strcmp(GET_STR(p2), "false"))
+				p->m->flag.share_ground = 0;
 		} else {
 			fprintf(stdout, "Warning: unknown flag: %s\n", GET_STR(p1));
 		}
@@ -1192,105 +2031,531 @@ static void directives(parser *p, term *t)
 		return;
 	}
 
-	if (!strcmp(dirname, "op") && (c->arity == 3)) {
-		cell *p1 = c + 1, *p2 = c + 2, *p3 = c + 3;
+	if (!strcmp(dirname, "op") && (c->arity == 3))
+		do_op(p, p->m, c);
+}
+
+void parser_xref(parser *p, term *t, rule *parent)
+{
+	for (idx_t i = 0; i < t->cidx; i++) {
+		cell *c = t->cells + i;
 
-		if (!is_integer(p1) || !is_literal(p2) || !is_atom(p3)) {
-			fprintf(stdout, "Error: unknown op\n");
-			p->error = 1;
-			return;
+		if (!is_literal(c))
+			continue;
+
+		const char *functor = GET_STR(c);
+		module *m = p->m;
+
+		if ((c->fn = get_builtin(m, functor, c->arity)) != NULL) {
+			c->flags |= FLAG_BUILTIN;
+			continue;
 		}
 
-		unsigned optype;
-		const char *spec = GET_STR(p2);
-
-		if (!strcmp(spec, "fx"))
-			optype = OP_FX;
-		else if (!strcmp(spec, "fy"))
-			optype = OP_FY;
-		else if (!strcmp(spec, "xf"))
-			optype = OP_XF;
-		else if (!strcmp(spec, "xfx"))
-			optype = OP_XFX;
-		else if (!strcmp(spec, "xfy"))
-			optype = OP_XFY;
-		else if (!strcmp(spec, "yf"))
-			optype = OP_YF;
-		else if (!strcmp(spec, "yfx"))
-			optype = OP_YFX;
-		else {
-			fprintf(stdout, "Error: unknown op spec val_type\n");
-			return;
+		if (check_builtin(m, functor, c->arity)) {
+			c->flags |= FLAG_BUILTIN;
+			continue;
 		}
 
-		if (!set_op(p->m, GET_STR(p3), optype, p1->val_num)) {
-			fprintf(stdout, "Error: could not set op\n");
-			return;
+		if (strchr(functor, ':')) {
+			char tmpbuf1[256], tmpbuf2[256];
+			tmpbuf1[0] = tmpbuf2[0] = '\0';
+			sscanf(functor, "%255[^:]:%255s", tmpbuf1, tmpbuf2);
+			tmpbuf1[sizeof(tmpbuf1)-1] = tmpbuf2[sizeof(tmpbuf2)-1] = '\0';
+			m = find_module(tmpbuf1);
+
+			if (m)
+				c->val_off = find_in_pool(tmpbuf2);
+			else
+				m = p->m;
+		}
+
+		module *tmp_m = NULL;
+
+		while (m) {
+			rule *h = find_rule(m, c);
+
+			if ((c+c->nbr_cells) >= (t->cells+t->cidx-1)) {
+				if (parent && (h == parent))
+					c->flags |= FLAG_TAIL_REC;
+			}
+
+			if (h && (m != p->m) && !h->is_public && strcmp(GET_STR(c), "dynamic")) {
+				fprintf(stdout, "Error: not a public method %s/%u\n", GET_STR(c), c->arity);
+				//p->error = 1;
+				break;
+			}
+
+			if (h) {
+				c->match = h;
+				break;
+			}
+
+			if (!tmp_m)
+				m = tmp_m = g_modules;
+			else
+				m = m->next;
 		}
 	}
 }
 
-void parser_xref(parser *p, term *t, rule *parent)
+// With opt on, a call to a wrapper, a predicate of one clause whose
+// head arguments are distinct variables and whose body is one goal on
+// just those, is replaced by that goal. Calls to functor/3 and =../2
+// with enough known become unifications. The clause keeps its cells,
+// for listing/1 and clause/2, and runs the rewritten body unless being
+// traced or until any wrapper used is changed, see g_inline_gen.
+
+#define INLINE_MAX_DEPTH 8
+#define INLINE_MAX_ARITY 16
+#define INLINE_MAX_CELLS 64
+
+typedef struct {
+	cell *cells;
+	idx_t cidx, size;
+} cell_buf;
+
+static idx_t buf_add(cell_buf *b, const cell *c, idx_t nbr_cells)
 {
-	for (idx_t i = 0; i < t->cidx; i++) {
-		cell *c = t->cells + i;
+	if ((b->cidx + nbr_cells) > b->size) {
+		b->size = (b->cidx + nbr_cells) * 2;
+		b->cells = realloc(b->cells, sizeof(cell)*b->size);
+		if (!b->cells) abort();
+	}
+
+	idx_t pos = b->cidx;
+	b->cidx += copy_cells(b->cells+pos, c, nbr_cells);
+	return pos;
+}
+
+static idx_t buf_functor(cell_buf *b, idx_t val_off, unsigned arity)
+{
+	cell tmp = {0};
+	tmp.val_type = TYPE_LITERAL;
+	tmp.nbr_cells = 1;
+	tmp.arity = arity;
+	tmp.val_off = val_off;
+	return buf_add(b, &tmp, 1);
+}
+
+static void buf_close(cell_buf *b, idx_t pos)
+{
+	b->cells[pos].nbr_cells = b->cidx - pos;
+}
+
+static int is_plain_atomic(const cell *c)
+{
+	return (is_literal(c) && !c->arity) || is_integer(c) || is_float(c);
+}
+
+static clause *find_wrapper(module *m, const cell *c, unsigned *head_vars)
+{
+	if (!is_literal(c) || (c->flags&FLAG_BUILTIN) || !c->match)
+		return NULL;
+
+	rule *h = c->match;
+
+	if (h->is_dynamic || h->is_multifile || h->is_persist
+		|| (h->cnt != 1) || (h->arity != c->arity)
+		|| (h->arity > INLINE_MAX_ARITY))
+		return NULL;
+
+	clause *r = h->head;
+
+	while (r && r->t.is_deleted)
+		r = r->next;
+
+	if (!r || (r->m != m) || r->nbr_shared)
+		return NULL;
+
+	cell *head = get_head(r->t.cells), *body = get_body(r->t.cells);
+
+	if (!body || !is_literal(body) || is_control(body)
+		|| (body->nbr_cells > INLINE_MAX_CELLS)
+		|| ((body->val_off == head->val_off) && (body->arity == head->arity)))
+		return NULL;
+
+	const char *name = GET_STR(body);
+
+	if (!strcmp(name, "!") || !strcmp(name, "\\+") || !strcmp(name, ":"))
+		return NULL;
+
+	cell *a = head + 1;
+
+	for (unsigned i = 0; i < head->arity; i++, a += a->nbr_cells) {
+		if (!is_variable(a))
+			return NULL;
+
+		for (unsigned j = 0; j < i; j++) {
+			if (head_vars[j] == a->var_nbr)
+				return NULL;
+		}
+
+		head_vars[i] = a->var_nbr;
+	}
+
+	for (idx_t i = 0; i < body->nbr_cells; i++) {
+		if (!is_variable(body+i))
+			continue;
+
+		unsigned j = 0;
+
+		while ((j < head->arity) && (head_vars[j] != body[i].var_nbr))
+			j++;
+
+		if (j == head->arity)
+			return NULL;
+	}
+
+	return r;
+}
+
+// The wrapper's goal with the caller's arguments put in for the head
+// variables.
+
+static void substitute(cell_buf *b, const clause *r, const unsigned *head_vars, const cell *c)
+{
+	const cell *body = get_body((cell*)r->t.cells), *args[INLINE_MAX_ARITY];
+	const cell *ends[INLINE_MAX_CELLS], *a = c + 1;
+	idx_t stack[INLINE_MAX_CELLS];
+	unsigned sp = 0;
+
+	for (unsigned i = 0; i < c->arity; i++, a += a->nbr_cells)
+		args[i] = a;
+
+	for (const cell *src = body, *end = body + body->nbr_cells; src < end;) {
+		if (is_variable(src)) {
+			unsigned j = 0;
+
+			while (head_vars[j] != src->var_nbr)
+				j++;
+
+			buf_add(b, args[j], args[j]->nbr_cells);
+		} else if (is_structure(src)) {
+			stack[sp] = buf_add(b, src, 1);
+			ends[sp++] = src + src->nbr_cells;
+			src++;
+			continue;
+		} else
+			buf_add(b, src, 1);
+
+		src++;
+
+		while (sp && (src >= ends[sp-1]))
+			buf_close(b, stack[--sp]);
+	}
+
+	b->cells[0].flags &= ~FLAG_TAIL_REC;
+}
+
+static int inline_builtin(cell_buf *b, const cell *c)
+{
+	if (!(c->flags&FLAG_BUILTIN))
+		return 0;
+
+	const cell *p1 = c + 1, *p2 = p1 + p1->nbr_cells, *p3 = p2 + p2->nbr_cells;
+	const char *name = GET_STR(c);
+
+	if (!strcmp(name, "functor") && (c->arity == 3)) {
+		if (is_literal(p1) || is_integer(p1) || is_float(p1)) {
+			cell tmp = *p1;
+			tmp.nbr_cells = 1;
+			tmp.arity = 0;
+			tmp.flags = 0;
+			idx_t conj = buf_functor(b, find_in_pool(","), 2);
+			idx_t eq = buf_functor(b, g_eq_s, 2);
+			buf_add(b, p2, p2->nbr_cells);
+			buf_add(b, &tmp, 1);
+			buf_close(b, eq);
+			eq = buf_functor(b, g_eq_s, 2);
+			buf_add(b, p3, p3->nbr_cells);
+			tmp.val_type = TYPE_INTEGER;
+			tmp.val_num = p1->arity;
+			tmp.val_den = 1;
+			buf_add(b, &tmp, 1);
+			buf_close(b, eq);
+			buf_close(b, conj);
+			return 1;
+		}
+
+		if (is_variable(p1) && is_plain_atomic(p2) && is_integer(p3) && !p3->val_num) {
+			idx_t eq = buf_functor(b, g_eq_s, 2);
+			buf_add(b, p1, 1);
+			buf_add(b, p2, 1);
+			buf_close(b, eq);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	if (strcmp(name, "=..") || (c->arity != 2))
+		return 0;
+
+	if (is_literal(p1) || is_integer(p1) || is_float(p1)) {
+		cell tmp = *p1;
+		tmp.nbr_cells = 1;
+		tmp.arity = 0;
+		tmp.flags = 0;
+		idx_t eq = buf_functor(b, g_eq_s, 2);
+		buf_add(b, p2, p2->nbr_cells);
+		idx_t dots[INLINE_MAX_ARITY+1];
+		unsigned n = 0;
+
+		if (p1->arity > INLINE_MAX_ARITY) {
+			b->cidx = eq;
+			return 0;
+		}
+
+		dots[n++] = buf_functor(b, g_dot_s, 2);
+		buf_add(b, &tmp, 1);
+
+		for (const cell *a = p1 + 1; n <= p1->arity; a += a->nbr_cells) {
+			dots[n++] = buf_functor(b, g_dot_s, 2);
+			buf_add(b, a, a->nbr_cells);
+		}
+
+		buf_functor(b, g_nil_s, 0);
+
+		while (n--)
+			buf_close(b, dots[n]);
+
+		buf_close(b, eq);
+		return 1;
+	}
+
+	if (!is_variable(p1) || !is_iso_list(p2))
+		return 0;
+
+	const cell *f = p2 + 1, *args[INLINE_MAX_ARITY];
+	const cell *l = f + f->nbr_cells;
+	unsigned n = 0;
+
+	while (is_iso_list(l) && (n < INLINE_MAX_ARITY)) {
+		args[n++] = l + 1;
+		l = l + 1;
+		l += l->nbr_cells;
+	}
+
+	if (!is_literal(l) || (l->val_off != g_nil_s) || l->arity || !is_plain_atomic(f))
+		return 0;
+
+	if (n && (!is_literal(f) || (f->val_off == g_nil_s)))
+		return 0;
+
+	idx_t eq = buf_functor(b, g_eq_s, 2);
+	buf_add(b, p1, 1);
+
+	if (!n)
+		buf_add(b, f, 1);
+	else {
+		idx_t s = buf_functor(b, f->val_off, n);
+
+		for (unsigned i = 0; i < n; i++)
+			buf_add(b, args[i], args[i]->nbr_cells);
+
+		buf_close(b, s);
+	}
+
+	buf_close(b, eq);
+	return 1;
+}
+
+static int inline_goal(module *m, cell_buf *b, const cell *c, unsigned depth)
+{
+	if (is_control(c) || (is_literal(c) && (c->arity == 1) && !strcmp(GET_STR(c), "\\+"))) {
+		idx_t pos = buf_add(b, c, 1);
+		int done = 0;
+		const cell *a = c + 1;
+
+		for (unsigned i = 0; i < c->arity; i++, a += a->nbr_cells)
+			done |= inline_goal(m, b, a, depth);
+
+		buf_close(b, pos);
+		return done;
+	}
+
+	unsigned head_vars[INLINE_MAX_ARITY];
+	clause *r = depth < INLINE_MAX_DEPTH ? find_wrapper(m, c, head_vars) : NULL;
+
+	if (r) {
+		cell_buf tmp = {0};
+		substitute(&tmp, r, head_vars, c);
+		inline_goal(m, b, tmp.cells, depth+1);
+		free(tmp.cells);
+		r->parent->is_inlined = 1;
+		return 1;
+	}
+
+	if (inline_builtin(b, c))
+		return 1;
+
+	idx_t pos = buf_add(b, c, c->nbr_cells);
+	b->cells[pos].flags &= ~FLAG_TAIL_REC;
+	return 0;
+}
+
+// Control constructs are laid out in line as a flat run of goals and
+// control cells (see fn_sys_try_0() etc), so running them takes no
+// copy of their arguments. A cell's 'jmp' is the offset to the cell
+// it names, which for '$cut' is back to its '$try':
+//
+//	(C -> T ; E)	$try C $cut T $jump E $end
+//	(C -> T)		$try C $cut T
+//	(A ; B)			$or A $jump B $end
+//	\+ G			$try G $cut_fail
+//	once(G)			$try G $cut
+//	ignore(G)		$try G $cut
+//	catch(G,C,R)	$catch G $jump '$recover'(C) R $end
+//
+// Jumps land on the cell before the target. When the construct ends
+// the body there is no '$end' and '$jump' goes straight to the exit.
+
+static idx_t buf_control(cell_buf *b, const char *name)
+{
+	return buf_functor(b, find_in_pool(name), 0);
+}
+
+static void buf_jump(cell_buf *b, idx_t from, idx_t to)
+{
+	b->cells[from].jmp = to > from ? to - from : from - to;
+}
+
+static void buf_exit(cell_buf *b, idx_t jump, int tail)
+{
+	if (tail)
+		return;
+
+	buf_jump(b, jump, buf_control(b, "$end"));
+}
+
+static int compile_goal(cell_buf *b, const cell *c, int tail)
+{
+	if (!is_literal(c) || !c->arity) {
+		idx_t pos = buf_add(b, c, c->nbr_cells);
+		b->cells[pos].flags &= ~FLAG_TAIL_REC;
+		return 0;
+	}
+
+	const char *name = GET_STR(c);
+	const cell *p1 = c + 1, *p2 = p1 + p1->nbr_cells;
+
+	if ((c->arity == 2) && !strcmp(name, ",")) {
+		int done = compile_goal(b, p1, 0);
+		return compile_goal(b, p2, tail) || done;
+	}
+
+	if ((c->arity == 2) && !strcmp(name, ";") && is_literal(p1)
+		&& (p1->arity == 2) && !strcmp(GET_STR(p1), "->")) {
+		const cell *cond = p1 + 1, *then = cond + cond->nbr_cells;
+		idx_t try = buf_control(b, "$try");
+		compile_goal(b, cond, 0);
+		buf_jump(b, buf_control(b, "$cut"), try);
+		compile_goal(b, then, 0);
+		idx_t jump = buf_control(b, "$jump");
+		buf_jump(b, try, jump);
+		compile_goal(b, p2, tail);
+		buf_exit(b, jump, tail);
+		return 1;
+	}
 
-		if (!is_literal(c))
-			continue;
+	if ((c->arity == 2) && !strcmp(name, ";")
+		&& !(is_literal(p1) && (p1->arity == 2) && !strcmp(GET_STR(p1), "*->"))) {
+		idx_t or = buf_control(b, "$or");
+		compile_goal(b, p1, 0);
+		idx_t jump = buf_control(b, "$jump");
+		buf_jump(b, or, jump);
+		compile_goal(b, p2, tail);
+		buf_exit(b, jump, tail);
+		return 1;
+	}
 
-		const char *functor = GET_STR(c);
-		module *m = p->m;
+	if ((c->arity == 2) && !strcmp(name, "->")) {
+		idx_t try = buf_control(b, "$try");
+		compile_goal(b, p1, 0);
+		buf_jump(b, buf_control(b, "$cut"), try);
+		compile_goal(b, p2, tail);
+		return 1;
+	}
 
-		if ((c->fn = get_builtin(m, functor, c->arity)) != NULL) {
-			c->flags |= FLAG_BUILTIN;
-			continue;
-		}
+	if ((c->arity == 1) && (!strcmp(name, "\\+") || !strcmp(name, "once") || !strcmp(name, "ignore"))) {
+		idx_t try = buf_control(b, "$try");
+		compile_goal(b, p1, 0);
+		idx_t cut = buf_control(b, !strcmp(name, "\\+") ? "$cut_fail" : "$cut");
+		buf_jump(b, cut, try);
 
-		if (check_builtin(m, functor, c->arity)) {
-			c->flags |= FLAG_BUILTIN;
-			continue;
-		}
+		if (strcmp(name, "once"))
+			buf_jump(b, try, cut);
 
-		if (strchr(functor, ':')) {
-			char tmpbuf1[256], tmpbuf2[256];
-			tmpbuf1[0] = tmpbuf2[0] = '\0';
-			sscanf(functor, "%255[^:]:%255s", tmpbuf1, tmpbuf2);
-			tmpbuf1[sizeof(tmpbuf1)-1] = tmpbuf2[sizeof(tmpbuf2)-1] = '\0';
-			m = find_module(tmpbuf1);
+		return 1;
+	}
 
-			if (m)
-				c->val_off = find_in_pool(tmpbuf2);
-			else
-				m = p->m;
-		}
+	if ((c->arity == 3) && !strcmp(name, "catch")) {
+		const cell *p3 = p2 + p2->nbr_cells;
+		idx_t catch = buf_control(b, "$catch");
+		compile_goal(b, p1, 0);
+		idx_t jump = buf_control(b, "$jump");
+		idx_t rec = buf_functor(b, find_in_pool("$recover"), 1);
+		buf_add(b, p2, p2->nbr_cells);
+		buf_close(b, rec);
+		buf_jump(b, catch, rec);
+		compile_goal(b, p3, tail);
+		buf_exit(b, jump, tail);
+		return 1;
+	}
 
-		module *tmp_m = NULL;
+	idx_t pos = buf_add(b, c, c->nbr_cells);
+	b->cells[pos].flags &= ~FLAG_TAIL_REC;
+	return 0;
+}
 
-		while (m) {
-			rule *h = find_rule(m, c);
+// The body to run is the clause's with wrappers inlined and control
+// constructs compiled, if there was anything to do.
 
-			if ((c+c->nbr_cells) >= (t->cells+t->cidx-1)) {
-				if (parent && (h == parent))
-					c->flags |= FLAG_TAIL_REC;
-			}
+static void inline_clause(parser *p, clause *r)
+{
+	cell *body = get_body(r->t.cells);
+	r->inline_gen = g_inline_gen;
 
-			if (h && (m != p->m) && !h->is_public && strcmp(GET_STR(c), "dynamic")) {
-				fprintf(stdout, "Error: not a public method %s/%u\n", GET_STR(c), c->arity);
-				//p->error = 1;
-				break;
-			}
+	if (!body || r->t.cut_only)
+		return;
 
-			if (h) {
-				c->match = h;
-				break;
-			}
+	cell_buf in = {0}, b = {0};
+	int done = inline_goal(r->m, &in, body, 0);
+	done = compile_goal(&b, in.cells, 1) || done;
+	free(in.cells);
 
-			if (!tmp_m)
-				m = tmp_m = g_modules;
-			else
-				m = m->next;
-		}
+	if (!done) {
+		free(b.cells);
+		return;
+	}
+
+	cell end = {0};
+	end.val_type = TYPE_END;
+	end.nbr_cells = 1;
+	buf_add(&b, &end, 1);
+	term *t = malloc(sizeof(term)+(sizeof(cell)*b.cidx));
+	if (!t) abort();
+	*t = r->t;
+	t->cidx = t->nbr_cells = b.cidx;
+	memcpy(t->cells, b.cells, sizeof(cell)*b.cidx);
+	free(b.cells);
+	parser_xref(p, t, r->parent);
+
+	// A call just before the way out of a construct ending the body
+	// is as good as last...
+
+	idx_t jump = find_in_pool("$jump");
+
+	for (cell *c = t->cells, *next; !is_end(c); c = next) {
+		next = c + c->nbr_cells;
+
+		if (is_literal(next) && (next->val_off == jump) && !next->jmp
+			&& is_literal(c) && !(c->flags&FLAG_BUILTIN) && (c->match == r->parent))
+			c->flags |= FLAG_TAIL_REC;
 	}
+
+	r->inlined = t;
+	r->t.owns_data = r->parent->owns_data = 1;
 }
 
 static void parser_xref_db(parser *p)
@@ -1299,6 +2564,16 @@ static void parser_xref_db(parser *p)
 		for (clause *r = h->head; r; r = r->next)
 			parser_xref(p, &r->t, h);
 	}
+
+	if (!p->m->opt)
+		return;
+
+	for (rule *h = p->m->head; h; h = h->next) {
+		for (clause *r = h->head; r; r = r->next) {
+			if (!r->inline_gen && !r->t.is_deleted)
+				inline_clause(p, r);
+		}
+	}
 }
 
 static void check_first_cut(parser *p)
@@ -1346,17 +2621,18 @@ static idx_t get_varno(parser *p, const char *src)
 
 	size_t len = strlen(src);
 
-	if ((offset+len+1) >= MAX_VAR_POOL_SIZE) {
-		fprintf(stdout, "Error: variable pool exhausted\n");
-		p->error = 1;
-		return 0;
-	}
+	if ((offset+len+1) >= MAX_VAR_POOL_SIZE)
+		return MAX_TERM_VARS;
 
 	strcpy(p->vartab.var_pool+offset, src);
 	return i;
 }
 
-void parser_assign_vars(parser *p)
+// Numbers the variables of the term just parsed. Returns 0 if there
+// are more than MAX_TERM_VARS of them (or their names overflow the
+// pool), leaving the caller to report it.
+
+int parser_assign_vars(parser *p)
 {
 	p->start_term = 1;
 	p->nbr_vars = 0;
@@ -1374,11 +2650,8 @@ void parser_assign_vars(parser *p)
 
 		c->var_nbr = get_varno(p, GET_STR(c));
 
-		if (c->var_nbr == MAX_ARITY) {
-			fprintf(stdout, "Error: max vars per term reached\n");
-			p->error = 1;
-			return;
-		}
+		if (c->var_nbr == MAX_TERM_VARS)
+			return 0;
 
 		p->vartab.var_name[c->var_nbr] = GET_STR(c);
 
@@ -1418,6 +2691,8 @@ void parser_assign_vars(parser *p)
 
 	if (p->consulting)
 		directives(p, p->t);
+
+	return 1;
 }
 
 static int attach_ops(parser *p, idx_t start_idx)
@@ -1813,12 +3088,103 @@ static cell *make_literal(parser *p, idx_t offset)
 	return c;
 }
 
+// With at most 19 significant digits, a mantissa below 2^53 and a
+// decimal exponent within 10^22 both operands are exact, so a single
+// multiply or divide gives the correctly rounded result. Anything else
+// goes to strtod.
+
+static double parse_float(const char *src)
+{
+	static const double s_pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	const char *s = src;
+	uint64_t mant = 0;
+	int digits = 0, exp10 = 0, neg = 0;
+
+	if (*s == '-') {
+		neg = 1;
+		s++;
+	} else if (*s == '+')
+		s++;
+
+	while (isdigit(*s)) {
+		mant = (mant * 10) + (*s++ - '0');
+		if (mant) digits++;
+	}
+
+	if (*s == '.') {
+		s++;
+
+		while (isdigit(*s)) {
+			mant = (mant * 10) + (*s++ - '0');
+			if (mant) digits++;
+			exp10--;
+		}
+	}
+
+	if ((*s == 'e') || (*s == 'E')) {
+		int eneg = 0, e = 0;
+		s++;
+
+		if (*s == '-') {
+			eneg = 1;
+			s++;
+		} else if (*s == '+')
+			s++;
+
+		while (isdigit(*s) && (e < 10000))
+			e = (e * 10) + (*s++ - '0');
+
+		exp10 += eneg ? -e : e;
+	}
+
+	if ((digits > 19) || (mant > (1ULL << 53)) || (exp10 < -22) || (exp10 > 22))
+		return strtod(src, NULL);
+
+	double v = (double)mant;
+	v = exp10 < 0 ? v / s_pow10[-exp10] : v * s_pow10[exp10];
+	return neg ? -v : v;
+}
+
+static void make_bigint_token(cell *c, const char *s)
+{
+	int neg = 0, base = 10;
+
+	if (*s == '-') {
+		neg = 1;
+		s++;
+	}
+
+	if ((s[0] == '0') && (s[1] == 'x'))
+		base = 16;
+	else if ((s[0] == '0') && (s[1] == 'o'))
+		base = 8;
+	else if ((s[0] == '0') && (s[1] == 'b'))
+		base = 2;
+
+	make_bigint_str(c, base != 10 ? s+2 : s, base, neg);
+}
+
+// Does an unsigned magnitude not fit in int_t?
+
+static int is_big_number(uint_t v, int neg, int overflow)
+{
+	const uint_t lim = (uint_t)1 << (sizeof(int_t)*8-1);
+	return overflow || (neg ? v > lim : v >= lim);
+}
+
+// Returns 2 for an integer too big for int_t (the value is then
+// truncated and the caller has to go to a bigint).
+
 static int parse_number(parser *p, const char **srcptr, int_t *val_num, int_t *val_den)
 {
 	module *m = p->m;
 	*val_den = 1;
 	const char *s = *srcptr;
-	int neg = 0;
+	int neg = 0, big = 0;
 
 	if (*s == '-') {
 		neg = 1;
@@ -1833,7 +3199,7 @@ static int parse_number(parser *p, const char **srcptr, int_t *val_num, int_t *v
 		s += 2;
 		int v = get_char_utf8(&s);
 		*val_num = v;
-		if (neg) *val_num = -*val_num;
+		if (neg) *val_num = (int_t)-(uint_t)*val_num;
 		*srcptr = s;
 		return 1;
 	}
@@ -1843,18 +3209,16 @@ static int parse_number(parser *p, const char **srcptr, int_t *val_num, int_t *v
 		s += 2;
 
 		while ((*s == '0') || (*s == '1')) {
-			v <<= 1;
-
-			if (*s == '1')
-				v |= 1;
+			if (__builtin_mul_overflow(v, 2, &v) || __builtin_add_overflow(v, *s - '0', &v))
+				big = 1;
 
 			s++;
 		}
 
 		*((uint_t*)val_num) = v;
-		if (neg) *val_num = -*val_num;
+		if (neg) *val_num = (int_t)-(uint_t)*val_num;
 		*srcptr = s;
-		return 1;
+		return is_big_number(v, neg, big) ? 2 : 1;
 	}
 
 	if ((*s == '0') && (s[1] == 'o')) {
@@ -1862,15 +3226,16 @@ static int parse_number(parser *p, const char **srcptr, int_t *val_num, int_t *v
 		s += 2;
 
 		while ((*s >= '0') && (*s <= '7')) {
-			v *= 8;
-			v += *s - '0';
+			if (__builtin_mul_overflow(v, 8, &v) || __builtin_add_overflow(v, *s - '0', &v))
+				big = 1;
+
 			s++;
 		}
 
 		*((uint_t*)val_num) = v;
-		if (neg) *val_num = -*val_num;
+		if (neg) *val_num = (int_t)-(uint_t)*val_num;
 		*srcptr = s;
-		return 1;
+		return is_big_number(v, neg, big) ? 2 : 1;
 	}
 
 	if ((*s == '0') && (s[1] == 'x')) {
@@ -1878,33 +3243,33 @@ static int parse_number(parser *p, const char **srcptr, int_t *val_num, int_t *v
 		s += 2;
 
 		while (((*s >= '0') && (*s <= '9')) || ((toupper(*s) >= 'A') && (toupper(*s) <= 'F'))) {
-			v *= 16;
+			int d = ((toupper(*s) >= 'A') && (toupper(*s) <= 'F')) ? 10 + (toupper(*s) - 'A') : *s - '0';
 
-			if ((toupper(*s) >= 'A') && (toupper(*s) <= 'F'))
-				v += 10 + (toupper(*s) - 'A');
-			else
-				v += *s - '0';
+			if (__builtin_mul_overflow(v, 16, &v) || __builtin_add_overflow(v, d, &v))
+				big = 1;
 
 			s++;
 		}
 
 		*((uint_t*)val_num) = v;
-		if (neg) *val_num = -*val_num;
+		if (neg) *val_num = (int_t)-(uint_t)*val_num;
 		*srcptr = s;
-		return 1;
+		return is_big_number(v, neg, big) ? 2 : 1;
 	}
 
-	int_t v = 0;
-	char *tmpptr = (char*)s;
+	uint_t v = 0;
 
 	while ((*s >= '0') && (*s <= '9')) {
-		v *= 10;
-		v += *s - '0';
+		if (__builtin_mul_overflow(v, 10, &v) || __builtin_add_overflow(v, *s - '0', &v))
+			big = 1;
+
 		s++;
 	}
 
 	*((uint_t*)val_num) = v;
-	if (neg) *val_num = -*val_num;
+	if (neg) *val_num = (int_t)-(uint_t)*val_num;
+	big = is_big_number(v, neg, big);
+	const char *end_digits = s;
 	int try_rational = 0;
 
 	if (((*s == 'r') || (*s == 'R')) && 0)
@@ -1913,10 +3278,22 @@ static int parse_number(parser *p, const char **srcptr, int_t *val_num, int_t *v
 		try_rational = 1;
 
 	if (!try_rational) {
-		strtod(tmpptr, &tmpptr);
-		if (tmpptr[-1] == '.') tmpptr--;
-		*srcptr = tmpptr;
-		s = *srcptr;
+		if ((*s == '.') && isdigit(s[1])) {
+			s++;
+
+			while (isdigit(*s))
+				s++;
+		}
+
+		if (((*s == 'e') || (*s == 'E')) &&
+			(isdigit(s[1]) || (((s[1] == '-') || (s[1] == '+')) && isdigit(s[2])))) {
+			s += 2;
+
+			while (isdigit(*s))
+				s++;
+		}
+
+		*srcptr = s;
 
 		if (
 			(*s == '(') ||
@@ -1926,7 +3303,7 @@ static int parse_number(parser *p, const char **srcptr, int_t *val_num, int_t *v
 			p->error = 1;
 		}
 
-		return 1;
+		return big && (*srcptr == end_digits) ? 2 : 1;
 	}
 
 	s++;
@@ -2103,16 +3480,13 @@ static int get_token(parser *p, int last_op)
 		return 1;
 	}
 
-	while (isspace(*src)) {
-		if (*src == '\n')
-			p->line_nbr++;
-
-		src++;
-	}
+	while (isspace(*src) || ((*src == '%') && !p->fp)) {
+		if (*src == '%') {
+			while (*src && (*src != '\n'))
+				src++;
 
-	if ((*src == '%') && !p->fp) {
-		while (*src && (*src != '\n'))
-			src++;
+			continue;
+		}
 
 		if (*src == '\n')
 			p->line_nbr++;
@@ -2451,9 +3825,11 @@ int parser_tokenize(parser *p, int args, int consing)
 		if (!p->quoted && !strcmp(p->token, ".") && (*p->srcptr != '(') && (*p->srcptr != ',') && (*p->srcptr != ')')) {
 			if (parser_attach(p, 0)) {
 				parser_dcg_rewrite(p);
-				parser_assign_vars(p);
 
-				if (p->consulting && !p->skip)
+				if (!parser_assign_vars(p)) {
+					fprintf(stdout, "Error: max vars per term reached, line %d\n", p->line_nbr);
+					p->error = 1;
+				} else if (p->consulting && !p->skip)
 					if (!assertz_to_db(p->m, p->t, 1)) {
 						printf("Error: '%s', line nbr %d\n", p->token, p->line_nbr);
 						p->error = 1;
@@ -2661,9 +4037,13 @@ int parser_tokenize(parser *p, int args, int consing)
 
 		if (p->val_type == TYPE_INTEGER) {
 			const char *src = p->token;
-			parse_number(p, &src, &c->val_num, &c->val_den);
 
-			if (strstr(p->token, "0o"))
+			if ((parse_number(p, &src, &c->val_num, &c->val_den) == 2) && USE_BIGINT) {
+				make_bigint_token(c, p->token);
+
+				if (p->consulting)
+					c->flags |= FLAG_CONST_BIGINT;
+			} else if (strstr(p->token, "0o"))
 				c->flags |= FLAG_OCTAL;
 			else if (strstr(p->token, "0x"))
 				c->flags |= FLAG_HEX;
@@ -2671,7 +4051,7 @@ int parser_tokenize(parser *p, int args, int consing)
 				c->flags |= FLAG_BINARY;
 		}
 		else if (p->val_type == TYPE_FLOAT)
-			c->val_flt = atof(p->token);
+			c->val_flt = parse_float(p->token);
 		else if ((!p->was_quoted || func || p->is_op || p->is_variable ||
 				check_builtin(p->m, p->token, 0)) && !p->string) {
 			if (func && !strcmp(p->token, "."))
@@ -2724,6 +4104,14 @@ static void module_purge(module *m)
 
 	for (rule *h = m->head; h; h = h->next) {
 		clause *last = NULL;
+		int purged = 0;
+
+		// Everything was retracted: free the slabs wholesale...
+
+		if (!h->cnt && h->head) {
+			clear_rule(h);
+			continue;
+		}
 
 		for (clause *r = h->head; r;) {
 			if (!r->t.is_deleted) {
@@ -2732,6 +4120,8 @@ static void module_purge(module *m)
 				continue;
 			}
 
+			purged = 1;
+
 			if (h->head == r)
 				h->head = r->next;
 
@@ -2742,10 +4132,14 @@ static void module_purge(module *m)
 				last->next = r->next;
 
 			clause *next = r->next;
-			clear_term(&r->t);
-			free(r);
+			slab_free(h, r);
 			r = next;
 		}
+
+		// The indexes still refer to the freed clauses...
+
+		if (purged)
+			unindex_rule(h);
 	}
 
 	m->dirty = 0;
@@ -2768,7 +4162,11 @@ static int parser_run(parser *p, const char *src, int dump)
 
 	if (p->command) {
 		parser_dcg_rewrite(p);
-		parser_assign_vars(p);
+
+		if (!parser_assign_vars(p)) {
+			fprintf(stdout, "Error: max vars per term reached\n");
+			return 0;
+		}
 	}
 
 	parser_xref(p, p->t, NULL);
@@ -2785,9 +4183,11 @@ static int parser_run(parser *p, const char *src, int dump)
 	p->m->status = q->status;
 
 	if (!p->m->quiet && !p->directive && dump && q->m->stats) {
+		double elapsed = (double)(get_time_in_usec() - q->time_started) / 1000 / 1000;
 		fprintf(stdout,
-			"Goals %llu, Matches %llu, Max frames %u, Max choices %u, Max trails: %u, Backtracks %llu, TCOs:%llu\n",
-			(unsigned long long)q->tot_goals, (unsigned long long)q->tot_matches,
+			"Goals %llu (%.0f/sec), Matches %llu, Max frames %u, Max choices %u, Max trails: %u, Backtracks %llu, TCOs:%llu\n",
+			(unsigned long long)q->tot_goals, elapsed > 0 ? q->tot_goals / elapsed : 0.0,
+			(unsigned long long)q->tot_matches,
 			q->max_frames, q->max_choices, q->max_trails,
 			(unsigned long long)q->tot_retries, (unsigned long long)q->tot_tcos);
 	}
@@ -2800,10 +4200,16 @@ static int parser_run(parser *p, const char *src, int dump)
 
 module *module_load_text(module *m, const char *src)
 {
+	loaded_file *save_loading = g_loading;
+	int save_reloading = g_reloading;
+	g_loading = NULL;
+	g_reloading = 0;
 	parser *p = create_parser(m);
 	p->consulting = 1;
 	p->srcptr = (char*)src;
 	parser_tokenize(p, 0, 0);
+	g_loading = save_loading;
+	g_reloading = save_reloading;
 
 	if (!p->error && !p->end_of_term && p->t->cidx) {
 		fprintf(stdout, "Error: syntax error, incomplete statement\n");
@@ -2879,6 +4285,21 @@ int module_load_fp(module *m, FILE *fp)
 	return ok && !halt;
 }
 
+static loaded_file *find_loaded(const char *filename)
+{
+	char *path = realpath(filename, NULL);
+
+	for (loaded_file *f = g_loaded; f; f = f->next) {
+		if (!strcmp(f->filename, path ? path : filename)) {
+			free(path);
+			return f;
+		}
+	}
+
+	free(path);
+	return NULL;
+}
+
 int module_load_file(module *m, const char *filename)
 {
 	if (!strcmp(filename, "user")) {
@@ -2924,12 +4345,175 @@ int module_load_file(module *m, const char *filename)
 
 	free(m->filename);
 	m->filename = strdup(filename);
+	loaded_file *f = find_loaded(tmpbuf);
+
+	// A file that make/0 will check by itself...
+
+	if (f && g_reloading) {
+		fclose(fp);
+		return 1;
+	}
+
+	if (!f) {
+		f = calloc(1, sizeof(loaded_file));
+		char *path = realpath(tmpbuf, NULL);
+		f->filename = path ? path : strdup(tmpbuf);
+		f->module_name = strdup(m->name);
+		f->next = g_loaded;
+		g_loaded = f;
+	}
+
+	struct stat st = {0};
+	fstat(fileno(fp), &st);
+	f->mtime = st.st_mtime;
+	f->size = st.st_size;
+	loaded_file *save_loading = g_loading;
+	int save_reloading = g_reloading;
+	g_loading = f;
+	g_reloading = 0;
 	int ok = module_load_fp(m, fp);
+	g_loading = save_loading;
+	g_reloading = save_reloading;
 	fclose(fp);
 
 	return ok;
 }
 
+// Put in the clauses make/0 read for each predicate that changed,
+// or drop them if it didn't. Those that are now gone from the file
+// are retracted. The rules themselves stay, so calls to them that
+// were already resolved are still good.
+
+static unsigned reload_commit(parser *p, loaded_file *f, int ok)
+{
+	unsigned cnt = 0;
+
+	for (module *m = g_modules; m; m = m->next) {
+		p->m = m;
+
+		for (rule *h = m->head; h; h = h->next) {
+			if (!h->is_reloaded) {
+				if (!ok || (h->src != f) || h->is_dynamic || !h->src_hash)
+					continue;
+
+				for (clause *r = h->head; r; r = r->next)
+					retract_from_db(m, r);
+
+				h->src_hash = 0;
+				cnt++;
+				continue;
+			}
+
+			h->is_reloaded = 0;
+
+			if (!ok || ((h->src == f) && (h->new_hash == h->src_hash))) {
+				for (clause *r = h->new_head; r;) {
+					clause *save = r->next;
+					slab_free(h, r);
+					r = save;
+				}
+
+				h->new_head = h->new_tail = NULL;
+				continue;
+			}
+
+			for (clause *r = h->head; r; r = r->next)
+				retract_from_db(m, r);
+
+			for (clause *r = h->new_head; r;) {
+				clause *save = r->next;
+				r->next = NULL;
+				parser_xref(p, &r->t, h);
+
+				if (h->tail)
+					h->tail->next = r;
+				else
+					h->head = r;
+
+				h->tail = r;
+				h->cnt++;
+				index_clause(h, r, 1);
+				r = save;
+			}
+
+			if (h->cnt > JUST_IN_TIME_COUNT)
+				h->is_indexed = 1;
+
+			h->new_head = h->new_tail = NULL;
+			h->src = f;
+			h->src_hash = h->new_hash;
+			cnt++;
+		}
+	}
+
+	return cnt;
+}
+
+static unsigned reload_file(loaded_file *f)
+{
+	module *m = find_module(f->module_name);
+	FILE *fp = m ? fopen(f->filename, "r") : NULL;
+
+	if (!fp)
+		return 0;
+
+	parser *p = create_parser(m);
+	p->consulting = 1;
+	p->fp = fp;
+	loaded_file *save_loading = g_loading;
+	g_loading = f;
+	g_reloading = 1;
+
+	while (getline(&p->save_line, &p->n_line, p->fp) != -1) {
+		p->srcptr = p->save_line;
+
+		if (!parser_tokenize(p, 0, 0))
+			break;
+	}
+
+	free(p->save_line);
+	fclose(fp);
+
+	if (!p->error && !p->end_of_term && p->t->cidx) {
+		fprintf(stdout, "Error: syntax error, incomplete statement\n");
+		p->error = 1;
+	}
+
+	g_reloading = 0;
+	g_loading = save_loading;
+	unsigned cnt = reload_commit(p, f, !p->error);
+	destroy_parser(p);
+	return cnt;
+}
+
+// Read again the files that have changed since they were consulted,
+// returning how many predicates were replaced. Initialization goals
+// aren't run again.
+
+unsigned make_changed(void)
+{
+	unsigned cnt = 0;
+
+	if (g_reloading)
+		return 0;
+
+	for (loaded_file *f = g_loaded; f; f = f->next) {
+		struct stat st = {0};
+
+		if (stat(f->filename, &st))
+			continue;
+
+		if ((st.st_mtime == f->mtime) && (st.st_size == f->size))
+			continue;
+
+		f->mtime = st.st_mtime;
+		f->size = st.st_size;
+		cnt += reload_file(f);
+	}
+
+	return cnt;
+}
+
 static void module_save_fp(module *m, FILE *fp, int canonical, int dq)
 {
         (void) dq;
@@ -2945,10 +4529,15 @@ static void module_save_fp(module *m, FILE *fp, int canonical, int dq)
 			if (r->t.is_deleted)
 				continue;
 
+			cell *c = unshare_clause(r);
+
 			if (canonical)
-				write_canonical(&q, fp, r->t.cells, ctx, 0, 0);
+				write_canonical(&q, fp, c, ctx, 0, 0);
 			else
-				write_term(&q, fp, r->t.cells, ctx, 0, 0, 0);
+				write_term(&q, fp, c, ctx, 0, 0, 0);
+
+			if (c != r->t.cells)
+				free(c);
 
 			fprintf(fp, "\n");
 		}
@@ -2992,8 +4581,11 @@ module *create_module(const char *name)
 	m->flag.character_escapes = 1;
 	m->flag.rational_syntax_natural = 0;
 	m->flag.prefer_rationals = 0;
-	m->user_ops = MAX_USER_OPS;
 	m->cpu_count = CPU_COUNT;
+	m->time_slice = TIME_SLICE;
+
+	for (const struct op_table *ptr = g_ops; ptr->name; ptr++)
+		add_op(m, ptr->name, ptr->val_type, ptr->precedence, 0);
 
 	make_rule(m, "call(G) :- G.");
 	make_rule(m, "format(F) :- format(F, []).");
@@ -3034,6 +4626,10 @@ module *create_module(const char *name)
 	make_rule(m, "'$sort2'(=, X1, _,  [X1]).");
 	make_rule(m, "'$sort2'(>, X1, X2, [X2, X1]).");
 
+	make_rule(m, "'$reverse'(L1, L2) :- '$reverse'(L1, [], L2).");
+	make_rule(m, "'$reverse'([], L, L) :- !.");
+	make_rule(m, "'$reverse'([H|T], L2, L3) :- '$reverse'(T, [H|L2], L3).");
+
 	make_rule(m, "mmerge([], R, R) :- !.");
 	make_rule(m, "mmerge(R, [], R) :- !.");
 	make_rule(m, "mmerge([H1|T1], [H2|T2], Result) :- "		\
@@ -3151,6 +4747,35 @@ module *create_module(const char *name)
 
 	make_rule(m, "setup_call_cleanup(A,G,B) :- A, !, (G -> true ; (B, !, fail)).");
 
+	make_rule(m, "call_with_inference_limit(G,N,R) :- "		\
+		"'$limit'(inferences,N,L),"							\
+		"'$set_limit'(inferences,L,Old),"					\
+		"'$choice'(CP),"									\
+		"catch(G,E,true),"									\
+		"'$det'(CP,D),"										\
+		"'$set_limit'(inferences,Old,_),"					\
+		"(var(E) -> R = D ; "								\
+		"E == inference_limit_exceeded -> R = E ; "			\
+		"throw(E)).");
+
+	make_rule(m, "call_with_time_limit(T,G) :- "			\
+		"'$limit'(time,T,L),"								\
+		"'$set_limit'(time,L,Old),"							\
+		"catch(G,E,('$set_limit'(time,Old,_),throw(E))),"	\
+		"'$set_limit'(time,Old,_), !.");
+
+	make_rule(m, "call_with_memory_limit(G,N) :- "			\
+		"'$limit'(memory,N,L),"								\
+		"'$set_limit'(memory,L,Old),"						\
+		"catch(G,E,('$set_limit'(memory,Old,_),throw(E))),"	\
+		"'$set_limit'(memory,Old,_), !.");
+
+	make_rule(m, "engine_create(T,G,E) :- "					\
+		"'$engine_create'('$engine'(T,Err,'$engine_run'(G,Err)),G,E).");
+
+	make_rule(m, "'$engine_run'(G,Err) :- "					\
+		"catch(G,Err,true), '$engine_yield'.");
+
 	// Edinburgh...
 
 	make_rule(m, "tab(0) :- !.");
@@ -3207,18 +4832,21 @@ void destroy_module(module *m)
 	for (rule *h = m->head; h;) {
 		rule *save = h->next;
 
-		for (clause *r = h->head; r;) {
-			clause *save = r->next;
-			clear_term(&r->t);
-			free(r);
-			r = save;
-		}
-
-		sl_destroy(h->index);
+		clear_rule(h);
 		free(h);
 		h = save;
 	}
 
+	for (size_t i = 0; i < m->ops_size; i++) {
+		for (op_def *d = m->ops[i]; d;) {
+			op_def *save = d->next;
+			free(d);
+			d = save;
+		}
+	}
+
+	free(m->ops);
+
 	module *last = NULL;
 
 	for (module *tmp = g_modules; tmp; tmp = tmp->next) {
@@ -3304,10 +4932,15 @@ prolog *pl_create()
 	g_cut_s = find_in_pool("!");
 	g_nil_s = find_in_pool("[]");
 	g_braces_s = find_in_pool("{}");
+	g_freeze_s = find_in_pool("freeze");
+	g_attr_hook_s = find_in_pool("attr_unify_hook");
+	g_clpfd_s = find_in_pool("clpfd");
+	g_fd_s = find_in_pool("$fd");
 	g_fail_s = find_in_pool("fail");
 	g_clause_s = find_in_pool(":-");
 	g_sys_elapsed_s = find_in_pool("$elapsed");
 	g_sys_queue_s = find_in_pool("$queue");
+	g_sys_aggregate_s = find_in_pool("$aggregate");
 	g_eof_s = find_in_pool("end_of_file");
 	g_lt_s = find_in_pool("<");
 	g_gt_s = find_in_pool(">");
@@ -3382,6 +5015,14 @@ void pl_destroy(prolog *pl)
 			destroy_module(m);
 		}
 
+		while (g_loaded) {
+			loaded_file *f = g_loaded;
+			g_loaded = f->next;
+			free(f->module_name);
+			free(f->filename);
+			free(f);
+		}
+
 		free(g_pool);
 		g_pool = NULL;
 	}
@@ -15,10 +15,6 @@
 #include "network.h"
 #include "utf8.h"
 
-#ifndef DBL_DECIMAL_DIG
-#define DBL_DECIMAL_DIG DBL_DIG
-#endif
-
 static int needs_quote(module *m, const char *src, size_t srclen)
 {
 	if (!strcmp(src, ",") || !strcmp(src, ".") || !strcmp(src, "|"))
@@ -43,182 +39,712 @@ static int needs_quote(module *m, const char *src, size_t srclen)
 	return 0;
 }
 
-static size_t _sprint_int(char *dst, size_t size, int_t n, int base)
+static const char g_digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static const char g_digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+// Digits are produced backwards into a local buffer, two at a time
+// for base 10. A negative value only gets a sign in base 10, other
+// bases write the magnitude and the caller adds any sign.
+
+size_t sprint_int(char *dst, size_t size, int_t n, int base)
 {
-	const char *save_dst = dst;
+	char tmpbuf[(sizeof(int_t)*8)+2];
+	char *src = tmpbuf + sizeof(tmpbuf);
+	uint_t v = n < 0 ? -(uint_t)n : (uint_t)n;
+
+	if (base == 10) {
+		while (v >= 100) {
+			unsigned i = (unsigned)(v % 100) * 2;
+			v /= 100;
+			*--src = g_digit_pairs[i+1];
+			*--src = g_digit_pairs[i];
+		}
 
-	if ((n / base) > 0)
-		dst += _sprint_int(dst, size, n / base, base);
+		if (v >= 10) {
+			*--src = g_digit_pairs[(v*2)+1];
+			*--src = g_digit_pairs[v*2];
+		} else
+			*--src = '0' + (char)v;
 
-	int n2 = n % base;
+		if (n < 0)
+			*--src = '-';
+	} else {
+		do {
+			*--src = g_digits[v % base];
+			v /= base;
+		} while (v);
+	}
 
-	if (n2 > 9) {
-		n2 -= 10;
-		n2 += 'A';
-	} else
-		n2 += '0';
+	size_t len = (tmpbuf + sizeof(tmpbuf)) - src;
 
-	if (size) *dst++ = (char)n2; else dst++;
-	return dst - save_dst;
+	if (size) {
+		size_t n = len < size ? len : size - 1;
+		memcpy(dst, src, n);
+		dst[n] = '\0';
+	}
+
+	return len;
 }
 
-size_t sprint_int(char *dst, size_t size, int_t n, int base)
+// Shortest round-trip float formatting using Grisu2 (Loitsch, "Printing
+// floating-point numbers quickly and accurately with integers"). The
+// cached powers of ten are computed once, exactly, on first use rather
+// than carried as a table.
+
+typedef struct {
+	uint64_t f;
+	int e;
+} diy_fp;
+
+#define NBR_CACHED_POWERS 87
+#define BIG_WORDS 40
+
+static diy_fp s_cached_powers[NBR_CACHED_POWERS];
+static int s_cached_powers_done = 0;
+
+static unsigned big_bitlen(const uint32_t *w, unsigned n)
 {
-	const char *save_dst = dst;
+	while (n && !w[n-1])
+		n--;
 
-	if ((n < 0) && (base == 10)) {
-		if (size) *dst++ = '-'; else dst++;
-		n = llabs((long long)n);
-	}
+	return n ? ((n-1)*32) + (32 - __builtin_clz(w[n-1])) : 0;
+}
 
-	if (n == 0) {
-		if (size) *dst++ = '0'; else dst++;
-		if (size) *dst = '\0';
-		return dst - save_dst;
+static unsigned big_bit(const uint32_t *w, unsigned i)
+{
+	return (w[i/32] >> (i%32)) & 1;
+}
+
+static void big_shl1(uint32_t *w, unsigned n)
+{
+	for (unsigned i = n-1; i > 0; i--)
+		w[i] = (w[i] << 1) | (w[i-1] >> 31);
+
+	w[0] <<= 1;
+}
+
+static int big_cmp(const uint32_t *a, const uint32_t *b, unsigned n)
+{
+	for (unsigned i = n; i--;) {
+		if (a[i] != b[i])
+			return a[i] < b[i] ? -1 : 1;
 	}
 
-	dst += _sprint_int(dst, size, n, base);
-	if (size) *dst = '\0';
-	return dst - save_dst;
+	return 0;
 }
 
-static size_t formatted(char *dst, size_t dstlen, const char *src, size_t srclen)
+static void big_sub(uint32_t *a, const uint32_t *b, unsigned n)
 {
-	extern const char *g_escapes;
-	extern const char *g_anti_escapes;
-	size_t len = 0;
+	uint64_t borrow = 0;
 
-	while (srclen--) {
-		int ch = *src++;
-		const char *ptr = strchr(g_escapes, ch);
+	for (unsigned i = 0; i < n; i++) {
+		uint64_t d = (uint64_t)a[i] - b[i] - borrow;
+		a[i] = (uint32_t)d;
+		borrow = (d >> 63) & 1;
+	}
+}
 
-		if (ch && ptr) {
-			if (dstlen) {
-				*dst++ = '\\';
-				*dst++ = g_anti_escapes[ptr-g_escapes];
+// The table holds 10^k for k = -348, -340 ... 340, as a normalized
+// 64-bit significand and binary exponent, correctly rounded.
+
+static void init_cached_powers(void)
+{
+	uint32_t b[BIG_WORDS] = {1};
+
+	for (int k = 0; k <= 348; k++) {
+		if (k) {
+			uint64_t carry = 0;
+
+			for (unsigned i = 0; i < BIG_WORDS; i++) {
+				uint64_t v = ((uint64_t)b[i] * 10) + carry;
+				b[i] = (uint32_t)v;
+				carry = v >> 32;
 			}
+		}
 
-			len += 2;
-		} else if (ch < ' ') {
-			if (dstlen) {
-				*dst++ = '\\';
-				*dst++ = 'x';
+		if ((k % 8) != 4)
+			continue;
+
+		unsigned len = big_bitlen(b, BIG_WORDS);
+
+		if (k <= 340) {
+			diy_fp *p = &s_cached_powers[(k+348)/8];
+			uint64_t f = 0;
+
+			for (int i = 0; i < 64; i++) {
+				int pos = (int)len - 1 - i;
+				f = (f << 1) | (pos >= 0 ? big_bit(b, pos) : 0);
 			}
 
-			size_t n = snprintf(dst, dstlen, "%d", ch);
-			len += n;
-			if (dstlen) dst += n;
+			p->e = (int)len - 64;
 
-			if (dstlen)
-				*dst++ = '\\';
+			if ((len > 64) && big_bit(b, len-65) && !++f) {
+				f = 1ULL << 63;
+				p->e++;
+			}
 
-			len += 3;
-		} else {
-			if (dstlen)
-				*dst++ = ch;
+			p->f = f;
+		}
+
+		// 10^-k = 2^(len+64) / 10^k, a 65-bit quotient rounded to 64
+
+		uint32_t r[BIG_WORDS] = {0};
+		uint64_t qh = 0, ql = 0;
 
-			len++;
+		for (int i = len + 64; i >= 0; i--) {
+			big_shl1(r, BIG_WORDS);
+			r[0] |= i == (int)(len + 64);
+			qh = (qh << 1) | (ql >> 63);
+			ql <<= 1;
+
+			if (big_cmp(r, b, BIG_WORDS) >= 0) {
+				big_sub(r, b, BIG_WORDS);
+				ql |= 1;
+			}
+		}
+
+		diy_fp *p = &s_cached_powers[(348-k)/8];
+		p->f = (qh << 63) | (ql >> 1);
+		p->e = -(int)len - 63;
+
+		if ((ql & 1) && !++p->f) {
+			p->f = 1ULL << 63;
+			p->e++;
 		}
 	}
 
-	if (dstlen)
-		*dst = '\0';
+	s_cached_powers_done = 1;
+}
 
-	return len;
+static diy_fp diy_mul(diy_fp x, diy_fp y)
+{
+	const uint64_t M32 = 0xFFFFFFFF;
+	uint64_t a = x.f >> 32, b = x.f & M32;
+	uint64_t c = y.f >> 32, d = y.f & M32;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+	tmp += 1U << 31;
+	diy_fp r = { ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64 };
+	return r;
 }
 
-static size_t plain(char *dst, size_t dstlen, const char *src, size_t srclen)
+static diy_fp diy_normalize(diy_fp x)
 {
-	size_t len = 0;
+	int s = __builtin_clzll(x.f);
+	x.f <<= s;
+	x.e -= s;
+	return x;
+}
 
-	while (srclen--) {
-		int ch = *src++;
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+	while ((rest < wp_w) && ((delta - rest) >= ten_kappa) &&
+		(((rest + ten_kappa) < wp_w) || ((wp_w - rest) > (rest + ten_kappa - wp_w)))) {
+		buf[len-1]--;
+		rest += ten_kappa;
+	}
+}
 
-		if (dstlen)
-			*dst++ = ch;
+// With wide set the scaled boundaries are moved out by their possible
+// error rather than in, giving digits that may not round-trip but are
+// never longer than the shortest form.
+
+static int grisu2(double v, char *buf, int *k, int wide)
+{
+	static const uint64_t s_pow10[] = {
+		1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+		10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+		100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+		100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+		100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+	};
+
+	if (!s_cached_powers_done)
+		init_cached_powers();
+
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	const uint64_t hidden = 1ULL << 52;
+	int bexp = (int)((bits >> 52) & 0x7FF);
+	diy_fp w;
+	w.f = bits & (hidden - 1);
+	w.e = bexp ? bexp - 1075 : -1074;
+	if (bexp) w.f += hidden;
+
+	// The boundaries halfway to the neighbouring doubles
+
+	diy_fp wp = { (w.f << 1) + 1, w.e - 1 };
+
+	while (!(wp.f & (hidden << 1))) {
+		wp.f <<= 1;
+		wp.e--;
+	}
 
-		len++;
+	wp.f <<= 64 - 52 - 2;
+	wp.e -= 64 - 52 - 2;
+	diy_fp wm = w.f == hidden ? (diy_fp){ (w.f << 2) - 1, w.e - 2 } : (diy_fp){ (w.f << 1) - 1, w.e - 1 };
+	wm.f <<= wm.e - wp.e;
+	wm.e = wp.e;
+
+	// Scale by a cached power of ten into the range Grisu works in
+
+	double dk = ((-61 - wp.e) * 0.30102999566398114) + 347;
+	int ki = (int)dk;
+	if ((dk - ki) > 0.0) ki++;
+	unsigned index = (ki >> 3) + 1;
+	*k = -(-348 + (int)(index << 3));
+	diy_fp c_mk = s_cached_powers[index];
+	diy_fp W = diy_mul(diy_normalize(w), c_mk);
+	diy_fp Wp = diy_mul(wp, c_mk);
+	diy_fp Wm = diy_mul(wm, c_mk);
+
+	if (wide) {
+		Wm.f--;
+		Wp.f++;
+	} else {
+		Wm.f++;
+		Wp.f--;
 	}
 
-	if (dstlen)
-		*dst = '\0';
+	// Generate digits
 
-	return len;
+	uint64_t delta = Wp.f - Wm.f;
+	diy_fp one = { 1ULL << -Wp.e, Wp.e };
+	uint64_t wp_w = Wp.f - W.f;
+	uint32_t p1 = (uint32_t)(Wp.f >> -one.e);
+	uint64_t p2 = Wp.f & (one.f - 1);
+	int kappa = 1, len = 0;
+
+	while ((kappa < 10) && (p1 >= s_pow10[kappa]))
+		kappa++;
+
+	while (kappa > 0) {
+		uint32_t d = p1 / (uint32_t)s_pow10[kappa-1];
+		p1 %= (uint32_t)s_pow10[kappa-1];
+
+		if (d || len)
+			buf[len++] = '0' + (char)d;
+
+		kappa--;
+		uint64_t tmp = ((uint64_t)p1 << -one.e) + p2;
+
+		if (tmp <= delta) {
+			*k += kappa;
+			grisu_round(buf, len, delta, tmp, s_pow10[kappa] << -one.e, wp_w);
+			return len;
+		}
+	}
+
+	for (;;) {
+		p2 *= 10;
+		delta *= 10;
+		char d = (char)(p2 >> -one.e);
+
+		if (d || len)
+			buf[len++] = '0' + d;
+
+		p2 &= one.f - 1;
+		kappa--;
+
+		if (p2 < delta) {
+			*k += kappa;
+			grisu_round(buf, len, delta, p2, one.f, -kappa < 20 ? wp_w * s_pow10[-kappa] : 0);
+			return len;
+		}
+	}
 }
 
-size_t write_canonical_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ctx, int running, int depth)
+// Grisu2 can miss the shortest form when it lies within the error of
+// its scaled boundaries (1.0e23 came out as 9.999999999999999e22). A
+// shorter length is then tried with correctly rounded printf digits,
+// keeping the first that reads back exactly.
+
+static int shortest_digits(double v, char *digits, int *k, int len, int min_len)
 {
-	char *save_dst = dst;
+	for (int n = min_len; n < len; n++) {
+		char tmpbuf[64];
+		snprintf(tmpbuf, sizeof(tmpbuf), "%.*e", n-1, v);
 
-	if (depth > MAX_DEPTH) {
-		if (depth > 64)
-			dst += snprintf(dst, dstlen, "...");
+		if (strtod(tmpbuf, NULL) != v)
+			continue;
 
-		q->cycle_error = 1;
-		return dst - save_dst;
+		const char *src = tmpbuf;
+		int i = 0;
+
+		while (*src != 'e') {
+			if (isdigit(*src))
+				digits[i++] = *src;
+
+			src++;
+		}
+
+		*k = atoi(src+1) - (n-1);
+		return n;
 	}
 
-	if (is_rational(c)) {
-		if (((c->flags & FLAG_HEX) || (c->flags & FLAG_BINARY))) {
-			dst += snprintf(dst, dstlen, "%s0x", c->val_num<0?"-":"");
-			dst += sprint_int(dst, dstlen, c->val_num, 16);
-		} else if ((c->flags & FLAG_OCTAL) && !running) {
-			dst += snprintf(dst, dstlen, "%s0o", c->val_num<0?"-":"");
-			dst += sprint_int(dst, dstlen, c->val_num, 8);
-		} else if (c->val_den != 1) {
-			if (q->m->flag.rational_syntax_natural) {
-				dst += sprint_int(dst, dstlen, c->val_num, 10);
-				dst += snprintf(dst, dstlen, "%s", "/");
-				dst += sprint_int(dst, dstlen, c->val_den, 10);
+	return len;
+}
+
+// Fixed notation for decimal exponents -4..14, otherwise d.ddde[-]N.
+// There is always a fraction so the result reads back as a float.
+
+size_t sprint_float(char *dst, size_t size, double v)
+{
+	char tmpbuf[64], digits[32];
+	char *s = tmpbuf;
+
+	if (isnan(v))
+		strcpy(s, "nan");
+	else if (isinf(v))
+		strcpy(s, v < 0 ? "-inf" : "inf");
+	else if (v == 0.0)
+		strcpy(s, signbit(v) ? "-0.0" : "0.0");
+	else {
+		if (v < 0) {
+			*s++ = '-';
+			v = -v;
+		}
+
+		int k, len = grisu2(v, digits, &k, 0);
+		char wide[32];
+		int k2, min_len = grisu2(v, wide, &k2, 1);
+
+		if (min_len < len)
+			len = shortest_digits(v, digits, &k, len, min_len);
+		int exp10 = len + k - 1;
+
+		if ((exp10 >= -4) && (exp10 < 15)) {
+			int point = len + k;
+
+			if (point <= 0) {
+				*s++ = '0';
+				*s++ = '.';
+				memset(s, '0', -point);
+				s += -point;
+				memcpy(s, digits, len);
+				s += len;
+			} else if (point >= len) {
+				memcpy(s, digits, len);
+				s += len;
+				memset(s, '0', point - len);
+				s += point - len;
+				*s++ = '.';
+				*s++ = '0';
 			} else {
-				dst += sprint_int(dst, dstlen, c->val_num, 10);
-				dst += snprintf(dst, dstlen, "%s", " rdiv ");
-				dst += sprint_int(dst, dstlen, c->val_den, 10);
+				memcpy(s, digits, point);
+				s += point;
+				*s++ = '.';
+				memcpy(s, digits + point, len - point);
+				s += len - point;
 			}
+		} else {
+			*s++ = digits[0];
+			*s++ = '.';
+
+			if (len > 1) {
+				memcpy(s, digits + 1, len - 1);
+				s += len - 1;
+			} else
+				*s++ = '0';
+
+			*s++ = 'e';
+			s += sprint_int(s, 8, exp10, 10);
+		}
+
+		*s = '\0';
+	}
+
+	size_t len = strlen(tmpbuf);
+
+	if (size) {
+		size_t n = len < size ? len : size - 1;
+		memcpy(dst, tmpbuf, n);
+		dst[n] = '\0';
+	}
+
+	return len;
+}
+
+// The writers below are single pass and do not recurse. Output goes
+// to an outbuf, which is either a caller supplied buffer (truncated,
+// but the full length is still counted), a growable heap buffer, or a
+// chunk buffer that is flushed to a FILE or stream as it fills. Pending
+// work (arguments, list tails, closing text) is kept on an explicit
+// stack, so deep terms cost heap rather than C stack.
+
+#define WRITE_CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+	char *buf;
+	size_t size, used, total;
+	FILE *fp;
+	stream *str;
+	int grow, flushed, error;
+} outbuf;
+
+enum { WR_TERM, WR_TEXT, WR_ARGS, WR_TAIL };
+
+typedef struct {
+	cell *c;
+	const char *s;
+	size_t len;
+	idx_t c_ctx, arity;
+	int depth;
+	uint8_t kind, cons, first, braces, print_list;
+} wr_item;
+
+typedef struct {
+	query *q;
+	outbuf *ob;
+	wr_item *items, local[32];
+	cell *root;
+	idx_t root_ctx;
+	size_t cnt, size;
+	int running, canonical, acyclic;
+} writer;
+
+static void ob_write(outbuf *ob, const char *src, size_t len)
+{
+	while (len && !ob->error) {
+		FILE *fp = ob->str ? ob->str->fp : ob->fp;
+		size_t nbytes = ob->str ? net_write(src, len, ob->str) : fwrite(src, 1, len, fp);
+
+		if (!nbytes || feof(fp)) {
+			ob->error = 1;
+			return;
+		}
+
+		len -= nbytes;
+		src += nbytes;
+	}
+
+	ob->flushed = 1;
+}
+
+static void ob_flush(outbuf *ob)
+{
+	ob_write(ob, ob->buf, ob->used);
+	ob->used = 0;
+}
+
+static void ob_putn(outbuf *ob, const char *src, size_t len)
+{
+	ob->total += len;
+
+	if ((ob->used + len) < ob->size) {
+		memcpy(ob->buf + ob->used, src, len);
+		ob->used += len;
+		return;
+	}
+
+	if (ob->fp || ob->str) {
+		ob_flush(ob);
+
+		if (len < ob->size) {
+			memcpy(ob->buf, src, len);
+			ob->used = len;
 		} else
-			dst += sprint_int(dst, dstlen, c->val_num, 10);
+			ob_write(ob, src, len);
+
+		return;
+	}
+
+	if (ob->grow) {
+		while (ob->size <= (ob->used + len))
+			ob->size *= 2;
+
+		ob->buf = realloc(ob->buf, ob->size);
+		memcpy(ob->buf + ob->used, src, len);
+		ob->used += len;
+		return;
+	}
+
+	if (ob->size > (ob->used + 1)) {
+		size_t n = ob->size - ob->used - 1;
+		memcpy(ob->buf + ob->used, src, n);
+		ob->used += n;
+	}
+}
+
+static void ob_puts(outbuf *ob, const char *src)
+{
+	ob_putn(ob, src, strlen(src));
+}
+
+static void ob_int(outbuf *ob, int_t n, int base)
+{
+	char tmpbuf[256];
+	ob_putn(ob, tmpbuf, sprint_int(tmpbuf, sizeof(tmpbuf), n, base));
+}
+
+static void ob_float(outbuf *ob, double v)
+{
+	char tmpbuf[64];
+	ob_putn(ob, tmpbuf, sprint_float(tmpbuf, sizeof(tmpbuf), v));
+}
+
+static void ob_formatted(outbuf *ob, const char *src, size_t srclen)
+{
+	extern const char *g_escapes;
+	extern const char *g_anti_escapes;
+	const char *run = src;
+
+	for (; srclen--; src++) {
+		int ch = *src;
+		const char *ptr = strchr(g_escapes, ch);
+		char tmpbuf[32];
+
+		if (ch && ptr) {
+			tmpbuf[0] = '\\';
+			tmpbuf[1] = g_anti_escapes[ptr-g_escapes];
+			ob_putn(ob, run, src - run);
+			ob_putn(ob, tmpbuf, 2);
+			run = src + 1;
+		} else if (ch < ' ') {
+			size_t n = snprintf(tmpbuf, sizeof(tmpbuf), "\\x%d\\", ch);
+			ob_putn(ob, run, src - run);
+			ob_putn(ob, tmpbuf, n);
+			run = src + 1;
+		}
+	}
+
+	ob_putn(ob, run, src - run);
+}
+
+static wr_item *wr_push(writer *w, unsigned kind, cell *c, idx_t c_ctx, int depth)
+{
+	if (w->cnt == w->size) {
+		wr_item *items = malloc(sizeof(wr_item) * w->size * 2);
+		memcpy(items, w->items, sizeof(wr_item) * w->cnt);
 
-		return dst - save_dst;
+		if (w->items != w->local)
+			free(w->items);
+
+		w->items = items;
+		w->size *= 2;
 	}
 
-	if (is_float(c) && (c->val_flt == M_PI)) {
-		dst += snprintf(dst, dstlen, "%s", "3.141592653589793");
-		return dst - save_dst;
-	} else if (is_float(c) && (c->val_flt == M_E)) {
-		dst += snprintf(dst, dstlen, "%s", "2.718281828459045");
-		return dst - save_dst;
-	} else if (is_float(c)) {
-		char tmpbuf[256];
-		sprintf(tmpbuf, "%.*g", DBL_DECIMAL_DIG, c->val_flt);
-		const char *ptr = strchr(tmpbuf, '.');
+	wr_item *it = &w->items[w->cnt++];
+	memset(it, 0, sizeof(wr_item));
+	it->kind = kind;
+	it->c = c;
+	it->c_ctx = c_ctx;
+	it->depth = depth;
+	return it;
+}
 
-		if (ptr && (strlen(ptr+1) > 1))
-			sprintf(tmpbuf, "%.*g", DBL_DECIMAL_DIG, c->val_flt);
+static void wr_push_term(writer *w, cell *c, idx_t c_ctx, int cons, int depth)
+{
+	wr_push(w, WR_TERM, c, c_ctx, depth)->cons = cons;
+}
 
-		if (!strchr(tmpbuf, '.'))
-			strcat(tmpbuf, ".0");
+static void wr_push_text(writer *w, const char *s)
+{
+	wr_item *it = wr_push(w, WR_TEXT, NULL, 0, 0);
+	it->s = s;
+	it->len = strlen(s);
+}
 
-		dst += snprintf(dst, dstlen, "%s", tmpbuf);
-		return dst - save_dst;
+static void wr_push_args(writer *w, cell *c, idx_t c_ctx, idx_t arity, int braces, int depth)
+{
+	wr_item *it = wr_push(w, WR_ARGS, c, c_ctx, depth);
+	it->arity = arity;
+	it->braces = braces;
+	it->first = 1;
+}
+
+static void wr_rational(writer *w, cell *c, int hex)
+{
+	query *q = w->q;
+	outbuf *ob = w->ob;
+
+	if (hex) {
+		ob_puts(ob, c->val_num<0?"-0x":"0x");
+		ob_int(ob, c->val_num, 16);
+	} else if ((c->flags & FLAG_OCTAL) && !w->running) {
+		ob_puts(ob, c->val_num<0?"-0o":"0o");
+		ob_int(ob, c->val_num, 8);
+	} else if (c->val_den != 1) {
+		ob_int(ob, c->val_num, 10);
+		ob_puts(ob, q->m->flag.rational_syntax_natural ? "/" : " rdiv ");
+		ob_int(ob, c->val_den, 10);
+	} else
+		ob_int(ob, c->val_num, 10);
+}
+
+static void wr_bigint(writer *w, cell *c)
+{
+	char *dst = bigint_to_str(c, 10);
+	ob_puts(w->ob, dst);
+	free(dst);
+}
+
+// Deep terms are checked once for cycles, and only cyclic ones are cut
+// off at MAX_DEPTH.
+
+static int wr_acyclic(writer *w)
+{
+	if (!w->acyclic)
+		w->acyclic = is_cyclic_term(w->q, w->root, w->root_ctx) ? -1 : 1;
+
+	return w->acyclic > 0;
+}
+
+static void wr_canonical(writer *w, cell *c, idx_t c_ctx, int depth)
+{
+	query *q = w->q;
+	outbuf *ob = w->ob;
+
+	if ((depth > MAX_DEPTH) && !wr_acyclic(w)) {
+		ob_puts(ob, "...");
+		q->cycle_error = 1;
+		return;
+	}
+
+	if (is_rational(c)) {
+		wr_rational(w, c, (c->flags & FLAG_HEX) || (c->flags & FLAG_BINARY));
+		return;
+	}
+
+	if (is_bigint(c)) {
+		wr_bigint(w, c);
+		return;
+	}
+
+	if (is_float(c)) {
+		ob_float(w->ob, c->val_flt);
+		return;
 	}
 
 	if (is_variable(c) && ((1ULL << c->var_nbr) & q->nv_mask)) {
-		dst += snprintf(dst, dstlen, "'$VAR'(%u)", q->nv_start + count_bits(q->nv_mask, c->var_nbr));
-		return dst - save_dst;
+		char tmpbuf[80];
+		ob_putn(ob, tmpbuf, snprintf(tmpbuf, sizeof(tmpbuf), "'$VAR'(%u)", q->nv_start + count_bits(q->nv_mask, c->var_nbr)));
+		return;
 	}
 
 	if (is_string(c)) {
 		int cnt = 0;
-		cell *l = c;
+		cell tmp, *l = c;
 
 		while (is_list(l)) {
 			if (cnt > 64) {
-				dst += snprintf(dst, dstlen, "...");
-				return dst - save_dst;
+				ob_puts(ob, "...");
+				return;
 			}
 
-			cell *h = LIST_HEAD(l);
-			l = LIST_TAIL(l);
+			cell *h = list_head(l);
+			l = list_tail(l, &tmp);
 			h->flags &= ~FLAG_STRING;
 
 			if (!cnt++)
@@ -233,26 +759,15 @@ size_t write_canonical_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t
 	const char *src = GET_STR(c);
 	int dq = 0, quote = !is_variable(c) && needs_quote(q->m, src, LEN_STR(c));
 	if (is_string(c)) dq = quote = 1;
-	dst += snprintf(dst, dstlen, "%s", quote?dq?"\"":"'":"");
-	dst += formatted(dst, dstlen, src, LEN_STR(c));
-	dst += snprintf(dst, dstlen, "%s", quote?dq?"\"":"'":"");
+	ob_puts(ob, quote?dq?"\"":"'":"");
+	ob_formatted(ob, src, LEN_STR(c));
+	ob_puts(ob, quote?dq?"\"":"'":"");
 
 	if (!is_structure(c))
-		return dst - save_dst;
-
-	idx_t arity = c->arity;
-	dst += snprintf(dst, dstlen, "(");
-
-	for (c++; arity--; c += c->nbr_cells) {
-		cell *tmp = running ? deref(q, c, c_ctx) : c;
-		dst += write_canonical_to_buf(q, dst, dstlen, tmp, q->latest_ctx, running, depth+1);
-
-		if (arity)
-			dst += snprintf(dst, dstlen, ",");
-	}
+		return;
 
-	dst += snprintf(dst, dstlen, ")");
-	return dst - save_dst;
+	ob_puts(ob, "(");
+	wr_push_args(w, c+1, c_ctx, c->arity, 0, depth);
 }
 
 static char *varformat(unsigned nbr)
@@ -264,172 +779,192 @@ static char *varformat(unsigned nbr)
 	return tmpbuf;
 }
 
-size_t write_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ctx, int running, int cons, int depth)
+static void wr_list(writer *w, cell *c, idx_t c_ctx, int cons, int print_list, int depth)
 {
-	char *save_dst = dst;
+	query *q = w->q;
+	outbuf *ob = w->ob;
 
-	if (depth > MAX_DEPTH) {
-		if (depth > 64)
-			dst += snprintf(dst, dstlen, "...");
+	if (q->max_depth && (depth >= q->max_depth)) {
+		ob_puts(ob, "...");
+		return;
+	}
 
-		q->cycle_error = 1;
-		return dst - save_dst;
+	if (!cons)
+		ob_puts(ob, "[");
+
+	cell *head = LIST_HEAD(c);
+	head = w->running ? deref(q, head, c_ctx) : head;
+	idx_t head_ctx = w->running ? q->latest_ctx : c_ctx;
+	int parens = is_structure(head) && !strcmp(GET_STR(head), ",");
+	wr_item *it = wr_push(w, WR_TAIL, c, c_ctx, depth);
+	it->cons = cons;
+	it->print_list = print_list;
+
+	if (parens) {
+		ob_puts(ob, "(");
+		wr_push_text(w, ")");
 	}
 
-	if (is_rational(c)) {
-		if (((c->flags & FLAG_HEX) || (c->flags & FLAG_BINARY)) && (running <= 0)) {
-			dst += snprintf(dst, dstlen, "%s0x", c->val_num<0?"-":"");
-			dst += sprint_int(dst, dstlen, c->val_num, 16);
-		} else if ((c->flags & FLAG_OCTAL) && !running) {
-			dst += snprintf(dst, dstlen, "%s0o", c->val_num<0?"-":"");
-			dst += sprint_int(dst, dstlen, c->val_num, 8);
-		} else if (c->val_den != 1) {
-			if (q->m->flag.rational_syntax_natural) {
-				dst += sprint_int(dst, dstlen, c->val_num, 10);
-				dst += snprintf(dst, dstlen, "/");
-				dst += sprint_int(dst, dstlen, c->val_den, 10);
-			} else {
-				dst += sprint_int(dst, dstlen, c->val_num, 10);
-				dst += snprintf(dst, dstlen, " rdiv ");
-				dst += sprint_int(dst, dstlen, c->val_den, 10);
-			}
-		} else
-			dst += sprint_int(dst, dstlen, c->val_num, 10);
+	wr_push_term(w, head, head_ctx, 0, depth+1);
+}
 
-		return dst - save_dst;
+static void wr_tail(writer *w, const wr_item *it)
+{
+	query *q = w->q;
+	outbuf *ob = w->ob;
+	int print_list = it->print_list;
+	idx_t c_ctx = it->c_ctx;
+	cell tmp, *tail = list_tail(it->c, &tmp);
+	tail = w->running ? deref(q, tail, c_ctx) : tail;
+	c_ctx = w->running ? q->latest_ctx : c_ctx;
+
+	if (is_iso_list(tail)) {
+		ob_puts(ob, ",");
+		wr_list(w, tail, c_ctx, 1, print_list+1, it->depth);
+		return;
 	}
 
-	if (is_float(c) && (c->val_flt == M_PI)) {
-		dst += snprintf(dst, dstlen, "%s", "3.141592653589793");
-		return dst - save_dst;
-	} else if (is_float(c) && (c->val_flt == M_E)) {
-		dst += snprintf(dst, dstlen, "%s", "2.718281828459045");
-		return dst - save_dst;
-	} else if (is_float(c)) {
-		char tmpbuf[256];
-		sprintf(tmpbuf, "%.*g", DBL_DECIMAL_DIG-1, c->val_flt);
-		const char *ptr = strchr(tmpbuf, '.');
+	if (is_string(tail)) {
+		cell *l = tail;
 
-		if (ptr && (strlen(ptr+1) > 1))
-			sprintf(tmpbuf, "%.*g", DBL_DECIMAL_DIG, c->val_flt);
+		while (is_list(l)) {
+			ob_puts(ob, ",");
+			cell *h = list_head(l);
+			ob_formatted(ob, GET_STR(h), LEN_STR(h));
+			l = list_tail(l, &tmp);
+		}
+
+		print_list++;
+	} else if (!is_literal(tail) || is_structure(tail) || strcmp(GET_STR(tail), "[]")) {
+		ob_puts(ob, "|");
 
-		if (!strchr(tmpbuf, '.'))
-			strcat(tmpbuf, ".0");
+		if (!it->cons || print_list)
+			wr_push_text(w, "]");
 
-		dst += snprintf(dst, dstlen, "%s", tmpbuf);
-		return dst - save_dst;
+		wr_push_term(w, tail, c_ctx, 1, it->depth+1);
+		return;
 	}
 
-	int is_chars_list = scan_list(q, c, c_ctx);
+	if (!it->cons || print_list)
+		ob_puts(ob, "]");
+}
 
-	if (is_chars_list) {
-		cell *l = c;
-		dst += snprintf(dst, dstlen, "%s", "\"");
+static void wr_args(writer *w, const wr_item *it)
+{
+	query *q = w->q;
+	outbuf *ob = w->ob;
 
-		while (is_list(l)) {
-			cell *h = LIST_HEAD(l);
-			cell *c = deref(q, h, c_ctx);
-			dst += formatted(dst, dstlen, GET_STR(c), LEN_STR(c));
-			l = LIST_TAIL(l);
-			l = deref(q, l, c_ctx);
-			c_ctx = q->latest_ctx;
-		}
+	if (!it->arity) {
+		ob_puts(ob, it->braces?"}":")");
+		return;
+	}
+
+	if (!it->first)
+		ob_puts(ob, ",");
+
+	cell *c = it->c;
+	cell *tmp = w->running ? deref(q, c, it->c_ctx) : c;
+	idx_t tmp_ctx = w->running ? q->latest_ctx : it->c_ctx;
+	wr_push_args(w, c+c->nbr_cells, it->c_ctx, it->arity-1, it->braces, it->depth);
+	w->items[w->cnt-1].first = 0;
+	int parens = 0;
 
-		dst += snprintf(dst, dstlen, "%s", "\"");
-		return dst - save_dst;
+	if (!w->canonical && !it->braces && is_literal(tmp)) {
+		const char *s = GET_STR(tmp);
+
+		if (!strcmp(s, ",") || !strcmp(s, ";") ||
+			!strcmp(s, "->") || !strcmp(s, ":-"))
+			parens = 1;
 	}
 
-	// FIXME make non-recursive
+	if (parens) {
+		ob_puts(ob, "(");
+		wr_push_text(w, ")");
+	}
 
-	const char *src = GET_STR(c);
-	int print_list = 0;
+	wr_push_term(w, tmp, tmp_ctx, 0, it->depth+1);
+}
 
-	while (is_iso_list(c)) {
-		if (q->max_depth && (depth >= q->max_depth)) {
-			dst += snprintf(dst, dstlen, "%s", "...");
-			return dst - save_dst;
-		}
+static void wr_term(writer *w, cell *c, idx_t c_ctx, int cons, int depth)
+{
+	query *q = w->q;
+	outbuf *ob = w->ob;
+	int running = w->running;
 
-		cell *head = LIST_HEAD(c);
+	if ((depth > MAX_DEPTH) && !wr_acyclic(w)) {
+		ob_puts(ob, "...");
+		q->cycle_error = 1;
+		return;
+	}
 
-		if (!cons)
-			dst += snprintf(dst, dstlen, "%s", "[");
+	if (is_rational(c)) {
+		wr_rational(w, c, ((c->flags & FLAG_HEX) || (c->flags & FLAG_BINARY)) && (running <= 0));
+		return;
+	}
 
-		head = running ? deref(q, head, c_ctx) : head;
-		idx_t head_ctx = q->latest_ctx;
-		int parens = is_structure(head) && !strcmp(GET_STR(head), ",");
-		if (parens) dst += snprintf(dst, dstlen, "%s", "(");
-		dst += write_term_to_buf(q, dst, dstlen, head, head_ctx, running, 0, depth+1);
-		if (parens) dst += snprintf(dst, dstlen, "%s", ")");
-		cell *tail = LIST_TAIL(c);
-		tail = running ? deref(q, tail, c_ctx) : tail;
-		c_ctx = q->latest_ctx;
+	if (is_bigint(c)) {
+		wr_bigint(w, c);
+		return;
+	}
 
-		if (is_literal(tail) && !is_structure(tail)) {
-			src = GET_STR(tail);
+	if (is_float(c)) {
+		ob_float(w->ob, c->val_flt);
+		return;
+	}
 
-			if (strcmp(src, "[]")) {
-				dst += snprintf(dst, dstlen, "%s", "|");
-				dst += write_term_to_buf(q, dst, dstlen, tail, c_ctx, running, 1, depth+1);
-			}
-		} else if (is_iso_list(tail)) {
-			dst += snprintf(dst, dstlen, "%s", ",");
-			c = tail;
-			print_list++;
-			cons = 1;
-			continue;
-		} else if (is_string(tail)) {
-			cell *l = tail;
-
-			while (is_list(l)) {
-				dst += snprintf(dst, dstlen, "%s", ",");
-				cell *h = LIST_HEAD(l);
-				dst += formatted(dst, dstlen, GET_STR(h), LEN_STR(h));
-				l = LIST_TAIL(l);
-			}
+	if (scan_list(q, c, c_ctx)) {
+		cell tmp, *l = c;
+		ob_puts(ob, "\"");
 
-			print_list++;
-		} else {
-			dst += snprintf(dst, dstlen, "%s", "|");
-			dst += write_term_to_buf(q, dst, dstlen, tail, c_ctx, running, 1, depth+1);
+		while (is_list(l)) {
+			cell *h = list_head(l);
+			cell *c = deref(q, h, c_ctx);
+			ob_formatted(ob, GET_STR(c), LEN_STR(c));
+			l = list_tail(l, &tmp);
+			l = deref(q, l, c_ctx);
+			c_ctx = q->latest_ctx;
 		}
 
-		if (!cons || print_list)
-			dst += snprintf(dst, dstlen, "%s", "]");
+		ob_puts(ob, "\"");
+		return;
+	}
 
-		return dst - save_dst;
+	if (is_iso_list(c)) {
+		wr_list(w, c, c_ctx, cons, 0, depth);
+		return;
 	}
 
+	const char *src = GET_STR(c);
 	int optype = (c->flags & OP_FX) | (c->flags & OP_FY) | (c->flags & OP_XF) |
 		(c->flags & OP_YF) | (c->flags & OP_XFX) |
 		(c->flags & OP_YFX) | (c->flags & OP_XFY);
 
-	if (q->ignore_ops || !optype) {
+	if (q->ignore_ops || !optype || !c->arity) {
 		int quote = ((running <= 0) || q->quoted) && !is_variable(c) && needs_quote(q->m, src, LEN_STR(c));
 		int dq = 0, braces = 0, parens = 0;
 		if (is_string(c)) dq = quote = 1;
 		if (q->quoted < 0) quote = 0;
 		if (c->arity && !strcmp(src, "{}")) braces = 1;
-		dst += snprintf(dst, dstlen, "%s", !braces&&quote?dq?"\"":"'":"");
+		ob_puts(ob, !braces&&quote?dq?"\"":"'":"");
 
 		if (q->quoted && get_op(q->m, GET_STR(c), NULL, NULL, 0))
 			parens = 1;
 
 		if (parens)
-			dst += snprintf(dst, dstlen, "%s", "(");
+			ob_puts(ob, "(");
 
 		if (running && is_variable(c) && ((1ULL << c->var_nbr) & q->nv_mask)) {
-			dst += snprintf(dst, dstlen, "%s", varformat(q->nv_start + count_bits(q->nv_mask, c->var_nbr)));
-			return dst - save_dst;
+			ob_puts(ob, varformat(q->nv_start + count_bits(q->nv_mask, c->var_nbr)));
+			return;
 		}
 
-		if (running && is_variable(c)
-			/*&& ((c_ctx != q->st.curr_frame) || is_fresh(c) || (running > 0))*/) {
+		if (running && is_variable(c)) {
 			frame *g = GET_FRAME(c_ctx);
 			slot *e = GET_SLOT(g, c->var_nbr);
 			idx_t slot_nbr = e - q->slots;
-			dst += snprintf(dst, dstlen, "_%u", (unsigned)slot_nbr);
-			return dst - save_dst;
+			char tmpbuf[80];
+			ob_putn(ob, tmpbuf, snprintf(tmpbuf, sizeof(tmpbuf), "_%u", (unsigned)slot_nbr));
+			return;
 		}
 
 		int len_str = LEN_STR(c);
@@ -440,211 +975,188 @@ size_t write_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ct
 			if ((running < 0) && is_blob(c) && (len_str > 128))
 				len_str = 128;
 
-			dst += formatted(dst, dstlen, src, LEN_STR(c));
+			ob_formatted(ob, src, LEN_STR(c));
 
 			if ((running < 0) && is_blob(c) && (len_str == 128))
-				dst += snprintf(dst, dstlen, "%s", "...");
+				ob_puts(ob, "...");
 		} else
-			dst += plain(dst, dstlen, src, LEN_STR(c));
+			ob_putn(ob, src, LEN_STR(c));
 
-		dst += snprintf(dst, dstlen, "%s", !braces&&quote?dq?"\"":"'":"");
+		ob_puts(ob, !braces&&quote?dq?"\"":"'":"");
 
 		if (parens)
-			dst += snprintf(dst, dstlen, "%s", ")");
+			ob_puts(ob, ")");
 
 		if (is_structure(c) && !is_string(c)) {
-			idx_t arity = c->arity;
-			dst += snprintf(dst, dstlen, "%s", braces?"{":"(");
-
-			for (c++; arity--; c += c->nbr_cells) {
-				cell *tmp = running ? deref(q, c, c_ctx) : c;
-				idx_t tmp_ctx = q->latest_ctx;
-				int parens = 0;
-
-				if (!braces && is_literal(tmp)) {
-					const char *s = GET_STR(tmp);
-
-					if (!strcmp(s, ",") || !strcmp(s, ";") ||
-						!strcmp(s, "->") || !strcmp(s, ":-"))
-						parens = 1;
-				}
-
-				if (parens)
-					dst += snprintf(dst, dstlen, "%s", "(");
-
-				dst += write_term_to_buf(q, dst, dstlen, tmp, tmp_ctx, running, 0, depth+1);
-
-				if (parens)
-					dst += snprintf(dst, dstlen, "%s", ")");
-
-				if (arity)
-					dst += snprintf(dst, dstlen, "%s", ",");
-			}
-
-			dst += snprintf(dst, dstlen, "%s", braces?"}":")");
+			ob_puts(ob, braces?"{":"(");
+			wr_push_args(w, c+1, c_ctx, c->arity, braces, depth);
 		}
 	} else if ((c->flags & OP_XF) || (c->flags & OP_YF)) {
 		cell *lhs = c + 1;
 		lhs = running ? deref(q, lhs, c_ctx) : lhs;
-		idx_t lhs_ctx = q->latest_ctx;
-		dst += write_term_to_buf(q, dst, dstlen, lhs, lhs_ctx, running, 0, depth+1);
-		dst += snprintf(dst, dstlen, "%s", src);
+		idx_t lhs_ctx = running ? q->latest_ctx : c_ctx;
+		wr_push_text(w, src);
+		wr_push_term(w, lhs, lhs_ctx, 0, depth+1);
 	} else if ((c->flags & OP_FX) || (c->flags & OP_FY)) {
 		cell *rhs = c + 1;
 		rhs = running ? deref(q, rhs, c_ctx) : rhs;
-		idx_t rhs_ctx = q->latest_ctx;
+		idx_t rhs_ctx = running ? q->latest_ctx : c_ctx;
 		int space = isalpha_utf8(peek_char_utf8(src)) || !strcmp(src, ":-") || !strcmp(src, "\\+");
 		int parens = is_structure(rhs) && !strcmp(GET_STR(rhs), ",");
-		dst += snprintf(dst, dstlen, "%s", src);
-		if (space && !parens) dst += snprintf(dst, dstlen, "%s", " ");
-		if (parens) dst += snprintf(dst, dstlen, "%s", "(");
-		dst += write_term_to_buf(q, dst, dstlen, rhs, rhs_ctx, running, 0, depth+1);
-		if (parens) dst += snprintf(dst, dstlen, "%s", ")");
+		ob_puts(ob, src);
+		if (space && !parens) ob_puts(ob, " ");
+		if (parens) ob_puts(ob, "(");
+		if (parens) wr_push_text(w, ")");
+		wr_push_term(w, rhs, rhs_ctx, 0, depth+1);
 	} else {
 		cell *lhs = c + 1;
 		cell *rhs = lhs + lhs->nbr_cells;
 		lhs = running ? deref(q, lhs, c_ctx) : lhs;
-		idx_t lhs_ctx = q->latest_ctx;
+		idx_t lhs_ctx = running ? q->latest_ctx : c_ctx;
 		rhs = running ? deref(q, rhs, c_ctx) : rhs;
-		idx_t rhs_ctx = q->latest_ctx;
+		idx_t rhs_ctx = running ? q->latest_ctx : c_ctx;
 		int my_prec = get_op(q->m, GET_STR(c), NULL, NULL, 0);
 		int lhs_prec1 = is_literal(lhs) ? get_op(q->m, GET_STR(lhs), NULL, NULL, 0) : 0;
 		int lhs_prec2 = is_literal(lhs) && !lhs->arity ? get_op(q->m, GET_STR(lhs), NULL, NULL, 0) : 0;
 		int rhs_prec1 = is_literal(rhs) ? get_op(q->m, GET_STR(rhs), NULL, NULL, 0) : 0;
 		int rhs_prec2 = is_literal(rhs) && !rhs->arity ? get_op(q->m, GET_STR(rhs), NULL, NULL, 0) : 0;
-		int parens = 0;//depth && strcmp(src, ",") && strcmp(src, "is") && strcmp(src, "->");
 		int lhs_parens = lhs_prec1 > my_prec;
 		lhs_parens |= lhs_prec2;
-		if (parens || lhs_parens) dst += snprintf(dst, dstlen, "%s", "(");
-		dst += write_term_to_buf(q, dst, dstlen, lhs, lhs_ctx, running, 0, depth+1);
-		if (lhs_parens) dst += snprintf(dst, dstlen, "%s", ")");
-		int space = isalpha_utf8(peek_char_utf8(src)) || !strcmp(src, ":-") || !strcmp(src, "-->") || !strcmp(src, "=..") || !*src;
-		if (space && !parens) dst += snprintf(dst, dstlen, "%s", " ");
-		dst += snprintf(dst, dstlen, "%s", src);
-		if (!*src) space = 0;
-		if (space && !parens) dst += snprintf(dst, dstlen, "%s", " ");
 		int rhs_parens = rhs_prec1 > my_prec;
 		rhs_parens |= rhs_prec2;
-		if (rhs_parens) dst += snprintf(dst, dstlen, "%s", "(");
-		dst += write_term_to_buf(q, dst, dstlen, rhs, rhs_ctx, running, 0, depth+1);
-		if (parens || rhs_parens) dst += snprintf(dst, dstlen, "%s", ")");
-	}
+		int space = isalpha_utf8(peek_char_utf8(src)) || !strcmp(src, ":-") || !strcmp(src, "-->") || !strcmp(src, "=..") || !*src;
 
-	return dst - save_dst;
+		// Pushed in reverse, so the lhs comes out first
+
+		if (rhs_parens) wr_push_text(w, ")");
+		wr_push_term(w, rhs, rhs_ctx, 0, depth+1);
+		if (rhs_parens) wr_push_text(w, "(");
+		if (space && *src) wr_push_text(w, " ");
+		wr_push_text(w, src);
+		if (space) wr_push_text(w, " ");
+		if (lhs_parens) wr_push_text(w, ")");
+		wr_push_term(w, lhs, lhs_ctx, 0, depth+1);
+		if (lhs_parens) ob_puts(ob, "(");
+	}
 }
 
-void write_canonical_to_stream(query *q, stream *str, cell *c, idx_t c_ctx, int running, int depth)
+static void write_to_outbuf(query *q, outbuf *ob, cell *c, idx_t c_ctx, int running, int canonical, int cons, int depth)
 {
-	size_t len = write_canonical_to_buf(q, NULL, 0, c, c_ctx, running, depth);
-
-	if (q->cycle_error) {
-		running = 0;
-		len = write_canonical_to_buf(q, NULL, 0, c, c_ctx, running, depth);
+	writer w = {0};
+	w.q = q;
+	w.ob = ob;
+	w.items = w.local;
+	w.size = sizeof(w.local) / sizeof(w.local[0]);
+	w.running = running;
+	w.canonical = canonical;
+	w.root = c;
+	w.root_ctx = c_ctx;
+	wr_push_term(&w, c, c_ctx, cons, depth);
+
+	while (w.cnt && !ob->error) {
+		wr_item it = w.items[--w.cnt];
+
+		if (it.kind == WR_TEXT)
+			ob_putn(ob, it.s, it.len);
+		else if (it.kind == WR_ARGS)
+			wr_args(&w, &it);
+		else if (it.kind == WR_TAIL)
+			wr_tail(&w, &it);
+		else if (canonical)
+			wr_canonical(&w, it.c, it.c_ctx, it.depth);
+		else
+			wr_term(&w, it.c, it.c_ctx, it.cons, it.depth);
 	}
 
-	char *dst = malloc(len+1);
-	write_canonical_to_buf(q, dst, len+1, c, c_ctx, running, depth);
-	q->cycle_error = 0;
-	const char *src = dst;
-
-	while (len) {
-		size_t nbytes = net_write(src, len, str);
+	if (w.items != w.local)
+		free(w.items);
+}
 
-		if (feof(str->fp)) {
-			q->error = 1;
-			return;
-		}
+static size_t write_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ctx, int running, int canonical, int cons, int depth)
+{
+	outbuf ob = {0};
+	ob.buf = dst;
+	ob.size = dst ? dstlen : 0;
+	write_to_outbuf(q, &ob, c, c_ctx, running, canonical, cons, depth);
 
-		len -= nbytes;
-		src += nbytes;
-	}
+	if (ob.size)
+		ob.buf[ob.used] = '\0';
 
-	free(dst);
+	return ob.total;
 }
 
-void write_canonical(query *q, FILE *fp, cell *c, idx_t c_ctx, int running, int depth)
+static char *write_to_strbuf(query *q, cell *c, idx_t c_ctx, int running, int canonical)
 {
-	size_t len = write_canonical_to_buf(q, NULL, 0, c, c_ctx, running, depth);
+	outbuf ob = {0};
+	ob.size = 256;
+	ob.buf = malloc(ob.size);
+	ob.grow = 1;
+	write_to_outbuf(q, &ob, c, c_ctx, running, canonical, 0, 0);
+	ob.buf[ob.used] = '\0';
+	return ob.buf;
+}
+
+// If a cycle is found before anything has been flushed the term is
+// written again uninstantiated, otherwise it stays truncated.
 
-	if (q->cycle_error) {
-		running = 0;
-		len = write_canonical_to_buf(q, NULL, 0, c, c_ctx, running, depth);
+static void write_to_file(query *q, FILE *fp, stream *str, cell *c, idx_t c_ctx, int running, int canonical, int cons, int depth)
+{
+	outbuf ob = {0};
+	ob.size = WRITE_CHUNK_SIZE;
+	ob.buf = malloc(ob.size);
+	ob.fp = fp;
+	ob.str = str;
+	write_to_outbuf(q, &ob, c, c_ctx, running, canonical, cons, depth);
+
+	if (q->cycle_error && running && !ob.flushed) {
+		ob.used = 0;
+		write_to_outbuf(q, &ob, c, c_ctx, 0, canonical, cons, depth);
 	}
 
-	char *dst = malloc(len+1);
-	write_canonical_to_buf(q, dst, len+1, c, c_ctx, running, depth);
 	q->cycle_error = 0;
-	const char *src = dst;
-
-	while (len) {
-		size_t nbytes = fwrite(src, 1, len, fp);
-
-		if (feof(fp)) {
-			q->error = 1;
-			return;
-		}
+	ob_flush(&ob);
+	free(ob.buf);
 
-		len -= nbytes;
-		src += nbytes;
-	}
-
-	free(dst);
+	if (ob.error)
+		q->error = 1;
 }
 
-void write_term_to_stream(query *q, stream *str, cell *c, idx_t c_ctx, int running, int cons, int depth)
+size_t write_canonical_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ctx, int running, int depth)
 {
-	size_t len = write_term_to_buf(q, NULL, 0, c, c_ctx, running, cons, depth);
+	return write_to_buf(q, dst, dstlen, c, c_ctx, running, 1, 0, depth);
+}
 
-	if (q->cycle_error) {
-		running = 0;
-		len = write_term_to_buf(q, NULL, 0, c, c_ctx, running, cons, depth);
-	}
+size_t write_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ctx, int running, int cons, int depth)
+{
+	return write_to_buf(q, dst, dstlen, c, c_ctx, running, 0, cons, depth);
+}
 
-	char *dst = malloc(len+1);
-	write_term_to_buf(q, dst, len+1, c, c_ctx, running, cons, depth);
-	q->cycle_error = 0;
-	const char *src = dst;
+char *write_canonical_to_strbuf(query *q, cell *c, idx_t c_ctx, int running)
+{
+	return write_to_strbuf(q, c, c_ctx, running, 1);
+}
 
-	while (len) {
-		size_t nbytes = net_write(src, len, str);
+char *write_term_to_strbuf(query *q, cell *c, idx_t c_ctx, int running)
+{
+	return write_to_strbuf(q, c, c_ctx, running, 0);
+}
 
-		if (feof(str->fp)) {
-			q->error = 1;
-			return;
-		}
+void write_canonical_to_stream(query *q, stream *str, cell *c, idx_t c_ctx, int running, int depth)
+{
+	write_to_file(q, NULL, str, c, c_ctx, running, 1, 0, depth);
+}
 
-		len -= nbytes;
-		src += nbytes;
-	}
+void write_canonical(query *q, FILE *fp, cell *c, idx_t c_ctx, int running, int depth)
+{
+	write_to_file(q, fp, NULL, c, c_ctx, running, 1, 0, depth);
+}
 
-	free(dst);
+void write_term_to_stream(query *q, stream *str, cell *c, idx_t c_ctx, int running, int cons, int depth)
+{
+	write_to_file(q, NULL, str, c, c_ctx, running, 0, cons, depth);
 }
 
 void write_term(query *q, FILE *fp, cell *c, idx_t c_ctx, int running, int cons, int depth)
 {
-	size_t len = write_term_to_buf(q, NULL, 0, c, c_ctx, running, cons, depth);
-
-	if (q->cycle_error) {
-		running = 0;
-		len = write_term_to_buf(q, NULL, 0, c, c_ctx, running, cons, depth);
-	}
-
-	char *dst = malloc(len+1);
-	write_term_to_buf(q, dst, len+1, c, c_ctx, running, cons, depth);
-	q->cycle_error = 0;
-	const char *src = dst;
-
-	while (len) {
-		size_t nbytes = fwrite(src, 1, len, fp);
-
-		if (feof(fp)) {
-			q->error = 1;
-			return;
-		}
-
-		len -= nbytes;
-		src += nbytes;
-	}
-
-	free(dst);
+	write_to_file(q, fp, NULL, c, c_ctx, running, 0, cons, depth);
 }
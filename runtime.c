@@ -155,9 +155,26 @@ static void trace_call(query *q, cell *c, int box)
 
 static void unwind_trail(query *q, const choice *ch)
 {
+	q->nbr_wakes = 0;
+
 	while (q->st.tp > ch->st.tp) {
 		trail *tr = q->trails + --q->st.tp;
 
+		if (tr->save_nbr) {
+			const saved *sv = q->saves + (q->nbr_saves = tr->save_nbr - 1);
+
+			if (sv->c) {
+				*sv->c = sv->val;
+				continue;
+			}
+
+			frame *g = GET_FRAME(tr->ctx);
+			slot *e = GET_SLOT(g, tr->var_nbr);
+			e->c = sv->val;
+			e->ctx = sv->ctx;
+			continue;
+		}
+
 		if (ch->pins) {
 			if (ch->pins & (1 << tr->var_nbr))
 				continue;
@@ -178,7 +195,7 @@ static void trim_trail(query *q)
 	while (q->st.tp > ch->st.tp) {
 		trail *tr = q->trails + q->st.tp - 1;
 
-		if (tr->ctx == q->st.curr_frame) {
+		if ((tr->ctx == q->st.curr_frame) && !tr->save_nbr) {
 			q->st.tp--;
 			continue;
 		}
@@ -226,6 +243,7 @@ void make_choice(query *q)
 	frame *g = GET_FRAME(q->st.curr_frame);
 	ch->nbr_vars = g->nbr_vars;
 	ch->nbr_slots = g->nbr_slots;
+	ch->overflow = g->overflow;
 	ch->any_choices = g->any_choices;
 	check_slot(q, g->nbr_vars);
 }
@@ -263,6 +281,8 @@ static void trim_heap(query *q, const choice *ch)
 
 			if (is_blob(c) && !is_const_cstring(c)) {
 				free(c->val_str);
+			} else if (is_bigint(c) && !is_const_bigint(c)) {
+				free_bigint(c);
 			} else if (is_integer(c) && ((c)->flags&FLAG_STREAM)) {
 				stream *str = &g_streams[c->val_num];
 
@@ -282,6 +302,7 @@ static void trim_heap(query *q, const choice *ch)
 
 		arena *save = a;
 		q->arenas = a = a->next;
+		q->tot_heapsize -= save->h_size;
 		free(save->heap);
 		free(save);
 	}
@@ -293,6 +314,8 @@ static void trim_heap(query *q, const choice *ch)
 
 		if (is_blob(c) && !is_const_cstring(c)) {
 			free(c->val_str);
+		} else if (is_bigint(c) && !is_const_bigint(c)) {
+			free_bigint(c);
 		} else if (is_integer(c) && ((c)->flags&FLAG_STREAM)) {
 			stream *str = &g_streams[c->val_num];
 
@@ -319,6 +342,13 @@ int retry_choice(query *q)
 
 	idx_t curr_choice = drop_choice(q);
 	const choice *ch = q->choices + curr_choice;
+
+	// Overflow slots the frame already had may have been moved up by
+	// create_vars() since, so go back to the ones the trail refers to.
+
+	if (ch->nbr_vars > ch->nbr_slots)
+		GET_FRAME(ch->st.curr_frame)->overflow = ch->overflow;
+
 	unwind_trail(q, ch);
 
 	if (ch->catchme2)
@@ -331,7 +361,7 @@ int retry_choice(query *q)
 	g->nbr_vars = ch->nbr_vars;
 	g->nbr_slots = ch->nbr_slots;
 	g->any_choices = ch->any_choices;
-	g->overflow = 0;
+	g->overflow = ch->overflow;
 	return 1;
 }
 
@@ -357,6 +387,7 @@ void make_frame(query *q, unsigned nbr_vars, int last_match)
 	g->nbr_vars = nbr_vars;
 	g->any_choices = 0;
 	g->did_cut = 0;
+	g->no_tco = 0;
 
 	q->st.sp += nbr_vars;
 	q->st.curr_frame = new_frame;
@@ -372,11 +403,10 @@ static void reuse_frame(query *q, unsigned nbr_vars)
 
 	idx_t curr_choice = q->cp - 1;
 	choice *ch = q->choices + curr_choice;
+	frame *new_g = GET_FRAME(q->st.fp);
 	q->st.sp = ch->st.sp;
 
 	if (!q->no_tco && q->m->opt) {
-		frame *new_g = GET_FRAME(q->st.fp);
-
 		for (unsigned i = 0; i < nbr_vars; i++) {
 			slot *e = GET_SLOT(g, i);
 			cell *c = &e->c;
@@ -390,14 +420,17 @@ static void reuse_frame(query *q, unsigned nbr_vars)
 		memcpy(to, from, sizeof(slot)*nbr_vars);
 		q->st.sp = g->ctx + nbr_vars;
 	} else {
-		g->ctx = q->st.sp;
-		q->st.sp += nbr_vars;
+		// The head was unified into the slots above, and the choice
+		// left may be older than this frame, so its sp can't be used.
+
+		g->ctx = new_g->ctx;
+		q->st.sp = g->ctx + nbr_vars;
 	}
 
 	if (q->cp)
 		trim_trail(q);
 	else
-		q->st.tp = 0;
+		q->st.tp = q->nbr_saves = 0;
 
 	q->tot_tcos++;
 }
@@ -410,6 +443,9 @@ static int check_slots(const query *q, frame *g, term *t)
 	for (unsigned i = 0; i < g->nbr_vars; i++) {
 		slot *e = GET_SLOT(g, i);
 
+		if (is_indirect(&e->c) && (e->c.val_ptr->flags & FLAG_GROUND))
+			continue;
+
 		if (is_indirect(&e->c) || is_string(&e->c))
 			return 0;
 	}
@@ -422,16 +458,15 @@ static void commit_me(query *q, term *t)
 	frame *g = GET_FRAME(q->st.curr_frame);
 	g->m = q->m;
 	q->m = q->st.curr_clause->m;
-	int last_match = (!q->st.curr_clause->next && !q->st.iter) || t->first_cut;
+	choice *ch = q->choices + q->cp - 1;
+	int last_match = (!ch->st.iter && (ch->st.by_index || !q->st.curr_clause->next)) || t->first_cut;
 	int recursive = (last_match || g->did_cut) && (q->st.curr_cell->flags&FLAG_TAIL_REC);
-	int tco = recursive && !g->any_choices && check_slots(q, g, t);
+	int tco = recursive && !g->any_choices && !g->no_tco && check_slots(q, g, t);
 
-	if (last_match)
+	if (last_match) {
+		sl_done(ch->st.iter);
+		ch->st.iter = NULL;
 		drop_choice(q);
-	else {
-		idx_t curr_choice = q->cp - 1;
-		choice *ch = q->choices + curr_choice;
-		ch->st.curr_clause = q->st.curr_clause;
 	}
 
 	if (tco && q->cp)
@@ -439,8 +474,12 @@ static void commit_me(query *q, term *t)
 	else
 		make_frame(q, t->nbr_vars, last_match);
 
+	const clause *r = q->st.curr_clause;
+
 	if (t->cut_only)
 		q->st.curr_cell = NULL;
+	else if (r->inlined && (r->inline_gen == g_inline_gen) && !q->trace)
+		q->st.curr_cell = r->inlined->cells;
 	else
 		q->st.curr_cell = get_body(t->cells);
 
@@ -481,7 +520,45 @@ void cut_me(query *q, int local_cut)
 	}
 
 	if (!q->cp)
-		q->st.tp = 0;
+		q->st.tp = q->nbr_saves = 0;
+}
+
+// Drops the choices back to and including the barrier left by the
+// control cell 'c' in the current frame, see compile_goal().
+
+void cut_barrier(query *q, const cell *c)
+{
+	frame *g = GET_FRAME(q->st.curr_frame);
+
+	while (q->cp) {
+		idx_t curr_choice = q->cp - 1;
+		choice *ch = q->choices + curr_choice;
+
+		if (ch->cgen < g->cgen)
+			break;
+
+		if (ch->st.qnbr != q->st.qnbr) {
+			free(q->tmpq[q->st.qnbr]);
+			q->tmpq[q->st.qnbr] = NULL;
+			q->st.qnbr = ch->st.qnbr;
+		}
+
+		if (ch->st.iter) {
+			sl_done(ch->st.iter);
+			ch->st.iter = NULL;
+		}
+
+		q->cp--;
+
+		if (ch->local_cut && (ch->st.curr_cell == c)
+			&& (ch->st.curr_frame == q->st.curr_frame))
+			break;
+	}
+
+	g->any_choices = q->cp && (q->choices[q->cp-1].cgen > g->cgen);
+
+	if (!q->cp)
+		q->st.tp = q->nbr_saves = 0;
 }
 
 static void follow_me(query *q)
@@ -527,6 +604,9 @@ unsigned create_vars(query *q, unsigned cnt)
 	frame *g = GET_FRAME(q->st.curr_frame);
 	unsigned var_nbr = g->nbr_vars;
 
+	if ((var_nbr + cnt) > UINT16_MAX)
+		return 0;
+
 	if ((g->ctx + g->nbr_slots) >= q->st.sp) {
 		g->nbr_slots += cnt;
 		q->st.sp = g->ctx + g->nbr_slots;
@@ -536,7 +616,9 @@ unsigned create_vars(query *q, unsigned cnt)
 	} else if ((g->overflow + (g->nbr_vars-g->nbr_slots)) == q->st.sp) {
 		q->st.sp += cnt;
 	} else {
-		assert(0);
+		// Other frames have been pushed since, move the overflow
+		// slots up to the top to keep them contiguous.
+
 		idx_t save_overflow = g->overflow;
 		g->overflow = q->st.sp;
 		idx_t cnt2 = g->nbr_vars-g->nbr_slots;
@@ -550,20 +632,58 @@ unsigned create_vars(query *q, unsigned cnt)
 	for (unsigned i = 0; i < cnt; i++) {
 		slot *e = GET_SLOT(g, g->nbr_vars+i);
 		e->c.val_type = TYPE_EMPTY;
+		e->c.attrs = NULL;
 	}
 
 	g->nbr_vars += cnt;
 	return var_nbr;
 }
 
+static void save_cell(query *q, cell *c, idx_t ctx, idx_t var_nbr, const cell *val, idx_t val_ctx);
+
+static void queue_wake(query *q, cell *attrs, idx_t ctx, idx_t var_nbr)
+{
+	if (q->nbr_wakes == q->wakes_size) {
+		q->wakes_size = q->wakes_size ? q->wakes_size * 2 : 16;
+		q->wakes = realloc(q->wakes, sizeof(wake)*q->wakes_size);
+		assert(q->wakes);
+	}
+
+	wake *w = q->wakes + q->nbr_wakes++;
+	w->attrs = attrs;
+	w->ctx = ctx;
+	w->var_nbr = var_nbr;
+}
+
+// Binding an attributed variable to a plain one moves the attributes
+// across. Binding it to anything else queues its goals, which run as
+// one batch when the current step is done (see call_attrs()).
+
+static void bind_attributed(query *q, cell *attrs, idx_t c_ctx, idx_t var_nbr, cell *v, idx_t v_ctx)
+{
+	if (is_variable(v)) {
+		slot *e = GET_SLOT(GET_FRAME(v_ctx), v->var_nbr);
+
+		if (is_empty(&e->c) && !e->c.attrs) {
+			set_attrs(q, v, v_ctx, attrs);
+			return;
+		}
+	}
+
+	queue_wake(q, attrs, c_ctx, var_nbr);
+}
+
 void set_var(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
 {
 	frame *g = GET_FRAME(c_ctx);
 	slot *e = GET_SLOT(g, c->var_nbr);
-	cell *frozen = NULL;
+	cell *attrs = is_empty(&e->c) ? e->c.attrs : NULL;
 
-	if (is_empty(&e->c) && e->c.attrs && !is_list_or_nil(e->c.attrs))
-		frozen = e->c.attrs;
+	// The attributes are lost by the binding, so keep the whole
+	// slot for backtracking rather than just trailing the variable.
+
+	if (attrs && q->cp)
+		save_cell(q, NULL, c_ctx, c->var_nbr, &e->c, e->ctx);
 
 	e->ctx = v_ctx;
 
@@ -572,8 +692,10 @@ void set_var(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
 	else
 		e->c = *v;
 
-	if (frozen)
-		call_attrs(q, frozen);
+	if (attrs) {
+		bind_attributed(q, attrs, c_ctx, c->var_nbr, v, v_ctx);
+		return;
+	}
 
 	if (!q->cp)
 		return;
@@ -582,6 +704,7 @@ void set_var(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
 	trail *tr = q->trails + q->st.tp++;
 	tr->var_nbr = c->var_nbr;
 	tr->ctx = c_ctx;
+	tr->save_nbr = 0;
 }
 
 void reset_value(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
@@ -604,33 +727,89 @@ void reset_value(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
 		e->c = *v;
 }
 
-int unify_internal(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, int depth);
+// Remember the old contents of a cell so backtracking can put them
+// back. A NULL cell means the slot of var_nbr in frame ctx.
 
-static int unify_structure(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, int depth)
+static void save_cell(query *q, cell *c, idx_t ctx, idx_t var_nbr, const cell *val, idx_t val_ctx)
 {
-	if (p1->arity != p2->arity)
-		return 0;
-
-	if (p1->val_off != p2->val_off)
-		return 0;
+	if (q->nbr_saves == q->saves_size) {
+		q->saves_size = q->saves_size ? q->saves_size * 2 : 100;
+		q->saves = realloc(q->saves, sizeof(saved)*q->saves_size);
+		assert(q->saves);
+	}
 
-	unsigned arity = p1->arity;
-	p1++; p2++;
+	check_trail(q);
+	saved *sv = q->saves + q->nbr_saves++;
+	sv->c = c;
+	sv->val = *val;
+	sv->ctx = val_ctx;
+	trail *tr = q->trails + q->st.tp++;
+	tr->ctx = ctx;
+	tr->var_nbr = var_nbr;
+	tr->save_nbr = q->nbr_saves;
+}
 
-	while (arity--) {
-		cell *c1 = deref(q, p1, p1_ctx);
-		idx_t c1_ctx = q->latest_ctx;
-		cell *c2 = deref(q, p2, p2_ctx);
-		idx_t c2_ctx = q->latest_ctx;
+// Like reset_value, but undone on backtracking.
 
-		if (!unify_internal(q, c1, c1_ctx, c2, c2_ctx, depth+1))
-			return 0;
+void rebind_value(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
+{
+	frame *g = GET_FRAME(c_ctx);
+	slot *e = GET_SLOT(g, c->var_nbr);
 
-		p1 += p1->nbr_cells;
-		p2 += p2->nbr_cells;
+	while (is_variable(&e->c)) {
+		c = &e->c;
+		c_ctx = e->ctx;
+		g = GET_FRAME(c_ctx);
+		e = GET_SLOT(g, c->var_nbr);
 	}
 
-	return 1;
+	if (q->cp)
+		save_cell(q, NULL, c_ctx, c->var_nbr, &e->c, e->ctx);
+
+	reset_value(q, c, c_ctx, v, v_ctx);
+}
+
+// Replace the binding of the slot itself rather than of the variable
+// at the end of its chain, undone on backtracking if 'trailed'.
+
+void rebind_slot(query *q, idx_t ctx, idx_t var_nbr, cell *v, idx_t v_ctx, int trailed)
+{
+	frame *g = GET_FRAME(ctx);
+	slot *e = GET_SLOT(g, var_nbr);
+
+	if (trailed && q->cp)
+		save_cell(q, NULL, ctx, var_nbr, &e->c, e->ctx);
+
+	e->ctx = v_ctx;
+
+	if (v->arity && !is_string(v))
+		make_indirect(&e->c, v);
+	else
+		e->c = *v;
+}
+
+// Replace the attributes of the unbound variable c, undone on
+// backtracking.
+
+void set_attrs(query *q, cell *c, idx_t c_ctx, cell *attrs)
+{
+	frame *g = GET_FRAME(c_ctx);
+	slot *e = GET_SLOT(g, c->var_nbr);
+
+	if (q->cp)
+		save_cell(q, NULL, c_ctx, c->var_nbr, &e->c, e->ctx);
+
+	e->c.attrs = attrs;
+}
+
+void overwrite_cell(query *q, cell *c, const cell *v, int trailed)
+{
+	if (trailed && q->cp)
+		save_cell(q, c, 0, 0, c, 0);
+
+	idx_t nbr_cells = c->nbr_cells;
+	*c = *v;
+	c->nbr_cells = nbr_cells;
 }
 
 static int unify_int(cell *p1, cell *p2)
@@ -641,6 +820,14 @@ static int unify_int(cell *p1, cell *p2)
 	return 0;
 }
 
+static int unify_bigint(cell *p1, cell *p2)
+{
+	if (is_bigint(p2))
+		return !bigint_cmp(p1, p2);
+
+	return 0;
+}
+
 static int unify_float(cell *p1, cell *p2)
 {
 	if (is_float(p2))
@@ -671,32 +858,6 @@ static int unify_cstring(cell *p1, cell *p2)
 	return 0;
 }
 
-static int unify_list(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, int depth)
-{
-	while (is_list(p1) && is_list(p2)) {
-		cell *h1 = LIST_HEAD(p1);
-		cell *c1 = deref(q, h1, p1_ctx);
-		idx_t c1_ctx = q->latest_ctx;
-
-		cell *h2 = LIST_HEAD(p2);
-		cell *c2 = deref(q, h2, p2_ctx);
-		idx_t c2_ctx = q->latest_ctx;
-
-		if (!unify_internal(q, c1, c1_ctx, c2, c2_ctx, depth+1))
-			return 0;
-
-		p1 = LIST_TAIL(p1);
-		p1 = deref(q, p1, p1_ctx);
-		p1_ctx = q->latest_ctx;
-
-		p2 = LIST_TAIL(p2);
-		p2 = deref(q, p2, p2_ctx);
-		p2_ctx = q->latest_ctx;
-	}
-
-	return unify_internal(q, p1, p1_ctx, p2, p2_ctx, depth+1);
-}
-
 struct dispatch {
 	uint8_t val_type;
 	int (*fn)(cell*, cell*);
@@ -710,16 +871,12 @@ static const struct dispatch g_disp[] =
 	{TYPE_CSTRING, unify_cstring},
 	{TYPE_INTEGER, unify_int},
 	{TYPE_FLOAT, unify_float},
+	{TYPE_BIGINT, unify_bigint},
 	{0}
 };
 
-int unify_internal(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, int depth)
+static int unify_var(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx)
 {
-	if (depth == MAX_DEPTH) {
-		q->cycle_error = 1;
-		return 1;
-	}
-
 	if (is_variable(p1) && is_variable(p2)) {
 		if (p2_ctx > p1_ctx)
 			set_var(q, p2, p2_ctx, p1, p1_ctx);
@@ -727,35 +884,258 @@ int unify_internal(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, int
 			set_var(q, p1, p1_ctx, p2, p2_ctx);
 		else if (p2->var_nbr != p1->var_nbr)
 			set_var(q, p2, p2_ctx, p1, p1_ctx);
-		return 1;
-	}
-
-	if (is_variable(p1)) {
+	} else if (is_variable(p1)) {
 		if (is_structure(p2) && (p2_ctx >= q->st.curr_frame))
 			q->no_tco = 1;
 
 		set_var(q, p1, p1_ctx, p2, p2_ctx);
-		return 1;
-	}
-
-	if (is_variable(p2)) {
+	} else {
 		if (is_structure(p1) && (p1_ctx >= q->st.curr_frame))
 			q->no_tco = 1;
 
 		set_var(q, p2, p2_ctx, p1, p1_ctx);
-		return 1;
 	}
 
-	if (is_string(p1) && is_string(p2))
-		return unify_cstring(p1, p2);
+	return 1;
+}
+
+// A list where one side is a packed string. The string elements are
+// characters, so no head pair needs more than one step. Leaves the
+// final tails in p1/p2, which may point at tmp1/tmp2.
+
+static int unify_string_list(query *q, cell **p1, idx_t *p1_ctx, cell **p2, idx_t *p2_ctx, cell *tmp1, cell *tmp2)
+{
+	while (is_list(*p1) && is_list(*p2)) {
+		if (is_string(*p1) && is_string(*p2)) {
+			if (!unify_cstring(*p1, *p2))
+				return 0;
+
+			tmp1->val_type = TYPE_LITERAL;
+			tmp1->nbr_cells = 1;
+			tmp1->arity = tmp1->flags = 0;
+			tmp1->val_off = g_nil_s;
+			*p1 = *p2 = tmp1;
+			return 1;
+		}
+
+		cell *c1 = deref(q, list_head(*p1), *p1_ctx);
+		idx_t c1_ctx = q->latest_ctx;
+		cell *c2 = deref(q, list_head(*p2), *p2_ctx);
+		idx_t c2_ctx = q->latest_ctx;
+
+		if (!unify_internal(q, c1, c1_ctx, c2, c2_ctx))
+			return 0;
+
+		*p1 = deref(q, list_tail(*p1, tmp1), *p1_ctx);
+		*p1_ctx = q->latest_ctx;
+		*p2 = deref(q, list_tail(*p2, tmp2), *p2_ctx);
+		*p2_ctx = q->latest_ctx;
+	}
+
+	return 1;
+}
+
+// Unification walks both terms with an explicit stack of argument
+// iterators. The last argument is taken without a push, so lists and
+// right-nested terms need no stack however long they are.
+//
+// Each pair of compounds is checked against one saved at power-of-two
+// intervals (Brent's method). Meeting a pair again means it has been
+// or is being unified already, so it is skipped. This is what stops
+// unification of cyclic terms.
+
+typedef struct {
+	cell *c1, *c2;
+	idx_t c1_ctx, c2_ctx;
+	unsigned nbr;
+} unify_frame;
+
+int unify_internal(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx)
+{
+	unify_frame local[64], *stack = local;
+	unsigned sp = 0, size = sizeof(local) / sizeof(local[0]);
+	cell *save1 = NULL, *save2 = NULL, tmp1, tmp2;
+	idx_t save1_ctx = 0, save2_ctx = 0, power = 1, lam = 0;
+	int ok = 1;
+
+	for (;;) {
+		if (is_variable(p1) || is_variable(p2)) {
+			unify_var(q, p1, p1_ctx, p2, p2_ctx);
+		} else if (is_list(p1) && is_list(p2) && (is_string(p1) || is_string(p2))) {
+			if (!unify_string_list(q, &p1, &p1_ctx, &p2, &p2_ctx, &tmp1, &tmp2)) {
+				ok = 0;
+				break;
+			}
+
+			continue;
+		} else if (p1->arity) {
+			if ((p1->arity != p2->arity) || (p1->val_off != p2->val_off)
+				|| !is_literal(p2) || is_string(p1)) {
+				ok = 0;
+				break;
+			}
+
+			int seen = (p1 == p2) && ((p1_ctx == p2_ctx) || (p1->flags & FLAG_GROUND));
+
+			if (!seen && (p1 == save1) && (p2 == save2)
+				&& (p1_ctx == save1_ctx) && (p2_ctx == save2_ctx))
+				seen = 1;
+
+			if (++lam == power) {
+				save1 = p1; save1_ctx = p1_ctx;
+				save2 = p2; save2_ctx = p2_ctx;
+				power *= 2;
+				lam = 0;
+			}
+
+			if (!seen) {
+				if (sp == size) {
+					size *= 2;
+
+					if (stack == local) {
+						stack = malloc(sizeof(unify_frame)*size);
+						memcpy(stack, local, sizeof(local));
+					} else
+						stack = realloc(stack, sizeof(unify_frame)*size);
+				}
+
+				unify_frame *f = stack + sp++;
+				f->c1 = p1 + 1;
+				f->c2 = p2 + 1;
+				f->c1_ctx = p1_ctx;
+				f->c2_ctx = p2_ctx;
+				f->nbr = p1->arity;
+			}
+		} else if (!g_disp[p1->val_type].fn(p1, p2)) {
+			ok = 0;
+			break;
+		}
+
+		if (!sp)
+			break;
+
+		unify_frame *f = stack + sp - 1;
+		cell *c1 = f->c1, *c2 = f->c2;
+		f->c1 += c1->nbr_cells;
+		f->c2 += c2->nbr_cells;
+
+		if (!--f->nbr)
+			sp--;
+
+		p1 = deref(q, c1, f->c1_ctx);
+		p1_ctx = q->latest_ctx;
+		p2 = deref(q, c2, f->c2_ctx);
+		p2_ctx = q->latest_ctx;
+	}
+
+	if (stack != local)
+		free(stack);
+
+	return ok;
+}
+
+static int unify_structure(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx)
+{
+	if ((p1->arity != p2->arity) || (p1->val_off != p2->val_off))
+		return 0;
+
+	return unify_internal(q, p1, p1_ctx, p2, p2_ctx);
+}
+
+// Run a compiled clause head against the goal p1, which is walked in
+// step. Each op has a fast path for the common cases and otherwise
+// falls back to a general unification of that argument.
+
+static int match_head(query *q, clause *r, cell *p1, idx_t p1_ctx, cell *head)
+{
+	if (!r->code)
+		return unify_structure(q, p1, p1_ctx, head, q->st.fp);
+
+	if ((p1->arity != head->arity) || (p1->val_off != head->val_off))
+		return 0;
+
+	struct { cell *g; idx_t ctx; } stack[MAX_HEAD_DEPTH];
+	unsigned sp = 0;
+	idx_t fp = q->st.fp;
+	cell *g = p1 + 1;
+	idx_t g_ctx = p1_ctx;
+
+	for (const head_op *op = r->code; op->op != H_END; op++) {
+		if (op->op == H_POP) {
+			sp--;
+			g = stack[sp].g;
+			g_ctx = stack[sp].ctx;
+			continue;
+		}
+
+		cell *a = deref(q, g, g_ctx);
+		idx_t a_ctx = q->latest_ctx;
+		g += g->nbr_cells;
+		cell *c = op->c;
+
+		switch (op->op) {
+		case H_VOID:
+			break;
+
+		case H_FIRST:
+			unify_var(q, a, a_ctx, c, fp);
+			break;
+
+		case H_ATOM:
+			if (is_literal(a) && !a->arity) {
+				if (a->val_off != c->val_off)
+					return 0;
+			} else if (is_variable(a))
+				unify_var(q, a, a_ctx, c, fp);
+			else if (!unify_internal(q, a, a_ctx, c, fp))
+				return 0;
+
+			break;
+
+		case H_INT:
+			if (is_rational(a)) {
+				if ((a->val_num != c->val_num) || (a->val_den != c->val_den))
+					return 0;
+			} else if (is_variable(a))
+				unify_var(q, a, a_ctx, c, fp);
+			else if (!unify_internal(q, a, a_ctx, c, fp))
+				return 0;
+
+			break;
+
+		case H_STRUCT:
+			if (is_literal(a) && (a->arity == c->arity) && (a->val_off == c->val_off)) {
+				stack[sp].g = g;
+				stack[sp].ctx = g_ctx;
+				sp++;
+				g = a + 1;
+				g_ctx = a_ctx;
+				break;
+			}
+
+			if (is_variable(a))
+				unify_var(q, a, a_ctx, c, fp);
+			else if (!unify_internal(q, a, a_ctx, c, fp))
+				return 0;
+
+			op += op->skip;
+			break;
 
-	if (is_list(p1) && is_list(p2))
-		return unify_list(q, p1, p1_ctx, p2, p2_ctx, depth+1);
+		case H_VAR:
+			c = deref(q, c, fp);
 
-	if (p1->arity)
-		return unify_structure(q, p1, p1_ctx, p2, p2_ctx, depth+1);
+			if (!unify_internal(q, a, a_ctx, c, q->latest_ctx))
+				return 0;
+
+			break;
+
+		default:
+			if (!unify_internal(q, a, a_ctx, c, fp))
+				return 0;
+		}
+	}
 
-	return g_disp[p1->val_type].fn(p1, p2);
+	return 1;
 }
 
 static void next_key(query *q)
@@ -765,70 +1145,132 @@ static void next_key(query *q)
 			q->st.curr_clause = NULL;
 			q->st.iter = NULL;
 		}
-	} else
+	} else if (q->st.by_index)
+		q->st.curr_clause = NULL;
+	else
 		q->st.curr_clause = q->st.curr_clause->next;
 }
 
-static int do_match2(query *q, cell *p1, idx_t p1_ctx)
+// Start on the clauses of h that may match the goal p1. The index on
+// the first bound argument that has one is used, and then q->st.iter
+// walks the rest of the candidates. Any iterator left over from an
+// earlier goal is released first.
+
+static void first_clause(query *q, rule *h, cell *p1, idx_t p1_ctx)
 {
-	cell *head = get_head(p1);
-	rule *h = find_matching_rule(q->m, head);
+	sl_done(q->st.iter);
+	q->st.iter = NULL;
+	q->st.by_index = 0;
+	q->st.db_gen = g_db_gen;
+	q->st.curr_clause = h ? h->head : NULL;
 
-	if (!h)
-		q->st.curr_clause = NULL;
-	else
-		q->st.curr_clause = h->head;
+	if (!h || !h->is_indexed)
+		return;
 
-	make_choice(q);
+	unsigned arity = p1->arity < MAX_INDEX_ARGS ? p1->arity : MAX_INDEX_ARGS;
+	cell *c = p1 + 1;
+
+	for (unsigned i = 0; i < arity; i++, c += c->nbr_cells) {
+		cell *key = deref(q, c, p1_ctx);
 
-	for (; q->st.curr_clause; q->st.curr_clause = q->st.curr_clause->next) {
-		if (q->st.curr_clause->t.is_deleted)
+		if (is_variable(key) || !index_rule(h, i))
 			continue;
 
-		term *t = &q->st.curr_clause->t;
-		cell *c = t->cells;
-		try_me(q, t->nbr_vars);
-		q->tot_matches++;
+		q->st.curr_clause = NULL;
+		q->st.by_index = 1;
 
-		if (unify_structure(q, p1, p1_ctx, c, q->st.fp, 0))
-			return 1;
+		if ((q->st.iter = sl_findkey(h->index[i], key)) != NULL)
+			next_key(q);
 
-		undo_me(q);
+		return;
 	}
+}
 
-	drop_choice(q);
-	return 0;
+// Bind the variables standing for the clause's shared terms. Those are
+// ground, so the context is immaterial.
+
+static void bind_shared(query *q, const clause *r)
+{
+	frame *g = GET_FRAME(q->st.fp);
+	unsigned first = r->t.nbr_vars - r->nbr_shared;
+
+	for (unsigned i = 0; i < r->nbr_shared; i++) {
+		slot *e = GET_SLOT(g, first+i);
+		make_indirect(&e->c, r->shared[i]);
+		e->ctx = 0;
+	}
 }
 
-int do_match(query *q, cell *p1, idx_t p1_ctx)
+// The choice made for a clause search keeps the index iterator while
+// the search is suspended, but it is worked from q->st in the meantime.
+
+static choice *take_iter(query *q)
 {
-	if (q->retry)
-		q->st.curr_clause = q->st.curr_clause->next;
-	else {
-		if (!strcmp(GET_STR(p1), ":-"))
-			return do_match2(q, p1, p1_ctx);
+	choice *ch = q->choices + q->cp - 1;
+	q->st.iter = ch->st.iter;
+	ch->st.iter = NULL;
+	return ch;
+}
 
-		rule *h = find_matching_rule(q->m, p1);
+static void keep_iter(query *q, choice *ch)
+{
+	if (q->st.iter && !sl_is_nextkey(q->st.iter)) {
+		sl_done(q->st.iter);
+		q->st.iter = NULL;
+	}
 
-		if (!h)
-			q->st.curr_clause = NULL;
-		else
-			q->st.curr_clause = h->head;
+	ch->st.curr_clause = q->st.curr_clause;
+	ch->st.iter = q->st.iter;
+	q->st.iter = NULL;
+}
+
+// Used by clause/2, clause/3 and retract/1. The goal is either a head
+// or (Head :- Body), which is matched against the whole clause.
+
+int do_match(query *q, cell *p1, idx_t p1_ctx)
+{
+	int is_clause = (p1->arity == 2) && !strcmp(GET_STR(p1), ":-");
+	cell *head = p1;
+	idx_t head_ctx = p1_ctx;
+
+	if (is_clause) {
+		head = deref(q, p1+1, p1_ctx);
+		head_ctx = q->latest_ctx;
 	}
 
+	if (q->retry)
+		next_key(q);
+	else
+		first_clause(q, is_variable(head) ? NULL : find_matching_rule(q->m, head), head, head_ctx);
+
+	if (!q->st.curr_clause)
+		return 0;
+
 	make_choice(q);
+	choice *ch = take_iter(q);
 
-	for (; q->st.curr_clause; q->st.curr_clause = q->st.curr_clause->next) {
-		if (q->st.curr_clause->t.is_deleted)
+	for (; q->st.curr_clause; next_key(q)) {
+		if (!is_visible(q->st.curr_clause, q->st.db_gen))
 			continue;
 
 		term *t = &q->st.curr_clause->t;
-		cell *head = get_head(t->cells);
 		try_me(q, t->nbr_vars);
+
+		if (q->st.curr_clause->nbr_shared)
+			bind_shared(q, q->st.curr_clause);
+
 		q->tot_matches++;
+		int ok;
+
+		if (is_clause)
+			ok = unify_structure(q, p1, p1_ctx, t->cells, q->st.fp);
+		else
+			ok = match_head(q, q->st.curr_clause, p1, p1_ctx, get_head(t->cells));
 
-		if (unify_structure(q, p1, p1_ctx, head, q->st.fp, 0))
+		if (ok) {
+			keep_iter(q, ch);
 			return 1;
+		}
 
 		undo_me(q);
 	}
@@ -857,30 +1299,7 @@ static int match(query *q)
 			}
 		}
 
-		if (h->index) {
-			cell *key = deep_clone_to_heap(q, q->st.curr_cell, q->st.curr_frame);
-			int all_vars = 1, arity = key->arity;
-
-			for (cell *c = key + 1; arity--; c += c->nbr_cells) {
-				if (!is_variable(c)) {
-					all_vars = 0;
-					break;
-				}
-			}
-
-			if (!all_vars) {
-				q->st.iter = sl_findkey(h->index, key);
-				next_key(q);
-			} else {
-				q->st.curr_clause = h->head;
-				sl_done(q->st.iter);
-				q->st.iter = NULL;
-			}
-		} else {
-			q->st.curr_clause = h->head;
-			sl_done(q->st.iter);
-			q->st.iter = NULL;
-		}
+		first_clause(q, h, q->st.curr_cell, q->st.curr_frame);
 	} else
 		next_key(q);
 
@@ -888,18 +1307,24 @@ static int match(query *q)
 		return 0;
 
 	make_choice(q);
+	choice *ch = take_iter(q);
 
 	for (; q->st.curr_clause; next_key(q)) {
-		if (q->st.curr_clause->t.is_deleted)
+		if (!is_visible(q->st.curr_clause, q->st.db_gen))
 			continue;
 
 		term *t = &q->st.curr_clause->t;
 		cell *head = get_head(t->cells);
 		try_me(q, t->nbr_vars);
+
+		if (q->st.curr_clause->nbr_shared)
+			bind_shared(q, q->st.curr_clause);
+
 		q->tot_matches++;
 		q->no_tco = 0;
 
-		if (unify_structure(q, q->st.curr_cell, q->st.curr_frame, head, q->st.fp, 0)) {
+		if (match_head(q, q->st.curr_clause, q->st.curr_cell, q->st.curr_frame, head)) {
+			keep_iter(q, ch);
 			Trace(q, q->st.curr_cell, EXIT);
 
 			if (q->error)
@@ -916,33 +1341,99 @@ static int match(query *q)
 	return 0;
 }
 
+// Poll for an interrupt every INTERRUPT_POLL+1 steps, not every goal.
+
+#define INTERRUPT_POLL 0x3FF
+
+static int check_interrupt(query *q)
+{
+	printf("\nAction (a)bort, (c)ontinue, (e)xit: ");
+	fflush(stdout);
+	int ch = history_getch();
+	printf("%c\n", ch);
+
+	if (ch == 'a') {
+		g_tpl_interrupt = 0;
+		q->abort = 1;
+		return 0;
+	}
+
+	if (ch == 'e') {
+		signal(SIGINT, NULL);
+		q->halt = 1;
+		return 0;
+	}
+
+	if (ch == 'c')
+		g_tpl_interrupt = 0;
+
+	return 1;
+}
+
+// The limits set by call_with_inference_limit/3, call_with_time_limit/2
+// and call_with_memory_limit/2 are held as absolute values, the tightest
+// of each kind in force. The clock is only read when polling. A limit
+// that is hit is lifted and its ball thrown from the next goal, see
+// limit_goal().
+
+static uint64_t *check_limits(query *q, unsigned poll)
+{
+	uint64_t *limit;
+
+	if (q->inf_limit && (q->tot_goals >= q->inf_limit))
+		limit = &q->inf_limit;
+	else if (q->mem_limit && (mem_used(q) > q->mem_limit))
+		limit = &q->mem_limit;
+	else if (q->time_limit && !(poll & INTERRUPT_POLL) && (get_time_in_usec() >= q->time_limit))
+		limit = &q->time_limit;
+	else
+		return NULL;
+
+	*limit = 0;
+	q->limited = q->inf_limit || q->mem_limit || q->time_limit;
+	return limit;
+}
+
+// Goals are resolved when a clause is cross-referenced: a builtin cell
+// carries its function and a call of a user predicate its rule (see
+// parser_xref()), so each step here is a single test of FLAG_BUILTIN.
+// Tracing and the rarer goal kinds are kept off the common path.
+
 void run_query(query *q)
 {
-	q->yielded = 0;
+	unsigned poll = 0;
+	q->yielded = q->preempted = 0;
+	q->yield_at = q->is_task && q->time_slice ? q->tot_goals + q->time_slice : 0;
 
 	while (!q->error) {
-		if (g_tpl_interrupt) {
-			printf("\nAction (a)bort, (c)ontinue, (e)xit: ");
-			fflush(stdout);
-			int ch = history_getch();
-			printf("%c\n", ch);
-
-			if (ch == 'c') {
-				g_tpl_interrupt = 0;
+		if (q->ball) {
+			if (!raise_error(q))
 				continue;
-			}
 
-			if (ch == 'a') {
-				g_tpl_interrupt = 0;
-				q->abort = 1;
-				break;
-			}
+			follow_me(q);
+		}
 
-			if (ch == 'e') {
-				signal(SIGINT, NULL);
-				q->halt = 1;
+		if (!(++poll & INTERRUPT_POLL) && g_tpl_interrupt) {
+			if (!check_interrupt(q))
 				break;
-			}
+
+			continue;
+		}
+
+		// A task that has used up its slice gives way to the others
+		// between goals, with nothing to undo: on resume it carries
+		// on from curr_cell as if it had never stopped.
+
+		if (q->yield_at && (q->tot_goals >= q->yield_at) && !q->retry) {
+			q->yielded = q->preempted = 1;
+			break;
+		}
+
+		if (q->limited && !q->retry) {
+			uint64_t *limit = check_limits(q, poll);
+
+			if (limit)
+				q->st.curr_cell = limit_goal(q, limit);
 		}
 
 		if (q->retry) {
@@ -950,39 +1441,30 @@ void run_query(query *q)
 				break;
 		}
 
-		if (is_variable(q->st.curr_cell)) {
-			if (!call_me(q, q->st.curr_cell))
+		cell *c = q->st.curr_cell;
+
+		if (is_variable(c)) {
+			if (!call_me(q, c))
 				continue;
+
+			c = q->st.curr_cell;
 		}
 
 		q->tot_goals++;
 		q->step++;
-		Trace(q, q->st.curr_cell, q->retry?REDO:q->resume?NEXT:CALL);
 
-		if (!(q->st.curr_cell->flags&FLAG_BUILTIN)) {
-			if (!is_literal(q->st.curr_cell)) {
-				throw_error(q, q->st.curr_cell, "type_error", "callable");
-				break;
-			}
+		if (q->trace)
+			trace_call(q, c, q->retry?REDO:q->resume?NEXT:CALL);
 
-			if (is_list(q->st.curr_cell)) {
-				consultall(q->m->p, q->st.curr_cell);
-				follow_me(q);
-			} else if (!match(q)) {
-				q->retry = 1;
-				q->tot_retries++;
-				Trace(q, q->st.curr_cell, FAIL);
-				continue;
-			}
-		} else {
-			if (!q->st.curr_cell->fn) {
+		if (c->flags&FLAG_BUILTIN) {
+			if (!c->fn) {
 				q->tot_goals--;
 				q->step--;
 				q->st.curr_cell++;					// NO-OP
 				continue;
 			}
 
-			if (!q->st.curr_cell->fn(q)) {
+			if (!c->fn(q)) {
 				q->retry = 1;
 
 				if (q->yielded)
@@ -993,13 +1475,31 @@ void run_query(query *q)
 				continue;
 			}
 
+			if (q->ball)
+				continue;
+
 			Trace(q, q->st.curr_cell, EXIT);
 
 			if (q->error)
 				break;
 
+			if (q->nbr_wakes)
+				call_attrs(q, 1);
+
 			follow_me(q);
-		}
+		} else if (!is_literal(c)) {
+			throw_error(q, c, "type_error", "callable");
+			continue;
+		} else if (is_list(c)) {
+			consultall(q->m->p, c);
+			follow_me(q);
+		} else if (!match(q)) {
+			q->retry = 1;
+			q->tot_retries++;
+			Trace(q, q->st.curr_cell, FAIL);
+			continue;
+		} else if (q->nbr_wakes)
+			call_attrs(q, 0);
 
 		q->resume = 0;
 		q->retry = 0;
@@ -1014,6 +1514,9 @@ void run_query(query *q)
 			follow_me(q);
 		}
 	}
+
+	if (q->ball)
+		raise_error(q);
 }
 
 void query_execute(query *q, term *t)
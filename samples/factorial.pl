@@ -22,3 +22,15 @@ test2 :-
 		F1 = 120,
 		fail.
 test2 :- write('PASSED'), nl.
+
+test3 :-
+	fac(1000,F),
+	number_codes(F,Cs),
+	length(Cs,2568),
+	write('fac(1000) has 2568 digits PASSED'), nl.
+
+test4 :-
+	between(1,100,_),
+		fac(1000,_),
+		fail.
+test4 :- write('PASSED'), nl.
@@ -21,3 +21,23 @@ test2 :-
 	fib(40,F),
 	F=165580141,
 	write('fib(40)='), write(F), write(' PASSED'), nl.
+
+% Linear version, which soon runs past 64 bits...
+
+fibl(N,F) :- fibl(N,0,1,F).
+
+fibl(0,F,_,F) :- !.
+fibl(N,A,B,F) :-
+	N1 is N - 1,
+	C is A + B,
+	fibl(N1,B,C,F).
+
+test3 :-
+	fibl(100,F),
+	F=354224848179261915075,
+	write('fibl(100)='), write(F), write(' PASSED'), nl.
+
+test4 :-
+	fibl(10000,F),
+	F mod 1000000 =:= 366875,
+	write('fibl(10000) PASSED'), nl.
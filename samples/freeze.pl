@@ -0,0 +1,38 @@
+% Freeze-heavy benchmark: a chain of N variables each frozen on the
+% next, woken all at once by binding the last.
+
+chain(0, X, X) :- !.
+chain(N, X, Y) :-
+	freeze(Z, X = Z),
+	N1 is N - 1,
+	chain(N1, Z, Y).
+
+run(0) :- !.
+run(N) :-
+	chain(1000, X, Y),
+	Y = done,
+	X == done,
+	N1 is N - 1,
+	run(N1).
+
+% Many frozen goals on one variable, woken by a single binding.
+
+many(0, _) :- !.
+many(N, X) :-
+	freeze(X, true),
+	N1 is N - 1,
+	many(N1, X).
+
+loop(0) :- !.
+loop(N) :-
+	many(10, X), X = 1,
+	N1 is N - 1,
+	loop(N1).
+
+test :-
+	run(100),
+	write('run(100) PASSED'), nl.
+
+test2 :-
+	loop(100000),
+	write('loop(100000) PASSED'), nl.
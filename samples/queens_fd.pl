@@ -0,0 +1,36 @@
+:- use_module(library(clpfd)).
+
+% N-queens with the finite domain solver, one variable per column
+% holding the row of its queen.
+
+queens(N, Qs) :-
+	length(Qs, N),
+	Qs ins 1..N,
+	safe(Qs),
+	labeling([ff], Qs).
+
+safe([]).
+safe([Q|Qs]) :- no_attack(Q, Qs, 1), safe(Qs).
+
+no_attack(_, [], _).
+no_attack(Q, [Q1|Qs], D) :-
+	Q #\= Q1,
+	Q #\= Q1 + D,
+	Q #\= Q1 - D,
+	D1 is D + 1,
+	no_attack(Q, Qs, D1).
+
+all(N, C) :- findall(Qs, queens(N, Qs), L), length(L, C).
+
+test :-
+	queens(8, Qs),
+	write(Qs), write(' PASSED'), nl.
+
+test2 :-
+	all(8, C),
+	C =:= 92,
+	write('all(8)=92 PASSED'), nl.
+
+test3 :-
+	queens(40, _),
+	write('queens(40) PASSED'), nl.
@@ -0,0 +1,48 @@
+% Rational arithmetic, with results that stay within 64 bits...
+
+% Sum of 1/(k*(k+1)) for k = 1..N telescopes to N/(N+1).
+
+tele(N,S) :- tele(1,N,0,S).
+
+tele(K,N,S,S) :- K > N, !.
+tele(K,N,S0,S) :-
+	S1 is S0 + 1 rdiv (K*(K+1)),
+	K1 is K + 1,
+	tele(K1,N,S1,S).
+
+% The harmonic number H(N). The denominator is lcm(1..N), which
+% passes 64 bits after N = 42.
+
+harmonic(N,H) :- harmonic(1,N,0,H).
+
+harmonic(K,N,H,H) :- K > N, !.
+harmonic(K,N,H0,H) :-
+	H1 is H0 + 1 rdiv K,
+	K1 is K + 1,
+	harmonic(K1,N,H1,H).
+
+test :-
+	tele(100000,S),
+	S =:= 100000 rdiv 100001,
+	write('tele(100000)='), write(S), write(' PASSED'), nl.
+
+loop(0) :- !.
+loop(N) :-
+	harmonic(40,_),
+	N1 is N - 1,
+	loop(N1).
+
+test2 :-
+	loop(10000),
+	harmonic(40,H),
+	H =:= 2078178381193813 rdiv 485721041551200,
+	write('harmonic(40)='), write(H), write(' PASSED'), nl.
+
+% H(40) + 1/41 + 1/42 still fits, but the next term does not.
+
+test3 :-
+	harmonic(40,H40),
+	H42 is H40 + 1 rdiv 41 + 1 rdiv 42,
+	catch(_ is H42 + 1 rdiv 43,error(E,_),true),
+	E = domain_error(integer_overflow,_),
+	write('harmonic(43) overflow PASSED'), nl.
@@ -0,0 +1,31 @@
+% Round trips of a term through the binary and the text encodings.
+
+data(N, t(V, L, V)) :-
+	findall(item(I, "name", [red,green,blue], 1.5, -I), between(1, N, I), L).
+
+binary(T, N) :-
+	between(1, N, _),
+	term_to_binary(T, B),
+	binary_to_term(B, _),
+	fail.
+binary(_, _).
+
+text(T, N) :-
+	between(1, N, _),
+	write_term_to_chars(S, T, [quoted(true)]),
+	read_term_from_chars(S, _, []),
+	fail.
+text(_, _).
+
+test :-
+	data(1000, T),
+	term_to_binary(T, B), binary_to_term(B, T2),
+	T2 = t(V, _, W), var(V), V == W, T2 = T,
+	write('binary round trip PASSED'), nl.
+
+% 100 round trips of a term of 1000 items each way...
+
+bench :-
+	data(1000, T),
+	time(binary(T, 100)),
+	time(text(T, 100)).
@@ -0,0 +1,38 @@
+:- use_module(library(clpfd)).
+
+% Sudoku with the finite domain solver.
+
+sudoku(Rows) :-
+	length(Rows, 9),
+	maplist(same_length(Rows), Rows),
+	flatten(Rows, Vs), Vs ins 1..9,
+	maplist(all_distinct, Rows),
+	transpose(Rows, Columns),
+	maplist(all_distinct, Columns),
+	Rows = [As,Bs,Cs,Ds,Es,Fs,Gs,Hs,Is],
+	blocks(As, Bs, Cs), blocks(Ds, Es, Fs), blocks(Gs, Hs, Is),
+	labeling([ff], Vs).
+
+blocks([], [], []).
+blocks([N1,N2,N3|Ns1], [N4,N5,N6|Ns2], [N7,N8,N9|Ns3]) :-
+	all_distinct([N1,N2,N3,N4,N5,N6,N7,N8,N9]),
+	blocks(Ns1, Ns2, Ns3).
+
+same_length([], []).
+same_length([_|T1], [_|T2]) :- same_length(T1, T2).
+
+problem(1, [[_,_,_,_,_,_,_,_,_],
+            [_,_,_,_,_,3,_,8,5],
+            [_,_,1,_,2,_,_,_,_],
+            [_,_,_,5,_,7,_,_,_],
+            [_,_,4,_,_,_,1,_,_],
+            [_,9,_,_,_,_,_,_,_],
+            [5,_,_,_,_,_,_,7,3],
+            [_,_,2,_,1,_,_,_,_],
+            [_,_,_,_,4,_,_,_,9]]).
+
+test :-
+	problem(1, Rows),
+	sudoku(Rows),
+	maplist(writeln, Rows),
+	write('PASSED'), nl.
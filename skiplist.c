@@ -21,10 +21,15 @@ struct slnode_ {
 	slnode_t *forward[];
 };
 
+// An iterator remembers the last value it returned, so that it can
+// find its place again if the list was changed under it.
+
 struct sliter_ {
 	skiplist *l;
 	slnode_t *p;
 	const void *key;
+	void *last;
+	unsigned long mods;
 	int idx, dynamic, busy;
 };
 
@@ -33,6 +38,7 @@ struct skiplist_ {
 	int (*compkey)(const void*, const void*);
 	sliter iter[MAX_ITERS];
 	size_t count;
+	unsigned long mods;
 	int level;
 	unsigned seed;
 };
@@ -164,7 +170,7 @@ int sl_set(skiplist *l, const void *key, const void *val)
 	}
 
 	if (p != l->header) {
-		int imid = binary_search2(l, p->bkt, key, 0, p->nbr - 1);
+		int imid = binary_search1(l, p->bkt, key, 0, p->nbr - 1);
 
 		if (p->nbr < BUCKET_SIZE) {
 			int j;
@@ -176,22 +182,17 @@ int sl_set(skiplist *l, const void *key, const void *val)
 			p->bkt[j].val = (void*)val;
 			p->nbr++;
 			l->count++;
+			l->mods++;
 			return 1;
 		}
 
-		// Don't drop this unless you are 100% sure:
-
-#if 0
-		while ((imid < p->nbr) && (l->compkey(p->bkt[imid].key, key) == 0))
-			imid++;
+		// The node is full: the entries after the new key move with it
+		// to a new node, or the key would land after larger ones...
 
-		if (imid <= BUCKET_SIZE) {
-			for (int j = imid; j < p->nbr; j++)
-				stash.bkt[stash.nbr++] = p->bkt[j];
+		for (int j = imid; j < p->nbr; j++)
+			stash.bkt[stash.nbr++] = p->bkt[j];
 
-			p->nbr = imid;
-		}
-#endif
+		p->nbr = imid;
 	}
 
 	k = random_level(&l->seed);
@@ -207,6 +208,7 @@ int sl_set(skiplist *l, const void *key, const void *val)
 	q->bkt[0].val = (void*)val;
 	q->nbr = 1;
 	l->count++;
+	l->mods++;
 
 	if (stash.nbr) {
 		for (int i = 0; i < stash.nbr; i++, q->nbr++)
@@ -251,22 +253,20 @@ int sl_app(skiplist *l, const void *key, const void *val)
 			p->bkt[j].val = (void*)val;
 			p->nbr++;
 			l->count++;
+			l->mods++;
 			return 1;
 		}
 
-		// Don't drop this unless you are 100% sure:
+		// The node is full: the entries after the new key move with it
+		// to a new node, or the key would land after larger ones...
 
-#if 0
 		while ((imid < p->nbr) && (l->compkey(p->bkt[imid].key, key) == 0))
 			imid++;
 
-		if (imid <= BUCKET_SIZE) {
-			for (int j = imid; j < p->nbr; j++)
-				stash.bkt[stash.nbr++] = p->bkt[j];
+		for (int j = imid; j < p->nbr; j++)
+			stash.bkt[stash.nbr++] = p->bkt[j];
 
-			p->nbr = imid;
-		}
-#endif
+		p->nbr = imid;
 	}
 
 	k = random_level(&l->seed);
@@ -282,6 +282,7 @@ int sl_app(skiplist *l, const void *key, const void *val)
 	q->bkt[0].val = (void*)val;
 	q->nbr = 1;
 	l->count++;
+	l->mods++;
 
 	if (stash.nbr) {
 		for (int i = 0; i < stash.nbr; i++, q->nbr++)
@@ -349,6 +350,7 @@ int sl_del(skiplist *l, const void *key)
 
 	q->nbr--;
 	l->count--;
+	l->mods++;
 
 	if (q->nbr)
 		return 1;
@@ -429,7 +431,7 @@ void sl_find(const skiplist *l, const void *key, int (*f)(void*, const void*, co
 	}
 }
 
-sliter *sl_findkey(skiplist *l, const void *key)
+static slnode_t *find_first(const skiplist *l, const void *key, int *idx)
 {
 	slnode_t *p, *q = 0;
 	p = l->header;
@@ -444,12 +446,24 @@ sliter *sl_findkey(skiplist *l, const void *key)
 
 	int imid = binary_search1(l, q->bkt, key, 0, q->nbr - 1);
 
-	if (imid < 0)
+	if ((imid < 0) || (imid >= q->nbr))
 		return NULL;
 
 	if (l->compkey(q->bkt[imid].key, key) != 0)
 		return NULL;
 
+	*idx = imid;
+	return q;
+}
+
+sliter *sl_findkey(skiplist *l, const void *key)
+{
+	int imid;
+	slnode_t *q = find_first(l, key, &imid);
+
+	if (!q)
+		return NULL;
+
 	sliter *iter;
 	int i = 0;
 
@@ -474,11 +488,46 @@ sliter *sl_findkey(skiplist *l, const void *key)
 	iter->l = (skiplist*)l;
 	iter->p = q;
 	iter->idx = imid;
+	iter->last = NULL;
+	iter->mods = l->mods;
 	return iter;
 }
 
+// Entries may have been added since the last step, and shifted or
+// split off into another node: step past the last value again.
+
+static void reseek(sliter *iter)
+{
+	iter->mods = iter->l->mods;
+
+	if (!iter->p || !iter->last)
+		return;
+
+	slnode_t *p = find_first(iter->l, iter->key, &iter->idx);
+
+	for (; p; p = p->forward[0], iter->idx = 0) {
+		for (; iter->idx < p->nbr; iter->idx++) {
+			if (iter->l->compkey(p->bkt[iter->idx].key, iter->key) != 0) {
+				iter->p = NULL;
+				return;
+			}
+
+			if (p->bkt[iter->idx].val == iter->last) {
+				iter->p = p;
+				iter->idx++;
+				return;
+			}
+		}
+	}
+
+	iter->p = NULL;
+}
+
 int sl_nextkey(sliter *iter, void **val)
 {
+	if (iter->mods != iter->l->mods)
+		reseek(iter);
+
 	if (!iter->p) {
 		sl_done(iter);
 		return 0;
@@ -490,7 +539,7 @@ int sl_nextkey(sliter *iter, void **val)
 			return 0;
 		}
 
-		*val = iter->p->bkt[iter->idx++].val;
+		*val = iter->last = iter->p->bkt[iter->idx++].val;
 		return 1;
 	}
 
@@ -504,6 +553,25 @@ int sl_nextkey(sliter *iter, void **val)
 	return 0;
 }
 
+int sl_is_nextkey(sliter *iter)
+{
+	if (iter->mods != iter->l->mods)
+		reseek(iter);
+
+	if (!iter->p)
+		return 0;
+
+	if (iter->idx < iter->p->nbr)
+		return !iter->l->compkey(iter->p->bkt[iter->idx].key, iter->key);
+
+	slnode_t *p = iter->p->forward[0];
+
+	if (!p || !p->nbr)
+		return 0;
+
+	return !iter->l->compkey(p->bkt[0].key, iter->key);
+}
+
 void sl_done(sliter *iter)
 {
 	if (!iter)
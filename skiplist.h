@@ -14,6 +14,7 @@ void sl_iterate(const skiplist *l, int (*callback)(void *p, const void *k, const
 void sl_find(const skiplist *l, const void *k, int (*f)(void *p, const void *k, const void *v), void *p);
 sliter *sl_findkey(skiplist *l, const void *k);
 int sl_nextkey(sliter *i, void **v);
+int sl_is_nextkey(sliter *i);
 void sl_done(sliter *i);
 size_t sl_count(const skiplist *l);
 void sl_dump(const skiplist *l, const char *(*f)(void *p, const void* k), void *p);
@@ -0,0 +1,24 @@
+:- initialization(main).
+
+main :-
+	nth0(1, [a,b,c], E0), writeln(E0),
+	nth1(1, [a,b,c], E1), writeln(E1),
+	(nth1(4, [a,b,c], _) -> writeln(yes) ; writeln(no)),
+	findall(I-X, nth0(I, [a,b,c], X), L0), writeln(L0),
+	findall(I, nth1(I, [a,b,a], a), L1), writeln(L1),
+	last([1,2,3], La), writeln(La),
+	reverse([1,f(Y),c], R), Y = 9, writeln(R),
+	reverse(R1, [1,2]), writeln(R1),
+	reverse([3|R2], [1,2,3]), writeln(R2),
+	findall(R3, reverse(R3, [1,2]), R3s), writeln(R3s),
+	memberchk(f(Z), [g(1),f(2),f(3)]), writeln(Z),
+	memberchk(x, Open), Open = [H|_], writeln(H),
+	sum_list([1,2,3.5], S), writeln(S),
+	max_list([3,1,4,1,5], Max), writeln(Max),
+	min_list([3,1,4,1.0,5], Min), writeln(Min),
+	numlist(1, 5, NL), writeln(NL),
+	subtract([1,2,3,4,5,6,7,8,9,10,11], [2,4,6,8,10,12,14,16,18,20], Sub), writeln(Sub),
+	intersection([1,2,3], [3,f(_),2], Int), writeln(Int),
+	union([1,2,3], [4,2,5], U), writeln(U),
+	list_to_set([1,2,1,f(1),3,f(1),2,1.0], Set), writeln(Set),
+	halt.
@@ -0,0 +1,20 @@
+:- initialization(main).
+
+p(3). p(1). p(4). p(1). p(5). p(f(x)). p(a). p(f(x)).
+n(3). n(1). n(4). n(1.5).
+
+main :-
+	aggregate_all(count, p(_), C), writeln(C),
+	aggregate_all(count, fail, C0), writeln(C0),
+	aggregate_all(sum(X), n(X), S), writeln(S),
+	aggregate_all(sum(X*2), n(X), S2), writeln(S2),
+	aggregate_all(max(X), n(X), Max), writeln(Max),
+	aggregate_all(min(X), n(X), Min), writeln(Min),
+	(aggregate_all(max(X), fail, _) -> writeln(yes) ; writeln(no)),
+	aggregate_all(bag(X), p(X), B), writeln(B),
+	aggregate_all(set(X), p(X), St), writeln(St),
+	aggregate_all(set(X-Y), (member(X,[b,a,b]), member(Y,[2,1])), St2), writeln(St2),
+	aggregate_all(set(X), fail, St0), writeln(St0),
+	aggregate_all(count, between(1,100000,_), Big), writeln(Big),
+	findall(N, (member(Z,[1,3]), aggregate_all(count, p(Z), N)), L), writeln(L),
+	halt.
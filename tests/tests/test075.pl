@@ -0,0 +1,14 @@
+:- initialization(main).
+
+wrap(_, T0, g(T0)).
+
+main :-
+	X = f(a+b*c, -(1), [1,2|t], "abc", 'Hello W', {a,b}, (a:-b,c;d->e), [(a,b)], \+ x, f((a,b)), 'a\nb'),
+	writeq(X), nl,
+	write_canonical(X), nl,
+	format("~w|~q~n", [g(1,[x]), 'A b']),
+	findall(ab, between(1, 100000, _), L),
+	term_to_atom(L, A), atom_length(A, Len), writeln(Len),
+	numlist(1, 500, Ns), foldl(wrap, Ns, z, T),
+	term_to_atom(T, A2), atom_length(A2, Len2), writeln(Len2),
+	halt.
@@ -0,0 +1,15 @@
+:- initialization(main).
+
+main :-
+	forall(member(X, [0.1, 0.3, 2.5, 100.0, -0.0, 1.0e15, 123456789012345.0, 1.0e100, 1.0e-5, 0.000123, 5.0e-324, 1.7976931348623157e308]),
+		writeln(X)),
+	forall(member(X, [1.0e23, 5.0e22, 9.007199254740993e15, 2.2250738585072014e-308, 6016.951217939863, 5.299064834871378e16, 7.036870839547745e177]),
+		writeln(X)),
+	X1 is 0.1+0.2, writeln(X1),
+	X2 is 1/3.0, writeln(X2),
+	forall(member(I, [0, 7, -7, 99, 100, -100, 123456789, -9223372036854775807]), writeln(I)),
+	forall(member(A, ['0.1', '2.5e-3', '1.0E10', '3.141592653589793', '12345678901234567890.0']),
+		(read_term_from_atom(A, N, []), writeln(N))),
+	findall(ok, (between(1, 1000, K), F is K / 7.0, term_to_atom(F, T), read_term_from_atom(T, F2, []), F2 =:= F), L),
+	length(L, Len), writeln(Len),
+	halt.
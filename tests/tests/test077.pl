@@ -0,0 +1,18 @@
+:- initialization(main).
+
+:- op(700, xfx, ===>).
+:- op(200, xfy, ::).
+:- op(900, fy, ~).
+
+mk_op(N) :- number_codes(N, Cs), atom_codes(Name, [0'o,0'p,0'_|Cs]), op(700, xfx, Name).
+
+main :-
+	X = (a ===> b :: c), writeq(X), nl,
+	Y = (~ ~ a), writeq(Y), nl,
+	Z = (- a - b), writeq(Z), nl,
+	forall(between(1, 300, N), mk_op(N)),
+	read_term_from_atom('x op_250 y', T, []), writeq(T), nl,
+	T =.. L, writeq(L), nl,
+	op(0, xfx, op_250),
+	writeq(op_250(x, y)), nl,
+	halt.
@@ -0,0 +1,48 @@
+:- initialization(main).
+
+:- dynamic(big/1).
+
+fac(0, 1) :- !.
+fac(N, F) :- N1 is N - 1, fac(N1, F1), F is N * F1.
+
+main :-
+	X is 9223372036854775807 + 1, writeq(X), nl,
+	Y is X - 1, writeq(Y), nl,
+	(integer(Y), integer(X) -> writeq(integers) ; true), nl,
+	Z is -(-9223372036854775808), writeq(Z), nl,
+	fac(25, F), writeq(F), nl,
+	A = 123456789012345678901234567890,
+	B is A * A, writeq(B), nl,
+	C is B // A, (C == A -> writeq(same) ; true), nl,
+	D is 2 ^ 100, writeq(D), nl,
+	assertz(big(D)), big(BB), writeq(BB), nl,
+	E is D >> 98, writeq(E), nl,
+	G is 1 << 70, writeq(G), nl,
+	H is -(2 ^ 64) mod 7, writeq(H), nl,
+	plus(9223372036854775807, 1, P1), plus(P2, 1, P1), plus(-9223372036854775808, P3, P1), writeq([P1, P2, P3]), nl,
+	(plus(P1, P1, 18446744073709551616) -> writeq(plus) ; true), nl,
+	M1 is 7 mod -3, M2 is (2 ^ 64) mod -3, M3 is -(2 ^ 64) rem 3, M4 is -7 rem 3, writeq([M1, M2, M3, M4]), nl,
+	I is 0xFFFFFFFFFFFFFFFFFF, writeq(I), nl,
+	J is float(D), writeq(J), nl,
+	K is truncate(1.0e20), writeq(K), nl,
+	(D > 1.0e30, D < 1.0e31, D =\= D + 1 -> writeq(cmp) ; true), nl,
+	ND is -D, msort([D, 1, ND, 2.5, a], L), writeq(L), nl,
+	number_codes(D, Cs), number_codes(D2, Cs), (D2 == D -> writeq(codes) ; true), nl,
+	findall(P, (between(62, 65, N), P is 2 ^ N), Ps), writeq(Ps), nl,
+	sum_list(Ps, S), writeq(S), nl,
+	aggregate_all(max(Q), member(Q, Ps), M), writeq(M), nl,
+	copy_term(f(D, _), f(CD, _)), writeq(CD), nl,
+	read_term_from_atom('g(-99999999999999999999999)', RT, []), writeq(RT), nl,
+	V is 99999999999999999999 - 99999999999999999998, writeq(V), nl,
+	R1 is 9223372036854775807 rdiv 3 * (3 rdiv 9223372036854775807), writeq(R1), nl,
+	(9223372036854775806 rdiv 9223372036854775807 > 9223372036854775805 rdiv 9223372036854775806 -> writeq(ratcmp) ; true), nl,
+	catch(_ is 9223372036854775807 rdiv 2 + 9223372036854775807 rdiv 3, error(RE, _), true), writeq(RE), nl,
+	R2 is -9223372036854775808, writeq(R2), nl,
+	R3 is (2 ^ 70) rdiv (2 ^ 69), R4 is (2 ^ 70) rdiv 2, R5 is -(2 ^ 70) rdiv (2 ^ 69), writeq([R3, R4, R5]), nl,
+	catch(_ is 7 rdiv 2 ^ 70, E7, true), (E7 = error(type_error(_, _)) -> true ; writeq(rdiv_overflow)), nl,
+	format("~0d ~D ~I~n", [D, ND, D]),
+	forall(member(Ex, [sqrt(2^70), sin(2^70), log(2^70), exp(2^70), atan2(2^70, 1), copysign(2^70, -1),
+			copysign(2.0, -(2^70)), truncate(2^70), round(-(2^70)), floor(2^70), ceiling(2^70),
+			float_integer_part(2^70), msb(2^70), msb(1000), msb(0)]),
+		(catch(Ev is Ex, Err, Ev = Err), writeq(Ex = Ev), nl)),
+	halt.
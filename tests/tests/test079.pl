@@ -0,0 +1,29 @@
+:- initialization(main).
+
+fill(I, N, _) :- I > N, !.
+fill(I, N, A) :- V is I * I, nb_setarg(I, A, V), I1 is I + 1, fill(I1, N, A).
+
+main :-
+	current_prolog_flag(max_arity, Max), writeq(Max), nl,
+	functor(A, array, 2000), fill(1, 2000, A),
+	arg(1500, A, X), writeq(X), nl,
+	( setarg(1500, A, foo), arg(1500, A, Y), writeq(Y), nl, fail ; true ),
+	arg(1500, A, Z), writeq(Z), nl,
+	T = f(a, b, c),
+	( setarg(2, T, x), writeq(T), nl, fail ; writeq(T), nl ),
+	( nb_setarg(2, T, x), fail ; writeq(T), nl ),
+	S = state(0),
+	( between(1, 10, I), arg(1, S, C0), C is C0 + I, nb_setarg(1, S, C), fail ; arg(1, S, Sum) ),
+	writeq(Sum), nl,
+	G = g(a, k(b), c), setarg(2, G, h(P, Q)), P = 1, setarg(1, G, Q), Q = 2, writeq(G), nl,
+	length(L, 3000), U =.. [u|L], functor(U, _, Ar), writeq(Ar), nl,
+	term_variables(U, Vs), length(Vs, Len), writeq(Len), nl,
+	T2 = f(a, b, c), S2 = T2, setarg(2, T2, x), writeq(S2-T2), nl,
+	T3 = f(a, b, c), S3 = T3, nb_setarg(2, T3, g(y)), writeq(S3-T3), nl,
+	T4 = f(a, b, c), S4 = T4,
+	( setarg(3, T4, g(V4)), V4 = 1, setarg(1, S4, k(V4)), writeq(T4), nl, fail ; writeq(S4), nl ),
+	call((functor(T5, f, 1000))), functor(T5, N5, A5), writeq(N5/A5), nl,
+	call((length(L6, 2000))), length(L6, N6), writeq(N6), nl,
+	functor(T7, f, 600), catch(assertz(big(T7)), E7, true), writeq(E7), nl,
+	( catch(big(_), _, fail) -> true ; writeq(not_asserted), nl ),
+	halt.
@@ -0,0 +1,24 @@
+:- initialization(main).
+
+mk(0, z) :- !.
+mk(N, s(T)) :- N1 is N-1, mk(N1, T).
+
+depth(z, 0) :- !.
+depth(s(T), N) :- depth(T, N0), N is N0 + 1.
+
+yn(G) :- ( G -> writeq(yes) ; writeq(no) ), nl.
+
+main :-
+	mk(5000, A), mk(5000, B), mk(4999, C),
+	yn(A = B), yn(A = C), yn(A == B),
+	compare(O1, A, B), writeq(O1), nl,
+	compare(O2, A, C), writeq(O2), nl,
+	copy_term(f(A, V), f(D, W)), yn(D == A), yn(V == W),
+	depth(D, N), writeq(N), nl,
+	format(atom(Atom), "~w", [A]), atom_length(Atom, Len), writeq(Len), nl,
+	numlist(1, 200000, L), findall(L, true, [M]), length(M, ML), writeq(ML), nl,
+	X = f(X), Y = f(Y), yn(X = Y), yn(X == Y),
+	P = g(P, a), Q = g(Q, b), yn(P = Q),
+	yn(acyclic_term(A)), yn(cyclic_term(X)), yn(ground(X)),
+	Z = h(Z, _), term_variables(Z, Vs), length(Vs, VN), writeq(VN), nl,
+	copy_term(Z, Z2), Z2 = h(h(_, _), _), writeq(copied), nl.
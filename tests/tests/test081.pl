@@ -0,0 +1,31 @@
+:- initialization(main).
+
+p(a, 1, f(X, g(Y)), X, Y).
+p(b, 2.5, [H|T], H, T).
+p("abc", 3, f(_, _), x, y).
+p(12345678901234567890123, 4, k, k, k).
+p(c, 1 rdiv 3, z, z, z).
+
+q(X, X).
+r(f(X, X), X).
+s(f(g(h(A)), B), A, B).
+
+t(X) :- p(X, _, _, _, _).
+
+main :-
+	( p(a, 1, f(1, g(2)), A, B), writeq(A-B), nl ; true ),
+	( p(a, N, S, u, v), writeq(N-S), nl ; true ),
+	( p(b, F, [1,2,3], H, T), writeq(F-H-T), nl ; true ),
+	( p(b, _, "xy", H2, T2), writeq(H2-T2), nl ; true ),
+	( p("abc", N3, _, _, _), writeq(N3), nl ; true ),
+	( p(12345678901234567890123, N4, _, _, _), writeq(N4), nl ; true ),
+	( p(c, R, _, _, _), writeq(R), nl ; true ),
+	findall(K, p(K, _, _, _, _), Ks), writeq(Ks), nl,
+	findall(K2, t(K2), Ks2), writeq(Ks2), nl,
+	( q(f(Z), f(1)), writeq(Z), nl ; true ),
+	( q(1, 2) -> writeq(yes) ; writeq(no) ), nl,
+	( r(f(1, W), W2), writeq(W-W2), nl ; true ),
+	( r(f(1, 2), _) -> writeq(yes) ; writeq(no) ), nl,
+	( s(V, 1, 2), writeq(V), nl ; true ),
+	( s(f(g(h(A5)), b), 9, B5), writeq(A5-B5), nl ; true ),
+	( s(f(g(k(_)), b), _, _) -> writeq(yes) ; writeq(no) ), nl.
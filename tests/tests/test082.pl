@@ -0,0 +1,60 @@
+:- initialization(main).
+:- dynamic(kv/2).
+:- dynamic(r/1).
+:- dynamic(kw/2).
+:- dynamic(g/2).
+
+load(N) :- between(1, N, I), K is I mod 50, assertz(kv(K, I)), fail.
+load(_).
+
+load2(N) :- between(1, N, I), K is I mod 50, J is 2000 - I, assertz(kw(K, J)), fail.
+load2(_).
+
+load3(N) :- between(1, N, I), K is I mod 10, assertz(g(I, K)), fail.
+load3(_).
+
+main :-
+	load(1000),
+	findall(V, kv(7, V), L1), length(L1, N1), L1 = [F1|_], writeq(N1-F1), nl,
+	findall(V, clause(kv(7, V), true), L2), ( L1 == L2 -> writeq(same) ; writeq(diff) ), nl,
+	assertz(kv(7, last)), asserta(kv(7, first)),
+	findall(V, kv(7, V), L3), length(L3, N3), L3 = [F3|_], last(L3, E3), writeq(N3-F3-E3), nl,
+	retract(kv(7, first)), retract(kv(7, 57)),
+	findall(V, kv(7, V), L4), length(L4, N4), L4 = [F4|_], writeq(N4-F4), nl,
+	retractall(kv(8, _)),
+	( kv(8, _) -> writeq(yes) ; writeq(no) ), nl,
+	findall(K, kv(K, _), Ks), length(Ks, NK), writeq(NK), nl,
+	findall(V, (retract(kv(9, V)), V > 500), L5), length(L5, N5), writeq(N5), nl,
+	( kv(9, _) -> writeq(yes) ; writeq(no) ), nl,
+	assertz((r(X) :- X > 1)), assertz((r(X) :- X < 0)), assertz(r(5)),
+	findall(B, clause(r(_), B), Bs), ( Bs = [_ > 1, _ < 0, true] -> writeq(ok) ; writeq(Bs) ), nl,
+	retract((r(_) :- _ < 0)),
+	findall(B, clause(r(_), B), Bs2), ( Bs2 = [_ > 1, true] -> writeq(ok) ; writeq(Bs2) ), nl,
+	retractall(kv(_, _)),
+	( kv(_, _) -> writeq(yes) ; writeq(no) ), nl,
+	load2(1000),
+	findall(V, kw(7, V), L6), L6 = [F6|_], last(L6, E6), writeq(F6-E6), nl,
+	assertz(kw(_, any)), asserta(kw(7, top)),
+	findall(V, kw(7, V), L7), length(L7, N7), L7 = [F7|_], last(L7, E7), writeq(N7-F7-E7), nl,
+	load3(1000),
+	findall(I, g(I, 3), L8), length(L8, N8), L8 = [F8|_], last(L8, E8), writeq(N8-F8-E8), nl,
+	assertz(g(z, _)),
+	findall(I, g(I, 3), L9), length(L9, N9), last(L9, E9), writeq(N9-E9), nl,
+	gen(lift(obj1), lift(G10), P10), writeq(G10-P10), nl.
+
+% A body mismatch backtracks inside clause/2, after copy_term/2 has
+% given the frame overflow variables.
+
+lift(Y) :- light(Y), part(Y, handle).
+light(A) :- small(A).
+small(obj1).
+part(obj1, handle).
+
+gen(A, GenA, GenA) :- clause(A, true).
+gen((A, B), (GenA, GenB), (PA, PB)) :- !,
+	gen(A, GenA, PA), gen(B, GenB, PB).
+gen(A, GenA, (GenA :- P)) :-
+	clause(GenA, GenB),
+	copy_term(GenA-GenB, A-B),
+	B \= true,
+	gen(B, GenB, P).
@@ -0,0 +1,25 @@
+:- initialization(main).
+:- dynamic(p/1).
+:- dynamic(q/1).
+:- dynamic(kv/2).
+
+p(1). p(2). p(3).
+q(aa). q(bb).
+
+load(N) :- between(1, N, I), K is I mod 10, assertz(kv(K, I)), fail.
+load(_).
+
+main :-
+	( p(X), Y is X + 10, assertz(p(Y)), fail ; true ),
+	findall(X, p(X), L1), writeq(L1), nl,
+	findall(X, (p(X), X < 10, retract(p(2))), L2), writeq(L2), nl,
+	( retract(q(X)), assertz(q(X)), fail ; true ),
+	findall(X, q(X), L3), writeq(L3), nl,
+	load(200),
+	( kv(7, V), W is V + 1000, assertz(kv(7, W)), asserta(kv(7, W)), fail ; true ),
+	findall(V, kv(7, V), L4), length(L4, N4), writeq(N4), nl,
+	findall(V, (kv(7, V), V < 1000, retract(kv(7, 17))), L5), length(L5, N5), writeq(N5), nl,
+	( clause(kv(3, V), true), retract(kv(3, V)), assertz(kv(3, V)), fail ; true ),
+	findall(V, kv(3, V), L6), length(L6, N6), writeq(N6), nl,
+	retractall(p(_)), assertz(p(xx)),
+	findall(X, p(X), L7), writeq(L7), nl.
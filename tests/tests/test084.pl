@@ -0,0 +1,17 @@
+:- initialization(main).
+:- dynamic(f/2).
+
+load(N) :- between(1, N, I), assertz(f(I, "a string")), fail.
+load(_).
+
+main :-
+	statistics(db_memory, [R0, U0]), ( R0 >= U0 -> write(ok) ; write(R0-U0) ), nl,
+	load(5000), statistics(db_memory, [R1, U1]),
+	( R1 >= U1 -> write(ok) ; write(R1-U1) ), nl,
+	( U1 - U0 > 5000*100 -> write(ok) ; write(U1-U0) ), nl,
+	retract(f(1, _)), retract(f(5000, _)),
+	findall(X, f(X, _), L), length(L, N), write(N), nl,
+	abolish(f/2), statistics(db_memory, [R2, U2]),
+	( U2 == U0 -> write(ok) ; write(U2-U0) ), nl,
+	( R2 == R0 -> write(ok) ; write(R2-R0) ), nl,
+	load(100), findall(X, f(X, _), L2), length(L2, N2), write(N2), nl.
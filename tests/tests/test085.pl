@@ -0,0 +1,28 @@
+:- initialization(main).
+:- set_prolog_flag(share_ground, true).
+:- dynamic(f/3).
+
+load(N) :- between(1, N, I), assertz(f(I, point(1.5,2.5,red,"label"), g(I))), fail.
+load(_).
+
+main :-
+	current_prolog_flag(share_ground, F), write(F), nl,
+	statistics(db_memory, [_, U0]),
+	load(2000),
+	statistics(db_memory, [_, U1]),
+	set_prolog_flag(share_ground, false),
+	asserta(f(0, point(1.5,2.5,red,"label"), g(0))),
+	statistics(db_memory, [_, U2]),
+	( U2 - U1 > (U1 - U0) / 2000 -> write(ok) ; write(U0-U1-U2) ), nl,
+	findall(I, f(I, point(1.5,2.5,red,"label"), _), L), length(L, N), write(N), nl,
+	( f(7, P, G) -> writeq(P-G) ; write(no) ), nl,
+	( f(I2, _, g(1999)) -> write(I2) ; write(no) ), nl,
+	( f(_, point(_,_,blue,_), _) -> write(yes) ; write(no) ), nl,
+	clause(f(3, A, B), true), writeq(A-B), nl,
+	retract(f(3, point(X,Y,Z,W), _)), writeq(X/Y/Z/W), nl,
+	( f(3, _, _) -> write(yes) ; write(no) ), nl,
+	set_prolog_flag(share_ground, true),
+	assertz((h(X1) :- X1 = foo(bar, baz, [1,2,3]))),
+	h(V), writeq(V), nl,
+	listing(h/1),
+	retractall(f(_, _, _)), findall(x, f(_,_,_), L3), length(L3, N3), write(N3), nl.
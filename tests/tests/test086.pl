@@ -0,0 +1,21 @@
+:- module(dom, []).
+:- initialization(main).
+
+attr_unify_hook(D, Y) :- ( var(Y) -> true ; memberchk(Y, D) ).
+
+chain(0, X, X) :- !.
+chain(N, X, Y) :- freeze(Z, X = Z), N1 is N - 1, chain(N1, Z, Y).
+
+main :-
+	freeze(A, write(a(A))), freeze(A, write(b(A))), A = 1, nl,
+	freeze(B, true), frozen(B, G1), writeq(G1), nl,
+	freeze(C, write(c)), freeze(D, write(d)), C = D, write(shared), nl, D = 2, nl,
+	f(E, F) = f(X, Y), freeze(X, write(x)), freeze(Y, write(y)), f(E, F) = f(1, 2), nl,
+	( freeze(H, fail), H = 1 -> write(bad) ; write(ok) ), nl,
+	chain(1000, P, Q), Q = done, writeq(P), nl,
+	put_attr(V, dom, [a,b]), ( V = c -> write(bad) ; write(ok) ), nl,
+	put_attr(V, dom, [b]), V = b, write(V), nl,
+	put_attr(W, foo, 1), put_attr(W, bar, 2), get_attrs(W, L1), writeq(L1), nl,
+	del_attr(W, foo), get_attr(W, bar, Z), writeq(Z), nl,
+	( get_attr(W, foo, _) -> write(bad) ; write(ok) ), nl,
+	( put_attr(K, foo, 1), fail ; get_attrs(K, L2), writeq(L2) ), nl.
@@ -0,0 +1,20 @@
+:- use_module(library(clpfd)).
+:- initialization(main).
+
+main :-
+	X in 1..10, X #> 3, X #\= 5, X #\= 8, fd_dom(X, D1), writeq(D1), nl,
+	fd_inf(X, I), fd_sup(X, S), fd_size(X, N), writeq(I-S-N), nl,
+	Y in 1..3\/7..9, Y #>= 2, fd_dom(Y, D2), writeq(D2), nl,
+	( X = 5 -> write(bad) ; write(ok) ), nl,
+	[A,B] ins 0..5, A + B #= 9, A #< B, writeq(A-B), nl,
+	[P,Q] ins 1..3, P = Q, fd_size(P, N2), writeq(N2), nl,
+	Vs = [U,V,W], Vs ins 1..3, all_different(Vs), U #= 1, V #\= 3, writeq(Vs), nl,
+	element(E, [10,20,30], 20), writeq(E), nl,
+	Ls = [L1,L2,L3], Ls ins 1..3, all_different(Ls), L1 #< L2,
+	findall(Ls, labeling([ff], Ls), All), writeq(All), nl,
+	( R in 1..3, R #> 3 -> write(bad) ; write(ok) ), nl,
+	T in 0..3, findall(T, labeling([down], [T]), Ts), writeq(Ts), nl,
+	W1 in 1..1000, W1 #\= 500, W1 #\= 1, fd_dom(W1, D3), fd_size(W1, N3), writeq(D3-N3), nl,
+	W2 in 1..200, W2 #\= 150, W2 #\= 10, W2 #> 100, fd_dom(W2, D4), fd_size(W2, N4), writeq(D4-N4), nl,
+	W3 in 1..10\/100..200\/500..sup, W3 #< 150, W3 #\= 100, fd_dom(W3, D5), writeq(D5), nl,
+	[W4,W5] ins 1..100, W4 #\= 30, W4 #\= 70, W5 #\= 50, W4 = W5, fd_dom(W4, D6), writeq(D6), nl.
@@ -0,0 +1,23 @@
+:- initialization(main).
+
+save(F, Cs) :-
+	open(F, write, S),
+	forall(member(C, Cs), (writeq(S, C), write(S, '.'), nl(S))),
+	close(S).
+
+main :-
+	F = 'tests/tests/test088.tmp',
+	save(F, [(p(X) :- q(X)), q(1), q(2), r(a), (s :- p(_))]),
+	consult(F),
+	findall(X, p(X), L1), writeq(L1), nl,
+	save(F, [(p(X) :- q(X)), q(1), q(2), q(3), (t :- q(3))]),
+	make,
+	findall(X, p(X), L2), writeq(L2), nl,
+	( catch(r(_), _, fail) -> write(bad) ; write(ok) ), nl,
+	( s -> write(s) ; write(no_s) ), nl,
+	( t -> write(t) ; write(no_t) ), nl,
+	open(F, write, S), write(S, 'q(5\n'), close(S),
+	make,
+	findall(X, q(X), L3), writeq(L3), nl,
+	make,
+	delete_file(F).
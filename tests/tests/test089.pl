@@ -0,0 +1,23 @@
+:- initialization(main).
+
+w(X, Y) :- atom_length(X, Y).
+w2(X) :- w(X, 3).
+sw(A, B) :- pair(B, A).
+pair(x, 1).
+pair(y, 2).
+tail([_|T], T).
+wt(L, T) :- tail(L, T).
+
+main :-
+	( w2(abc) -> write(yes) ; write(no) ), nl,
+	( w2(abcd) -> write(yes) ; write(no) ), nl,
+	findall(A-B, sw(A, B), L), writeq(L), nl,
+	wt([1,2|Z], T), Z = [3], writeq(T), nl,
+	functor(foo(a,b), N, Ar), writeq(N/Ar), nl,
+	functor(T1, bar, 0), writeq(T1), nl,
+	functor(T2, 1.5, 0), writeq(T2), nl,
+	T3 =.. [baz, 1, V], V = 2, writeq(T3), nl,
+	f(1, [2]) =.. L2, writeq(L2), nl,
+	T4 =.. [7], writeq(T4), nl,
+	( functor(foo(a), bar, _) -> write(yes) ; write(no) ), nl,
+	clause(w2(abc), Body), writeq(Body), nl.
@@ -0,0 +1,41 @@
+:- initialization(main).
+
+batches(S, N, Bs) :-
+	read_terms(S, N, Ts),
+	( Ts == [] -> Bs = [] ; Bs = [Ts|Bs0], batches(S, N, Bs0) ).
+
+main :-
+	F = 'tests/tests/test090.tmp',
+	open(F, write, S0),
+	write(S0, 'a(1). b("two").\nc :-\n\td, % comment\n\t/* block */ e.\n'),
+	write(S0, 'f([1,2|T], T, \'x y\').\ng(123456789012345678901234567890).\nh.\n'),
+	close(S0),
+	open(F, read, S1),
+	batches(S1, 2, Bs),
+	close(S1),
+	forall(member(B, Bs), (writeq(B), nl)),
+	open(F, read, S2),
+	read_terms(S2, 1, T1), writeq(T1), nl,
+	read(S2, T2), writeq(T2), nl,
+	read_terms(S2, 10, T3), length(T3, N3), write(N3), nl,
+	close(S2),
+	open(F, write, S3),
+	forall(between(1, 5000, I), (writeq(S3, n(I, [I], "s")), write(S3, '.\n'))),
+	close(S3),
+	open(F, read, S4),
+	batches(S4, 1000, Bs4),
+	close(S4),
+	length(Bs4, N4), write(N4), nl,
+	last(Bs4, L4), last(L4, E4), writeq(E4), nl,
+	open(F, write, S5),
+	write(S5, 'p. q.\nline one\nxyz'),
+	close(S5),
+	open(F, read, S6),
+	read_terms(S6, 1, T6), writeq(T6), nl,
+	getline(S6, L6), writeq(L6), nl,
+	getline(S6, L7), writeq(L7), nl,
+	bread(S6, 2, B6), writeq(B6), nl,
+	get_char(S6, C6), writeq(C6), nl,
+	get_char(S6, C7), writeq(C7), nl,
+	close(S6),
+	delete_file(F).
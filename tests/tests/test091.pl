@@ -0,0 +1,38 @@
+:- initialization(main).
+
+main :-
+	F = 'tests/tests/test091.tmp',
+	open(F, write, S0),
+	csv_write(S0, [row(id, name, note), [1, 'a,b', "say \"hi\""], r(2, x, 'two\nlines'), r(3, '', 2.5)], []),
+	close(S0),
+	open(F, read, S1),
+	read_rows(S1, Rs),
+	close(S1),
+	forall(member(R, Rs), (writeq(R), nl)),
+	csv_read(F, Rs2, [skip_header(true), convert(false)]),
+	forall(member(R, Rs2), (writeq(R), nl)),
+	csv_read(F, N, [skip_header(true), assert(true), functor(item)]),
+	write(N), nl,
+	findall(I-Name, item(I, Name, _), L), writeq(L), nl,
+	csv_write(user_output, [x(1, 'a;b', c)], [separator(;)]),
+	open(F, write, S2),
+	write(S2, '0x1F,0b101,1e3,-2.5E-1,+7,1.,.5,12abc,99999999999999999999999,-123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890\n'),
+	close(S2),
+	csv_read(F, [R3], []),
+	writeq(R3), nl,
+	arg(9, R3, B), B1 is B + 1, writeq(B1), nl,
+	csv_read(F, 1, [assert(true), functor(big)]),
+	big(_, _, _, _, _, _, _, _, _, B2), B3 is B2 - 1, writeq(B3), nl,
+	open(F, write, S3),
+	forall(between(1, 5000, I), (write(S3, I), write(S3, ','))),
+	write(S3, x), nl(S3),
+	close(S3),
+	catch(csv_read(F, _, []), error(E4, _), true), writeq(E4), nl,
+	open(F, read, S4),
+	catch(csv_read_row(S4, _, []), error(E5, _), true), writeq(E5), nl,
+	close(S4),
+	delete_file(F).
+
+read_rows(S, Rs) :-
+	csv_read_row(S, R, []),
+	( R == end_of_file -> Rs = [] ; Rs = [R|Rs0], read_rows(S, Rs0) ).
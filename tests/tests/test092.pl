@@ -0,0 +1,36 @@
+:- initialization(main).
+
+p(1). p(2). p(3).
+
+t1(X) :- ( p(X), X > 1 -> true ; fail ).
+t2(X) :- ( p(X) ; X = 4 ).
+t3(X) :- \+ p(X), X = ok.
+t4 :- \+ \+ p(2).
+t5(X) :- once(p(X)).
+t6(X) :- ignore(p(X)), true.
+t7(X) :- ignore(fail), X = y.
+t8(R) :- catch((p(X), X > 2, throw(found(X))), found(Y), R = caught(Y)).
+t9(R) :- catch(p(R), _, true).
+t10(X) :- ( p(X), ! ; X = 9 ).
+t11(L) :- findall(X-Y, ( p(X), ( X > 1 -> Y = big ; Y = small ) ), L).
+t12(X) :- ( fail -> X = a ; fail -> X = b ; X = c ).
+t13(X) :- ( true ; X = 2 ), ( var(X) -> X = 1 ; true ).
+t14(R) :- catch(catch(throw(a), b, R = inner), a, R = outer).
+t15(X) :- ( p(X) -> ( X > 5 -> fail ; true ) ; true ).
+t16(X) :- ( p(X), X > 1 -> true ), X < 3.
+t17 :- catch(throw(e), e, (fail ; true)).
+t18(X) :- ( X = 1 ; X = 2 ; X = 3 ), X > 1.
+t19(R) :- catch(t19a, E, R = E).
+t19a :- ( true -> throw(deep) ; true ).
+
+loop(0) :- !.
+loop(N) :- ( N > 0 -> N1 is N-1, loop(N1) ; true ).
+t20 :- loop(100000).
+
+go(T, G) :- findall(T, G, L), writeq(L), nl.
+
+main :-
+	go(X, t1(X)), go(X, t2(X)), go(X, t3(X)), go(t4, t4), go(X, t5(X)),
+	go(X, t6(X)), go(X, t7(X)), go(X, t8(X)), go(X, t9(X)), go(X, t10(X)),
+	go(X, t11(X)), go(X, t12(X)), go(X, t13(X)), go(X, t14(X)), go(X, t15(X)),
+	go(X, t16(X)), go(t17, t17), go(X, t18(X)), go(X, t19(X)), go(t20, t20).
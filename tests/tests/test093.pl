@@ -0,0 +1,15 @@
+:- initialization(main).
+
+spin(0, Id) :- !, format("~w done~n", [Id]).
+spin(N, Id) :- N1 is N-1, spin(N1, Id).
+
+io(Id) :- between(1, 3, I), format("~w ~w~n", [Id, I]), fail.
+io(_).
+
+main :-
+	spawn(io(x)), spawn(spin(100000, a)), wait,
+	set_prolog_flag(time_slice, 0),
+	spawn(io(y)), spawn(spin(100000, b)), wait,
+	set_prolog_flag(time_slice, 1000),
+	spawn(io(z)), spawn((time_slice(0), spin(100000, c))), wait,
+	current_prolog_flag(time_slice, N), writeln(N).
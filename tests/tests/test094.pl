@@ -0,0 +1,18 @@
+:- initialization(main).
+
+loop :- loop.
+grow(L) :- grow([x|L]).
+p(1). p(2). p(3).
+
+main :-
+	call_with_inference_limit(loop, 10000, R1), writeln(R1),
+	call_with_inference_limit(true, 100, R2), writeln(R2),
+	findall(X-R, call_with_inference_limit(p(X), 100, R), L3), writeln(L3),
+	call_with_inference_limit(call_with_inference_limit(loop, 1000000, R4), 1000, R5), ( var(R4) -> writeln(R5) ; writeln(R4) ),
+	catch(call_with_inference_limit(throw(oops(1)), 100, _), E6, true), writeln(E6),
+	call_with_inference_limit(loop, 1000, R7), writeln(R7),
+	catch(call_with_time_limit(0.05, loop), E8, true), writeln(E8),
+	call_with_time_limit(5, true), \+ call_with_time_limit(5, fail), writeln(ok),
+	catch(call_with_memory_limit(grow([]), 1000000), E9, true), writeln(E9),
+	call_with_memory_limit(true, 1000000), writeln(ok),
+	catch(call_with_time_limit(0.05, delay(5000)), E10, true), writeln(E10).
@@ -0,0 +1,19 @@
+:- initialization(main).
+
+rt(T) :- term_to_binary(T, B), binary_to_term(B, T2), writeq(T2), nl.
+
+main :-
+	rt(foo), rt([]), rt(''), rt('quoted atom'), rt([f(a),g(b)|c]),
+	rt(f(X, Y, X, Y, _)), rt(g([1,2|T], T)),
+	rt("a string"), rt(f("")),
+	rt(0), rt(123), rt(-5), rt(1.5), rt(-0.25), rt(1.0e100),
+	rt(123456789012345678901234567890), rt(-123456789012345678901234567890),
+	rt(x+y*z), rt(- a), rt((a :- b, c ; d)), rt(f(a,a,a,b,b,b)),
+	open('tests/tests/test095.tmp', write, S),
+	bwrite_term(S, f(V, [1,2,3], "s", V)), bwrite_term(S, hello),
+	close(S),
+	open('tests/tests/test095.tmp', read, S2),
+	bread_term(S2, A), bread_term(S2, B), bread_term(S2, C),
+	close(S2),
+	delete_file('tests/tests/test095.tmp'),
+	writeq([A,B,C]), nl.
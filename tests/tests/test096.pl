@@ -0,0 +1,24 @@
+:- initialization(main).
+
+nat(0).
+nat(N) :- nat(M), N is M+1.
+
+take(_, 0, []) :- !.
+take(E, K, [X|Xs]) :- engine_next(E, X), K1 is K-1, take(E, K1, Xs).
+
+main :-
+	engine_create(X, member(X, [a,b,c]), E1),
+	engine_next(E1, A), engine_next(E1, B), engine_next(E1, C),
+	writeq([A,B,C]), nl,
+	(engine_next(E1, _) -> writeq(more) ; writeq(done)), nl,
+	engine_destroy(E1),
+	engine_create(N, nat(N), E2),
+	take(E2, 3, L), writeq(L), nl,
+	engine_destroy(E2),
+	engine_create(Y, (member(Y, [1,2,3]), Y > 1, !), E3),
+	engine_next(E3, D), writeq(D), nl,
+	(engine_next(E3, _) -> writeq(more) ; writeq(done)), nl,
+	engine_create(Z, (Z = 1 ; throw(oops)), E4),
+	engine_next(E4, F), writeq(F), nl,
+	catch(engine_next(E4, _), Err, true), writeq(caught(Err)), nl,
+	(engine_next(E4, _) -> writeq(more) ; writeq(done)), nl.
@@ -0,0 +1,13 @@
+:- initialization(main).
+
+loop(0) :- !.
+loop(N) :- N1 is N-1, loop(N1).
+
+main :-
+	statistics(inferences, I0),
+	integer(I0),
+	loop(1000),
+	statistics(inferences, I1),
+	(I1 - I0 >= 2000 -> writeq(ok) ; writeq(I1-I0)), nl,
+	statistics(inferences, I2),
+	(I2 >= I1 -> writeq(ok) ; writeq(I2-I1)), nl.